@@ -64,7 +64,7 @@ int main(void)
 	while(1)
 	{
 		int interrupt;
-		res = mcp2221_readInterrupt(myDev, &interrupt);
+		res = mcp2221_readClearInterrupt(myDev, &interrupt);
 		if(res != MCP2221_SUCCESS)
 			break;
 
@@ -72,9 +72,6 @@ int main(void)
 		{
 			triggerCount++;
 			printf("Interrupt triggered! %d\n", triggerCount);
-			res = mcp2221_clearInterrupt(myDev);
-			if(res != MCP2221_SUCCESS)
-				break;
 		}
 	}
 
@@ -0,0 +1,277 @@
+/*
+ * Project: MCP2221 HID Library
+ * Author: Zak Kemble, contact@zakkemble.co.uk
+ * Copyright: (C) 2015 by Zak Kemble
+ * License: GNU GPL v3 (see License.txt)
+ * Web: http://blog.zakkemble.co.uk/mcp2221-hid-library/
+ */
+
+// Logic analyzer style GPIO capture into a memory-mapped, run-length encoded file
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "libmcp2221.h"
+#include "libmcp2221_private.h"
+
+#define CAPTURE_MIN_SIZE	(sizeof(mcp2221_capheader_t) + (16 * sizeof(mcp2221_caprecord_t)))
+
+struct mcp2221_capture_t{
+	mcp2221_t* device;
+	pthread_t thread;
+	int fd;
+	uint8_t* map;
+	size_t mapSize;
+	mcp2221_capheader_t* header;
+	mcp2221_caprecord_t* records;
+	uint64_t maxRecords;
+
+	pthread_mutex_t lock;		// Protects stop and stats
+	int stop;
+	mcp2221_capture_stats_t stats;
+
+	struct mcp2221_capture_t* next;	// Next capture on the same device, under the device lock
+};
+
+static void* captureThread(void* arg)
+{
+	mcp2221_capture_t* cap = arg;
+	mcp2221_capheader_t* hdr = cap->header;
+	NEW_REPORT(report);
+
+	int64_t start = mcp2221_nowNs();
+	int64_t lastRecordUs = 0;
+	uint64_t run = 0;
+	int last = -1;
+	mcp2221_error res = MCP2221_SUCCESS;
+
+	hdr->monotonicStartNs = start;
+
+	while(1)
+	{
+		pthread_mutex_lock(&cap->lock);
+		int stop = cap->stop;
+		pthread_mutex_unlock(&cap->lock);
+		if(stop)
+			break;
+
+		memset(report, 0x00, REPORT_SIZE);
+		report[0] = USB_CMD_GETGPIO;
+		int64_t t0 = mcp2221_nowNs();
+		res = mcp2221_doTransaction(cap->device, report);
+		int64_t t1 = mcp2221_nowNs();
+		if(res != MCP2221_SUCCESS)
+			break;
+
+		int states = 0;
+		for(int i=0;i<MCP2221_GPIO_COUNT;i++)
+		{
+			if(report[(i * 2) + 2] == MCP2221_GPIO_VALUE_HIGH)
+				states |= (1 << i);
+		}
+		states &= hdr->pins;
+
+		int64_t nowUs = (((t0 + t1) / 2) - start) / 1000;
+		hdr->samples++;
+		run++;
+
+		// Only transitions are stored, plus a keep-alive record before the 32-bit delta would overflow
+		if(states == last && (nowUs - lastRecordUs) < (int64_t)UINT32_MAX && run < UINT16_MAX)
+			continue;
+
+		if(hdr->records >= cap->maxRecords)
+		{
+			hdr->flags |= MCP2221_CAPFLAG_TRUNCATED;
+			break;
+		}
+
+		mcp2221_caprecord_t* rec = &cap->records[hdr->records];
+		rec->deltaUs = nowUs - lastRecordUs;
+		rec->run = run;
+		rec->states = states;
+		rec->flags = (states == last) ? MCP2221_CAPREC_KEEPALIVE : 0;
+
+		// Publish the record only once it is complete, so a reader of the live file never sees half a record
+		__atomic_store_n(&hdr->records, hdr->records + 1, __ATOMIC_RELEASE);
+
+		lastRecordUs = nowUs;
+		last = states;
+		run = 0;
+
+		pthread_mutex_lock(&cap->lock);
+		cap->stats.transitions++;
+		pthread_mutex_unlock(&cap->lock);
+	}
+
+	hdr->durationNs = mcp2221_nowNs() - start;
+	hdr->flags |= MCP2221_CAPFLAG_COMPLETE;
+
+	pthread_mutex_lock(&cap->lock);
+	cap->stats.lastError = res;
+	cap->stats.running = 0;
+	pthread_mutex_unlock(&cap->lock);
+
+	return NULL;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_captureStart(mcp2221_t* device, const char* path, int pins, size_t maxBytes, int cpu, mcp2221_capture_t** capture)
+{
+	if(!device || !device->priv || !path || !capture || maxBytes < CAPTURE_MIN_SIZE)
+		return MCP2221_INVALID_ARG;
+
+	mcp2221_capture_t* cap = calloc(1, sizeof(mcp2221_capture_t));
+	if(!cap)
+		return MCP2221_ERROR;
+
+	cap->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(cap->fd < 0)
+	{
+		free(cap);
+		return MCP2221_ERROR;
+	}
+
+	cap->mapSize = maxBytes;
+	if(ftruncate(cap->fd, cap->mapSize) != 0 ||
+		(cap->map = mmap(NULL, cap->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, cap->fd, 0)) == MAP_FAILED)
+	{
+		close(cap->fd);
+		unlink(path);
+		free(cap);
+		return MCP2221_ERROR;
+	}
+
+	cap->device = device;
+	cap->header = (mcp2221_capheader_t*)cap->map;
+	cap->records = (mcp2221_caprecord_t*)(cap->map + sizeof(mcp2221_capheader_t));
+	cap->maxRecords = (cap->mapSize - sizeof(mcp2221_capheader_t)) / sizeof(mcp2221_caprecord_t);
+
+	mcp2221_capheader_t* hdr = cap->header;
+	memcpy(hdr->magic, MCP2221_CAP_MAGIC, sizeof(hdr->magic));
+	hdr->version = MCP2221_CAP_VERSION;
+	hdr->headerSize = sizeof(mcp2221_capheader_t);
+	hdr->recordSize = sizeof(mcp2221_caprecord_t);
+	hdr->pins = pins & 0x0F;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	hdr->realtimeStartNs = ((int64_t)ts.tv_sec * NS_PER_SEC) + ts.tv_nsec;
+
+	cap->stats.running = 1;
+	pthread_mutex_init(&cap->lock, NULL);
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	if(cpu >= 0)
+	{
+		// Keep the sampling loop on one core so it is not migrated mid-capture
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	}
+
+	int err = pthread_create(&cap->thread, &attr, captureThread, cap);
+	pthread_attr_destroy(&attr);
+	if(err != 0)
+	{
+		pthread_mutex_destroy(&cap->lock);
+		munmap(cap->map, cap->mapSize);
+		close(cap->fd);
+		unlink(path);
+		free(cap);
+		return MCP2221_ERROR;
+	}
+
+	// Listed on the device so that mcp2221_close() can stop it
+	mcp2221_lock(device);
+	cap->next = device->priv->captures;
+	device->priv->captures = cap;
+	mcp2221_unlock(device);
+
+	*capture = cap;
+	return MCP2221_SUCCESS;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_captureStats(mcp2221_capture_t* capture, mcp2221_capture_stats_t* stats)
+{
+	if(!capture || !stats)
+		return MCP2221_INVALID_ARG;
+
+	mcp2221_capheader_t* hdr = capture->header;
+
+	pthread_mutex_lock(&capture->lock);
+	*stats = capture->stats;
+	pthread_mutex_unlock(&capture->lock);
+
+	stats->samples = hdr->samples;
+	stats->bytes = sizeof(mcp2221_capheader_t) + (__atomic_load_n(&hdr->records, __ATOMIC_ACQUIRE) * sizeof(mcp2221_caprecord_t));
+	stats->truncated = !!(hdr->flags & MCP2221_CAPFLAG_TRUNCATED);
+
+	int64_t elapsed = stats->running ? (mcp2221_nowNs() - hdr->monotonicStartNs) : hdr->durationNs;
+	if(elapsed > 0)
+		stats->sampleRate = (double)hdr->samples * NS_PER_SEC / elapsed;
+
+	return MCP2221_SUCCESS;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_captureStop(mcp2221_capture_t* capture, mcp2221_capture_stats_t* stats)
+{
+	if(!capture)
+		return MCP2221_INVALID_ARG;
+
+	mcp2221_t* device = capture->device;
+	mcp2221_lock(device);
+	for(mcp2221_capture_t** c = &device->priv->captures; *c; c = &(*c)->next)
+	{
+		if(*c == capture)
+		{
+			*c = capture->next;
+			break;
+		}
+	}
+	mcp2221_unlock(device);
+
+	pthread_mutex_lock(&capture->lock);
+	capture->stop = 1;
+	pthread_mutex_unlock(&capture->lock);
+	pthread_join(capture->thread, NULL);
+
+	if(stats)
+		mcp2221_captureStats(capture, stats);
+
+	mcp2221_error res = capture->stats.lastError;
+
+	// Cut the file down to what was actually recorded
+	size_t used = sizeof(mcp2221_capheader_t) + (capture->header->records * sizeof(mcp2221_caprecord_t));
+	msync(capture->map, capture->mapSize, MS_SYNC);
+	munmap(capture->map, capture->mapSize);
+	if(ftruncate(capture->fd, used) != 0 && res == MCP2221_SUCCESS)
+		res = MCP2221_ERROR;
+	close(capture->fd);
+
+	pthread_mutex_destroy(&capture->lock);
+	free(capture);
+
+	return res;
+}
+
+void LIB_INTERNAL mcp2221_captureStopAll(mcp2221_t* device)
+{
+	// Not under the device lock while joining, the capture thread needs it for its transactions
+	while(1)
+	{
+		mcp2221_lock(device);
+		mcp2221_capture_t* capture = device->priv->captures;
+		mcp2221_unlock(device);
+		if(!capture)
+			break;
+		mcp2221_captureStop(capture, NULL);
+	}
+}
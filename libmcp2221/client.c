@@ -0,0 +1,407 @@
+/*
+ * Project: MCP2221 HID Library
+ * Author: Zak Kemble, contact@zakkemble.co.uk
+ * Copyright: (C) 2015 by Zak Kemble
+ * License: GNU GPL v3 (see License.txt)
+ * Web: http://blog.zakkemble.co.uk/mcp2221-hid-library/
+ */
+
+// Transport to the local multiplexing server (mcp2221d) over a Unix domain socket,
+// reports go through shared memory rings once the server has accepted them
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "hidapi.h"
+#include "libmcp2221.h"
+#include "libmcp2221_private.h"
+#include "server_proto.h"
+
+typedef struct{
+	int fd;
+	srv_shm_t* shm;		// NULL if reports go over the socket
+	int reqEvent;		// Signalled by us after pushing a request
+	int respEvent;		// Signalled by the server after pushing a response
+}client_t;
+
+static int serverConnect(void)
+{
+	const char* path = mcp2221_serverPath();
+	if(!path || strlen(path) >= sizeof(((struct sockaddr_un*)0)->sun_path))
+		return -1;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0)
+		return -1;
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int readAll(int fd, void* buff, size_t len)
+{
+	uint8_t* ptr = buff;
+	while(len)
+	{
+		ssize_t res = recv(fd, ptr, len, 0);
+		if(res < 0 && errno == EINTR)
+			continue;
+		if(res <= 0)
+			return -1;
+		ptr += res;
+		len -= res;
+	}
+	return 0;
+}
+
+// Header and payload go out in one call so the server never sees half a message, fds (if any) go with it
+static int sendMsgFds(int fd, uint8_t type, const void* payload, uint32_t len, const int* fds, int nfds)
+{
+	srv_header_t hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.type = type;
+	hdr.len = len;
+
+	struct iovec iov[2];
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void*)payload;
+	iov[1].iov_len = len;
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	union{
+		struct cmsghdr hdr;
+		char buff[CMSG_SPACE(3 * sizeof(int))];
+	}control;
+	if(nfds)
+	{
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buff;
+		msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	}
+
+	ssize_t total = sizeof(hdr) + len;
+	ssize_t res;
+	while((res = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+	return (res == total) ? 0 : -1;
+}
+
+static int sendMsg(int fd, uint8_t type, const void* payload, uint32_t len)
+{
+	return sendMsgFds(fd, type, payload, len, NULL, 0);
+}
+
+static mcp2221_error serverSend(mcp2221_t* device, const uint8_t* report)
+{
+	client_t* client = device->handle;
+	if(sendMsg(client->fd, SRV_MSG_REPORT, report, REPORT_SIZE) != 0)
+		return MCP2221_ERROR_HID;
+	return MCP2221_SUCCESS;
+}
+
+static mcp2221_error serverGet(mcp2221_t* device, uint8_t* report)
+{
+	client_t* client = device->handle;
+	srv_header_t hdr;
+	if(readAll(client->fd, &hdr, sizeof(hdr)) != 0 || hdr.type != SRV_MSG_REPORT || hdr.len != REPORT_SIZE)
+		return MCP2221_ERROR_HID;
+	if(readAll(client->fd, report, REPORT_SIZE) != 0)
+		return MCP2221_ERROR_HID;
+	return hdr.status;
+}
+
+// No copies through the kernel and no syscall other than the eventfd wake up on each side
+static mcp2221_error shmSend(mcp2221_t* device, const uint8_t* report)
+{
+	client_t* client = device->handle;
+	srv_slot_t* slot = srv_ringWriteSlot(&client->shm->req);
+	if(!slot)
+		return MCP2221_ERROR;
+
+	memcpy(slot->report, report, REPORT_SIZE);
+	srv_ringPush(&client->shm->req);
+
+	uint64_t one = 1;
+	if(write(client->reqEvent, &one, sizeof(one)) != sizeof(one))
+		return MCP2221_ERROR_HID;
+	return MCP2221_SUCCESS;
+}
+
+static mcp2221_error shmGet(mcp2221_t* device, uint8_t* report)
+{
+	client_t* client = device->handle;
+	srv_slot_t* slot;
+
+	while(!(slot = srv_ringReadSlot(&client->shm->resp)))
+	{
+		// The server never writes to the socket after SHM, anything there means it went away
+		struct pollfd fds[2];
+		fds[0].fd = client->respEvent;
+		fds[0].events = POLLIN;
+		fds[1].fd = client->fd;
+		fds[1].events = POLLIN;
+		if(poll(fds, 2, -1) < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return MCP2221_ERROR_HID;
+		}
+
+		if(fds[0].revents & POLLIN)
+		{
+			uint64_t count;
+			if(read(client->respEvent, &count, sizeof(count)) < 0 && errno != EAGAIN)
+				return MCP2221_ERROR_HID;
+		}
+		else if(fds[1].revents)
+			return MCP2221_ERROR_HID;
+	}
+
+	memcpy(report, slot->report, REPORT_SIZE);
+	mcp2221_error res = slot->status;
+	srv_ringPop(&client->shm->resp);
+	return res;
+}
+
+static void shmFree(client_t* client)
+{
+	if(client->shm)
+		munmap(client->shm, sizeof(srv_shm_t));
+	if(client->reqEvent >= 0)
+		close(client->reqEvent);
+	if(client->respEvent >= 0)
+		close(client->respEvent);
+	client->shm = NULL;
+	client->reqEvent = -1;
+	client->respEvent = -1;
+}
+
+// Hand the server a sealed memfd with both rings and the two eventfds, 0 if it accepted them
+static int shmSetup(client_t* client)
+{
+	int memfd = memfd_create("mcp2221-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if(memfd < 0)
+		return -1;
+
+	// Sealed so we can't shrink it under the server
+	if(ftruncate(memfd, sizeof(srv_shm_t)) != 0 || fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0)
+	{
+		close(memfd);
+		return -1;
+	}
+
+	client->shm = mmap(NULL, sizeof(srv_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if(client->shm == MAP_FAILED)
+	{
+		client->shm = NULL;
+		close(memfd);
+		return -1;
+	}
+	client->shm->magic = SRV_SHM_MAGIC;
+	client->shm->slots = SRV_RING_SLOTS;
+
+	client->reqEvent = eventfd(0, EFD_CLOEXEC);
+	client->respEvent = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+	srv_header_t hdr;
+	int fds[3] = {memfd, client->reqEvent, client->respEvent};
+	int res = -1;
+	if(client->reqEvent >= 0 && client->respEvent >= 0 &&
+		sendMsgFds(client->fd, SRV_MSG_SHM, NULL, 0, fds, 3) == 0 &&
+		readAll(client->fd, &hdr, sizeof(hdr)) == 0 &&
+		hdr.type == SRV_MSG_SHM && hdr.status == MCP2221_SUCCESS)
+		res = 0;
+
+	close(memfd);
+	if(res != 0)
+		shmFree(client);
+	return res;
+}
+
+static void serverClose(mcp2221_t* device)
+{
+	client_t* client = device->handle;
+	if(client)
+	{
+		shmFree(client);
+		close(client->fd);
+		free(client);
+	}
+}
+
+// The server closes the connection when it goes away
+static int serverAlive(mcp2221_t* device)
+{
+	client_t* client = device->handle;
+	struct pollfd pfd = {client->fd, POLLRDHUP, 0};
+	return !(poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR)));
+}
+
+// Responses come on the socket, nothing is left over there between transactions
+static int serverAsyncFd(mcp2221_t* device, int arm)
+{
+	(void)arm;
+	client_t* client = device->handle;
+	return client->fd;
+}
+
+// The server signals the response eventfd after every push, shmGet() leaves it set if the response was already there
+static int shmAsyncFd(mcp2221_t* device, int arm)
+{
+	client_t* client = device->handle;
+	if(arm)
+	{
+		uint64_t count;
+		if(read(client->respEvent, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			return -1;
+	}
+	return client->respEvent;
+}
+
+static const mcp2221_transport_t serverTransport = {serverSend, serverGet, serverClose, NULL, serverAlive, serverAsyncFd};
+static const mcp2221_transport_t shmTransport = {shmSend, shmGet, serverClose, NULL, serverAlive, shmAsyncFd};
+
+LIB_INTERNAL const char* mcp2221_serverPath(void)
+{
+	const char* path = getenv(MCP2221_SERVER_ENV);
+	return (path && path[0]) ? path : NULL;
+}
+
+static wchar_t* dupString(const wchar_t* str)
+{
+	wchar_t buff[MCP2221_STR_LEN];
+	wcsncpy(buff, str, MCP2221_STR_LEN - 1);
+	buff[MCP2221_STR_LEN - 1] = L'\0';
+	return wcsdup(buff);
+}
+
+LIB_INTERNAL struct hid_device_info* mcp2221_serverEnumerate(unsigned short vid, unsigned short pid)
+{
+	int fd = serverConnect();
+	if(fd < 0)
+		return NULL;
+
+	srv_list_t list;
+	list.vid = vid;
+	list.pid = pid;
+
+	srv_header_t hdr;
+	if(sendMsg(fd, SRV_MSG_LIST, &list, sizeof(list)) != 0 || readAll(fd, &hdr, sizeof(hdr)) != 0 || hdr.status != MCP2221_SUCCESS)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	struct hid_device_info* first = NULL;
+	struct hid_device_info** next = &first;
+
+	for(uint32_t i=0;i<hdr.len / sizeof(srv_devinfo_t);i++)
+	{
+		srv_devinfo_t info;
+		if(readAll(fd, &info, sizeof(info)) != 0)
+			break;
+		info.path[SRV_PATH_LEN - 1] = '\0';
+
+		struct hid_device_info* dev = calloc(1, sizeof(struct hid_device_info));
+		if(!dev)
+			break;
+		dev->path = strdup(info.path);
+		dev->vendor_id = info.vid;
+		dev->product_id = info.pid;
+		dev->interface_number = info.interface;
+		dev->manufacturer_string = dupString(info.manufacturer);
+		dev->product_string = dupString(info.product);
+		dev->serial_number = info.serial[0] ? dupString(info.serial) : NULL;
+
+		*next = dev;
+		next = &dev->next;
+	}
+
+	close(fd);
+	return first;
+}
+
+void LIB_INTERNAL mcp2221_serverFreeEnumeration(struct hid_device_info* devs)
+{
+	while(devs)
+	{
+		struct hid_device_info* next = devs->next;
+		free(devs->path);
+		free(devs->manufacturer_string);
+		free(devs->product_string);
+		free(devs->serial_number);
+		free(devs);
+		devs = next;
+	}
+}
+
+mcp2221_error LIB_INTERNAL mcp2221_serverOpen(mcp2221_t* device, const char* path)
+{
+	char buff[SRV_PATH_LEN];
+	if(strlen(path) >= SRV_PATH_LEN)
+		return MCP2221_INVALID_ARG;
+	memset(buff, 0, sizeof(buff));
+	strcpy(buff, path);
+
+	int fd = serverConnect();
+	if(fd < 0)
+		return MCP2221_ERROR_HID;
+
+	srv_header_t hdr;
+	if(sendMsg(fd, SRV_MSG_OPEN, buff, sizeof(buff)) != 0 || readAll(fd, &hdr, sizeof(hdr)) != 0)
+	{
+		close(fd);
+		return MCP2221_ERROR_HID;
+	}
+	if(hdr.status != MCP2221_SUCCESS)
+	{
+		close(fd);
+		return hdr.status;
+	}
+
+	client_t* client = malloc(sizeof(client_t));
+	if(!client)
+	{
+		close(fd);
+		return MCP2221_ERROR;
+	}
+	client->fd = fd;
+	client->shm = NULL;
+	client->reqEvent = -1;
+	client->respEvent = -1;
+
+	// Falls back to the socket if the server can't map the rings
+	device->handle = client;
+	device->priv->transport = (shmSetup(client) == 0) ? &shmTransport : &serverTransport;
+	return MCP2221_SUCCESS;
+}
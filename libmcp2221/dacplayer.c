@@ -0,0 +1,297 @@
+/*
+ * Project: MCP2221 HID Library
+ * Author: Zak Kemble, contact@zakkemble.co.uk
+ * Copyright: (C) 2015 by Zak Kemble
+ * License: GNU GPL v3 (see License.txt)
+ * Web: http://blog.zakkemble.co.uk/mcp2221-hid-library/
+ */
+
+// DAC waveform player, runs SET SRAM updates from its own thread on an absolute schedule
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include "libmcp2221.h"
+#include "libmcp2221_private.h"
+
+#define DACPLAY_MAX_RATE	1000	// A SET SRAM round trip takes at least 1 USB frame each way
+
+struct mcp2221_dacplayer_t{
+	mcp2221_t* device;
+	pthread_t thread;
+	pthread_mutex_t lock;		// Protects everything below
+
+	uint8_t report[REPORT_SIZE];	// Pre-encoded SET SRAM report, only the value byte changes
+	int64_t period;				// Sample period in ns
+	int loop;
+	int stop;
+
+	uint8_t* codes;				// Waveform currently playing, owned by the thread
+	int count;
+	uint8_t* pending;			// Waveform queued by mcp2221_dacPlayUpdate(), swapped in at the end of a pass
+	int pendingCount;
+
+	mcp2221_dacplayer_stats_t stats;
+	int64_t startTime;
+	int64_t endTime;
+	int64_t latencySum;
+	int64_t errorSum;
+
+	struct mcp2221_dacplayer_t* next;	// Next player on the same device, under the device lock
+};
+
+static uint8_t* copyCodes(const uint8_t* codes, int count)
+{
+	uint8_t* copy = malloc(count);
+	if(!copy)
+		return NULL;
+	for(int i=0;i<count;i++)
+		copy[i] = (codes[i] > MCP2221_DAC_MAX) ? MCP2221_DAC_MAX : codes[i];
+	return copy;
+}
+
+static int64_t absNs(int64_t val)
+{
+	return (val < 0) ? -val : val;
+}
+
+static void* playerThread(void* arg)
+{
+	mcp2221_dacplayer_t* player = arg;
+	NEW_REPORT(report);
+
+	int idx = 0;
+	int lastCode = -1;
+	int64_t lead = 0; // How early to start a transaction, half of the smoothed round trip
+	int64_t next = mcp2221_nowNs();
+
+	pthread_mutex_lock(&player->lock);
+	player->startTime = next;
+	pthread_mutex_unlock(&player->lock);
+
+	while(1)
+	{
+		pthread_mutex_lock(&player->lock);
+		int stop = player->stop;
+		uint8_t code = player->codes[idx];
+		pthread_mutex_unlock(&player->lock);
+		if(stop)
+			break;
+
+		if(code == lastCode)
+		{
+			// Nothing to send, but keep to the schedule so that waveform swaps and stops happen on time
+			mcp2221_sleepUntilNs(next);
+			pthread_mutex_lock(&player->lock);
+			player->stats.skipped++;
+		}
+		else
+		{
+			mcp2221_sleepUntilNs(next - lead);
+
+			memcpy(report, player->report, REPORT_SIZE);
+			report[4] = 0x80 | code;
+
+			int64_t t0 = mcp2221_nowNs();
+			mcp2221_error res = mcp2221_doTransaction(player->device, report);
+			int64_t t1 = mcp2221_nowNs();
+
+			pthread_mutex_lock(&player->lock);
+			if(res != MCP2221_SUCCESS)
+			{
+				player->stats.lastError = res;
+				pthread_mutex_unlock(&player->lock);
+				break;
+			}
+
+			lastCode = code;
+
+			int64_t latency = t1 - t0;
+			lead = ((lead * 7) + (latency / 2)) / 8;
+
+			// The device applies the value roughly halfway through the round trip
+			int64_t error = absNs(((t0 + t1) / 2) - next);
+
+			player->stats.updates++;
+			player->latencySum += latency;
+			player->errorSum += error;
+			if(latency > player->stats.latencyMaxNs)
+				player->stats.latencyMaxNs = latency;
+			if(error > player->stats.errorMaxNs)
+				player->stats.errorMaxNs = error;
+
+			if(t1 > next + player->period)
+			{
+				// Fell behind by more than a sample, restart the schedule from now instead of bursting to catch up
+				player->stats.late++;
+				next = t1 - player->period;
+			}
+		}
+
+		player->stats.samples++;
+		next += player->period;
+
+		if(++idx >= player->count)
+		{
+			idx = 0;
+			player->stats.loops++;
+
+			if(player->pending)
+			{
+				free(player->codes);
+				player->codes = player->pending;
+				player->count = player->pendingCount;
+				player->pending = NULL;
+			}
+			else if(!player->loop)
+			{
+				pthread_mutex_unlock(&player->lock);
+				break;
+			}
+		}
+		pthread_mutex_unlock(&player->lock);
+	}
+
+	pthread_mutex_lock(&player->lock);
+	player->stats.running = 0;
+	player->endTime = mcp2221_nowNs();
+	pthread_mutex_unlock(&player->lock);
+
+	return NULL;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_dacPlay(mcp2221_t* device, mcp2221_dac_ref_t ref, const uint8_t* codes, int count, int rate, int loop, mcp2221_dacplayer_t** player)
+{
+	if(!device || !device->priv || !codes || !player || count < 1 || rate < 1 || rate > DACPLAY_MAX_RATE)
+		return MCP2221_INVALID_ARG;
+
+	mcp2221_dacplayer_t* p = calloc(1, sizeof(mcp2221_dacplayer_t));
+	if(!p)
+		return MCP2221_ERROR;
+
+	p->codes = copyCodes(codes, count);
+	if(!p->codes)
+	{
+		free(p);
+		return MCP2221_ERROR;
+	}
+
+	p->device = device;
+	p->count = count;
+	p->period = NS_PER_SEC / rate;
+	p->loop = !!loop;
+	p->stats.running = 1;
+	p->stats.lastError = MCP2221_SUCCESS;
+
+	// Same encoding as mcp2221_setDAC()
+	p->report[0] = USB_CMD_SETSRAM;
+	p->report[3] = 0x80 | ref;
+
+	pthread_mutex_init(&p->lock, NULL);
+
+	if(pthread_create(&p->thread, NULL, playerThread, p) != 0)
+	{
+		pthread_mutex_destroy(&p->lock);
+		free(p->codes);
+		free(p);
+		return MCP2221_ERROR;
+	}
+
+	// Listed on the device so that mcp2221_close() can stop it
+	mcp2221_lock(device);
+	p->next = device->priv->dacPlayers;
+	device->priv->dacPlayers = p;
+	mcp2221_unlock(device);
+
+	*player = p;
+	return MCP2221_SUCCESS;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_dacPlayUpdate(mcp2221_dacplayer_t* player, const uint8_t* codes, int count)
+{
+	if(!player || !codes || count < 1)
+		return MCP2221_INVALID_ARG;
+
+	uint8_t* copy = copyCodes(codes, count);
+	if(!copy)
+		return MCP2221_ERROR;
+
+	pthread_mutex_lock(&player->lock);
+	free(player->pending);
+	player->pending = copy;
+	player->pendingCount = count;
+	pthread_mutex_unlock(&player->lock);
+
+	return MCP2221_SUCCESS;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_dacPlayStats(mcp2221_dacplayer_t* player, mcp2221_dacplayer_stats_t* stats)
+{
+	if(!player || !stats)
+		return MCP2221_INVALID_ARG;
+
+	pthread_mutex_lock(&player->lock);
+	*stats = player->stats;
+	if(player->stats.updates)
+	{
+		stats->latencyAvgNs = player->latencySum / player->stats.updates;
+		stats->errorAvgNs = player->errorSum / player->stats.updates;
+	}
+	int64_t elapsed = (player->stats.running ? mcp2221_nowNs() : player->endTime) - player->startTime;
+	if(player->stats.samples && elapsed > 0)
+		stats->rate = (double)player->stats.samples * NS_PER_SEC / elapsed;
+	pthread_mutex_unlock(&player->lock);
+
+	return MCP2221_SUCCESS;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_dacPlayStop(mcp2221_dacplayer_t* player)
+{
+	if(!player)
+		return MCP2221_INVALID_ARG;
+
+	mcp2221_t* device = player->device;
+	mcp2221_lock(device);
+	for(mcp2221_dacplayer_t** p = &device->priv->dacPlayers; *p; p = &(*p)->next)
+	{
+		if(*p == player)
+		{
+			*p = player->next;
+			break;
+		}
+	}
+	mcp2221_unlock(device);
+
+	pthread_mutex_lock(&player->lock);
+	player->stop = 1;
+	pthread_mutex_unlock(&player->lock);
+
+	// The thread notices within one sample period
+	pthread_join(player->thread, NULL);
+
+	mcp2221_error res = player->stats.lastError;
+
+	pthread_mutex_destroy(&player->lock);
+	free(player->codes);
+	free(player->pending);
+	free(player);
+
+	return res;
+}
+
+void LIB_INTERNAL mcp2221_dacPlayStopAll(mcp2221_t* device)
+{
+	// Not under the device lock while joining, the player thread needs it for its transactions
+	while(1)
+	{
+		mcp2221_lock(device);
+		mcp2221_dacplayer_t* player = device->priv->dacPlayers;
+		mcp2221_unlock(device);
+		if(!player)
+			break;
+		mcp2221_dacPlayStop(player);
+	}
+}
@@ -0,0 +1,421 @@
+/*
+ * Project: MCP2221 HID Library
+ * Author: Zak Kemble, contact@zakkemble.co.uk
+ * Copyright: (C) 2015 by Zak Kemble
+ * License: GNU GPL v3 (see License.txt)
+ * Web: http://blog.zakkemble.co.uk/mcp2221-hid-library/
+ */
+
+// GPIO change monitor, one GET GPIO poll thread per device shared by all subscribers
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include "libmcp2221.h"
+#include "libmcp2221_private.h"
+
+struct mcp2221_gpioqueue_t{
+	mcp2221_gpioevent_t* events;
+	unsigned int mask;			// Capacity - 1, capacity is a power of 2
+	unsigned int head;			// Written by the monitor thread only
+	unsigned int tail;			// Written by the consumer only
+	unsigned long dropped;		// Events lost because the queue was full
+};
+
+typedef struct{
+	int id;						// 0 = unused slot
+	int pins;
+	mcp2221_gpio_callback_t callback;
+	void* userData;
+	mcp2221_gpioqueue_t* queue;
+}subscriber_t;
+
+struct mcp2221_gpiomon_t{
+	mcp2221_t* device;
+	pthread_t thread;
+	int running;
+	int stop;
+	mcp2221_gpiomon_conf_t conf;
+
+	pthread_mutex_t subLock;	// Protects subs, held while callbacks run
+	subscriber_t subs[MCP2221_GPIOMON_MAX_SUBS];
+	int nextId;
+
+	pthread_mutex_t statLock;	// Protects stats
+	mcp2221_gpiomon_stats_t stats;
+};
+
+mcp2221_gpiomon_conf_t LIB_EXPORT mcp2221_gpioMonitorConfInit(void)
+{
+	mcp2221_gpiomon_conf_t conf;
+	conf.pins		= MCP2221_GPIO0 | MCP2221_GPIO1 | MCP2221_GPIO2 | MCP2221_GPIO3;
+	conf.pollUs		= 1000;
+	conf.idlePollUs	= 50000;
+	conf.idleAfterUs	= 100000;
+	conf.debounceUs	= 0;
+	return conf;
+}
+
+static void deliver(struct mcp2221_gpiomon_t* mon, const mcp2221_gpioevent_t* event)
+{
+	pthread_mutex_lock(&mon->subLock);
+	for(int i=0;i<MCP2221_GPIOMON_MAX_SUBS;i++)
+	{
+		subscriber_t* sub = &mon->subs[i];
+		if(!sub->id || !(sub->pins & (1 << event->pin)))
+			continue;
+
+		if(sub->callback)
+			sub->callback(mon->device, event, sub->userData);
+		else
+		{
+			mcp2221_gpioqueue_t* q = sub->queue;
+			unsigned int head = q->head;
+			unsigned int tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+			if(head - tail > q->mask)
+				__atomic_fetch_add(&q->dropped, 1, __ATOMIC_RELAXED);
+			else
+			{
+				q->events[head & q->mask] = *event;
+				__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+			}
+		}
+	}
+	pthread_mutex_unlock(&mon->subLock);
+}
+
+static void* monitorThread(void* arg)
+{
+	struct mcp2221_gpiomon_t* mon = arg;
+	mcp2221_gpiomon_conf_t conf = mon->conf;
+	NEW_REPORT(report);
+
+	int reported = -1;			// Debounced pin states, bit set = HIGH
+	int candidate = 0;			// Raw states waiting for the debounce time to pass
+	int64_t changedAt[MCP2221_GPIO_COUNT];	// When each pin was first seen at its candidate value
+	int64_t interval = (int64_t)conf.pollUs * 1000;
+	int64_t lastActivity = mcp2221_nowNs();
+	int64_t next = lastActivity;
+
+	while(1)
+	{
+		pthread_mutex_lock(&mon->statLock);
+		int stop = mon->stop;
+		pthread_mutex_unlock(&mon->statLock);
+		if(stop)
+			break;
+
+		mcp2221_sleepUntilNs(next);
+
+		memset(report, 0x00, REPORT_SIZE);
+		report[0] = USB_CMD_GETGPIO;
+		int64_t t0 = mcp2221_nowNs();
+		mcp2221_error res = mcp2221_doTransaction(mon->device, report);
+		int64_t now = mcp2221_nowNs();
+		int64_t sampled = (t0 + now) / 2;
+
+		pthread_mutex_lock(&mon->statLock);
+		mon->stats.polls++;
+		if(res != MCP2221_SUCCESS)
+		{
+			// Keep trying, but slowly, the device might just be busy or about to be closed
+			mon->stats.errors++;
+			mon->stats.lastError = res;
+			mon->stats.intervalUs = conf.idlePollUs;
+			pthread_mutex_unlock(&mon->statLock);
+			next = now + ((int64_t)conf.idlePollUs * 1000);
+			continue;
+		}
+		pthread_mutex_unlock(&mon->statLock);
+
+		int states = 0;
+		for(int i=0;i<MCP2221_GPIO_COUNT;i++)
+		{
+			if(report[(i * 2) + 2] == MCP2221_GPIO_VALUE_HIGH)
+				states |= (1 << i);
+		}
+		states &= conf.pins;
+
+		if(reported < 0)
+		{
+			// First sample is the reference, there are no edges yet
+			reported = states;
+			candidate = states;
+		}
+
+		int pending = 0;
+		int active = (states != candidate);
+		for(int i=0;i<MCP2221_GPIO_COUNT;i++)
+		{
+			int bit = (1 << i);
+			if(!(conf.pins & bit))
+				continue;
+
+			if((states ^ candidate) & bit)
+			{
+				// Raw value changed (or bounced back), restart the debounce time
+				candidate ^= bit;
+				changedAt[i] = sampled;
+			}
+
+			if((candidate ^ reported) & bit)
+			{
+				if(sampled - changedAt[i] >= (int64_t)conf.debounceUs * 1000)
+				{
+					reported ^= bit;
+
+					mcp2221_gpioevent_t event;
+					event.timestampNs = changedAt[i];
+					event.pin = i;
+					event.value = (reported & bit) ? MCP2221_GPIO_VALUE_HIGH : MCP2221_GPIO_VALUE_LOW;
+					event.states = reported;
+					deliver(mon, &event);
+
+					pthread_mutex_lock(&mon->statLock);
+					mon->stats.events++;
+					pthread_mutex_unlock(&mon->statLock);
+				}
+				else
+					pending = 1;
+			}
+		}
+
+		// Poll fast while pins are moving or being debounced, then back off exponentially to the idle rate
+		if(active || pending)
+			lastActivity = now;
+		if(now - lastActivity < (int64_t)conf.idleAfterUs * 1000)
+			interval = (int64_t)conf.pollUs * 1000;
+		else if(interval < (int64_t)conf.idlePollUs * 1000)
+		{
+			interval *= 2;
+			if(interval > (int64_t)conf.idlePollUs * 1000)
+				interval = (int64_t)conf.idlePollUs * 1000;
+		}
+
+		pthread_mutex_lock(&mon->statLock);
+		mon->stats.intervalUs = interval / 1000;
+		pthread_mutex_unlock(&mon->statLock);
+
+		next += interval;
+		if(next < now)
+			next = now; // Polling is slower than the requested rate, don't try to catch up
+	}
+
+	return NULL;
+}
+
+static struct mcp2221_gpiomon_t* getMonitor(mcp2221_t* device)
+{
+	if(!device->priv->gpioMon)
+	{
+		struct mcp2221_gpiomon_t* mon = calloc(1, sizeof(struct mcp2221_gpiomon_t));
+		if(!mon)
+			return NULL;
+		mon->device = device;
+		mon->nextId = 1;
+		mon->conf = mcp2221_gpioMonitorConfInit();
+		pthread_mutex_init(&mon->subLock, NULL);
+		pthread_mutex_init(&mon->statLock, NULL);
+		device->priv->gpioMon = mon;
+	}
+	return device->priv->gpioMon;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_gpioMonitorStart(mcp2221_t* device, const mcp2221_gpiomon_conf_t* conf)
+{
+	if(!device || !device->priv)
+		return MCP2221_INVALID_ARG;
+	if(conf && (conf->pollUs < 1 || conf->idlePollUs < conf->pollUs || conf->debounceUs < 0 || conf->idleAfterUs < 0))
+		return MCP2221_INVALID_ARG;
+
+	struct mcp2221_gpiomon_t* mon = getMonitor(device);
+	if(!mon)
+		return MCP2221_ERROR;
+	if(mon->running)
+		return MCP2221_ERROR; // Already polling, all subscribers share this poll stream
+
+	if(conf)
+		mon->conf = *conf;
+	mon->stop = 0;
+	memset(&mon->stats, 0, sizeof(mon->stats));
+	mon->stats.intervalUs = mon->conf.pollUs;
+
+	if(pthread_create(&mon->thread, NULL, monitorThread, mon) != 0)
+		return MCP2221_ERROR;
+	mon->running = 1;
+
+	return MCP2221_SUCCESS;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_gpioMonitorStop(mcp2221_t* device)
+{
+	if(!device || !device->priv)
+		return MCP2221_INVALID_ARG;
+
+	struct mcp2221_gpiomon_t* mon = device->priv->gpioMon;
+	if(!mon)
+		return MCP2221_SUCCESS;
+
+	if(mon->running)
+	{
+		pthread_mutex_lock(&mon->statLock);
+		mon->stop = 1;
+		pthread_mutex_unlock(&mon->statLock);
+		pthread_join(mon->thread, NULL);
+		mon->running = 0;
+	}
+
+	for(int i=0;i<MCP2221_GPIOMON_MAX_SUBS;i++)
+	{
+		if(mon->subs[i].queue)
+		{
+			free(mon->subs[i].queue->events);
+			free(mon->subs[i].queue);
+		}
+	}
+
+	pthread_mutex_destroy(&mon->subLock);
+	pthread_mutex_destroy(&mon->statLock);
+	free(mon);
+	device->priv->gpioMon = NULL;
+
+	return MCP2221_SUCCESS;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_gpioMonitorStats(mcp2221_t* device, mcp2221_gpiomon_stats_t* stats)
+{
+	if(!device || !device->priv || !stats)
+		return MCP2221_INVALID_ARG;
+
+	struct mcp2221_gpiomon_t* mon = device->priv->gpioMon;
+	if(!mon)
+		return MCP2221_ERROR;
+
+	pthread_mutex_lock(&mon->statLock);
+	*stats = mon->stats;
+	pthread_mutex_unlock(&mon->statLock);
+
+	return MCP2221_SUCCESS;
+}
+
+static mcp2221_error addSubscriber(mcp2221_t* device, int pins, mcp2221_gpio_callback_t callback, void* userData, mcp2221_gpioqueue_t* queue, int* id)
+{
+	struct mcp2221_gpiomon_t* mon = getMonitor(device);
+	if(!mon)
+		return MCP2221_ERROR;
+
+	mcp2221_error res = MCP2221_ERROR; // No free slot
+	pthread_mutex_lock(&mon->subLock);
+	for(int i=0;i<MCP2221_GPIOMON_MAX_SUBS;i++)
+	{
+		subscriber_t* sub = &mon->subs[i];
+		if(sub->id)
+			continue;
+		sub->id = mon->nextId++;
+		sub->pins = pins;
+		sub->callback = callback;
+		sub->userData = userData;
+		sub->queue = queue;
+		if(id)
+			*id = sub->id;
+		res = MCP2221_SUCCESS;
+		break;
+	}
+	pthread_mutex_unlock(&mon->subLock);
+
+	return res;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_gpioSubscribe(mcp2221_t* device, int pins, mcp2221_gpio_callback_t callback, void* userData, int* id)
+{
+	if(!device || !device->priv || !callback)
+		return MCP2221_INVALID_ARG;
+	return addSubscriber(device, pins, callback, userData, NULL, id);
+}
+
+mcp2221_error LIB_EXPORT mcp2221_gpioSubscribeQueue(mcp2221_t* device, int pins, int capacity, mcp2221_gpioqueue_t** queue, int* id)
+{
+	if(!device || !device->priv || !queue || capacity < 1)
+		return MCP2221_INVALID_ARG;
+
+	unsigned int size = 1;
+	while(size < (unsigned int)capacity)
+		size <<= 1;
+
+	mcp2221_gpioqueue_t* q = calloc(1, sizeof(mcp2221_gpioqueue_t));
+	if(!q)
+		return MCP2221_ERROR;
+	q->events = malloc(size * sizeof(mcp2221_gpioevent_t));
+	if(!q->events)
+	{
+		free(q);
+		return MCP2221_ERROR;
+	}
+	q->mask = size - 1;
+
+	mcp2221_error res = addSubscriber(device, pins, NULL, NULL, q, id);
+	if(res != MCP2221_SUCCESS)
+	{
+		free(q->events);
+		free(q);
+		return res;
+	}
+
+	*queue = q;
+	return res;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_gpioUnsubscribe(mcp2221_t* device, int id)
+{
+	if(!device || !device->priv)
+		return MCP2221_INVALID_ARG;
+
+	struct mcp2221_gpiomon_t* mon = device->priv->gpioMon;
+	if(!mon)
+		return MCP2221_INVALID_ARG;
+
+	mcp2221_error res = MCP2221_INVALID_ARG;
+	pthread_mutex_lock(&mon->subLock);
+	for(int i=0;i<MCP2221_GPIOMON_MAX_SUBS;i++)
+	{
+		subscriber_t* sub = &mon->subs[i];
+		if(sub->id != id)
+			continue;
+		if(sub->queue)
+		{
+			free(sub->queue->events);
+			free(sub->queue);
+		}
+		memset(sub, 0, sizeof(subscriber_t));
+		res = MCP2221_SUCCESS;
+		break;
+	}
+	pthread_mutex_unlock(&mon->subLock);
+
+	return res;
+}
+
+int LIB_EXPORT mcp2221_gpioQueuePop(mcp2221_gpioqueue_t* queue, mcp2221_gpioevent_t* event)
+{
+	if(!queue || !event)
+		return 0;
+
+	unsigned int tail = queue->tail;
+	unsigned int head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+	if(head == tail)
+		return 0;
+
+	*event = queue->events[tail & queue->mask];
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+unsigned long LIB_EXPORT mcp2221_gpioQueueDropped(mcp2221_gpioqueue_t* queue)
+{
+	if(!queue)
+		return 0;
+	return __atomic_load_n(&queue->dropped, __ATOMIC_RELAXED);
+}
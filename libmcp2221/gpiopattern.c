@@ -0,0 +1,184 @@
+/*
+ * Project: MCP2221 HID Library
+ * Author: Zak Kemble, contact@zakkemble.co.uk
+ * Copyright: (C) 2015 by Zak Kemble
+ * License: GNU GPL v3 (see License.txt)
+ * Web: http://blog.zakkemble.co.uk/mcp2221-hid-library/
+ */
+
+// Timed GPIO patterns, every step is encoded into its SET GPIO report before the pattern runs
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include "libmcp2221.h"
+#include "libmcp2221_private.h"
+
+struct mcp2221_gpiopattern_t{
+	int count;
+	uint8_t (*reports)[REPORT_SIZE];	// One pre-encoded SET GPIO report per step
+	int64_t* offsets;					// Scheduled time of each step from the start of a pass, in ns
+	int64_t length;						// Duration of one pass, in ns
+	int* pins;							// Pins changed by each step, 0 for pure delays
+	int* values;
+};
+
+static int64_t absNs(int64_t val)
+{
+	return (val < 0) ? -val : val;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_gpioPatternCompile(const mcp2221_gpiostep_t* steps, int count, mcp2221_gpiopattern_t** pattern)
+{
+	if(!steps || !pattern || count < 1)
+		return MCP2221_INVALID_ARG;
+
+	mcp2221_gpiopattern_t* p = calloc(1, sizeof(mcp2221_gpiopattern_t));
+	if(!p)
+		return MCP2221_ERROR;
+
+	p->count = count;
+	p->reports = malloc(count * sizeof(*p->reports));
+	p->offsets = malloc(count * sizeof(*p->offsets));
+	p->pins = malloc(count * sizeof(*p->pins));
+	p->values = malloc(count * sizeof(*p->values));
+	if(!p->reports || !p->offsets || !p->pins || !p->values)
+	{
+		mcp2221_gpioPatternFree(p);
+		return MCP2221_ERROR;
+	}
+
+	int64_t offset = 0;
+	for(int i=0;i<count;i++)
+	{
+		p->pins[i] = steps[i].pins & 0x0F;
+		p->values[i] = steps[i].values & 0x0F;
+		mcp2221_encodeGPIOMask(p->reports[i], p->pins[i], p->values[i]);
+		p->offsets[i] = offset;
+		offset += (int64_t)steps[i].delayUs * 1000;
+	}
+	p->length = offset;
+
+	*pattern = p;
+	return MCP2221_SUCCESS;
+}
+
+void LIB_EXPORT mcp2221_gpioPatternFree(mcp2221_gpiopattern_t* pattern)
+{
+	if(pattern)
+	{
+		free(pattern->reports);
+		free(pattern->offsets);
+		free(pattern->pins);
+		free(pattern->values);
+		free(pattern);
+	}
+}
+
+mcp2221_error LIB_EXPORT mcp2221_gpioPatternRun(mcp2221_t* device, mcp2221_gpiopattern_t* pattern, int repeat, mcp2221_gpiopattern_stats_t* stats, int64_t* edgeNs)
+{
+	if(!device || !pattern || repeat < 1)
+		return MCP2221_INVALID_ARG;
+
+	mcp2221_gpiopattern_stats_t st;
+	memset(&st, 0, sizeof(st));
+	st.gapMinNs = -1;
+
+	NEW_REPORT(report);
+	mcp2221_error res = MCP2221_SUCCESS;
+	int64_t lead = 0; // How early to start a transaction, half of the smoothed round trip
+	int64_t latencySum = 0;
+	int64_t errorSum = 0;
+	int64_t lastEdge = -1;
+
+	// Keep other threads off the device for the whole pattern, otherwise their
+	// transactions would land between our edges and ruin the timing
+	mcp2221_lock(device);
+
+	int64_t start = mcp2221_nowNs();
+
+	for(int r=0;r<repeat && res == MCP2221_SUCCESS;r++)
+	{
+		int64_t passStart = start + (r * pattern->length);
+
+		for(int i=0;i<pattern->count;i++)
+		{
+			int64_t deadline = passStart + pattern->offsets[i];
+			int64_t* edge = edgeNs ? &edgeNs[(r * pattern->count) + i] : NULL;
+
+			if(!pattern->pins[i])
+			{
+				// Pure delay, nothing to send
+				if(edge)
+					*edge = -1;
+				st.steps++;
+				continue;
+			}
+
+			mcp2221_sleepUntilNs(deadline - lead);
+
+			memcpy(report, pattern->reports[i], REPORT_SIZE);
+
+			int64_t t0 = mcp2221_nowNs();
+			res = mcp2221_doTransaction(device, report);
+			int64_t t1 = mcp2221_nowNs();
+
+			if(res != MCP2221_SUCCESS)
+				break;
+
+			// The device applies the new state roughly halfway through the round trip
+			int64_t applied = (t0 + t1) / 2;
+			int64_t latency = t1 - t0;
+			int64_t error = absNs(applied - deadline);
+			lead = ((lead * 7) + (latency / 2)) / 8;
+
+			if(edge)
+				*edge = applied - start;
+
+			if(lastEdge >= 0)
+			{
+				int64_t gap = applied - lastEdge;
+				if(st.gapMinNs < 0 || gap < st.gapMinNs)
+					st.gapMinNs = gap;
+				if(gap > st.gapMaxNs)
+					st.gapMaxNs = gap;
+			}
+			lastEdge = applied;
+
+			st.steps++;
+			st.edges++;
+			latencySum += latency;
+			errorSum += error;
+			if(latency > st.latencyMaxNs)
+				st.latencyMaxNs = latency;
+			if(error > st.errorMaxNs)
+				st.errorMaxNs = error;
+
+			mcp2221_cacheGPIOMask(device, pattern->pins[i], pattern->values[i]);
+		}
+	}
+
+	// Hold the final state for the delay of the last step, so patterns can be chained
+	if(res == MCP2221_SUCCESS)
+		mcp2221_sleepUntilNs(start + (repeat * pattern->length));
+
+	st.durationNs = mcp2221_nowNs() - start;
+
+	mcp2221_unlock(device);
+
+	if(st.edges)
+	{
+		st.latencyAvgNs = latencySum / st.edges;
+		st.errorAvgNs = errorSum / st.edges;
+	}
+	if(st.gapMinNs < 0)
+		st.gapMinNs = 0;
+
+	if(stats)
+		*stats = st;
+
+	return res;
+}
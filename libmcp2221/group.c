@@ -0,0 +1,357 @@
+/*
+ * Project: MCP2221 HID Library
+ * Author: Zak Kemble, contact@zakkemble.co.uk
+ * Copyright: (C) 2015 by Zak Kemble
+ * License: GNU GPL v3 (see License.txt)
+ * Web: http://blog.zakkemble.co.uk/mcp2221-hid-library/
+ */
+
+// Device groups, runs the same operation on many devices at once with one worker thread per device
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include "libmcp2221.h"
+#include "libmcp2221_private.h"
+
+// Workers sleep until a common start time so their requests go out together,
+// far enough ahead that every worker has woken up by then
+#define GROUP_START_LEAD_NS(count)	(250000LL + ((count) * 20000LL))
+
+typedef struct{
+	mcp2221_group_t* group;
+	int index;
+	pthread_t thread;
+}worker_t;
+
+struct mcp2221_group_t{
+	int count;
+	mcp2221_t** devices;
+	worker_t* workers;
+	pthread_mutex_t runLock;	// Only one operation at a time
+
+	pthread_mutex_t lock;		// Protects everything below
+	pthread_cond_t startCond;	// Signalled when a new operation is ready
+	pthread_cond_t doneCond;	// Signalled when the last worker finishes
+	unsigned long generation;	// Incremented for every operation
+	int pending;				// Workers still running the current operation
+	int stop;
+
+	// Current operation
+	mcp2221_group_func_t func;
+	void* userData;
+	int64_t startNs;
+	mcp2221_groupresult_t* results;
+};
+
+static void* workerThread(void* arg)
+{
+	worker_t* worker = arg;
+	mcp2221_group_t* group = worker->group;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&group->lock);
+	while(1)
+	{
+		while(!group->stop && group->generation == seen)
+			pthread_cond_wait(&group->startCond, &group->lock);
+		if(group->stop)
+			break;
+
+		seen = group->generation;
+		mcp2221_group_func_t func = group->func;
+		void* userData = group->userData;
+		int64_t startNs = group->startNs;
+		pthread_mutex_unlock(&group->lock);
+
+		mcp2221_sleepUntilNs(startNs);
+		mcp2221_groupresult_t result;
+		result.startNs = mcp2221_nowNs();
+		result.res = func(group->devices[worker->index], worker->index, userData);
+		result.endNs = mcp2221_nowNs();
+
+		pthread_mutex_lock(&group->lock);
+		group->results[worker->index] = result;
+		if(--group->pending == 0)
+			pthread_cond_signal(&group->doneCond);
+	}
+	pthread_mutex_unlock(&group->lock);
+
+	return NULL;
+}
+
+// Run func on every device at the same time and wait for all of them, failures do not stop the others
+static mcp2221_error runAll(mcp2221_group_t* group, mcp2221_group_func_t func, void* userData, mcp2221_groupresult_t* results)
+{
+	pthread_mutex_lock(&group->runLock);
+	pthread_mutex_lock(&group->lock);
+
+	group->func = func;
+	group->userData = userData;
+	group->startNs = mcp2221_nowNs() + GROUP_START_LEAD_NS(group->count);
+	group->pending = group->count;
+	group->generation++;
+	pthread_cond_broadcast(&group->startCond);
+
+	while(group->pending)
+		pthread_cond_wait(&group->doneCond, &group->lock);
+
+	int failed = 0;
+	for(int i=0;i<group->count;i++)
+	{
+		if(group->results[i].res != MCP2221_SUCCESS)
+			failed++;
+	}
+	if(results)
+		memcpy(results, group->results, group->count * sizeof(mcp2221_groupresult_t));
+
+	pthread_mutex_unlock(&group->lock);
+	pthread_mutex_unlock(&group->runLock);
+
+	if(!failed)
+		return MCP2221_SUCCESS;
+	return (failed == group->count) ? group->results[0].res : MCP2221_ERROR;
+}
+
+static void stopWorkers(mcp2221_group_t* group, int count)
+{
+	pthread_mutex_lock(&group->lock);
+	group->stop = 1;
+	pthread_cond_broadcast(&group->startCond);
+	pthread_mutex_unlock(&group->lock);
+
+	for(int i=0;i<count;i++)
+		pthread_join(group->workers[i].thread, NULL);
+}
+
+mcp2221_error LIB_EXPORT mcp2221_groupCreate(mcp2221_t** devices, int count, mcp2221_group_t** group)
+{
+	if(!devices || count <= 0 || !group)
+		return MCP2221_INVALID_ARG;
+	for(int i=0;i<count;i++)
+	{
+		if(!devices[i])
+			return MCP2221_INVALID_ARG;
+	}
+
+	mcp2221_group_t* grp = calloc(1, sizeof(mcp2221_group_t));
+	if(!grp)
+		return MCP2221_ERROR;
+
+	grp->count = count;
+	grp->devices = malloc(count * sizeof(mcp2221_t*));
+	grp->workers = calloc(count, sizeof(worker_t));
+	grp->results = calloc(count, sizeof(mcp2221_groupresult_t));
+	if(!grp->devices || !grp->workers || !grp->results)
+	{
+		free(grp->devices);
+		free(grp->workers);
+		free(grp->results);
+		free(grp);
+		return MCP2221_ERROR;
+	}
+	memcpy(grp->devices, devices, count * sizeof(mcp2221_t*));
+
+	pthread_mutex_init(&grp->runLock, NULL);
+	pthread_mutex_init(&grp->lock, NULL);
+	pthread_cond_init(&grp->startCond, NULL);
+	pthread_cond_init(&grp->doneCond, NULL);
+
+	for(int i=0;i<count;i++)
+	{
+		grp->workers[i].group = grp;
+		grp->workers[i].index = i;
+		if(pthread_create(&grp->workers[i].thread, NULL, workerThread, &grp->workers[i]) != 0)
+		{
+			stopWorkers(grp, i);
+			grp->count = 0;
+			mcp2221_groupFree(grp);
+			return MCP2221_ERROR;
+		}
+	}
+
+	*group = grp;
+	return MCP2221_SUCCESS;
+}
+
+void LIB_EXPORT mcp2221_groupFree(mcp2221_group_t* group)
+{
+	if(!group)
+		return;
+
+	if(group->count)
+		stopWorkers(group, group->count);
+
+	pthread_cond_destroy(&group->startCond);
+	pthread_cond_destroy(&group->doneCond);
+	pthread_mutex_destroy(&group->lock);
+	pthread_mutex_destroy(&group->runLock);
+	free(group->devices);
+	free(group->workers);
+	free(group->results);
+	free(group);
+}
+
+int LIB_EXPORT mcp2221_groupCount(mcp2221_group_t* group)
+{
+	return group ? group->count : 0;
+}
+
+typedef struct{
+	mcp2221_sample_src_t source;
+	mcp2221_groupsample_t* samples;
+}sampleJob_t;
+
+static mcp2221_error sampleDevice(mcp2221_t* device, int index, void* userData)
+{
+	sampleJob_t* job = userData;
+	mcp2221_groupsample_t* sample = &job->samples[index];
+	NEW_REPORT(report);
+
+	memset(report, 0x00, REPORT_SIZE);
+	report[0] = (job->source == MCP2221_SAMPLE_GPIO) ? USB_CMD_GETGPIO : USB_CMD_STATUSSET;
+
+	sample->sentNs = mcp2221_nowNs();
+	sample->res = mcp2221_doTransaction(device, report);
+	sample->receivedNs = mcp2221_nowNs();
+	sample->timestampNs = (sample->sentNs + sample->receivedNs) / 2;
+
+	if(sample->res != MCP2221_SUCCESS)
+		return sample->res;
+
+	if(job->source == MCP2221_SAMPLE_GPIO)
+	{
+		for(int i=0;i<MCP2221_GPIO_COUNT;i++)
+			sample->gpio[i] = report[(i * 2) + 2];
+	}
+	else
+	{
+		for(int i=0;i<MCP2221_ADC_COUNT;i++)
+			sample->adc[i] = (report[51 + (i * 2)]<<8) | report[50 + (i * 2)];
+	}
+
+	return MCP2221_SUCCESS;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_groupSample(mcp2221_group_t* group, mcp2221_sample_src_t source, mcp2221_groupsample_t* samples, int64_t* skewNs)
+{
+	if(!group || !samples)
+		return MCP2221_INVALID_ARG;
+	if(source != MCP2221_SAMPLE_ADC && source != MCP2221_SAMPLE_GPIO)
+		return MCP2221_INVALID_ARG;
+
+	memset(samples, 0, group->count * sizeof(mcp2221_groupsample_t));
+
+	sampleJob_t job;
+	job.source = source;
+	job.samples = samples;
+	mcp2221_error res = runAll(group, sampleDevice, &job, NULL);
+
+	// Skew is the spread of the sample times of the devices that answered
+	int64_t first = 0;
+	int64_t last = 0;
+	int ok = 0;
+	for(int i=0;i<group->count;i++)
+	{
+		if(samples[i].res != MCP2221_SUCCESS)
+			continue;
+		if(!ok || samples[i].timestampNs < first)
+			first = samples[i].timestampNs;
+		if(!ok || samples[i].timestampNs > last)
+			last = samples[i].timestampNs;
+		ok++;
+	}
+
+	if(skewNs)
+		*skewNs = last - first;
+
+	return res;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_groupRun(mcp2221_group_t* group, mcp2221_group_func_t func, void* userData, mcp2221_groupresult_t* results)
+{
+	if(!group || !func)
+		return MCP2221_INVALID_ARG;
+	return runAll(group, func, userData, results);
+}
+
+static mcp2221_error gpioConfDevice(mcp2221_t* device, int index, void* userData)
+{
+	(void)index;
+	return mcp2221_setGPIOConf(device, userData);
+}
+
+mcp2221_error LIB_EXPORT mcp2221_groupSetGPIOConf(mcp2221_group_t* group, mcp2221_gpioconfset_t* confSet, mcp2221_groupresult_t* results)
+{
+	if(!group || !confSet)
+		return MCP2221_INVALID_ARG;
+	return runAll(group, gpioConfDevice, confSet, results);
+}
+
+typedef struct{
+	mcp2221_dac_ref_t ref;
+	int value;
+}dacJob_t;
+
+static mcp2221_error dacDevice(mcp2221_t* device, int index, void* userData)
+{
+	dacJob_t* job = userData;
+	(void)index;
+	return mcp2221_setDAC(device, job->ref, job->value);
+}
+
+mcp2221_error LIB_EXPORT mcp2221_groupSetDAC(mcp2221_group_t* group, mcp2221_dac_ref_t ref, int value, mcp2221_groupresult_t* results)
+{
+	if(!group)
+		return MCP2221_INVALID_ARG;
+	dacJob_t job;
+	job.ref = ref;
+	job.value = value;
+	return runAll(group, dacDevice, &job, results);
+}
+
+static mcp2221_error i2cDividerDevice(mcp2221_t* device, int index, void* userData)
+{
+	(void)index;
+	return mcp2221_i2cDivider(device, *(int*)userData);
+}
+
+mcp2221_error LIB_EXPORT mcp2221_groupI2cDivider(mcp2221_group_t* group, int i2cdiv, mcp2221_groupresult_t* results)
+{
+	if(!group)
+		return MCP2221_INVALID_ARG;
+	return runAll(group, i2cDividerDevice, &i2cdiv, results);
+}
+
+typedef struct{
+	int address;
+	const uint8_t* data;
+	unsigned int len;
+}i2cWriteJob_t;
+
+static mcp2221_error i2cWriteDevice(mcp2221_t* device, int index, void* userData)
+{
+	i2cWriteJob_t* job = userData;
+	(void)index;
+
+	mcp2221_error res;
+	if((res = mcp2221_i2cWriteRead(device, job->address, job->data, job->len, NULL, 0)) != MCP2221_SUCCESS)
+		return res;
+
+	// Wait for the write to finish on the bus so the result and timing mean something
+	return mcp2221_wait_state(device, MCP2221_I2C_IDLE);
+}
+
+mcp2221_error LIB_EXPORT mcp2221_groupI2cWrite(mcp2221_group_t* group, int address, const uint8_t* data, unsigned int len, mcp2221_groupresult_t* results)
+{
+	if(!group || !data)
+		return MCP2221_INVALID_ARG;
+	i2cWriteJob_t job;
+	job.address = address;
+	job.data = data;
+	job.len = len;
+	return runAll(group, i2cWriteDevice, &job, results);
+}
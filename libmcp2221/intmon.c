@@ -0,0 +1,271 @@
+/*
+ * Project: MCP2221 HID Library
+ * Author: Zak Kemble, contact@zakkemble.co.uk
+ * Copyright: (C) 2015 by Zak Kemble
+ * License: GNU GPL v3 (see License.txt)
+ * Web: http://blog.zakkemble.co.uk/mcp2221-hid-library/
+ */
+
+// Interrupt input monitor, polls and clears the interrupt flag on a background thread
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include "libmcp2221.h"
+#include "libmcp2221_private.h"
+
+typedef struct{
+	int id;						// 0 = unused slot
+	mcp2221_int_callback_t callback;
+	void* userData;
+}subscriber_t;
+
+struct mcp2221_intmon_t{
+	mcp2221_t* device;
+	pthread_t thread;
+	int minPollUs;
+	int maxPollUs;
+
+	pthread_mutex_t subLock;	// Protects subs, held while callbacks run
+	subscriber_t subs[MCP2221_INTMON_MAX_SUBS];
+	int nextId;
+
+	pthread_mutex_t statLock;	// Protects stop and stats
+	int running;				// Poll thread has been started
+	int stop;
+	mcp2221_intmon_stats_t stats;
+};
+
+static void deliver(struct mcp2221_intmon_t* mon, const mcp2221_intevent_t* event)
+{
+	pthread_mutex_lock(&mon->subLock);
+	for(int i=0;i<MCP2221_INTMON_MAX_SUBS;i++)
+	{
+		if(mon->subs[i].id)
+			mon->subs[i].callback(mon->device, event, mon->subs[i].userData);
+	}
+	pthread_mutex_unlock(&mon->subLock);
+}
+
+static void* monitorThread(void* arg)
+{
+	struct mcp2221_intmon_t* mon = arg;
+	int64_t minInterval = (int64_t)mon->minPollUs * 1000;
+	int64_t maxInterval = (int64_t)mon->maxPollUs * 1000;
+	int64_t interval = minInterval;
+	int64_t lastSample = mcp2221_nowNs();
+	int64_t next = lastSample;
+	int lastState = 0;
+	unsigned long sequence = 0;
+
+	while(1)
+	{
+		pthread_mutex_lock(&mon->statLock);
+		int stop = mon->stop;
+		pthread_mutex_unlock(&mon->statLock);
+		if(stop)
+			break;
+
+		mcp2221_sleepUntilNs(next);
+
+		int state;
+		int64_t t0 = mcp2221_nowNs();
+		mcp2221_error res = mcp2221_readClearInterrupt(mon->device, &state);
+		int64_t now = mcp2221_nowNs();
+		int64_t sampled = (t0 + now) / 2;
+
+		pthread_mutex_lock(&mon->statLock);
+		mon->stats.polls++;
+		if(res != MCP2221_SUCCESS)
+		{
+			mon->stats.errors++;
+			mon->stats.lastError = res;
+			mon->stats.intervalUs = mon->maxPollUs;
+			pthread_mutex_unlock(&mon->statLock);
+			lastState = 0;
+			next = now + maxInterval;
+			continue;
+		}
+
+		if(state)
+		{
+			mon->stats.edges++;
+
+			// The flag was already set again on the very next poll at full speed, the input is
+			// probably pulsing faster than we can poll so some edges were merged into this one
+			if(lastState && interval == minInterval)
+				mon->stats.coalesced++;
+		}
+		pthread_mutex_unlock(&mon->statLock);
+
+		if(state)
+		{
+			mcp2221_intevent_t event;
+			event.timestampNs = sampled;
+			event.earliestNs = lastSample;
+			event.sequence = ++sequence;
+			deliver(mon, &event);
+
+			// Edges are coming in, poll as fast as allowed
+			interval = minInterval;
+		}
+		else if(interval < maxInterval)
+		{
+			// Idle, back off gradually
+			interval += (interval / 2) + 1000;
+			if(interval > maxInterval)
+				interval = maxInterval;
+		}
+
+		lastState = state;
+		lastSample = sampled;
+
+		pthread_mutex_lock(&mon->statLock);
+		mon->stats.intervalUs = interval / 1000;
+		pthread_mutex_unlock(&mon->statLock);
+
+		next += interval;
+		if(next < now)
+			next = now; // Polling is slower than the requested rate, don't try to catch up
+	}
+
+	return NULL;
+}
+
+static struct mcp2221_intmon_t* getMonitor(mcp2221_t* device)
+{
+	if(!device->priv->intMon)
+	{
+		struct mcp2221_intmon_t* mon = calloc(1, sizeof(struct mcp2221_intmon_t));
+		if(!mon)
+			return NULL;
+		mon->device = device;
+		mon->nextId = 1;
+		pthread_mutex_init(&mon->subLock, NULL);
+		pthread_mutex_init(&mon->statLock, NULL);
+		device->priv->intMon = mon;
+	}
+	return device->priv->intMon;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_intMonitorStart(mcp2221_t* device, int minPollUs, int maxPollUs)
+{
+	if(!device || !device->priv || minPollUs < 0 || maxPollUs < minPollUs)
+		return MCP2221_INVALID_ARG;
+
+	struct mcp2221_intmon_t* mon = getMonitor(device);
+	if(!mon)
+		return MCP2221_ERROR;
+	if(mon->running)
+		return MCP2221_ERROR; // Already polling, all subscribers share this poll stream
+
+	mon->minPollUs = minPollUs;
+	mon->maxPollUs = maxPollUs;
+	mon->stop = 0;
+	memset(&mon->stats, 0, sizeof(mon->stats));
+	mon->stats.intervalUs = minPollUs;
+
+	if(pthread_create(&mon->thread, NULL, monitorThread, mon) != 0)
+		return MCP2221_ERROR;
+	mon->running = 1;
+
+	return MCP2221_SUCCESS;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_intMonitorStop(mcp2221_t* device)
+{
+	if(!device || !device->priv)
+		return MCP2221_INVALID_ARG;
+
+	struct mcp2221_intmon_t* mon = device->priv->intMon;
+	if(!mon)
+		return MCP2221_SUCCESS;
+
+	if(mon->running)
+	{
+		pthread_mutex_lock(&mon->statLock);
+		mon->stop = 1;
+		pthread_mutex_unlock(&mon->statLock);
+		pthread_join(mon->thread, NULL);
+		mon->running = 0;
+	}
+
+	pthread_mutex_destroy(&mon->subLock);
+	pthread_mutex_destroy(&mon->statLock);
+	free(mon);
+	device->priv->intMon = NULL;
+
+	return MCP2221_SUCCESS;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_intMonitorStats(mcp2221_t* device, mcp2221_intmon_stats_t* stats)
+{
+	if(!device || !device->priv || !stats)
+		return MCP2221_INVALID_ARG;
+
+	struct mcp2221_intmon_t* mon = device->priv->intMon;
+	if(!mon)
+		return MCP2221_ERROR;
+
+	pthread_mutex_lock(&mon->statLock);
+	*stats = mon->stats;
+	pthread_mutex_unlock(&mon->statLock);
+
+	return MCP2221_SUCCESS;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_intSubscribe(mcp2221_t* device, mcp2221_int_callback_t callback, void* userData, int* id)
+{
+	if(!device || !device->priv || !callback)
+		return MCP2221_INVALID_ARG;
+
+	struct mcp2221_intmon_t* mon = getMonitor(device);
+	if(!mon)
+		return MCP2221_ERROR;
+
+	mcp2221_error res = MCP2221_ERROR; // No free slot
+	pthread_mutex_lock(&mon->subLock);
+	for(int i=0;i<MCP2221_INTMON_MAX_SUBS;i++)
+	{
+		if(mon->subs[i].id)
+			continue;
+		mon->subs[i].id = mon->nextId++;
+		mon->subs[i].callback = callback;
+		mon->subs[i].userData = userData;
+		if(id)
+			*id = mon->subs[i].id;
+		res = MCP2221_SUCCESS;
+		break;
+	}
+	pthread_mutex_unlock(&mon->subLock);
+
+	return res;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_intUnsubscribe(mcp2221_t* device, int id)
+{
+	if(!device || !device->priv)
+		return MCP2221_INVALID_ARG;
+
+	struct mcp2221_intmon_t* mon = device->priv->intMon;
+	if(!mon)
+		return MCP2221_INVALID_ARG;
+
+	mcp2221_error res = MCP2221_INVALID_ARG;
+	pthread_mutex_lock(&mon->subLock);
+	for(int i=0;i<MCP2221_INTMON_MAX_SUBS;i++)
+	{
+		if(mon->subs[i].id == id)
+		{
+			memset(&mon->subs[i], 0, sizeof(subscriber_t));
+			res = MCP2221_SUCCESS;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mon->subLock);
+
+	return res;
+}
@@ -6,30 +6,30 @@
  * Web: http://blog.zakkemble.co.uk/mcp2221-hid-library/
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <limits.h>
 #include <unistd.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#endif
 #include "hidapi.h"
 #include "libmcp2221.h"
+#include "libmcp2221_private.h"
 
 #define UNUSED(var) ((void)(var))
 
 #ifndef DEBUG_INFO_HID
 #define DEBUG_INFO_HID	0
 #endif
-#define REPORT_SIZE		MCP2221_REPORT_SIZE
 #define HID_REPORT_SIZE	REPORT_SIZE + 1 // + 1 for report ID, which is always 0 for MCP2221
 
-#ifdef _WIN32
-	#define LIB_EXPORT __declspec(dllexport)
-#else
-	#define LIB_EXPORT
-#endif
-
-#define NEW_REPORT(report) uint8_t report[REPORT_SIZE];
-
 #if !DEBUG_INFO_HID
 #define debug_printf(fmt, ...)	((void)(0))
 #define debug_puts(str)			((void)(0))
@@ -38,25 +38,6 @@
 #define debug_puts(str)			(puts(str))
 #endif
 
-typedef enum
-{
-	USB_CMD_STATUSSET	= 0x10,
-	USB_CMD_READFLASH	= 0xB0,
-	USB_CMD_WRITEFLASH	= 0xB1,
-	USB_CMD_FLASHPASS	= 0xB2,
-	USB_CMD_I2CWRITE	= 0x90,
-	USB_CMD_I2CWRITE_REPEATSTART	= 0x92,
-	USB_CMD_I2CWRITE_NOSTOP			= 0x94,
-	USB_CMD_I2CREAD		= 0x91,
-	USB_CMD_I2CREAD_REPEATSTART		= 0x93,
-	USB_CMD_I2CREAD_GET	= 0x40,
-	USB_CMD_SETGPIO		= 0x50,
-	USB_CMD_GETGPIO		= 0x51,
-	USB_CMD_SETSRAM		= 0x60,
-	USB_CMD_GETSRAM		= 0x61,
-	USB_CMD_RESET		= 0x70
-}usb_cmd_t;
-
 typedef enum
 {
 	FLASH_SECTION_CHIPSETTINGS		= 0x00,
@@ -94,6 +75,17 @@ static void clearUsbDevList(void)
 	devList = NULL;
 }
 
+// Serial number the device with this path was enumerated with, NULL if unknown
+static const wchar_t* listSerial(const char* devPath)
+{
+	for(device_list_t* dev = devList; dev; dev = dev->next)
+	{
+		if(strcmp(dev->devPath, devPath) == 0)
+			return dev->serial;
+	}
+	return NULL;
+}
+
 // Add a device to linked list
 static void addUsbDevList(int id, struct hid_device_info* dev2)
 {
@@ -172,7 +164,7 @@ static mcp2221_error doUSBget(hid_device* handle, void* data)
 	return MCP2221_SUCCESS;
 }
 
-static mcp2221_error doUSBsend(hid_device* handle, void* data)
+static mcp2221_error doUSBsend(hid_device* handle, const void* data)
 {
 	if(!handle || !data)
 		return MCP2221_INVALID_ARG;
@@ -200,18 +192,75 @@ static mcp2221_error doUSBsend(hid_device* handle, void* data)
 	return MCP2221_SUCCESS;
 }
 
+static mcp2221_error hidSend(mcp2221_t* device, const uint8_t* report)
+{
+	return doUSBsend(device->handle, report);
+}
+
+static mcp2221_error hidGet(mcp2221_t* device, uint8_t* report)
+{
+	return doUSBget(device->handle, report);
+}
+
+static void hidClose(mcp2221_t* device)
+{
+	hid_close(device->handle);
+#ifndef _WIN32
+	if(device->priv->hupFd >= 0)
+		close(device->priv->hupFd);
+#endif
+	device->priv->hupFd = -1;
+}
+
+#ifndef _WIN32
+// hidraw hangs up every open descriptor as soon as the device is removed
+static int hidAlive(mcp2221_t* device)
+{
+	if(device->priv->hupFd < 0)
+		return 1;
+	struct pollfd pfd = {device->priv->hupFd, 0, 0};
+	return !(poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR)));
+}
+
+// The hang up descriptor gets its own copy of every response, so it polls readable along with HIDAPI's
+static int hidAsyncFd(mcp2221_t* device, int arm)
+{
+	if(arm && device->priv->hupFd >= 0)
+	{
+		uint8_t buff[HID_REPORT_SIZE];
+		while(read(device->priv->hupFd, buff, sizeof(buff)) > 0);
+	}
+	return device->priv->hupFd;
+}
+
+static const mcp2221_transport_t hidTransport = {hidSend, hidGet, hidClose, NULL, hidAlive, hidAsyncFd};
+#else
+static const mcp2221_transport_t hidTransport = {hidSend, hidGet, hidClose, NULL, NULL, NULL};
+#endif
+
 static mcp2221_error USBget(mcp2221_t* device, void* data)
 {
-	if(!device)
+	if(!device || !device->priv)
 		return MCP2221_INVALID_ARG;
-	return doUSBget(device->handle, data);
+	return device->priv->transport->get(device, data);
 }
 
 static mcp2221_error USBsend(mcp2221_t* device, void* data)
 {
-	if(!device)
+	if(!device || !device->priv)
 		return MCP2221_INVALID_ARG;
-	return doUSBsend(device->handle, data);
+	return device->priv->transport->send(device, data);
+}
+
+static void delayUs(mcp2221_t* device, int us)
+{
+	// The real-time loop doesn't sleep, its next poll is paced by the USB frames anyway
+	if(device->priv && mcp2221_rtIsIoThread(device))
+		return;
+	if(device->priv && device->priv->transport && device->priv->transport->delay)
+		device->priv->transport->delay(device, us);
+	else
+		usleep(us);
 }
 
 static void clearReport(void* report)
@@ -236,18 +285,61 @@ static mcp2221_error getResponse(mcp2221_t* device, uint8_t* report, uint8_t typ
 	return res;
 }
 
+void LIB_INTERNAL mcp2221_lock(mcp2221_t* device)
+{
+	pthread_mutex_lock(&device->priv->lock);
+}
+
+void LIB_INTERNAL mcp2221_unlock(mcp2221_t* device)
+{
+	pthread_mutex_unlock(&device->priv->lock);
+}
+
+// Bookkeeping once a transaction has its response or has failed, holding the device lock
+static void transactionDone(mcp2221_t* device, uint8_t type, mcp2221_error res, int64_t start, const uint8_t* report)
+{
+	int64_t end = mcp2221_nowNs();
+	if(device->priv->metrics)
+		mcp2221_metricsTransaction(device->priv->metrics, type, res, end - start);
+	// Liveness checks don't need a transaction of their own while these get through
+	__atomic_store_n(&device->priv->lastOkNs, (res == MCP2221_SUCCESS) ? end : 0, __ATOMIC_RELAXED);
+	MCP2221_PROBE4(transaction_end, device, type, res, report[1]);
+	(void)report; // Only used by the probe
+}
+
 static mcp2221_error doTransaction(mcp2221_t* device, uint8_t* report)
 {
+	if(!device || !device->priv)
+		return MCP2221_INVALID_ARG;
+
 	uint8_t type = report[0];
 	mcp2221_error res;
+
+	// Library threads (e.g. the DAC player) share the device with the application,
+	// so the send and its response must not interleave with another transaction
+	mcp2221_lock(device);
+	if(device->priv->asyncPending)
+	{
+		mcp2221_unlock(device);
+		return MCP2221_PENDING;
+	}
+	MCP2221_PROBE3(transaction_start, device, type, report[1] | (report[2]<<8));
+	int64_t start = device->priv->metrics ? mcp2221_nowNs() : 0;
 	if((res = USBsend(device, report)) == MCP2221_SUCCESS) {
         // There is no response for the reset command
         if (report[0] != USB_CMD_RESET)
             res = getResponse(device, report, type);
     }
+	transactionDone(device, type, res, start, report);
+	mcp2221_unlock(device);
 	return res;
 }
 
+mcp2221_error LIB_INTERNAL mcp2221_doTransaction(mcp2221_t* device, uint8_t* report)
+{
+	return doTransaction(device, report);
+}
+
 // Reads FLASH data for updating
 static int saveReport(mcp2221_t* device, uint8_t* report)
 {
@@ -400,31 +492,76 @@ static mcp2221_error getUSBInfo(mcp2221_t* device)
 }
 
 // Open handle to device
-static mcp2221_t* open(char* devPath)
+static mcp2221_t* openPath(char* devPath)
 {
 	if(!devPath)
 		return NULL;
 
-	// Open device
-	hid_device* handle = hid_open_path(devPath);
-	if(!handle)
-		return NULL;
-
 	// TODO use strdup?
 
 	// Store device info
 	mcp2221_t* device = calloc(1, sizeof(mcp2221_t));
-	device->handle = handle;
+	device->priv = calloc(1, sizeof(struct mcp2221_priv_t));
+	device->priv->hupFd = -1;
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT); // So a real-time loop is never held up by a lower priority holder for long
+	pthread_mutex_init(&device->priv->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
 	device->path = malloc(strlen(devPath) + 1);
 	strcpy(device->path, devPath);
 
 	mcp2221_error res;
+
+	// Open device, through the local server if one is set
+	if(mcp2221_replayPath())
+		res = mcp2221_replayOpen(device, devPath);
+	else if(mcp2221_simIsPath(devPath))
+		res = mcp2221_simOpen(device, devPath);
+	else if(mcp2221_serverPath())
+		res = mcp2221_serverOpen(device, devPath);
+	else
+	{
+		device->handle = hid_open_path(devPath);
+		device->priv->transport = &hidTransport;
+		res = device->handle ? MCP2221_SUCCESS : MCP2221_ERROR_HID;
+
+#ifndef _WIN32
+		// HIDAPI doesn't give out its descriptor, so open another one on hidraw nodes for mcp2221_isAlive().
+		// It gets its own copy of input reports, the kernel drops those once its small queue is full.
+		if(res == MCP2221_SUCCESS && strncmp(devPath, "/dev/", 5) == 0)
+			device->priv->hupFd = open(devPath, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+#endif
+	}
+
+	if(res != MCP2221_SUCCESS)
+	{
+		device->priv->transport = NULL;
+		mcp2221_close(device);
+		return NULL;
+	}
+
+	// Record everything from here on if MCP2221_RECORD is set, replays are not recorded again
+	if(!mcp2221_replayPath() && mcp2221_recordWrap(device, listSerial(devPath)) != MCP2221_SUCCESS)
+	{
+		mcp2221_close(device);
+		return NULL;
+	}
+
+	// Count from the first transaction so opening shows up too, the serial label follows once it has been read
+	device->priv->metrics = mcp2221_metricsAttach(devPath);
+
 	if((res = updateGPIOCache(device)) != MCP2221_SUCCESS || (res = getUSBInfo(device)) != MCP2221_SUCCESS)
 	{
 		mcp2221_close(device);
 		return NULL;
 	}
 
+	if(device->priv->metrics)
+		mcp2221_metricsSetSerial(device->priv->metrics, device->usbInfo.serial);
+
+	MCP2221_PROBE2(open, device, device->path);
 	return device;
 }
 
@@ -440,12 +577,15 @@ mcp2221_error LIB_EXPORT mcp2221_init()
 		return MCP2221_ERROR_HID;
 	}
 
-	return MCP2221_SUCCESS;
+	// Export metrics if MCP2221_METRICS is set
+	return mcp2221_metricsInit();
 }
 
 void LIB_EXPORT mcp2221_exit()
 {
 	clearUsbDevList();
+	mcp2221_recordExit();
+	mcp2221_metricsExit();
 	hid_exit();
 	
 	// TODO return errors from hid_exit
@@ -468,7 +608,19 @@ int LIB_EXPORT mcp2221_find(int vid, int pid, wchar_t* manufacturer, wchar_t* pr
 
 	clearUsbDevList();
 
-	struct hid_device_info* allDevices = hid_enumerate(vid, pid);
+	// Replayed or simulated devices replace real ones, the local server enumerates the devices it can reach instead
+	int useReplay = (mcp2221_replayPath() != NULL);
+	int useSim = !useReplay && (mcp2221_simCount() > 0);
+	int useServer = !useReplay && !useSim && (mcp2221_serverPath() != NULL);
+	struct hid_device_info* allDevices;
+	if(useReplay)
+		allDevices = mcp2221_replayEnumerate(vid, pid);
+	else if(useSim)
+		allDevices = mcp2221_simEnumerate(vid, pid);
+	else if(useServer)
+		allDevices = mcp2221_serverEnumerate(vid, pid);
+	else
+		allDevices = hid_enumerate(vid, pid);
 	struct hid_device_info* currentDevice;
 	currentDevice = allDevices;
 
@@ -494,7 +646,14 @@ int LIB_EXPORT mcp2221_find(int vid, int pid, wchar_t* manufacturer, wchar_t* pr
 		currentDevice = currentDevice->next;
 	}
 
-	hid_free_enumeration(allDevices);
+	if(useReplay)
+		mcp2221_replayFreeEnumeration(allDevices);
+	else if(useSim)
+		mcp2221_simFreeEnumeration(allDevices);
+	else if(useServer)
+		mcp2221_serverFreeEnumeration(allDevices);
+	else
+		hid_free_enumeration(allDevices);
 
 	return count;
 }
@@ -513,7 +672,7 @@ int LIB_EXPORT mcp2221_sameDevice(mcp2221_t* dev1, mcp2221_t* dev2)
 mcp2221_t* LIB_EXPORT mcp2221_open()
 {
 	if(devList)
-		return open(devList->devPath);
+		return openPath(devList->devPath);
 	return NULL;
 }
 
@@ -530,7 +689,7 @@ mcp2221_t* LIB_EXPORT mcp2221_open_byIndex(int idx)
 		}
 	}
 
-	return open(devPath);
+	return openPath(devPath);
 }
 
 mcp2221_t* LIB_EXPORT mcp2221_open_bySerial(wchar_t* serial)
@@ -548,7 +707,12 @@ mcp2221_t* LIB_EXPORT mcp2221_open_bySerial(wchar_t* serial)
 		}
 	}
 
-	return open(devPath);
+	return openPath(devPath);
+}
+
+mcp2221_t* LIB_EXPORT mcp2221_open_byPath(char* path)
+{
+	return openPath(path);
 }
 
 // Close handle
@@ -556,8 +720,33 @@ void LIB_EXPORT mcp2221_close(mcp2221_t* device)
 {
 	if(device)
 	{
-		hid_close(device->handle);
+		MCP2221_PROBE1(close, device);
+
+		// Library threads must be gone before the handle is
+#ifndef _WIN32
+		mcp2221_rtStop(device);
+#endif
+		if(device->priv)
+		{
+			mcp2221_dacPlayStopAll(device);
+			mcp2221_captureStopAll(device);
+		}
+		mcp2221_gpioMonitorStop(device);
+		mcp2221_intMonitorStop(device);
+#ifndef _WIN32
+		mcp2221_pwmStop(device);
+#endif
+
+		if(device->priv && device->priv->transport)
+			device->priv->transport->close(device);
+		if(device->priv && device->priv->metrics)
+			mcp2221_metricsDetach(device->priv->metrics);
 		device->handle = NULL;
+		if(device->priv)
+		{
+			pthread_mutex_destroy(&device->priv->lock);
+			free(device->priv);
+		}
 		free(device);
 		//device = NULL; // needed? this isnt a pointer to a pointer
 	}
@@ -590,6 +779,130 @@ mcp2221_error LIB_EXPORT mcp2221_isConnected(mcp2221_t* device)
 	return res;
 }
 
+mcp2221_error LIB_EXPORT mcp2221_isAlive(mcp2221_t* device, int idleMs)
+{
+	if(!device || !device->priv || !device->priv->transport)
+		return MCP2221_INVALID_ARG;
+
+	const mcp2221_transport_t* transport = device->priv->transport;
+	if(transport->alive && !transport->alive(device))
+		return MCP2221_ERROR_HID;
+
+	if(idleMs < 0)
+		return MCP2221_SUCCESS;
+	if(idleMs == 0)
+		idleMs = MCP2221_ALIVE_IDLE;
+
+	int64_t lastOk = __atomic_load_n(&device->priv->lastOkNs, __ATOMIC_RELAXED);
+	if(lastOk && mcp2221_nowNs() - lastOk < (int64_t)idleMs * 1000000)
+		return MCP2221_SUCCESS;
+
+	return mcp2221_isConnected(device);
+}
+
+mcp2221_error LIB_EXPORT mcp2221_submit(mcp2221_t* device, const uint8_t* report)
+{
+	if(!device || !device->priv || !device->priv->transport || !report || report[0] == USB_CMD_RESET)
+		return MCP2221_INVALID_ARG;
+
+	const mcp2221_transport_t* transport = device->priv->transport;
+	if(!transport->asyncFd)
+		return MCP2221_ERROR;
+
+	mcp2221_lock(device);
+	if(device->priv->asyncPending)
+	{
+		mcp2221_unlock(device);
+		return MCP2221_PENDING;
+	}
+	if(transport->asyncFd(device, 1) < 0)
+	{
+		mcp2221_unlock(device);
+		return MCP2221_ERROR;
+	}
+
+	MCP2221_PROBE3(transaction_start, device, report[0], report[1] | (report[2]<<8));
+	int64_t start = mcp2221_nowNs();
+	mcp2221_error res = transport->send(device, report);
+	if(res == MCP2221_SUCCESS)
+	{
+		device->priv->asyncPending = 1;
+		device->priv->asyncCmd = report[0];
+		device->priv->asyncStartNs = start;
+	}
+	else
+		transactionDone(device, report[0], res, start, report);
+	mcp2221_unlock(device);
+	return res;
+}
+
+#ifndef _WIN32
+// 1 if the response of the submitted transaction is ready, 0 if not yet, -1 if it can't be waited for
+static int asyncReady(mcp2221_t* device)
+{
+	int fd = device->priv->transport->asyncFd(device, 0);
+	if(fd < 0)
+		return -1;
+
+	// A hang up or error counts as ready too, get() then reports it
+	struct pollfd pfd = {fd, POLLIN, 0};
+	int res = poll(&pfd, 1, 0);
+	if(res < 0)
+		return (errno == EINTR) ? 0 : -1;
+	return res > 0;
+}
+#else
+// Nothing can be submitted without the asyncFd hook
+static int asyncReady(mcp2221_t* device)
+{
+	UNUSED(device);
+	return -1;
+}
+#endif
+
+mcp2221_error LIB_EXPORT mcp2221_complete(mcp2221_t* device, uint8_t* report)
+{
+	if(!device || !device->priv || !device->priv->transport || !report)
+		return MCP2221_INVALID_ARG;
+
+	mcp2221_lock(device);
+	if(!device->priv->asyncPending)
+	{
+		mcp2221_unlock(device);
+		return MCP2221_ERROR;
+	}
+
+	uint8_t type = device->priv->asyncCmd;
+	int ready = asyncReady(device);
+	if(ready == 0)
+	{
+		mcp2221_unlock(device);
+		return MCP2221_PENDING;
+	}
+
+	// The response can't be waited for any more, give up on it so the device can be used again
+	if(ready < 0)
+	{
+		device->priv->asyncPending = 0;
+		transactionDone(device, type, MCP2221_ERROR, device->priv->asyncStartNs, report);
+		mcp2221_unlock(device);
+		return MCP2221_ERROR;
+	}
+
+	mcp2221_error res = getResponse(device, report, type);
+	device->priv->asyncPending = 0;
+	transactionDone(device, type, res, device->priv->asyncStartNs, report);
+	mcp2221_unlock(device);
+	return res;
+}
+
+int LIB_EXPORT mcp2221_pollFd(mcp2221_t* device)
+{
+	if(!device || !device->priv || !device->priv->transport || !device->priv->transport->asyncFd)
+		return -1;
+	return device->priv->transport->asyncFd(device, 0);
+}
+
 mcp2221_error LIB_EXPORT mcp2221_rawReport(mcp2221_t* device, uint8_t* report)
 {
 	return doTransaction(device, report);
@@ -606,6 +919,52 @@ mcp2221_error LIB_EXPORT mcp2221_setClockOut(mcp2221_t* device, mcp2221_clkdiv_t
 	return res;
 }
 
+mcp2221_error LIB_EXPORT mcp2221_planClockFrequency(uint32_t hz, mcp2221_clkduty_t duty, mcp2221_clkplan_t* plan)
+{
+	if(!plan || hz == 0)
+		return MCP2221_INVALID_ARG;
+
+	plan->hz = hz;
+	plan->duty = duty;
+	plan->div = MCP2221_CLKDIV_2;
+	uint32_t bestErr = UINT32_MAX;
+
+	// Dividers are 48MHz / 2^n, small enough to just try them all
+	for(int n=MCP2221_CLKDIV_2;n<=MCP2221_CLKDIV_128;n++)
+	{
+		uint32_t freq = 48000000UL >> n;
+		uint32_t err = (freq > hz) ? (freq - hz) : (hz - freq);
+		if(err < bestErr)
+		{
+			bestErr = err;
+			plan->div = n;
+		}
+	}
+
+	plan->achievedHz = (duty == MCP2221_CLKDUTY_0) ? 0 : (48000000UL >> plan->div);
+	return MCP2221_SUCCESS;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_setClockPlan(mcp2221_t* device, const mcp2221_clkplan_t* plan)
+{
+	if(!plan)
+		return MCP2221_INVALID_ARG;
+	return mcp2221_setClockOut(device, plan->div, plan->duty);
+}
+
+mcp2221_error LIB_EXPORT mcp2221_setClockFrequency(mcp2221_t* device, uint32_t hz, mcp2221_clkduty_t duty, uint32_t* achievedHz)
+{
+	mcp2221_clkplan_t plan;
+	mcp2221_error res;
+	if((res = mcp2221_planClockFrequency(hz, duty, &plan)) != MCP2221_SUCCESS)
+		return res;
+	if((res = mcp2221_setClockPlan(device, &plan)) != MCP2221_SUCCESS)
+		return res;
+	if(achievedHz)
+		*achievedHz = plan.achievedHz;
+	return MCP2221_SUCCESS;
+}
+
 mcp2221_error LIB_EXPORT mcp2221_getClockOut(mcp2221_t* device, mcp2221_clkdiv_t* div, mcp2221_clkduty_t* duty)
 {
 	NEW_REPORT(report);
@@ -742,6 +1101,50 @@ mcp2221_error LIB_EXPORT mcp2221_clearInterrupt(mcp2221_t* device)
 	return res;
 }
 
+mcp2221_error LIB_EXPORT mcp2221_readClearInterrupt(mcp2221_t* device, int* state)
+{
+	if(!state)
+		return MCP2221_INVALID_ARG;
+	*state = 0;
+
+	NEW_REPORT(report);
+	mcp2221_error res;
+	if((res = setReport(device, report, USB_CMD_STATUSSET)) != MCP2221_SUCCESS)
+		return res;
+
+	// The chip has no combined read-and-clear and the SET SRAM response does not carry the flag,
+	// so the clear is sent straight after the status response, without giving other threads a chance
+	// to get in between. Edges landing in that gap are merged into the one being cleared.
+	mcp2221_lock(device);
+	res = doTransaction(device, report);
+	if(res == MCP2221_SUCCESS && report[24])
+	{
+		*state = 1;
+		device->priv->intCount++;
+
+		setReport(device, report, USB_CMD_SETSRAM);
+		report[6] = 0x81;
+		res = doTransaction(device, report);
+	}
+	mcp2221_unlock(device);
+
+	return res;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_getInterruptCount(mcp2221_t* device, unsigned long* count, int reset)
+{
+	if(!device || !device->priv || !count)
+		return MCP2221_INVALID_ARG;
+
+	mcp2221_lock(device);
+	*count = device->priv->intCount;
+	if(reset)
+		device->priv->intCount = 0;
+	mcp2221_unlock(device);
+
+	return MCP2221_SUCCESS;
+}
+
 mcp2221_gpioconfset_t LIB_EXPORT mcp2221_GPIOConfInit()
 {
 	mcp2221_gpioconfset_t confSet;
@@ -830,6 +1233,53 @@ mcp2221_error LIB_EXPORT mcp2221_setGPIO(mcp2221_t* device, mcp2221_gpio_t pins,
 	return res;
 }
 
+void LIB_INTERNAL mcp2221_encodeGPIOMask(uint8_t* report, int mask, int values)
+{
+	clearReport(report);
+	report[0] = USB_CMD_SETGPIO;
+
+	for(int i=0;i<MCP2221_GPIO_COUNT;i++)
+	{
+		if(mask & (1 << i))
+		{
+			int idx = (i * 4) + 2;
+			report[idx] = 1;
+			report[idx + 1] = (values & (1 << i)) ? MCP2221_GPIO_VALUE_HIGH : MCP2221_GPIO_VALUE_LOW;
+		}
+	}
+}
+
+void LIB_INTERNAL mcp2221_cacheGPIOMask(mcp2221_t* device, int mask, int values)
+{
+	// Save to cache for use in mcp2221_setGPIOConf()
+	for(int i=0;i<MCP2221_GPIO_COUNT;i++)
+	{
+		if(mask & (1 << i))
+		{
+			if(values & (1 << i))
+				device->gpioCache[i] |= 16;
+			else
+				device->gpioCache[i] &= ~16;
+		}
+	}
+}
+
+mcp2221_error LIB_EXPORT mcp2221_setGPIOMask(mcp2221_t* device, int mask, int values)
+{
+	if(!device)
+		return MCP2221_INVALID_ARG;
+
+	NEW_REPORT(report);
+	mcp2221_encodeGPIOMask(report, mask, values);
+
+	// Cache and device must not get out of step if another thread changes pins at the same time
+	mcp2221_lock(device);
+	mcp2221_cacheGPIOMask(device, mask, values);
+	mcp2221_error res = doTransaction(device, report);
+	mcp2221_unlock(device);
+	return res;
+}
+
 mcp2221_error LIB_EXPORT mcp2221_getGPIO(mcp2221_t* device, mcp2221_gpioconfset_t* confGet)
 {
 	NEW_REPORT(report);
@@ -1419,7 +1869,11 @@ mcp2221_error LIB_EXPORT mcp2221_i2cCancel(mcp2221_t* device)
 	res = doTransaction(device, report);
 	// TODO check response
 
-    usleep(1*1000); // wait 1ms for cancellation
+	// wait 1ms for cancellation, the real-time I/O thread skips delayUs() but still has to give it the time
+	if(device->priv && mcp2221_rtIsIoThread(device))
+		mcp2221_sleepUntilNs(mcp2221_nowNs() + 1000*1000);
+	else
+		delayUs(device, 1*1000);
 
 	return res;
 }
@@ -1467,22 +1921,34 @@ mcp2221_error LIB_EXPORT mcp2221_i2cReadPins(mcp2221_t* device, mcp2221_i2cpins_
 	return res;
 }
 
-static mcp2221_error mcp2221_wait_state(mcp2221_t *device,
-                                        const mcp2221_i2c_state_t w_state)
+mcp2221_error LIB_INTERNAL mcp2221_wait_state(mcp2221_t *device,
+                                              const mcp2221_i2c_state_t w_state)
 {
     mcp2221_error res = MCP2221_SUCCESS;
     mcp2221_i2c_state_t state = MCP2221_I2C_IDLE;
     unsigned int count = 100;
+    int nacked = 0;
+    // The real-time I/O thread doesn't sleep between polls, so only the clock bounds its wait.
+    // Elsewhere the 10ms delays add up to the same second, also on the simulator's virtual clock.
+    int ioThread = mcp2221_rtIsIoThread(device);
+    int64_t deadline = mcp2221_nowNs() + NS_PER_SEC;
 
     do {
         res = mcp2221_i2cState(device, &state);
+        MCP2221_PROBE4(i2c_poll, device, state, w_state, res);
         if (res != MCP2221_SUCCESS) return res;
+        if (state == MCP2221_ADDR_NACK)
+            nacked = 1;
         if (state == w_state)
-            return res;
-        usleep(10*1000);
-    } while (count--);
-
-    return MCP2221_TIMEOUT;
+            break;
+        delayUs(device, 10*1000);
+    } while ((ioThread || count--) && mcp2221_nowNs() < deadline);
+
+    if (state != w_state)
+        res = MCP2221_TIMEOUT;
+    if (device->priv->metrics)
+        mcp2221_metricsI2cWait(device->priv->metrics, res, nacked);
+    return res;
 }
 
 static inline mcp2221_error mcp2221_wait_data_ready(mcp2221_t *device)
@@ -1519,6 +1985,9 @@ mcp2221_i2cWriteRead(mcp2221_t* device,
         res = mcp2221_i2cRead(device, address, r_len, MCP2221_I2CRW_NORMAL);
         if (res != MCP2221_SUCCESS) return res;
 
+        res = mcp2221_wait_data_ready(device);
+        if (res != MCP2221_SUCCESS) return res;
+
         res = mcp2221_i2cGet(device, r_buf, r_len);
     }
     else if (!r_buf || r_len == 0) { /* only write data */
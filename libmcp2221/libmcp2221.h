@@ -10,6 +10,7 @@
 #define LIBMCP2221_H_
 
 #include <stdint.h>
+#include <stddef.h>
 #include <wchar.h>
 
 #define MCP2221_STR_LEN		31	/**< Maximum length of wchar_t USB descriptor strings + 1 for null term */
@@ -24,6 +25,33 @@
 
 #define MCP2221_REPORT_SIZE	64	/**< HID Report size */
 
+#define MCP2221_GPIOMON_MAX_SUBS	16	/**< Maximum number of GPIO monitor subscribers per device */
+#define MCP2221_INTMON_MAX_SUBS		16	/**< Maximum number of interrupt monitor subscribers per device */
+
+#define MCP2221_CAP_MAGIC			"MCP2221C"	/**< Capture file magic (8 bytes, not null terminated) */
+#define MCP2221_CAP_VERSION			1			/**< Capture file format version */
+#define MCP2221_CAPFLAG_COMPLETE	0x01		/**< Capture file header flag: capture has ended */
+#define MCP2221_CAPFLAG_TRUNCATED	0x02		/**< Capture file header flag: capture ended because the file was full */
+#define MCP2221_CAPREC_KEEPALIVE	0x01		/**< Capture record flag: no transition, only inserted to keep deltaUs and run from overflowing */
+
+#define MCP2221_REC_MAGIC			"MCP2221R"	/**< Report recording file magic (8 bytes, not null terminated) */
+#define MCP2221_REC_VERSION			1			/**< Report recording file format version */
+
+#define MCP2221_SERVER_ENV			"MCP2221_SERVER"	/**< Environment variable with the socket path of the local server, see mcp2221_find() */
+#define MCP2221_SIM_ENV				"MCP2221_SIM"		/**< Environment variable with the number of simulated devices to use instead of real ones, see mcp2221_find() */
+#define MCP2221_SIM_PREFIX			"sim:"				/**< Path prefix of simulated devices */
+#define MCP2221_SIM_TIMING_ENV		"MCP2221_SIM_TIMING"	/**< Environment variable with the timing model of simulated devices, see mcp2221_simClock() */
+#define MCP2221_RECORD_ENV			"MCP2221_RECORD"	/**< Environment variable with a file to record all reports of opened devices into, see mcp2221_find() */
+#define MCP2221_REPLAY_ENV			"MCP2221_REPLAY"	/**< Environment variable with a recording to replay instead of using real devices, see mcp2221_find() */
+#define MCP2221_METRICS_ENV			"MCP2221_METRICS"	/**< Environment variable with where to export metrics from mcp2221_init(), see mcp2221_metricsStart() */
+#define MCP2221_METRICS_INTERVAL_ENV	"MCP2221_METRICS_INTERVAL"	/**< Environment variable with the file rewrite interval of metrics in milliseconds */
+#define MCP2221_METRICS_INTERVAL	10000				/**< Default file rewrite interval of metrics in milliseconds */
+#define MCP2221_ALIVE_IDLE			1000				/**< Default idle time in milliseconds before mcp2221_isAlive() sends a report */
+
+#define MCP2221_PWM_MAX_FREQ		100			/**< Highest software PWM frequency in Hz, each edge costs one USB transaction */
+#define MCP2221_PWM_MERGE_US		500			/**< Software PWM edges of different pins due within this many microseconds share one SET GPIO report */
+#define MCP2221_RT_HIST_BUCKETS		16			/**< Buckets of the real-time loop wake up latency histogram (see ::mcp2221_rt_stats_t) */
+
 /**
  * \enum mcp2221_error 
  * \brief Error codes
@@ -34,7 +62,8 @@ typedef enum
 	MCP2221_ERROR = -1,			/**< General error */
 	MCP2221_INVALID_ARG = -2,	/**< Invalid argument supplied, probably a null pointer */
 	MCP2221_ERROR_HID = -3,		/**< HIDAPI returned an error */
-    MCP2221_TIMEOUT = -4        /**< Some action/access timed out without success */
+    MCP2221_TIMEOUT = -4,       /**< Some action/access timed out without success */
+	MCP2221_PENDING = -5		/**< An asynchronous transaction has not completed yet (see mcp2221_submit()) */
 }mcp2221_error;
 
 /**
@@ -261,6 +290,7 @@ typedef struct{
 	char* path;		/**< Device path, used to identify the physical device */
 	uint8_t gpioCache[MCP2221_GPIO_COUNT];	/**< GPIO config cache */
 	mcp2221_usbinfo_t usbInfo;
+	struct mcp2221_priv_t* priv;	/**< Library internal state (transaction lock etc.), do not touch */
 }mcp2221_t;
 
 /**
@@ -292,6 +322,389 @@ typedef struct{
 	mcp2221_gpioconf_t conf[MCP2221_GPIO_COUNT];
 }mcp2221_gpioconfset_t;
 
+/**
+* \struct mcp2221_dacplayer_t
+* \brief Opaque handle of a running DAC waveform player (see mcp2221_dacPlay())
+*/
+typedef struct mcp2221_dacplayer_t mcp2221_dacplayer_t;
+
+/**
+* \struct mcp2221_dacplayer_stats_t
+* \brief Achieved timing of a DAC waveform player
+*/
+typedef struct{
+	unsigned long samples;		/**< Number of waveform samples played so far */
+	unsigned long updates;		/**< Number of SET SRAM transactions sent */
+	unsigned long skipped;		/**< Samples where the code was unchanged and no transaction was sent */
+	unsigned long late;			/**< Samples whose update finished after the next sample was due */
+	unsigned long loops;		/**< Number of completed passes through the waveform */
+	double rate;				/**< Achieved sample rate in Hz */
+	int64_t latencyAvgNs;		/**< Average transaction round trip */
+	int64_t latencyMaxNs;		/**< Longest transaction round trip */
+	int64_t errorAvgNs;			/**< Average absolute deviation of the update time from its deadline */
+	int64_t errorMaxNs;			/**< Largest absolute deviation of the update time from its deadline */
+	int running;				/**< 1 while the player thread is active, 0 once a non-looping waveform has finished or an error occurred */
+	mcp2221_error lastError;	/**< Error that stopped the player, ::MCP2221_SUCCESS otherwise */
+}mcp2221_dacplayer_stats_t;
+
+/**
+* \struct mcp2221_gpiostep_t
+* \brief One step of a timed GPIO pattern
+*/
+typedef struct{
+	int pins;				/**< Which pins to change (see ::mcp2221_gpio_t), 0 for a pure delay */
+	int values;				/**< New value of each selected pin, bit set = HIGH (same bit layout as ::mcp2221_gpio_t) */
+	unsigned int delayUs;	/**< Time in microseconds until the next step is due */
+}mcp2221_gpiostep_t;
+
+/**
+* \struct mcp2221_gpiopattern_t
+* \brief Opaque pre-encoded GPIO pattern (see mcp2221_gpioPatternCompile())
+*/
+typedef struct mcp2221_gpiopattern_t mcp2221_gpiopattern_t;
+
+/**
+* \struct mcp2221_gpiopattern_stats_t
+* \brief Achieved edge timing of a GPIO pattern run
+*/
+typedef struct{
+	unsigned long steps;	/**< Number of steps executed */
+	unsigned long edges;	/**< Number of SET GPIO transactions sent */
+	int64_t durationNs;		/**< Total run time */
+	int64_t latencyAvgNs;	/**< Average transaction round trip */
+	int64_t latencyMaxNs;	/**< Longest transaction round trip */
+	int64_t errorAvgNs;		/**< Average absolute deviation of an edge from its scheduled time */
+	int64_t errorMaxNs;		/**< Largest absolute deviation of an edge from its scheduled time */
+	int64_t gapMinNs;		/**< Shortest measured time between two consecutive edges */
+	int64_t gapMaxNs;		/**< Longest measured time between two consecutive edges */
+}mcp2221_gpiopattern_stats_t;
+
+/**
+* \struct mcp2221_gpiomon_conf_t
+* \brief GPIO monitor configuration (see mcp2221_gpioMonitorConfInit() for defaults)
+*/
+typedef struct{
+	int pins;			/**< Which pins to watch (see ::mcp2221_gpio_t) */
+	int pollUs;			/**< Poll interval while pins are changing, in microseconds */
+	int idlePollUs;		/**< Longest poll interval once pins are idle, in microseconds */
+	int idleAfterUs;	/**< Time without changes after which polling slows down, in microseconds */
+	int debounceUs;		/**< Time a new value must be stable before it is reported, in microseconds (0 = no debouncing) */
+}mcp2221_gpiomon_conf_t;
+
+/**
+* \struct mcp2221_gpioevent_t
+* \brief GPIO change event
+*/
+typedef struct{
+	int64_t timestampNs;			/**< CLOCK_MONOTONIC time at which the new value was first seen */
+	int pin;						/**< Pin that changed (0 - 3) */
+	mcp2221_gpio_value_t value;		/**< New value of the pin */
+	int states;						/**< Debounced values of all watched pins after the change, bit set = HIGH */
+}mcp2221_gpioevent_t;
+
+/**
+* \struct mcp2221_gpiomon_stats_t
+* \brief GPIO monitor statistics
+*/
+typedef struct{
+	unsigned long polls;		/**< Number of GET GPIO transactions */
+	unsigned long events;		/**< Number of change events delivered */
+	unsigned long errors;		/**< Number of failed polls */
+	int intervalUs;				/**< Current poll interval, in microseconds */
+	mcp2221_error lastError;	/**< Error of the last failed poll */
+}mcp2221_gpiomon_stats_t;
+
+/**
+* \struct mcp2221_gpioqueue_t
+* \brief Opaque lock-free single consumer event queue (see mcp2221_gpioSubscribeQueue())
+*/
+typedef struct mcp2221_gpioqueue_t mcp2221_gpioqueue_t;
+
+/**
+* \brief GPIO change callback, called from the monitor thread
+*/
+typedef void (*mcp2221_gpio_callback_t)(mcp2221_t* device, const mcp2221_gpioevent_t* event, void* userData);
+
+/**
+* \struct mcp2221_intevent_t
+* \brief Interrupt input event, the edge happened between earliestNs and timestampNs
+*/
+typedef struct{
+	int64_t timestampNs;		/**< CLOCK_MONOTONIC time of the poll that found the interrupt flag set */
+	int64_t earliestNs;			/**< CLOCK_MONOTONIC time of the previous poll */
+	unsigned long sequence;		/**< Running event number, starting at 1 */
+}mcp2221_intevent_t;
+
+/**
+* \struct mcp2221_intmon_stats_t
+* \brief Interrupt monitor statistics
+*/
+typedef struct{
+	unsigned long polls;		/**< Number of polls */
+	unsigned long edges;		/**< Number of polls that found the interrupt flag set (events delivered) */
+	unsigned long coalesced;	/**< Events where the flag was set again on the next full-speed poll, edges were probably merged */
+	unsigned long errors;		/**< Number of failed polls */
+	int intervalUs;				/**< Current poll interval, in microseconds */
+	mcp2221_error lastError;	/**< Error of the last failed poll */
+}mcp2221_intmon_stats_t;
+
+/**
+* \brief Interrupt event callback, called from the monitor thread
+*/
+typedef void (*mcp2221_int_callback_t)(mcp2221_t* device, const mcp2221_intevent_t* event, void* userData);
+
+/**
+* \struct mcp2221_capheader_t
+* \brief GPIO capture file header (72 bytes, host byte order)
+*
+* A capture file is this header followed by ::mcp2221_caprecord_t records. The first record holds the initial
+* pin states, every further record is a change of at least one pin. The time of a record is the sum of deltaUs
+* of it and all records before it, relative to monotonicStartNs. To convert to VCD, emit each pin as a 1-bit
+* wire, dump the states of the first record at time 0 and a value change for every pin that differs from the
+* previous record (records with ::MCP2221_CAPREC_KEEPALIVE never differ), see utils/cap2vcd.c.
+* While the capture is running the file is larger than needed, only the first "records" records are valid.
+*/
+typedef struct{
+	char magic[8];				/**< ::MCP2221_CAP_MAGIC */
+	uint32_t version;			/**< ::MCP2221_CAP_VERSION */
+	uint32_t headerSize;		/**< sizeof(mcp2221_capheader_t), offset of the first record */
+	uint32_t recordSize;		/**< sizeof(mcp2221_caprecord_t) */
+	uint32_t pins;				/**< Captured pins (see ::mcp2221_gpio_t), other pins always read LOW */
+	int64_t realtimeStartNs;	/**< CLOCK_REALTIME at start of capture */
+	int64_t monotonicStartNs;	/**< CLOCK_MONOTONIC at start of capture, record times are relative to this */
+	int64_t durationNs;			/**< Length of the capture, valid once ::MCP2221_CAPFLAG_COMPLETE is set */
+	uint64_t records;			/**< Number of valid records */
+	uint64_t samples;			/**< Number of GET GPIO samples taken */
+	uint32_t flags;				/**< ::MCP2221_CAPFLAG_COMPLETE, ::MCP2221_CAPFLAG_TRUNCATED */
+	uint32_t reserved;
+}mcp2221_capheader_t;
+
+/**
+* \struct mcp2221_caprecord_t
+* \brief GPIO capture file record (8 bytes, host byte order)
+*/
+typedef struct{
+	uint32_t deltaUs;	/**< Time since the previous record (or since start of capture for the first record), in microseconds */
+	uint16_t run;		/**< Number of samples since the previous record, including this one */
+	uint8_t states;		/**< Pin states from this record on, bit set = HIGH (same bit layout as ::mcp2221_gpio_t) */
+	uint8_t flags;		/**< ::MCP2221_CAPREC_KEEPALIVE */
+}mcp2221_caprecord_t;
+
+/**
+* \enum mcp2221_rectype_t
+* \brief Report recording record types
+*/
+typedef enum
+{
+	MCP2221_REC_OPEN	= 1,	/**< A device was opened, payload: path and serial number (ASCII), each null terminated */
+	MCP2221_REC_SEND	= 2,	/**< Report sent, timed before sending */
+	MCP2221_REC_GET		= 3,	/**< Response read, timed when it arrived */
+	MCP2221_REC_CLOSE	= 4		/**< The device was closed, no payload */
+}mcp2221_rectype_t;
+
+/**
+* \struct mcp2221_recheader_t
+* \brief Report recording file header (32 bytes, host byte order)
+*
+* A recording is this header followed by ::mcp2221_recrecord_t records, each followed by len bytes of payload.
+* Reports are stored up to their last non-zero byte, the rest of the 64 bytes are zero.
+* The time of a record is the sum of deltaUs of it and all records before it, relative to monotonicStartNs.
+* Records of all devices opened by the process are interleaved, device tells them apart.
+*/
+typedef struct{
+	char magic[8];				/**< ::MCP2221_REC_MAGIC */
+	uint32_t version;			/**< ::MCP2221_REC_VERSION */
+	uint32_t headerSize;		/**< sizeof(mcp2221_recheader_t), offset of the first record */
+	int64_t realtimeStartNs;	/**< CLOCK_REALTIME at start of recording */
+	int64_t monotonicStartNs;	/**< CLOCK_MONOTONIC at start of recording */
+}mcp2221_recheader_t;
+
+/**
+* \struct mcp2221_recrecord_t
+* \brief Report recording record (8 bytes, host byte order)
+*/
+typedef struct{
+	uint32_t deltaUs;			/**< Time since the previous record (or since start of recording for the first record), in microseconds */
+	uint8_t type;				/**< ::mcp2221_rectype_t */
+	uint8_t device;				/**< Number of the device, in the order they were opened */
+	uint8_t len;				/**< Payload bytes following the record */
+	int8_t status;				/**< ::mcp2221_error of the send or read */
+}mcp2221_recrecord_t;
+
+/**
+* \struct mcp2221_capture_t
+* \brief Opaque handle of a running GPIO capture (see mcp2221_captureStart())
+*/
+typedef struct mcp2221_capture_t mcp2221_capture_t;
+
+/**
+* \struct mcp2221_capture_stats_t
+* \brief GPIO capture progress
+*/
+typedef struct{
+	unsigned long long samples;		/**< Number of samples taken */
+	unsigned long transitions;		/**< Number of records written */
+	unsigned long long bytes;		/**< Size of the valid part of the file */
+	double sampleRate;				/**< Achieved sample rate in Hz */
+	int truncated;					/**< 1 if the capture stopped because the file was full */
+	int running;					/**< 1 while the capture thread is active */
+	mcp2221_error lastError;		/**< Error that stopped the capture, ::MCP2221_SUCCESS otherwise */
+}mcp2221_capture_stats_t;
+
+/**
+* \struct mcp2221_pwm_stats_t
+* \brief Achieved timing of a software PWM pin
+*
+* Edge times are taken as the midpoint of the SET GPIO transaction that made them.
+*/
+typedef struct{
+	int enabled;					/**< 1 if the pin is toggling */
+	unsigned long cycles;			/**< Number of complete cycles measured */
+	unsigned long skipped;			/**< Number of cycles dropped because the scheduler fell behind */
+	double frequency;				/**< Average achieved frequency in Hz */
+	double duty;					/**< Average achieved duty cycle (0.0 - 1.0) */
+	int64_t periodErrAvgNs;			/**< Average difference between the achieved and requested period */
+	int64_t periodErrMaxNs;			/**< Largest difference between the achieved and requested period */
+	int64_t highErrAvgNs;			/**< Average difference between the achieved and requested HIGH time */
+	int64_t highErrMaxNs;			/**< Largest difference between the achieved and requested HIGH time */
+	unsigned long reports;			/**< SET GPIO reports sent by the PWM scheduler, for all pins */
+	unsigned long edges;			/**< Edges made by the PWM scheduler, for all pins. edges / reports shows how well edges are merged */
+}mcp2221_pwm_stats_t;
+
+/**
+* \struct mcp2221_rt_conf_t
+* \brief Real-time loop configuration (see mcp2221_rtConfInit() for defaults)
+*/
+typedef struct{
+	int periodUs;		/**< Period of the loop, in microseconds */
+	int priority;		/**< SCHED_FIFO priority of the I/O thread (1 - 99), 0 to leave it on the normal scheduler */
+	int cpu;			/**< CPU to pin the I/O thread to, -1 for any */
+	int lockMemory;		/**< 1 to lock all current and future memory of the process into RAM (mlockall()), it stays locked after mcp2221_rtStop() */
+}mcp2221_rt_conf_t;
+
+/**
+* \struct mcp2221_rt_stats_t
+* \brief Achieved timing of the real-time loop
+*/
+typedef struct{
+	int running;					/**< 1 while the loop is running */
+	int result;						/**< Non-zero value returned by the callback that stopped the loop */
+	unsigned long cycles;			/**< Number of times the callback has run */
+	unsigned long overruns;			/**< Number of times the callback ran past the next deadline */
+	unsigned long skipped;			/**< Number of deadlines dropped because of overruns */
+	int64_t wakeAvgNs;				/**< Average time between a deadline and the thread waking up for it */
+	int64_t wakeMaxNs;				/**< Longest time between a deadline and the thread waking up for it */
+	int64_t jitterAvgNs;			/**< Average difference between the time from one wake up to the next and the period */
+	int64_t jitterMaxNs;			/**< Largest difference between the time from one wake up to the next and the period */
+	int64_t runAvgNs;				/**< Average run time of the callback */
+	int64_t runMaxNs;				/**< Longest run time of the callback */
+	unsigned long wakeHist[MCP2221_RT_HIST_BUCKETS];	/**< Wake up latency histogram, bucket 0 counts latencies under 1us and bucket n those under 2^n us. The last bucket counts everything above */
+}mcp2221_rt_stats_t;
+
+/**
+* \brief Real-time loop callback, called once per period on the I/O thread
+*
+* @param [device] Device the loop runs on
+* @param [userData] Pointer given to mcp2221_rtStart()
+* @return 0 to carry on, anything else to stop the loop (see ::mcp2221_rt_stats_t.result)
+*/
+typedef int (*mcp2221_rt_callback_t)(mcp2221_t* device, void* userData);
+
+/**
+* \struct mcp2221_clkplan_t
+* \brief Precomputed clock reference output setting (see mcp2221_planClockFrequency())
+*/
+typedef struct{
+	uint32_t hz;				/**< Requested frequency */
+	uint32_t achievedHz;		/**< Frequency the divider gives, 0 if the output is disabled */
+	mcp2221_clkdiv_t div;		/**< Divider */
+	mcp2221_clkduty_t duty;		/**< Duty cycle */
+}mcp2221_clkplan_t;
+
+/**
+* \struct mcp2221_group_t
+* \brief Opaque handle of a device group (see mcp2221_groupCreate())
+*/
+typedef struct mcp2221_group_t mcp2221_group_t;
+
+/**
+ * \enum mcp2221_sample_src_t
+ * \brief What to read in a group sample
+ */
+typedef enum
+{
+	MCP2221_SAMPLE_ADC = 0,		/**< ADC values (STATUS/SET PARAMETERS) */
+	MCP2221_SAMPLE_GPIO = 1		/**< GPIO values (GET GPIO) */
+}mcp2221_sample_src_t;
+
+/**
+* \struct mcp2221_groupsample_t
+* \brief Sample of one device in a group
+*/
+typedef struct{
+	mcp2221_error res;						/**< Result of the transaction, the other fields are only valid if ::MCP2221_SUCCESS */
+	int64_t sentNs;							/**< CLOCK_MONOTONIC just before the request was sent */
+	int64_t receivedNs;						/**< CLOCK_MONOTONIC just after the response arrived */
+	int64_t timestampNs;					/**< Estimated time of the sample, midpoint of sentNs and receivedNs */
+	int adc[MCP2221_ADC_COUNT];				/**< ADC values if ::MCP2221_SAMPLE_ADC */
+	mcp2221_gpio_value_t gpio[MCP2221_GPIO_COUNT];	/**< GPIO values if ::MCP2221_SAMPLE_GPIO */
+}mcp2221_groupsample_t;
+
+/**
+* \struct mcp2221_groupresult_t
+* \brief Result of a group operation on one device
+*/
+typedef struct{
+	mcp2221_error res;		/**< What the operation returned for this device */
+	int64_t startNs;		/**< CLOCK_MONOTONIC when the operation started on this device */
+	int64_t endNs;			/**< CLOCK_MONOTONIC when the operation finished on this device */
+}mcp2221_groupresult_t;
+
+/**
+* @brief Group operation, called on the worker thread of each device
+*
+* @param [device] Device to operate on
+* @param [index] Index of the device in the group
+* @param [userData] Pointer given to mcp2221_groupRun()
+* @return ::mcp2221_error error code
+*/
+typedef mcp2221_error (*mcp2221_group_func_t)(mcp2221_t* device, int index, void* userData);
+
+/**
+* \struct mcp2221_pool_t
+* \brief Opaque handle of a device job pool (see mcp2221_poolCreate())
+*/
+typedef struct mcp2221_pool_t mcp2221_pool_t;
+
+/**
+* \struct mcp2221_job_t
+* \brief Job for a device pool, owned by the caller and must stay valid until it has finished
+*/
+typedef struct{
+	mcp2221_group_func_t func;	/**< Set by caller: what to run, index is the index of the device in the pool */
+	void* userData;				/**< Set by caller: passed to func */
+	int affinity;				/**< Set by caller: preferred device index, -1 for any */
+	int pinned;					/**< Set by caller: 1 if the job must run on the affinity device (e.g. only that adapter can reach the part) */
+	mcp2221_error res;			/**< What func returned */
+	int device;					/**< Index of the device the job ran on */
+	int64_t queuedNs;			/**< CLOCK_MONOTONIC when the job was submitted */
+	int64_t startNs;			/**< CLOCK_MONOTONIC when the job started */
+	int64_t endNs;				/**< CLOCK_MONOTONIC when the job finished */
+}mcp2221_job_t;
+
+/**
+* \struct mcp2221_pool_stats_t
+* \brief Per-device statistics of a job pool
+*/
+typedef struct{
+	unsigned long jobs;		/**< Jobs run on this device */
+	unsigned long stolen;	/**< Jobs run on this device that were queued for another one */
+	unsigned long failed;	/**< Jobs that returned an error */
+	int queued;				/**< Jobs currently waiting in this device's queue */
+	int64_t busyNs;			/**< Total time spent running jobs */
+	double utilisation;		/**< busyNs as a fraction of the pool's lifetime (0.0 - 1.0) */
+}mcp2221_pool_stats_t;
+
 
 
 
@@ -316,6 +729,15 @@ void mcp2221_exit(void);
 /**
 * @brief Find all HIDs matching the supplied parameters, must be called before attempting to open a device
 *
+* If the MCP2221_SERVER environment variable is set to the socket of a running mcp2221d, the devices are found
+* and later opened through that server instead, so several processes can share them without any code changes.
+* If MCP2221_SIM is set to a number, that many simulated devices are found instead of real ones (paths "sim:0", "sim:1"...).
+* They answer every command in the same process without any I/O, for benchmarks and tests without hardware.
+* If MCP2221_REPLAY is set to a recording (see ::mcp2221_recheader_t), the devices in the recording are found instead
+* and opening them replays their responses with the original latency. A request that does not match the recording skips
+* ahead to the next recorded request with the same command, MCP2221_ERROR_HID is returned when there is none.
+* If MCP2221_RECORD is set to a file, every report sent to and read from devices opened afterwards is recorded there.
+*
 * @param [vid] VID to match, 0 will match all VIDs
 * @param [pid] PID to match, 0 will match all PIDs
 * @param [manufacturer] Manufacturer to match, NULL will match all manufacturers
@@ -355,6 +777,14 @@ mcp2221_t* mcp2221_open_byIndex(int idx);
 */
 mcp2221_t* mcp2221_open_bySerial(wchar_t* serial);
 
+/**
+* @brief Open device with specified path (see mcp2221_t.path)
+*
+* @param [path] Device path
+* @return Device handle, NULL on error
+*/
+mcp2221_t* mcp2221_open_byPath(char* path);
+
 /**
 * @brief Close device
 *
@@ -378,6 +808,55 @@ mcp2221_error mcp2221_reset(mcp2221_t* device);
 */
 mcp2221_error mcp2221_isConnected(mcp2221_t* device);
 
+/**
+* @brief Check to see if the device is still connected, without any USB traffic most of the time
+*
+* Asks the transport first: a hidraw device hangs up as soon as it is removed and a connection to mcp2221d
+* hangs up when the server goes away, which costs a poll() and no USB traffic. Only if no transaction has
+* succeeded for idleMs does this fall back to mcp2221_isConnected(), so a watchdog calling it often on busy
+* devices adds nothing to the bus. On Windows there is no hang up to check, only the idle time.
+*
+* @param [device] Device to operate on
+* @param [idleMs] Milliseconds without a successful transaction before sending one, 0 for ::MCP2221_ALIVE_IDLE, -1 to never send one
+* @return ::mcp2221_error error code, ::MCP2221_ERROR_HID if the device has gone
+*/
+mcp2221_error mcp2221_isAlive(mcp2221_t* device, int idleMs);
+
+/**
+* @brief Send a report without waiting for its response
+*
+* For event loops that drive many devices from one thread: wait for mcp2221_pollFd() to become readable, then
+* collect the response with mcp2221_complete(). Only one transaction can be outstanding per device, and until it
+* has completed every other call on the device returns ::MCP2221_PENDING. Not all transports support this; it
+* needs a hidraw device, a connection to mcp2221d or a simulated device (whose responses are ready at once).
+*
+* @param [device] Device to operate on
+* @param [report] Report to send (::MCP2221_REPORT_SIZE bytes), not the reset command as it has no response
+* @return ::mcp2221_error error code, ::MCP2221_PENDING if a transaction is already outstanding, ::MCP2221_ERROR if the transport can't do this
+*/
+mcp2221_error mcp2221_submit(mcp2221_t* device, const uint8_t* report);
+
+/**
+* @brief Collect the response of a transaction started by mcp2221_submit(), without blocking
+*
+* @param [device] Device to operate on
+* @param [report] Buffer where the response will be placed (::MCP2221_REPORT_SIZE bytes)
+* @return ::mcp2221_error error code of the transaction, ::MCP2221_PENDING if the response hasn't arrived yet (or the poll was interrupted), ::MCP2221_ERROR if nothing was submitted
+* or the response can't be waited for, the transaction is then dropped
+*/
+mcp2221_error mcp2221_complete(mcp2221_t* device, uint8_t* report);
+
+/**
+* @brief Get a descriptor that polls readable (POLLIN) once mcp2221_complete() has a response
+*
+* Stays the same while the device is open, so it can be registered with epoll or an event loop once.
+* It may also be readable without a response waiting; mcp2221_complete() then returns ::MCP2221_PENDING.
+*
+* @param [device] Device to operate on
+* @return Descriptor, -1 if the transport doesn't support mcp2221_submit()
+*/
+int mcp2221_pollFd(mcp2221_t* device);
+
 /**
 * @brief Send a custom report, the response is placed in the same buffer
 *
@@ -404,6 +883,44 @@ mcp2221_gpioconfset_t mcp2221_GPIOConfInit(void);
 */
 mcp2221_error mcp2221_setClockOut(mcp2221_t* device, mcp2221_clkdiv_t div, mcp2221_clkduty_t duty);
 
+/**
+* @brief Work out the divider that gets closest to a clock reference output frequency
+*
+* Does not talk to the device. Build a table of plans up front and apply them with mcp2221_setClockPlan() to
+* switch frequencies without any calculation in the test sequence.
+* Frequencies outside of 375KHz - 24MHz are clamped.
+*
+* @param [hz] Wanted frequency
+* @param [duty] Duty cycle, ::MCP2221_CLKDUTY_0 disables the output
+* @param [plan] Pointer to ::mcp2221_clkplan_t struct where the plan will be placed
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_planClockFrequency(uint32_t hz, mcp2221_clkduty_t duty, mcp2221_clkplan_t* plan);
+
+/**
+* @brief Apply a clock reference output plan (SRAM)
+*
+* A single SET SRAM transaction, nothing is read back.
+*
+* @param [device] Device to operate on
+* @param [plan] Plan from mcp2221_planClockFrequency()
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_setClockPlan(mcp2221_t* device, const mcp2221_clkplan_t* plan);
+
+/**
+* @brief Set the clock reference output to the nearest possible frequency (SRAM)
+*
+* Same as mcp2221_planClockFrequency() followed by mcp2221_setClockPlan().
+*
+* @param [device] Device to operate on
+* @param [hz] Wanted frequency
+* @param [duty] Duty cycle, ::MCP2221_CLKDUTY_0 disables the output
+* @param [achievedHz] Pointer to variable where the frequency actually set will be placed, can be NULL
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_setClockFrequency(mcp2221_t* device, uint32_t hz, mcp2221_clkduty_t duty, uint32_t* achievedHz);
+
 /**
 * @brief Set the DAC voltage reference and output value (SRAM)
 *
@@ -452,6 +969,19 @@ mcp2221_error mcp2221_setGPIOConf(mcp2221_t* device, mcp2221_gpioconfset_t* conf
 */
 mcp2221_error mcp2221_setGPIO(mcp2221_t* device, mcp2221_gpio_t pins, mcp2221_gpio_value_t value);
 
+/**
+* @brief Set GPIO pin output values, each pin with its own value, in a single transaction
+*
+* Unlike mcp2221_setGPIO() the selected pins can be set to different values, so a multi-pin update needs
+* only one report and all pins change at the same time.
+*
+* @param [device] Device to operate on
+* @param [mask] Which GPIO pins should be changed (see ::mcp2221_gpio_t)
+* @param [values] New value of each pin in mask, bit set = HIGH (same bit layout as ::mcp2221_gpio_t)
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_setGPIOMask(mcp2221_t* device, int mask, int values);
+
 /**
 * @brief Get the current clock output divider (SRAM)
 *
@@ -525,6 +1055,31 @@ mcp2221_error mcp2221_readInterrupt(mcp2221_t* device, int* state);
 */
 mcp2221_error mcp2221_clearInterrupt(mcp2221_t* device);
 
+/**
+* @brief Read the interrupt state and clear it if it was set, in a single call
+*
+* Replaces mcp2221_readInterrupt() followed by mcp2221_clearInterrupt() when the flag is set. The USB traffic is
+* the same (one transaction, two when the flag is set), but the clear is sent immediately after the status without
+* letting other threads in between, and every cleared interrupt is counted (see mcp2221_getInterruptCount()).
+* The chip has no atomic read-and-clear, edges that arrive during the round trip between reading and clearing
+* are counted as one.
+*
+* @param [device] Device to operate on
+* @param [state] Pointer to variable where state will be placed (0 = not triggered, 1 = triggered and cleared)
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_readClearInterrupt(mcp2221_t* device, int* state);
+
+/**
+* @brief Get the number of interrupts seen by mcp2221_readClearInterrupt()
+*
+* @param [device] Device to operate on
+* @param [count] Pointer to variable where the count will be placed
+* @param [reset] 1 = Reset the count to 0 after reading it
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_getInterruptCount(mcp2221_t* device, unsigned long* count, int reset);
+
 /**
 * @brief Read GPIO values
 *
@@ -886,6 +1441,546 @@ mcp2221_error mcp2221_i2cWriteRead(mcp2221_t* device,
                                    uint8_t *const r_buf,
                                    const unsigned int r_len);
 
+/**
+* @brief Start playing a waveform on the DAC from a dedicated thread
+*
+* Samples are written at absolute deadlines (no drift), each transaction is started early by half of the
+* measured round trip so that the new value lands on its deadline, and samples that repeat the previous
+* code do not cause a transaction. The DAC pin must already be configured as DAC output (mcp2221_setGPIOConf()).
+*
+* @param [device] Device to operate on
+* @param [ref] Voltage reference
+* @param [codes] Waveform samples (0 - 31), the buffer is copied
+* @param [count] Number of samples
+* @param [rate] Sample rate in Hz (max 1000)
+* @param [loop] 0 = Play once, 1 = Repeat until stopped
+* @param [player] Pointer to a ::mcp2221_dacplayer_t pointer where the player handle will be placed
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_dacPlay(mcp2221_t* device, mcp2221_dac_ref_t ref, const uint8_t* codes, int count, int rate, int loop, mcp2221_dacplayer_t** player);
+
+/**
+* @brief Queue a new waveform for a running player (double buffered)
+*
+* The new samples are taken over when the current pass through the waveform is complete, so the output never
+* shows a mix of the old and new waveform. Queuing again before the swap replaces the pending waveform.
+*
+* @param [player] Player to operate on
+* @param [codes] Waveform samples (0 - 31), the buffer is copied
+* @param [count] Number of samples
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_dacPlayUpdate(mcp2221_dacplayer_t* player, const uint8_t* codes, int count);
+
+/**
+* @brief Get the achieved timing of a player
+*
+* @param [player] Player to operate on
+* @param [stats] Pointer to ::mcp2221_dacplayer_stats_t struct where data will be placed
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_dacPlayStats(mcp2221_dacplayer_t* player, mcp2221_dacplayer_stats_t* stats);
+
+/**
+* @brief Stop the player thread and free the player, must be called for every successful mcp2221_dacPlay()
+*
+* mcp2221_close() stops and frees any player still running on the device, its handle is invalid afterwards.
+*
+* @param [player] Player to operate on
+* @return ::mcp2221_error error code of the player thread
+*/
+mcp2221_error mcp2221_dacPlayStop(mcp2221_dacplayer_t* player);
+
+/**
+* @brief Encode a sequence of GPIO steps into SET GPIO reports, ready to be run with mcp2221_gpioPatternRun()
+*
+* @param [steps] Array of steps
+* @param [count] Number of steps
+* @param [pattern] Pointer to a ::mcp2221_gpiopattern_t pointer where the pattern will be placed
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_gpioPatternCompile(const mcp2221_gpiostep_t* steps, int count, mcp2221_gpiopattern_t** pattern);
+
+/**
+* @brief Run a compiled GPIO pattern, blocks until the pattern is complete
+*
+* Every step is scheduled at an absolute time from the start of the run and its transaction is started early by
+* half of the measured round trip. Steps with a delay of 0 are sent back-to-back. The device is locked for the
+* whole run so that transactions from other threads can not disturb the timing.
+* The pins must already be configured as GPIO outputs (mcp2221_setGPIOConf()).
+*
+* @param [device] Device to operate on
+* @param [pattern] Pattern to run
+* @param [repeat] Number of times to run the pattern (at least 1)
+* @param [stats] Pointer to ::mcp2221_gpiopattern_stats_t struct where the achieved timing will be placed, can be NULL
+* @param [edgeNs] Array of at least (step count * repeat) elements where the time of each step from the start of the run will be placed (-1 for pure delays), can be NULL
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_gpioPatternRun(mcp2221_t* device, mcp2221_gpiopattern_t* pattern, int repeat, mcp2221_gpiopattern_stats_t* stats, int64_t* edgeNs);
+
+/**
+* @brief Free a compiled GPIO pattern
+*
+* @param [pattern] Pattern to free
+* @return (none)
+*/
+void mcp2221_gpioPatternFree(mcp2221_gpiopattern_t* pattern);
+
+/**
+* @brief Get the default GPIO monitor configuration
+*
+* @return ::mcp2221_gpiomon_conf_t
+*/
+mcp2221_gpiomon_conf_t mcp2221_gpioMonitorConfInit(void);
+
+/**
+* @brief Start polling GPIO values on a background thread and report changes to the subscribers
+*
+* There is one poll thread per device which is shared by all subscribers. Polling runs at conf->pollUs while pins
+* change and slows down exponentially to conf->idlePollUs once no pin has changed for conf->idleAfterUs.
+*
+* @param [device] Device to operate on
+* @param [conf] Pointer to ::mcp2221_gpiomon_conf_t struct, NULL for defaults
+* @return ::mcp2221_error error code (::MCP2221_ERROR if the monitor is already running)
+*/
+mcp2221_error mcp2221_gpioMonitorStart(mcp2221_t* device, const mcp2221_gpiomon_conf_t* conf);
+
+/**
+* @brief Stop the GPIO monitor and remove all subscribers (also done by mcp2221_close())
+*
+* @param [device] Device to operate on
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_gpioMonitorStop(mcp2221_t* device);
+
+/**
+* @brief Get GPIO monitor statistics
+*
+* @param [device] Device to operate on
+* @param [stats] Pointer to ::mcp2221_gpiomon_stats_t struct where data will be placed
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_gpioMonitorStats(mcp2221_t* device, mcp2221_gpiomon_stats_t* stats);
+
+/**
+* @brief Subscribe a callback to GPIO change events
+*
+* The callback runs on the monitor thread and should return quickly, it must not call mcp2221_gpioUnsubscribe() or mcp2221_gpioMonitorStop().
+*
+* @param [device] Device to operate on
+* @param [pins] Which pins to receive events for (see ::mcp2221_gpio_t)
+* @param [callback] Function to call for each event
+* @param [userData] Passed to the callback
+* @param [id] Pointer to int where the subscription ID will be placed, can be NULL
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_gpioSubscribe(mcp2221_t* device, int pins, mcp2221_gpio_callback_t callback, void* userData, int* id);
+
+/**
+* @brief Subscribe a lock-free queue to GPIO change events, events are read with mcp2221_gpioQueuePop()
+*
+* @param [device] Device to operate on
+* @param [pins] Which pins to receive events for (see ::mcp2221_gpio_t)
+* @param [capacity] Number of events the queue can hold (rounded up to a power of 2)
+* @param [queue] Pointer to a ::mcp2221_gpioqueue_t pointer where the queue will be placed, freed by mcp2221_gpioUnsubscribe()
+* @param [id] Pointer to int where the subscription ID will be placed, can be NULL
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_gpioSubscribeQueue(mcp2221_t* device, int pins, int capacity, mcp2221_gpioqueue_t** queue, int* id);
+
+/**
+* @brief Remove a subscriber
+*
+* @param [device] Device to operate on
+* @param [id] Subscription ID
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_gpioUnsubscribe(mcp2221_t* device, int id);
+
+/**
+* @brief Take the oldest event from a queue without blocking (single consumer)
+*
+* @param [queue] Queue to read from
+* @param [event] Pointer to ::mcp2221_gpioevent_t struct where the event will be placed
+* @return 1 if an event was read, 0 if the queue is empty
+*/
+int mcp2221_gpioQueuePop(mcp2221_gpioqueue_t* queue, mcp2221_gpioevent_t* event);
+
+/**
+* @brief Get the number of events lost because the queue was full
+*
+* @param [queue] Queue to operate on
+* @return Number of dropped events
+*/
+unsigned long mcp2221_gpioQueueDropped(mcp2221_gpioqueue_t* queue);
+
+/**
+* @brief Start polling and clearing the interrupt flag on a background thread (see mcp2221_readClearInterrupt())
+*
+* Polling runs at minPollUs after an edge was seen and slows down gradually to maxPollUs while the input is idle.
+* Use minPollUs = 0 to poll back-to-back for the highest event rate the device can sustain.
+* Interrupt detection must be configured first (mcp2221_setGPIOConf() and mcp2221_setInterrupt()).
+*
+* @param [device] Device to operate on
+* @param [minPollUs] Shortest poll interval, in microseconds
+* @param [maxPollUs] Longest poll interval, in microseconds
+* @return ::mcp2221_error error code (::MCP2221_ERROR if the monitor is already running)
+*/
+mcp2221_error mcp2221_intMonitorStart(mcp2221_t* device, int minPollUs, int maxPollUs);
+
+/**
+* @brief Stop the interrupt monitor and remove all subscribers (also done by mcp2221_close())
+*
+* @param [device] Device to operate on
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_intMonitorStop(mcp2221_t* device);
+
+/**
+* @brief Get interrupt monitor statistics
+*
+* @param [device] Device to operate on
+* @param [stats] Pointer to ::mcp2221_intmon_stats_t struct where data will be placed
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_intMonitorStats(mcp2221_t* device, mcp2221_intmon_stats_t* stats);
+
+/**
+* @brief Subscribe a callback to interrupt events
+*
+* Subscribers can be added before or after mcp2221_intMonitorStart(), events are delivered while the monitor is running.
+* The callback runs on the monitor thread and should return quickly, it must not call mcp2221_intUnsubscribe() or mcp2221_intMonitorStop().
+*
+* @param [device] Device to operate on
+* @param [callback] Function to call for each event
+* @param [userData] Passed to the callback
+* @param [id] Pointer to int where the subscription ID will be placed, can be NULL
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_intSubscribe(mcp2221_t* device, mcp2221_int_callback_t callback, void* userData, int* id);
+
+/**
+* @brief Remove an interrupt event subscriber
+*
+* @param [device] Device to operate on
+* @param [id] Subscription ID
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_intUnsubscribe(mcp2221_t* device, int id);
+
+/**
+* @brief Start capturing GPIO input states into a file, logic analyzer style
+*
+* GET GPIO is polled back-to-back on a dedicated thread (optionally pinned to one CPU) and only state changes are
+* written, with their time, to a memory-mapped file (see ::mcp2221_capheader_t for the format).
+* Other users of the device will slow the sample rate down while the capture is running.
+*
+* @param [device] Device to operate on
+* @param [path] File to write, it is created or truncated
+* @param [pins] Which pins to capture (see ::mcp2221_gpio_t)
+* @param [maxBytes] Largest file size, the capture stops when it is full
+* @param [cpu] CPU to run the capture thread on, -1 to not pin it
+* @param [capture] Pointer to a ::mcp2221_capture_t pointer where the capture handle will be placed
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_captureStart(mcp2221_t* device, const char* path, int pins, size_t maxBytes, int cpu, mcp2221_capture_t** capture);
+
+/**
+* @brief Get the progress of a running capture
+*
+* @param [capture] Capture to operate on
+* @param [stats] Pointer to ::mcp2221_capture_stats_t struct where data will be placed
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_captureStats(mcp2221_capture_t* capture, mcp2221_capture_stats_t* stats);
+
+/**
+* @brief Stop a capture, finish the file and free the handle
+*
+* mcp2221_close() stops any capture still running on the device, its handle is invalid afterwards.
+*
+* @param [capture] Capture to operate on
+* @param [stats] Pointer to ::mcp2221_capture_stats_t struct where the final statistics will be placed, can be NULL
+* @return ::mcp2221_error error code of the capture thread
+*/
+mcp2221_error mcp2221_captureStop(mcp2221_capture_t* capture, mcp2221_capture_stats_t* stats);
+
+/**
+* @brief Set the software PWM output of a GPIO pin
+*
+* All PWM pins of a device are driven by one scheduling thread, started on first use. Edges are scheduled on
+* absolute deadlines and every edge of any pin due within ::MCP2221_PWM_MERGE_US of the earliest one goes out
+* in the same SET GPIO report, so 4 pins at the same frequency cost no more transactions than 1.
+* Each edge is a USB transaction (around 1ms), so duty resolution is poor at the higher frequencies; check
+* mcp2221_pwmStats() for what is actually achieved.
+* The pin must already be configured as a GPIO output. Calling again on a running pin changes it from the
+* current cycle on without restarting it.
+*
+* @param [device] Device to operate on
+* @param [pin] Pin number (0 - 3)
+* @param [frequency] Frequency in Hz (up to ::MCP2221_PWM_MAX_FREQ), 0 to stop the pin and drive it LOW
+* @param [duty] Duty cycle (0.0 - 1.0), 0.0 and 1.0 stop the pin and drive it LOW or HIGH
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_pwmSet(mcp2221_t* device, int pin, double frequency, double duty);
+
+/**
+* @brief Get the achieved timing of a software PWM pin
+*
+* @param [device] Device to operate on
+* @param [pin] Pin number (0 - 3)
+* @param [stats] Pointer to ::mcp2221_pwm_stats_t struct where data will be placed
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_pwmStats(mcp2221_t* device, int pin, mcp2221_pwm_stats_t* stats);
+
+/**
+* @brief Stop software PWM on all pins, the pins are left at their current level
+*
+* Called by mcp2221_close().
+*
+* @param [device] Device to operate on
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_pwmStop(mcp2221_t* device);
+
+/**
+* @brief Get the default real-time loop configuration
+*
+* @return ::mcp2221_rt_conf_t
+*/
+mcp2221_rt_conf_t mcp2221_rtConfInit(void);
+
+/**
+* @brief Start a real-time loop that runs a callback on a dedicated I/O thread once every period
+*
+* For closed-loop control with deterministic latency. The thread is created with its SCHED_FIFO priority and CPU
+* affinity already set, prefaults its stack before the first cycle and wakes up on absolute deadlines, dropping
+* any it overran instead of bursting to catch up. Library calls made from the callback don't allocate and don't
+* sleep: I2C state polls that would wait 10ms between polls go back to back instead, paced by the USB frames, and still
+* give up after a second. Only mcp2221_i2cCancel() keeps its 1ms wait for the cancellation to finish.
+* Device locks inherit priority, so other threads using the device can't hold the loop up for longer than their
+* own transaction. Check mcp2221_rtStats() for the jitter actually achieved.
+* Raising the priority needs CAP_SYS_NICE or a high enough RLIMIT_RTPRIO, locking memory a high enough RLIMIT_MEMLOCK.
+*
+* @param [device] Device to operate on
+* @param [conf] Pointer to ::mcp2221_rt_conf_t struct, NULL for defaults
+* @param [callback] Function to run every period
+* @param [userData] Pointer passed to the callback
+* @return ::mcp2221_error error code (::MCP2221_ERROR if the loop is already running or the priority, affinity or memory lock were refused)
+*/
+mcp2221_error mcp2221_rtStart(mcp2221_t* device, const mcp2221_rt_conf_t* conf, mcp2221_rt_callback_t callback, void* userData);
+
+/**
+* @brief Get the achieved timing of the real-time loop
+*
+* @param [device] Device to operate on
+* @param [stats] Pointer to ::mcp2221_rt_stats_t struct where data will be placed
+* @return ::mcp2221_error error code (::MCP2221_ERROR if the loop was not started)
+*/
+mcp2221_error mcp2221_rtStats(mcp2221_t* device, mcp2221_rt_stats_t* stats);
+
+/**
+* @brief Stop the real-time loop, waits for the current cycle to finish
+*
+* Also needed after the callback has stopped the loop, before it can be started again. Called by mcp2221_close().
+*
+* @param [device] Device to operate on
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_rtStop(mcp2221_t* device);
+
+/**
+* @brief Create a group of devices that can be operated on concurrently
+*
+* A worker thread is started for each device. The devices must stay open until the group is freed and
+* can still be used directly at the same time.
+*
+* @param [devices] Array of device handles
+* @param [count] Number of devices
+* @param [group] Pointer to a ::mcp2221_group_t pointer where the group handle will be placed
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_groupCreate(mcp2221_t** devices, int count, mcp2221_group_t** group);
+
+/**
+* @brief Stop the worker threads and free a group, the devices are not closed
+*
+* @param [group] Group to free
+*/
+void mcp2221_groupFree(mcp2221_group_t* group);
+
+/**
+* @brief Get the number of devices in a group
+*
+* @param [group] Group to operate on
+* @return Number of devices
+*/
+int mcp2221_groupCount(mcp2221_group_t* group);
+
+/**
+* @brief Read the ADCs or GPIOs of every device in a group at the same time
+*
+* All workers send their request at a common start time instead of one after another, so the skew between
+* devices is down to USB scheduling rather than the sum of the transaction times.
+*
+* @param [group] Group to operate on
+* @param [source] What to read
+* @param [samples] Array of ::mcp2221_groupsample_t with an element for each device in the group, in the same order
+* @param [skewNs] Pointer to variable where the spread between the earliest and latest sample time will be placed, can be NULL
+* @return ::mcp2221_error error code, ::MCP2221_ERROR if only some devices failed (check res of each sample)
+*/
+mcp2221_error mcp2221_groupSample(mcp2221_group_t* group, mcp2221_sample_src_t source, mcp2221_groupsample_t* samples, int64_t* skewNs);
+
+/**
+* @brief Run an operation on every device in a group concurrently
+*
+* Returns once the operation has finished on all devices, so the time taken is that of the slowest device
+* rather than the sum of all of them. A failure on one device does not stop the others.
+* Only one operation runs on a group at a time, other callers wait.
+*
+* @param [group] Group to operate on
+* @param [func] Operation to run
+* @param [userData] Pointer passed to func, shared by all devices
+* @param [results] Array of ::mcp2221_groupresult_t with an element for each device in the group, can be NULL
+* @return ::mcp2221_error error code, ::MCP2221_ERROR if only some devices failed (check results)
+*/
+mcp2221_error mcp2221_groupRun(mcp2221_group_t* group, mcp2221_group_func_t func, void* userData, mcp2221_groupresult_t* results);
+
+/**
+* @brief Configure GPIO pins of every device in a group (SRAM), see mcp2221_setGPIOConf()
+*
+* @param [group] Group to operate on
+* @param [confSet] Configuration to apply to all devices
+* @param [results] Array of ::mcp2221_groupresult_t with an element for each device in the group, can be NULL
+* @return ::mcp2221_error error code, ::MCP2221_ERROR if only some devices failed (check results)
+*/
+mcp2221_error mcp2221_groupSetGPIOConf(mcp2221_group_t* group, mcp2221_gpioconfset_t* confSet, mcp2221_groupresult_t* results);
+
+/**
+* @brief Set the DAC of every device in a group (SRAM), see mcp2221_setDAC()
+*
+* @param [group] Group to operate on
+* @param [ref] Voltage reference
+* @param [value] Output value, between 0 and ::MCP2221_DAC_MAX
+* @param [results] Array of ::mcp2221_groupresult_t with an element for each device in the group, can be NULL
+* @return ::mcp2221_error error code, ::MCP2221_ERROR if only some devices failed (check results)
+*/
+mcp2221_error mcp2221_groupSetDAC(mcp2221_group_t* group, mcp2221_dac_ref_t ref, int value, mcp2221_groupresult_t* results);
+
+/**
+* @brief Set the I2C clock divider of every device in a group, see mcp2221_i2cDivider()
+*
+* @param [group] Group to operate on
+* @param [i2cdiv] Divider
+* @param [results] Array of ::mcp2221_groupresult_t with an element for each device in the group, can be NULL
+* @return ::mcp2221_error error code, ::MCP2221_ERROR if only some devices failed (check results)
+*/
+mcp2221_error mcp2221_groupI2cDivider(mcp2221_group_t* group, int i2cdiv, mcp2221_groupresult_t* results);
+
+/**
+* @brief Write the same data to an I2C slave on every device in a group
+*
+* Each device waits for its bus to be idle, writes, then waits for the write to complete.
+*
+* @param [group] Group to operate on
+* @param [address] I2C slave address (7 bit addresses only)
+* @param [data] Data to write
+* @param [len] Number of bytes to write (max 60)
+* @param [results] Array of ::mcp2221_groupresult_t with an element for each device in the group, can be NULL
+* @return ::mcp2221_error error code, ::MCP2221_ERROR if only some devices failed (check results)
+*/
+mcp2221_error mcp2221_groupI2cWrite(mcp2221_group_t* group, int address, const uint8_t* data, unsigned int len, mcp2221_groupresult_t* results);
+
+/**
+* @brief Create a job pool over interchangeable devices
+*
+* Each device gets a worker thread and a job queue. Jobs go to the queue of their affinity device, or round robin
+* if they have none. A device with an empty queue steals the newest unpinned job from another device's queue,
+* so no adapter idles while there is work. The devices must stay open until the pool is freed.
+*
+* @param [devices] Array of device handles
+* @param [count] Number of devices
+* @param [pool] Pointer to a ::mcp2221_pool_t pointer where the pool handle will be placed
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_poolCreate(mcp2221_t** devices, int count, mcp2221_pool_t** pool);
+
+/**
+* @brief Queue a job on a pool
+*
+* @param [pool] Pool to operate on
+* @param [job] Job to queue, func, userData, affinity and pinned must be set. The other fields are filled in when it has run
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_poolSubmit(mcp2221_pool_t* pool, mcp2221_job_t* job);
+
+/**
+* @brief Wait for all queued jobs of a pool to finish
+*
+* @param [pool] Pool to operate on
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_poolWait(mcp2221_pool_t* pool);
+
+/**
+* @brief Get the statistics of a device in a pool
+*
+* @param [pool] Pool to operate on
+* @param [index] Index of the device in the pool
+* @param [stats] Pointer to ::mcp2221_pool_stats_t struct where data will be placed
+* @return ::mcp2221_error error code
+*/
+mcp2221_error mcp2221_poolStats(mcp2221_pool_t* pool, int index, mcp2221_pool_stats_t* stats);
+
+/**
+* @brief Wait for the queued jobs to finish, then stop the worker threads and free a pool. The devices are not closed
+*
+* @param [pool] Pool to free
+*/
+void mcp2221_poolFree(mcp2221_pool_t* pool);
+
+/**
+* @brief Get the virtual clock of a simulated device
+*
+* Simulated devices answer instantly unless MCP2221_SIM_TIMING is set when they are opened, as "mode[,key=value...]".
+* The mode is "virtual" to only advance the device's clock by the modelled time (runs faster than real time and gives
+* the same result every time) or "real" to also sleep for it. The model puts each request in the next USB frame and its
+* response in the frame after the firmware has handled it, adds the ADC conversion to STATUS/SET and keeps the I2C engine
+* busy for the bus time of each transfer at the current divider. Library waits between polls advance the virtual clock
+* instead of sleeping. Keys: frame (frame interval, default 1000us), proc (command handling, default 50us),
+* adc (conversion, default 90us) and i2c (start/stop bits per transfer, default 2).
+*
+* @param [device] Simulated device
+* @param [us] Pointer to where the time since the device was opened will be placed, in microseconds (0 without a timing model)
+* @param [reports] Pointer to where the number of reports sent to the device will be placed, can be NULL
+* @return ::mcp2221_error error code, ::MCP2221_INVALID_ARG if the device is not simulated
+*/
+mcp2221_error mcp2221_simClock(mcp2221_t* device, uint64_t* us, unsigned long* reports);
+
+/**
+* @brief Start exporting metrics of opened devices in the Prometheus text format
+*
+* Counts transactions, errors, timeouts, bytes, transaction latency (histogram), I2C NACKs, flash writes and reconnects
+* of every device opened afterwards, labelled with its path and serial. Devices that are already open are not counted
+* until they are closed and opened again. Counters are kept per path until mcp2221_exit(), so they carry on when a device
+* is closed and opened again. Counting is a few relaxed atomic adds per transaction.
+* mcp2221_init() calls this if MCP2221_METRICS is set, with MCP2221_METRICS_INTERVAL as the interval. Not available on Windows.
+*
+* @param [target] "unix:<path>" to serve the metrics on a Unix socket (one exposition per connection, as an HTTP response
+* if the client sends a GET request) or "file:<path>" / "<path>" to rewrite a file, e.g. for the node_exporter textfile collector
+* @param [intervalMs] How often to rewrite the file in milliseconds, 0 for ::MCP2221_METRICS_INTERVAL
+* @return ::mcp2221_error error code, ::MCP2221_ERROR if already running or the socket could not be set up
+*/
+mcp2221_error mcp2221_metricsStart(const char* target, int intervalMs);
+
+/**
+* @brief Stop exporting metrics, counting carries on for devices that are already open
+*
+* @return (none)
+*/
+void mcp2221_metricsStop(void);
+
 #if defined(__cplusplus)
 }
 #endif
@@ -0,0 +1,631 @@
+/*
+ * Project: MCP2221 HID Library
+ * Author: Zak Kemble, contact@zakkemble.co.uk
+ * Copyright: (C) 2015 by Zak Kemble
+ * License: GNU GPL v3 (see License.txt)
+ * Web: http://blog.zakkemble.co.uk/mcp2221-hid-library/
+ */
+
+// Header-only C++17 wrapper: owning handles, strongly typed enums and results instead of out-params.
+// Every call is an inline forward to the C function of the same name, nothing is allocated or copied.
+
+#ifndef LIBMCP2221_HPP_
+#define LIBMCP2221_HPP_
+
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#if defined(__has_include)
+#if __has_include(<span>)
+#include <span>
+#endif
+#endif
+#include "libmcp2221.h"
+
+namespace mcp2221 {
+
+/**
+* \brief Error codes (see ::mcp2221_error)
+*/
+enum class Error : int
+{
+	Success = MCP2221_SUCCESS,
+	General = MCP2221_ERROR,
+	InvalidArg = MCP2221_INVALID_ARG,
+	Hid = MCP2221_ERROR_HID,
+	Timeout = MCP2221_TIMEOUT,
+	Pending = MCP2221_PENDING
+};
+
+/** \brief Reference voltages for DAC (see ::mcp2221_dac_ref_t) */
+enum class DacRef : int
+{
+	Ref4096 = MCP2221_DAC_REF_4096,
+	Ref2048 = MCP2221_DAC_REF_2048,
+	Ref1024 = MCP2221_DAC_REF_1024,
+	Off = MCP2221_DAC_REF_OFF,
+	Vdd = MCP2221_DAC_REF_VDD
+};
+
+/** \brief Reference voltages for ADC (see ::mcp2221_adc_ref_t) */
+enum class AdcRef : int
+{
+	Ref4096 = MCP2221_ADC_REF_4096,
+	Ref2048 = MCP2221_ADC_REF_2048,
+	Ref1024 = MCP2221_ADC_REF_1024,
+	Off = MCP2221_ADC_REF_OFF,
+	Vdd = MCP2221_ADC_REF_VDD
+};
+
+/** \brief Trigger modes for interrupt (see ::mcp2221_int_trig_t) */
+enum class IntTrig : int
+{
+	Invalid = MCP2221_INT_TRIG_INVALID,
+	Rising = MCP2221_INT_TRIG_RISING,
+	Falling = MCP2221_INT_TRIG_FALLING,
+	Both = MCP2221_INT_TRIG_BOTH
+};
+
+/** \brief GPIO modes (see ::mcp2221_gpio_mode_t) */
+enum class GpioMode : int
+{
+	Gpio = MCP2221_GPIO_MODE_GPIO,
+	Dedicated = MCP2221_GPIO_MODE_DEDI,
+	Alt1 = MCP2221_GPIO_MODE_ALT1,
+	Alt2 = MCP2221_GPIO_MODE_ALT2,
+	Alt3 = MCP2221_GPIO_MODE_ALT3,
+	Suspend = MCP2221_GPIO_MODE_SSPND,
+	Adc = MCP2221_GPIO_MODE_ADC,
+	Dac = MCP2221_GPIO_MODE_DAC,
+	Ioc = MCP2221_GPIO_MODE_IOC,
+	Invalid = MCP2221_GPIO_MODE_INVALID
+};
+
+/** \brief GPIO values (see ::mcp2221_gpio_value_t) */
+enum class GpioValue : int
+{
+	High = MCP2221_GPIO_VALUE_HIGH,
+	Low = MCP2221_GPIO_VALUE_LOW,
+	Invalid = MCP2221_GPIO_VALUE_INVALID
+};
+
+/** \brief GPIO direction (see ::mcp2221_gpio_direction_t) */
+enum class GpioDir : int
+{
+	Input = MCP2221_GPIO_DIR_INPUT,
+	Output = MCP2221_GPIO_DIR_OUTPUT,
+	Invalid = MCP2221_GPIO_DIR_INVALID
+};
+
+/** \brief GPIO pins, can be combined with | (see ::mcp2221_gpio_t) */
+enum class Gpio : int
+{
+	None = 0,
+	Gpio0 = MCP2221_GPIO0,
+	Gpio1 = MCP2221_GPIO1,
+	Gpio2 = MCP2221_GPIO2,
+	Gpio3 = MCP2221_GPIO3,
+	All = MCP2221_GPIO0 | MCP2221_GPIO1 | MCP2221_GPIO2 | MCP2221_GPIO3
+};
+
+constexpr Gpio operator|(Gpio a, Gpio b) { return static_cast<Gpio>(static_cast<int>(a) | static_cast<int>(b)); }
+constexpr Gpio operator&(Gpio a, Gpio b) { return static_cast<Gpio>(static_cast<int>(a) & static_cast<int>(b)); }
+
+/** \brief Power source (see ::mcp2221_pwrsrc_t) */
+enum class PowerSource : int
+{
+	SelfPowered = MCP2221_PWRSRC_SELFPOWERED,
+	BusPowered = MCP2221_PWRSRC_BUSPOWERED
+};
+
+/** \brief Remote USB host wakeup (see ::mcp2221_wakeup_t) */
+enum class Wakeup : int
+{
+	Disabled = MCP2221_WAKEUP_DISABLED,
+	Enabled = MCP2221_WAKEUP_ENABLED
+};
+
+/** \brief Clock reference output divider from 48MHz (see ::mcp2221_clkdiv_t) */
+enum class ClkDiv : int
+{
+	Reserved = MCP2221_CLKDIV_RESERVED,
+	Div2 = MCP2221_CLKDIV_2,
+	Div4 = MCP2221_CLKDIV_4,
+	Div8 = MCP2221_CLKDIV_8,
+	Div16 = MCP2221_CLKDIV_16,
+	Div32 = MCP2221_CLKDIV_32,
+	Div64 = MCP2221_CLKDIV_64,
+	Div128 = MCP2221_CLKDIV_128
+};
+
+/** \brief Clock reference output duty cycle (see ::mcp2221_clkduty_t) */
+enum class ClkDuty : int
+{
+	Duty0 = MCP2221_CLKDUTY_0,
+	Duty25 = MCP2221_CLKDUTY_25,
+	Duty50 = MCP2221_CLKDUTY_50,
+	Duty75 = MCP2221_CLKDUTY_75
+};
+
+/** \brief I2C transfer type (see ::mcp2221_i2crw_t) */
+enum class I2cRw : int
+{
+	Normal = MCP2221_I2CRW_NORMAL,
+	Repeated = MCP2221_I2CRW_REPEATED,
+	NoStop = MCP2221_I2CRW_NOSTOP
+};
+
+/** \brief I2C engine state (see ::mcp2221_i2c_state_t) */
+enum class I2cState : int
+{
+	Idle = MCP2221_I2C_IDLE,
+	StartTimeout = MCP2221_RESP_I2C_START_TOUT,
+	RepeatedStartTimeout = MCP2221_RESP_I2C_RSTART_TOUT,
+	AddressSend = MCP2221_RESP_I2C_WRADDRL_WSEND,
+	AddressTimeout = MCP2221_RESP_I2C_WRADDRL_TOUT,
+	AddressNack = MCP2221_RESP_I2C_WRADDRL_NACK,
+	WriteTimeout = MCP2221_RESP_I2C_WRDATA_TOUT,
+	WriteNoStop = MCP2221_I2C_UNKNOWN2,
+	ReadBusy = MCP2221_I2C_UNKNOWN4,
+	ReadTimeout = MCP2221_RESP_I2C_RDDATA_TOUT,
+	DataReady = MCP2221_I2C_DATAREADY,
+	StopTimeout = MCP2221_RESP_I2C_STOP_TOUT,
+	ReadError = MCP2221_RESP_READ_ERR
+};
+
+/** \brief Dedicated pin whose polarity to set or get (see ::mcp2221_dedipin_t) */
+enum class DediPin : int
+{
+	LedUartRx = MCP2221_DEDIPIN_LEDUARTRX,
+	LedUartTx = MCP2221_DEDIPIN_LEDUARTTX,
+	LedI2c = MCP2221_DEDIPIN_LEDI2C,
+	Suspend = MCP2221_DEDIPIN_SSPND,
+	UsbCfg = MCP2221_DEDIPIN_USBCFG
+};
+
+/**
+* \brief Either a value or the error that prevented it, like std::expected<T, Error>
+*
+* The value is only meaningful if the result converts to true. value() asserts that it does.
+*/
+template<typename T>
+class Result
+{
+public:
+	constexpr Result(T value) : val(std::move(value)), err(Error::Success) {}
+	constexpr Result(Error error) : val(), err(error) {}
+
+	constexpr explicit operator bool() const { return err == Error::Success; }
+	constexpr bool hasValue() const { return err == Error::Success; }
+	constexpr Error error() const { return err; }
+
+	T& value() & { assert(hasValue()); return val; }
+	const T& value() const & { assert(hasValue()); return val; }
+	T&& value() && { assert(hasValue()); return std::move(val); }
+	T& operator*() & { return value(); }
+	const T& operator*() const & { return value(); }
+	T&& operator*() && { return std::move(*this).value(); }
+	T* operator->() { return &value(); }
+	const T* operator->() const { return &value(); }
+
+	template<typename U>
+	constexpr T valueOr(U&& other) const & { return hasValue() ? val : static_cast<T>(std::forward<U>(other)); }
+
+private:
+	T val;
+	Error err;
+};
+
+/**
+* \brief Result of a call that only returns an error code
+*/
+template<>
+class Result<void>
+{
+public:
+	constexpr Result() : err(Error::Success) {}
+	constexpr Result(Error error) : err(error) {}
+	constexpr Result(mcp2221_error error) : err(static_cast<Error>(error)) {}
+
+	constexpr explicit operator bool() const { return err == Error::Success; }
+	constexpr bool hasValue() const { return err == Error::Success; }
+	constexpr Error error() const { return err; }
+
+private:
+	Error err;
+};
+
+using Status = Result<void>;
+
+namespace detail {
+	// Value if res is MCP2221_SUCCESS, the error otherwise
+	template<typename T>
+	inline Result<T> make(mcp2221_error res, T&& value)
+	{
+		if(res != MCP2221_SUCCESS)
+			return static_cast<Error>(res);
+		return Result<T>(std::forward<T>(value));
+	}
+}
+
+#if defined(__cpp_lib_span)
+/** \brief Contiguous buffer, std::span from C++20 */
+template<typename T>
+using Span = std::span<T>;
+#else
+/**
+* \brief Contiguous buffer for C++17, the subset of std::span used here.
+* Constructible from a pointer and size, a C array or anything with data() and size().
+*/
+template<typename T>
+class Span
+{
+public:
+	constexpr Span() : ptr(nullptr), len(0) {}
+	constexpr Span(T* data, std::size_t size) : ptr(data), len(size) {}
+	template<std::size_t N>
+	constexpr Span(T (&arr)[N]) : ptr(arr), len(N) {}
+	template<typename C, typename = std::enable_if_t<std::is_convertible_v<decltype(std::declval<C&>().data()), T*>>>
+	constexpr Span(C& container) : ptr(container.data()), len(container.size()) {}
+	template<typename C, typename = std::enable_if_t<std::is_convertible_v<decltype(std::declval<const C&>().data()), T*>>>
+	constexpr Span(const C& container) : ptr(container.data()), len(container.size()) {}
+
+	constexpr T* data() const { return ptr; }
+	constexpr std::size_t size() const { return len; }
+	constexpr bool empty() const { return len == 0; }
+	constexpr T* begin() const { return ptr; }
+	constexpr T* end() const { return ptr + len; }
+	constexpr T& operator[](std::size_t idx) const { return ptr[idx]; }
+
+private:
+	T* ptr;
+	std::size_t len;
+};
+#endif
+
+/** \brief DAC or ADC reference and output value */
+struct DacSetting
+{
+	DacRef ref;
+	int value;
+};
+
+/** \brief Clock reference output setting */
+struct ClockSetting
+{
+	ClkDiv div;
+	ClkDuty duty;
+};
+
+/** \brief USB VID and PID */
+struct VidPid
+{
+	int vid;
+	int pid;
+};
+
+/**
+* \brief An open device, closed when this goes out of scope (see ::mcp2221_t)
+*
+* Move-only. Open devices with Context::open() and friends, or adopt a handle from the C API.
+* The C handle is still available from get() for anything not wrapped here.
+*/
+class Device
+{
+public:
+	Device() noexcept : dev(nullptr) {}
+	explicit Device(mcp2221_t* device) noexcept : dev(device) {}
+	Device(Device&& other) noexcept : dev(std::exchange(other.dev, nullptr)) {}
+	Device& operator=(Device&& other) noexcept
+	{
+		if(this != &other)
+		{
+			close();
+			dev = std::exchange(other.dev, nullptr);
+		}
+		return *this;
+	}
+	Device(const Device&) = delete;
+	Device& operator=(const Device&) = delete;
+	~Device() { close(); }
+
+	/** \brief C handle, still owned by this */
+	mcp2221_t* get() const noexcept { return dev; }
+	/** \brief Give up ownership of the C handle, the caller has to mcp2221_close() it */
+	mcp2221_t* release() noexcept { return std::exchange(dev, nullptr); }
+	explicit operator bool() const noexcept { return dev != nullptr; }
+
+	/** \brief Close the device now instead of on destruction */
+	void close() noexcept
+	{
+		if(dev)
+			mcp2221_close(dev);
+		dev = nullptr;
+	}
+
+	const char* path() const { return dev->path; }
+	const mcp2221_usbinfo_t& usbInfo() const { return dev->usbInfo; }
+	bool sameDevice(const Device& other) const { return mcp2221_sameDevice(dev, other.dev); }
+
+	Status reset() { return mcp2221_reset(dev); }
+	Status isConnected() { return mcp2221_isConnected(dev); }
+	Status isAlive(int idleMs = 0) { return mcp2221_isAlive(dev, idleMs); }
+	Status rawReport(std::array<uint8_t, MCP2221_REPORT_SIZE>& report) { return mcp2221_rawReport(dev, report.data()); }
+
+	// SRAM settings, take effect immediately
+
+	Status setClockOut(ClkDiv div, ClkDuty duty) { return mcp2221_setClockOut(dev, static_cast<mcp2221_clkdiv_t>(div), static_cast<mcp2221_clkduty_t>(duty)); }
+	Result<ClockSetting> getClockOut()
+	{
+		mcp2221_clkdiv_t div;
+		mcp2221_clkduty_t duty;
+		mcp2221_error res = mcp2221_getClockOut(dev, &div, &duty);
+		return detail::make(res, ClockSetting{static_cast<ClkDiv>(div), static_cast<ClkDuty>(duty)});
+	}
+	/** \brief Set the clock output as close as possible to hz, returns the achieved frequency */
+	Result<uint32_t> setClockFrequency(uint32_t hz, ClkDuty duty)
+	{
+		uint32_t achieved = 0;
+		mcp2221_error res = mcp2221_setClockFrequency(dev, hz, static_cast<mcp2221_clkduty_t>(duty), &achieved);
+		return detail::make(res, std::move(achieved));
+	}
+
+	Status setDAC(DacRef ref, int value) { return mcp2221_setDAC(dev, static_cast<mcp2221_dac_ref_t>(ref), value); }
+	Result<DacSetting> getDAC()
+	{
+		mcp2221_dac_ref_t ref;
+		int value = 0;
+		mcp2221_error res = mcp2221_getDAC(dev, &ref, &value);
+		return detail::make(res, DacSetting{static_cast<DacRef>(ref), value});
+	}
+
+	Status setADC(AdcRef ref) { return mcp2221_setADC(dev, static_cast<mcp2221_adc_ref_t>(ref)); }
+	Result<AdcRef> getADC()
+	{
+		mcp2221_adc_ref_t ref;
+		mcp2221_error res = mcp2221_getADC(dev, &ref);
+		return detail::make(res, static_cast<AdcRef>(ref));
+	}
+
+	Status setInterrupt(IntTrig trig, bool clearInt) { return mcp2221_setInterrupt(dev, static_cast<mcp2221_int_trig_t>(trig), clearInt); }
+	Result<IntTrig> getInterrupt()
+	{
+		mcp2221_int_trig_t trig;
+		mcp2221_error res = mcp2221_getInterrupt(dev, &trig);
+		return detail::make(res, static_cast<IntTrig>(trig));
+	}
+
+	Status setGPIOConf(mcp2221_gpioconfset_t& confSet) { return mcp2221_setGPIOConf(dev, &confSet); }
+	Result<mcp2221_gpioconfset_t> getGPIO()
+	{
+		mcp2221_gpioconfset_t confGet;
+		mcp2221_error res = mcp2221_getGPIO(dev, &confGet);
+		return detail::make(res, std::move(confGet));
+	}
+	Status setGPIO(Gpio pins, GpioValue value) { return mcp2221_setGPIO(dev, static_cast<mcp2221_gpio_t>(pins), static_cast<mcp2221_gpio_value_t>(value)); }
+	/** \brief Set the pins in mask to the matching bits of values in one transaction */
+	Status setGPIOMask(Gpio mask, Gpio values) { return mcp2221_setGPIOMask(dev, static_cast<int>(mask), static_cast<int>(values)); }
+
+	// Inputs
+
+	Result<std::array<int, MCP2221_ADC_COUNT>> readADC()
+	{
+		std::array<int, MCP2221_ADC_COUNT> values;
+		mcp2221_error res = mcp2221_readADC(dev, values.data());
+		return detail::make(res, std::move(values));
+	}
+	Result<std::array<GpioValue, MCP2221_GPIO_COUNT>> readGPIO()
+	{
+		static_assert(sizeof(GpioValue) == sizeof(mcp2221_gpio_value_t), "GpioValue must match mcp2221_gpio_value_t");
+		std::array<GpioValue, MCP2221_GPIO_COUNT> values;
+		mcp2221_error res = mcp2221_readGPIO(dev, reinterpret_cast<mcp2221_gpio_value_t*>(values.data()));
+		return detail::make(res, std::move(values));
+	}
+	Result<bool> readInterrupt()
+	{
+		int state = 0;
+		mcp2221_error res = mcp2221_readInterrupt(dev, &state);
+		return detail::make(res, state != 0);
+	}
+	Status clearInterrupt() { return mcp2221_clearInterrupt(dev); }
+	Result<bool> readClearInterrupt()
+	{
+		int state = 0;
+		mcp2221_error res = mcp2221_readClearInterrupt(dev, &state);
+		return detail::make(res, state != 0);
+	}
+
+	// I2C
+
+	Status i2cWrite(int address, Span<const uint8_t> data, I2cRw type = I2cRw::Normal)
+	{
+		return mcp2221_i2cWrite(dev, address, data.data(), static_cast<int>(data.size()), static_cast<mcp2221_i2crw_t>(type));
+	}
+	Status i2cRead(int address, int len, I2cRw type = I2cRw::Normal) { return mcp2221_i2cRead(dev, address, len, static_cast<mcp2221_i2crw_t>(type)); }
+	/** \brief Fetch the data of the last i2cRead(), fills the whole buffer */
+	Status i2cGet(Span<uint8_t> data) { return mcp2221_i2cGet(dev, data.data(), static_cast<int>(data.size())); }
+	/** \brief Write, repeated start and fill the read buffer. Either buffer can be empty */
+	Status i2cWriteRead(int address, Span<const uint8_t> write, Span<uint8_t> read)
+	{
+		return mcp2221_i2cWriteRead(dev, address, write.data(), static_cast<unsigned int>(write.size()), read.data(), static_cast<unsigned int>(read.size()));
+	}
+	Status i2cCancel() { return mcp2221_i2cCancel(dev); }
+	Result<I2cState> i2cState()
+	{
+		mcp2221_i2c_state_t state;
+		mcp2221_error res = mcp2221_i2cState(dev, &state);
+		return detail::make(res, static_cast<I2cState>(state));
+	}
+	Status i2cDivider(int i2cdiv) { return mcp2221_i2cDivider(dev, i2cdiv); }
+	Result<mcp2221_i2cpins_t> i2cReadPins()
+	{
+		mcp2221_i2cpins_t pins;
+		mcp2221_error res = mcp2221_i2cReadPins(dev, &pins);
+		return detail::make(res, std::move(pins));
+	}
+
+	// Flash settings, used at startup
+
+	Status saveManufacturer(const wchar_t* str) { return mcp2221_saveManufacturer(dev, const_cast<wchar_t*>(str)); }
+	Status saveProduct(const wchar_t* str) { return mcp2221_saveProduct(dev, const_cast<wchar_t*>(str)); }
+	Status saveSerial(const wchar_t* str) { return mcp2221_saveSerial(dev, const_cast<wchar_t*>(str)); }
+	Status saveVIDPID(int vid, int pid) { return mcp2221_saveVIDPID(dev, vid, pid); }
+	Status saveSerialEnumerate(bool enumerate) { return mcp2221_saveSerialEnumerate(dev, enumerate); }
+	Status saveMilliamps(int milliamps) { return mcp2221_saveMilliamps(dev, milliamps); }
+	Status savePowerSource(PowerSource source) { return mcp2221_savePowerSource(dev, static_cast<mcp2221_pwrsrc_t>(source)); }
+	Status saveRemoteWakeup(Wakeup wakeup) { return mcp2221_saveRemoteWakeup(dev, static_cast<mcp2221_wakeup_t>(wakeup)); }
+	Status savePolarity(DediPin pin, int polarity) { return mcp2221_savePolarity(dev, static_cast<mcp2221_dedipin_t>(pin), polarity); }
+	Status saveClockOut(ClkDiv div, ClkDuty duty) { return mcp2221_saveClockOut(dev, static_cast<mcp2221_clkdiv_t>(div), static_cast<mcp2221_clkduty_t>(duty)); }
+	Status saveDAC(DacRef ref, int value) { return mcp2221_saveDAC(dev, static_cast<mcp2221_dac_ref_t>(ref), value); }
+	Status saveADC(AdcRef ref) { return mcp2221_saveADC(dev, static_cast<mcp2221_adc_ref_t>(ref)); }
+	Status saveInterrupt(IntTrig trig) { return mcp2221_saveInterrupt(dev, static_cast<mcp2221_int_trig_t>(trig)); }
+	Status saveGPIOConf(mcp2221_gpioconfset_t& confSet) { return mcp2221_saveGPIOConf(dev, &confSet); }
+
+	/** \brief Read the manufacturer descriptor into a buffer of at least ::MCP2221_STR_LEN characters */
+	Status loadManufacturer(Span<wchar_t> buffer) { assert(buffer.size() >= MCP2221_STR_LEN); return mcp2221_loadManufacturer(dev, buffer.data()); }
+	/** \brief Read the product descriptor into a buffer of at least ::MCP2221_STR_LEN characters */
+	Status loadProduct(Span<wchar_t> buffer) { assert(buffer.size() >= MCP2221_STR_LEN); return mcp2221_loadProduct(dev, buffer.data()); }
+	/** \brief Read the serial descriptor into a buffer of at least ::MCP2221_STR_LEN characters */
+	Status loadSerial(Span<wchar_t> buffer) { assert(buffer.size() >= MCP2221_STR_LEN); return mcp2221_loadSerial(dev, buffer.data()); }
+	Result<VidPid> loadVIDPID()
+	{
+		int vid = 0;
+		int pid = 0;
+		mcp2221_error res = mcp2221_loadVIDPID(dev, &vid, &pid);
+		return detail::make(res, VidPid{vid, pid});
+	}
+	Result<bool> loadSerialEnumerate()
+	{
+		int enumerate = 0;
+		mcp2221_error res = mcp2221_loadSerialEnumerate(dev, &enumerate);
+		return detail::make(res, enumerate != 0);
+	}
+	Result<int> loadMilliamps()
+	{
+		int milliamps = 0;
+		mcp2221_error res = mcp2221_loadMilliamps(dev, &milliamps);
+		return detail::make(res, std::move(milliamps));
+	}
+	Result<PowerSource> loadPowerSource()
+	{
+		mcp2221_pwrsrc_t source;
+		mcp2221_error res = mcp2221_loadPowerSource(dev, &source);
+		return detail::make(res, static_cast<PowerSource>(source));
+	}
+	Result<Wakeup> loadRemoteWakeup()
+	{
+		mcp2221_wakeup_t wakeup;
+		mcp2221_error res = mcp2221_loadRemoteWakeup(dev, &wakeup);
+		return detail::make(res, static_cast<Wakeup>(wakeup));
+	}
+	Result<int> loadPolarity(DediPin pin)
+	{
+		int polarity = 0;
+		mcp2221_error res = mcp2221_loadPolarity(dev, static_cast<mcp2221_dedipin_t>(pin), &polarity);
+		return detail::make(res, std::move(polarity));
+	}
+	Result<ClockSetting> loadClockOut()
+	{
+		mcp2221_clkdiv_t div;
+		mcp2221_clkduty_t duty;
+		mcp2221_error res = mcp2221_loadClockOut(dev, &div, &duty);
+		return detail::make(res, ClockSetting{static_cast<ClkDiv>(div), static_cast<ClkDuty>(duty)});
+	}
+	Result<DacSetting> loadDAC()
+	{
+		mcp2221_dac_ref_t ref;
+		int value = 0;
+		mcp2221_error res = mcp2221_loadDAC(dev, &ref, &value);
+		return detail::make(res, DacSetting{static_cast<DacRef>(ref), value});
+	}
+	Result<AdcRef> loadADC()
+	{
+		mcp2221_adc_ref_t ref;
+		mcp2221_error res = mcp2221_loadADC(dev, &ref);
+		return detail::make(res, static_cast<AdcRef>(ref));
+	}
+	Result<IntTrig> loadInterrupt()
+	{
+		mcp2221_int_trig_t trig;
+		mcp2221_error res = mcp2221_loadInterrupt(dev, &trig);
+		return detail::make(res, static_cast<IntTrig>(trig));
+	}
+	Result<mcp2221_gpioconfset_t> loadGPIOConf()
+	{
+		mcp2221_gpioconfset_t confSet;
+		mcp2221_error res = mcp2221_loadGPIOConf(dev, &confSet);
+		return detail::make(res, std::move(confSet));
+	}
+
+private:
+	mcp2221_t* dev;
+};
+
+/**
+* \brief Library initialisation, mcp2221_exit() is called when this goes out of scope
+*
+* Move-only. Devices should be closed before their Context goes.
+*/
+class Context
+{
+public:
+	/** \brief Initialise the library (see mcp2221_init()) */
+	static Result<Context> create()
+	{
+		mcp2221_error res = mcp2221_init();
+		if(res != MCP2221_SUCCESS)
+			return static_cast<Error>(res);
+		return Context(true);
+	}
+
+	Context() noexcept : owned(false) {}
+	Context(Context&& other) noexcept : owned(std::exchange(other.owned, false)) {}
+	Context& operator=(Context&& other) noexcept
+	{
+		if(this != &other)
+		{
+			if(owned)
+				mcp2221_exit();
+			owned = std::exchange(other.owned, false);
+		}
+		return *this;
+	}
+	Context(const Context&) = delete;
+	Context& operator=(const Context&) = delete;
+	~Context()
+	{
+		if(owned)
+			mcp2221_exit();
+	}
+
+	/** \brief Find devices (see mcp2221_find()), returns how many were found */
+	int find(int vid = MCP2221_DEFAULT_VID, int pid = MCP2221_DEFAULT_PID, wchar_t* manufacturer = nullptr, wchar_t* product = nullptr, wchar_t* serial = nullptr)
+	{
+		return mcp2221_find(vid, pid, manufacturer, product, serial);
+	}
+
+	Result<Device> open() { return wrap(mcp2221_open()); }
+	Result<Device> openByIndex(int idx) { return wrap(mcp2221_open_byIndex(idx)); }
+	Result<Device> openBySerial(const wchar_t* serial) { return wrap(mcp2221_open_bySerial(const_cast<wchar_t*>(serial))); }
+	Result<Device> openByPath(const char* path) { return wrap(mcp2221_open_byPath(const_cast<char*>(path))); }
+
+private:
+	explicit Context(bool own) noexcept : owned(own) {}
+
+	// The C open functions only say whether they worked
+	static Result<Device> wrap(mcp2221_t* device)
+	{
+		if(!device)
+			return Error::General;
+		return Result<Device>(Device(device));
+	}
+
+	bool owned;
+};
+
+} // namespace mcp2221
+
+#endif /* LIBMCP2221_HPP_ */
@@ -0,0 +1,416 @@
+/*
+ * Project: MCP2221 HID Library
+ * Author: Zak Kemble, contact@zakkemble.co.uk
+ * Copyright: (C) 2015 by Zak Kemble
+ * License: GNU GPL v3 (see License.txt)
+ * Web: http://blog.zakkemble.co.uk/mcp2221-hid-library/
+ */
+
+// Header-only C++20 coroutine interface on top of mcp2221_submit()/mcp2221_complete(), for driving many devices
+// from one thread. A task waiting for a response is suspended until the device's mcp2221_pollFd() is readable.
+// Resuming it is up to an executor: EpollExecutor below, or anything with the same waitReadable() member.
+
+#ifndef LIBMCP2221_CORO_HPP_
+#define LIBMCP2221_CORO_HPP_
+
+#if !defined(__cpp_impl_coroutine)
+#error "libmcp2221_coro.hpp needs C++20 coroutines"
+#endif
+
+#include <array>
+#include <coroutine>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <cerrno>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include "libmcp2221.hpp"
+
+namespace mcp2221 {
+namespace coro {
+
+template<typename T>
+class Task;
+
+namespace detail {
+	constexpr uint8_t CMD_STATUSSET = 0x10;
+	constexpr uint8_t CMD_I2CWRITE = 0x90;
+	constexpr uint8_t CMD_I2CWRITE_REPEATSTART = 0x92;
+	constexpr uint8_t CMD_I2CWRITE_NOSTOP = 0x94;
+	constexpr uint8_t CMD_I2CREAD = 0x91;
+	constexpr uint8_t CMD_I2CREAD_REPEATSTART = 0x93;
+	constexpr uint8_t CMD_I2CREAD_GET = 0x40;
+
+	constexpr int I2C_MAX_LEN = 60;
+	// State polls go back to back, each one is a USB round trip (about 1ms on hardware)
+	constexpr int I2C_POLLS = 500;
+
+	struct PromiseBase
+	{
+		std::coroutine_handle<> continuation;
+		bool detached = false;
+
+		struct FinalAwaiter
+		{
+			bool await_ready() noexcept { return false; }
+			template<typename P>
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) noexcept
+			{
+				PromiseBase& promise = handle.promise();
+				if(promise.detached)
+				{
+					handle.destroy();
+					return std::noop_coroutine();
+				}
+				return promise.continuation ? promise.continuation : std::noop_coroutine();
+			}
+			void await_resume() noexcept {}
+		};
+
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		FinalAwaiter final_suspend() noexcept { return {}; }
+		// Errors are results, nothing in here throws on purpose
+		void unhandled_exception() noexcept { std::terminate(); }
+	};
+
+	template<typename T>
+	struct Promise : PromiseBase
+	{
+		std::optional<T> value;
+
+		Task<T> get_return_object() noexcept;
+		void return_value(T val) { value.emplace(std::move(val)); }
+	};
+
+	template<>
+	struct Promise<void> : PromiseBase
+	{
+		Task<void> get_return_object() noexcept;
+		void return_void() noexcept {}
+	};
+
+	// Suspends until fd is readable, false from await_resume() if the executor couldn't wait for it
+	template<typename Executor>
+	struct Readable
+	{
+		Executor& executor;
+		int fd;
+		bool waiting = false;
+
+		bool await_ready() const noexcept { return false; }
+		bool await_suspend(std::coroutine_handle<> handle) { return (waiting = executor.waitReadable(fd, handle)); }
+		bool await_resume() const noexcept { return waiting; }
+	};
+}
+
+/**
+* \brief Lazily started coroutine returning T, runs when awaited
+*
+* Move-only. Destroying a task that is suspended in the middle of a transaction leaves it outstanding,
+* so let tasks run to completion (spawn() ones that nothing awaits).
+*/
+template<typename T>
+class Task
+{
+public:
+	using promise_type = detail::Promise<T>;
+
+	Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+	Task& operator=(Task&& other) noexcept
+	{
+		if(this != &other)
+		{
+			if(handle)
+				handle.destroy();
+			handle = std::exchange(other.handle, nullptr);
+		}
+		return *this;
+	}
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+	~Task()
+	{
+		if(handle)
+			handle.destroy();
+	}
+
+	bool await_ready() const noexcept { return !handle || handle.done(); }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+	{
+		handle.promise().continuation = awaiting;
+		return handle;
+	}
+	T await_resume()
+	{
+		if constexpr (!std::is_void_v<T>)
+			return std::move(*handle.promise().value);
+	}
+
+	/** \brief Start the task with nothing awaiting it, it frees itself once done */
+	void detach()
+	{
+		auto h = std::exchange(handle, nullptr);
+		h.promise().detached = true;
+		h.resume();
+	}
+
+private:
+	friend struct detail::Promise<T>;
+	explicit Task(std::coroutine_handle<promise_type> h) noexcept : handle(h) {}
+
+	std::coroutine_handle<promise_type> handle;
+};
+
+namespace detail {
+	template<typename T>
+	inline Task<T> Promise<T>::get_return_object() noexcept
+	{
+		return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+	}
+
+	inline Task<void> Promise<void>::get_return_object() noexcept
+	{
+		return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+	}
+}
+
+/**
+* \brief Run a task until its first suspension, then leave it to the executor
+*/
+inline void spawn(Task<void> task)
+{
+	task.detach();
+}
+
+/**
+* \brief Minimal single-threaded executor on epoll
+*
+* Its own descriptor (fd()) is readable whenever runOnce() has work, so it can be nested in another event loop.
+* Any other executor only needs the same member:
+*     bool waitReadable(int fd, std::coroutine_handle<> handle);
+* which resumes handle once, on the executor's thread, after fd polls readable, and returns false if it can't.
+*/
+class EpollExecutor
+{
+public:
+	EpollExecutor() : epfd(epoll_create1(EPOLL_CLOEXEC)) {}
+	EpollExecutor(const EpollExecutor&) = delete;
+	EpollExecutor& operator=(const EpollExecutor&) = delete;
+	~EpollExecutor()
+	{
+		if(epfd >= 0)
+			::close(epfd);
+	}
+
+	bool valid() const { return epfd >= 0; }
+	int fd() const { return epfd; }
+	/** \brief Number of tasks waiting for a descriptor */
+	int waiting() const { return waiters; }
+
+	bool waitReadable(int fd, std::coroutine_handle<> handle)
+	{
+		epoll_event ev;
+		std::memset(&ev, 0x00, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		ev.data.ptr = handle.address();
+		// Devices keep the same descriptor, so it is only added the first time
+		if(epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) != 0 && (errno != ENOENT || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0))
+			return false;
+		waiters++;
+		return true;
+	}
+
+	/**
+	* \brief Wait up to timeoutMs (-1 forever) and resume the tasks whose descriptors are ready
+	* \return Number of tasks resumed, -1 on error
+	*/
+	int runOnce(int timeoutMs = -1)
+	{
+		epoll_event events[16];
+		int count = epoll_wait(epfd, events, 16, timeoutMs);
+		if(count < 0)
+			return (errno == EINTR) ? 0 : -1;
+		for(int i = 0; i < count; i++)
+		{
+			waiters--;
+			std::coroutine_handle<>::from_address(events[i].data.ptr).resume();
+		}
+		return count;
+	}
+
+	/** \brief Run until no task is waiting */
+	void run()
+	{
+		while(waiters > 0 && runOnce() >= 0);
+	}
+
+private:
+	int epfd;
+	int waiters = 0;
+};
+
+/** \brief Decoded status report (see mcp2221_readADC(), mcp2221_readInterrupt(), mcp2221_i2cState() and mcp2221_i2cReadPins()) */
+struct StatusSnapshot
+{
+	I2cState i2cState;
+	std::array<int, MCP2221_ADC_COUNT> adc;
+	bool interrupt;
+	int scl;
+	int sda;
+};
+
+using Report = std::array<uint8_t, MCP2221_REPORT_SIZE>;
+
+/**
+* \brief Awaitable operations on a device, resumed by Executor
+*
+* Only one operation can be in progress per device; an overlapping one returns Error::Pending.
+* Synchronous calls on the device also return ::MCP2221_PENDING while one is. The device must stay open.
+*/
+template<typename Executor = EpollExecutor>
+class AsyncDevice
+{
+public:
+	AsyncDevice(Device& device, Executor& executor) : dev(device.get()), ex(executor) {}
+	AsyncDevice(mcp2221_t* device, Executor& executor) : dev(device), ex(executor) {}
+
+	mcp2221_t* get() const { return dev; }
+
+	/** \brief Send a report, the response is placed in the same buffer (see mcp2221_rawReport()) */
+	Task<Status> transaction(Report& report)
+	{
+		mcp2221_error res = mcp2221_submit(dev, report.data());
+		if(res != MCP2221_SUCCESS)
+			co_return res;
+
+		int fd = mcp2221_pollFd(dev);
+		while((res = mcp2221_complete(dev, report.data())) == MCP2221_PENDING)
+		{
+			// Can't leave the transaction outstanding, so block for it if the executor won't wait
+			if(!co_await detail::Readable<Executor>{ex, fd})
+			{
+				pollfd pfd = {fd, POLLIN, 0};
+				poll(&pfd, 1, -1);
+			}
+		}
+		co_return res;
+	}
+
+	/** \brief Read the status report once, for ADC values, the interrupt flag and the I2C state */
+	Task<Result<StatusSnapshot>> status()
+	{
+		Report report = {};
+		report[0] = detail::CMD_STATUSSET;
+		Status res = co_await transaction(report);
+		if(!res)
+			co_return res.error();
+
+		StatusSnapshot snapshot;
+		snapshot.i2cState = static_cast<I2cState>(report[8]);
+		for(int i = 0; i < MCP2221_ADC_COUNT; i++)
+			snapshot.adc[i] = (report[51 + (i * 2)]<<8) | report[50 + (i * 2)];
+		snapshot.interrupt = report[24];
+		snapshot.scl = report[22];
+		snapshot.sda = report[23];
+		co_return snapshot;
+	}
+
+	/** \brief Poll the I2C state until it is state, Error::Timeout if it never gets there */
+	Task<Status> waitState(I2cState state)
+	{
+		for(int i = 0; i < detail::I2C_POLLS; i++)
+		{
+			Result<StatusSnapshot> snapshot = co_await status();
+			if(!snapshot)
+				co_return snapshot.error();
+			if(snapshot->i2cState == state)
+				co_return Status();
+		}
+		co_return Error::Timeout;
+	}
+
+	/** \brief Start an I2C write of up to 60 bytes (see mcp2221_i2cWrite()) */
+	Task<Status> i2cWrite(int address, Span<const uint8_t> data, I2cRw type = I2cRw::Normal)
+	{
+		if(data.size() > detail::I2C_MAX_LEN)
+			co_return Error::InvalidArg;
+
+		Report report = {};
+		report[0] = (type == I2cRw::Repeated) ? detail::CMD_I2CWRITE_REPEATSTART : (type == I2cRw::NoStop) ? detail::CMD_I2CWRITE_NOSTOP : detail::CMD_I2CWRITE;
+		report[1] = static_cast<uint8_t>(data.size());
+		report[3] = static_cast<uint8_t>(address<<1);
+		std::memcpy(&report[4], data.data(), data.size());
+		co_return co_await transaction(report);
+	}
+
+	/** \brief Start an I2C read of up to 60 bytes, fetch them with i2cGet() once the state is DataReady (see mcp2221_i2cRead()) */
+	Task<Status> i2cRead(int address, int len, I2cRw type = I2cRw::Normal)
+	{
+		if(len < 0 || len > detail::I2C_MAX_LEN)
+			co_return Error::InvalidArg;
+
+		Report report = {};
+		report[0] = (type == I2cRw::Repeated) ? detail::CMD_I2CREAD_REPEATSTART : detail::CMD_I2CREAD;
+		report[1] = static_cast<uint8_t>(len);
+		report[3] = static_cast<uint8_t>(address<<1);
+		co_return co_await transaction(report);
+	}
+
+	/** \brief Fetch the data of the last i2cRead(), fills the whole buffer */
+	Task<Status> i2cGet(Span<uint8_t> data)
+	{
+		if(data.size() > detail::I2C_MAX_LEN)
+			co_return Error::InvalidArg;
+
+		Report report = {};
+		report[0] = detail::CMD_I2CREAD_GET;
+		report[1] = static_cast<uint8_t>(data.size());
+		Status res = co_await transaction(report);
+		if(res)
+			std::memcpy(data.data(), &report[4], data.size());
+		co_return res;
+	}
+
+	/** \brief Write, repeated start and fill the read buffer. Either buffer can be empty (see mcp2221_i2cWriteRead()) */
+	Task<Status> i2cWriteRead(int address, Span<const uint8_t> write, Span<uint8_t> read)
+	{
+		if(write.size() > detail::I2C_MAX_LEN || read.size() > detail::I2C_MAX_LEN)
+			co_return Error::InvalidArg;
+		if(write.empty() && read.empty())
+			co_return Status();
+
+		Status res = co_await waitState(I2cState::Idle);
+		if(!res)
+			co_return res;
+
+		if(read.empty())
+			co_return co_await i2cWrite(address, write);
+
+		if(!write.empty())
+		{
+			if(!(res = co_await i2cWrite(address, write, I2cRw::NoStop)))
+				co_return res;
+			if(!(res = co_await waitState(I2cState::WriteNoStop)))
+				co_return res;
+		}
+
+		if(!(res = co_await i2cRead(address, static_cast<int>(read.size()), write.empty() ? I2cRw::Normal : I2cRw::Repeated)))
+			co_return res;
+		if(!(res = co_await waitState(I2cState::DataReady)))
+			co_return res;
+		co_return co_await i2cGet(read);
+	}
+
+private:
+	mcp2221_t* dev;
+	Executor& ex;
+};
+
+} // namespace coro
+} // namespace mcp2221
+
+#endif /* LIBMCP2221_CORO_HPP_ */
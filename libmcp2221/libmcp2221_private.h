@@ -0,0 +1,215 @@
+/*
+ * Project: MCP2221 HID Library
+ * Author: Zak Kemble, contact@zakkemble.co.uk
+ * Copyright: (C) 2015 by Zak Kemble
+ * License: GNU GPL v3 (see License.txt)
+ * Web: http://blog.zakkemble.co.uk/mcp2221-hid-library/
+ */
+
+// Library internals shared between the source files, not installed
+
+#ifndef LIBMCP2221_PRIVATE_H_
+#define LIBMCP2221_PRIVATE_H_
+
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "libmcp2221.h"
+
+#ifdef _WIN32
+	#define LIB_EXPORT __declspec(dllexport)
+	#define LIB_INTERNAL
+#else
+	#define LIB_EXPORT
+	#define LIB_INTERNAL __attribute__((visibility("hidden")))
+#endif
+
+#define REPORT_SIZE		MCP2221_REPORT_SIZE
+
+#define NEW_REPORT(report) uint8_t report[REPORT_SIZE];
+
+typedef enum
+{
+	USB_CMD_STATUSSET	= 0x10,
+	USB_CMD_READFLASH	= 0xB0,
+	USB_CMD_WRITEFLASH	= 0xB1,
+	USB_CMD_FLASHPASS	= 0xB2,
+	USB_CMD_I2CWRITE	= 0x90,
+	USB_CMD_I2CWRITE_REPEATSTART	= 0x92,
+	USB_CMD_I2CWRITE_NOSTOP			= 0x94,
+	USB_CMD_I2CREAD		= 0x91,
+	USB_CMD_I2CREAD_REPEATSTART		= 0x93,
+	USB_CMD_I2CREAD_GET	= 0x40,
+	USB_CMD_SETGPIO		= 0x50,
+	USB_CMD_GETGPIO		= 0x51,
+	USB_CMD_SETSRAM		= 0x60,
+	USB_CMD_GETSRAM		= 0x61,
+	USB_CMD_RESET		= 0x70
+}usb_cmd_t;
+
+// How reports get to a device: straight to HID, or through the local server (see client.c)
+typedef struct{
+	mcp2221_error (*send)(mcp2221_t* device, const uint8_t* report);
+	mcp2221_error (*get)(mcp2221_t* device, uint8_t* report);
+	void (*close)(mcp2221_t* device);
+	void (*delay)(mcp2221_t* device, int us);	// Wait between polls, NULL to sleep in real time (simulated devices may use a virtual clock)
+	int (*alive)(mcp2221_t* device);	// 0 if the transport has been told the device is gone, without any traffic. NULL if it can't tell
+	int (*asyncFd)(mcp2221_t* device, int arm);	// Descriptor readable once get() won't block, -1 if none. arm clears readiness left from earlier responses. NULL if not supported
+}mcp2221_transport_t;
+
+// Per-device state that is not part of the public mcp2221_t
+struct mcp2221_priv_t{
+	const mcp2221_transport_t* transport;
+	pthread_mutex_t lock;	// Serialises transactions from the application and library threads (recursive)
+	struct mcp2221_gpiomon_t* gpioMon;	// GPIO change monitor, NULL if not used
+	struct mcp2221_intmon_t* intMon;	// Interrupt monitor, NULL if not used
+	struct mcp2221_pwm_t* pwm;	// Software PWM scheduler, NULL if not used
+	unsigned long intCount;	// Interrupt flags seen and cleared by mcp2221_readClearInterrupt()
+	const mcp2221_transport_t* recordInner;	// Transport under the recorder, see record.c
+	int recordId;			// Device number in the recording
+	struct mcp2221_metrics_t* metrics;	// Counters for the metrics exporter, NULL if the exporter was not running at open
+	int64_t lastOkNs;		// Monotonic time the last transaction succeeded, 0 if it failed (atomic, see mcp2221_isAlive())
+	int hupFd;				// Extra descriptor on the hidraw node, only polled for the hang up on removal. -1 if none
+	struct mcp2221_rt_t* rt;	// Real-time loop, NULL if not running
+	struct mcp2221_dacplayer_t* dacPlayers;	// DAC players not stopped yet, linked through their next field
+	struct mcp2221_capture_t* captures;	// GPIO captures not stopped yet, linked through their next field
+	int asyncPending;		// A report sent by mcp2221_submit() is waiting for mcp2221_complete()
+	uint8_t asyncCmd;		// Its command
+	int64_t asyncStartNs;	// When it was sent
+};
+
+// Send a report and read the response into the same buffer, holding the device lock
+mcp2221_error LIB_INTERNAL mcp2221_doTransaction(mcp2221_t* device, uint8_t* report);
+
+// Hold the device lock across several transactions (e.g. read-modify-write of gpioCache)
+void LIB_INTERNAL mcp2221_lock(mcp2221_t* device);
+void LIB_INTERNAL mcp2221_unlock(mcp2221_t* device);
+
+// Build a SET GPIO report where every pin in mask gets its own value from values (bit set = HIGH)
+void LIB_INTERNAL mcp2221_encodeGPIOMask(uint8_t* report, int mask, int values);
+
+// Update the output value bits of gpioCache after a SET GPIO, caller should hold the device lock
+void LIB_INTERNAL mcp2221_cacheGPIOMask(mcp2221_t* device, int mask, int values);
+
+// Stop and free every DAC player of the device (dacplayer.c)
+void LIB_INTERNAL mcp2221_dacPlayStopAll(mcp2221_t* device);
+
+// Poll the I2C state until it is w_state, gives up with MCP2221_TIMEOUT after about a second
+mcp2221_error LIB_INTERNAL mcp2221_wait_state(mcp2221_t* device, const mcp2221_i2c_state_t w_state);
+
+struct hid_device_info;
+
+#ifndef _WIN32
+// Local server client (client.c), used instead of HID when MCP2221_SERVER is set
+LIB_INTERNAL const char* mcp2221_serverPath(void);
+LIB_INTERNAL struct hid_device_info* mcp2221_serverEnumerate(unsigned short vid, unsigned short pid);
+void LIB_INTERNAL mcp2221_serverFreeEnumeration(struct hid_device_info* devs);
+mcp2221_error LIB_INTERNAL mcp2221_serverOpen(mcp2221_t* device, const char* path);
+#else
+static inline const char* mcp2221_serverPath(void) { return NULL; }
+static inline struct hid_device_info* mcp2221_serverEnumerate(unsigned short vid, unsigned short pid) { (void)vid; (void)pid; return NULL; }
+static inline void mcp2221_serverFreeEnumeration(struct hid_device_info* devs) { (void)devs; }
+static inline mcp2221_error mcp2221_serverOpen(mcp2221_t* device, const char* path) { (void)device; (void)path; return MCP2221_ERROR; }
+#endif
+
+#ifndef _WIN32
+// Simulated devices (sim.c), enumerated instead of HID when MCP2221_SIM is set
+int LIB_INTERNAL mcp2221_simCount(void);
+int LIB_INTERNAL mcp2221_simIsPath(const char* path);
+LIB_INTERNAL struct hid_device_info* mcp2221_simEnumerate(unsigned short vid, unsigned short pid);
+void LIB_INTERNAL mcp2221_simFreeEnumeration(struct hid_device_info* devs);
+mcp2221_error LIB_INTERNAL mcp2221_simOpen(mcp2221_t* device, const char* path);
+#else
+static inline int mcp2221_simCount(void) { return 0; }
+static inline int mcp2221_simIsPath(const char* path) { (void)path; return 0; }
+static inline struct hid_device_info* mcp2221_simEnumerate(unsigned short vid, unsigned short pid) { (void)vid; (void)pid; return NULL; }
+static inline void mcp2221_simFreeEnumeration(struct hid_device_info* devs) { (void)devs; }
+static inline mcp2221_error mcp2221_simOpen(mcp2221_t* device, const char* path) { (void)device; (void)path; return MCP2221_ERROR; }
+#endif
+
+#ifndef _WIN32
+// Report recording and replay (record.c), MCP2221_RECORD wraps any transport, MCP2221_REPLAY is used instead of HID
+mcp2221_error LIB_INTERNAL mcp2221_recordWrap(mcp2221_t* device, const wchar_t* serial);
+LIB_INTERNAL const char* mcp2221_replayPath(void);
+LIB_INTERNAL struct hid_device_info* mcp2221_replayEnumerate(unsigned short vid, unsigned short pid);
+void LIB_INTERNAL mcp2221_replayFreeEnumeration(struct hid_device_info* devs);
+mcp2221_error LIB_INTERNAL mcp2221_replayOpen(mcp2221_t* device, const char* path);
+void LIB_INTERNAL mcp2221_recordExit(void);
+#else
+static inline mcp2221_error mcp2221_recordWrap(mcp2221_t* device, const wchar_t* serial) { (void)device; (void)serial; return MCP2221_SUCCESS; }
+static inline const char* mcp2221_replayPath(void) { return NULL; }
+static inline struct hid_device_info* mcp2221_replayEnumerate(unsigned short vid, unsigned short pid) { (void)vid; (void)pid; return NULL; }
+static inline void mcp2221_replayFreeEnumeration(struct hid_device_info* devs) { (void)devs; }
+static inline mcp2221_error mcp2221_replayOpen(mcp2221_t* device, const char* path) { (void)device; (void)path; return MCP2221_ERROR; }
+static inline void mcp2221_recordExit(void) { }
+#endif
+
+#ifndef _WIN32
+// Stop every GPIO capture of the device and finish their files (capture.c)
+void LIB_INTERNAL mcp2221_captureStopAll(mcp2221_t* device);
+#else
+static inline void mcp2221_captureStopAll(mcp2221_t* device) { (void)device; }
+#endif
+
+#ifndef _WIN32
+// rt.c
+int LIB_INTERNAL mcp2221_rtIsIoThread(mcp2221_t* device);
+#else
+static inline int mcp2221_rtIsIoThread(mcp2221_t* device) { (void)device; return 0; }
+#endif
+
+#ifndef _WIN32
+// metrics.c
+LIB_INTERNAL struct mcp2221_metrics_t* mcp2221_metricsAttach(const char* path);
+void LIB_INTERNAL mcp2221_metricsSetSerial(struct mcp2221_metrics_t* m, const wchar_t* serial);
+void LIB_INTERNAL mcp2221_metricsDetach(struct mcp2221_metrics_t* m);
+void LIB_INTERNAL mcp2221_metricsTransaction(struct mcp2221_metrics_t* m, uint8_t cmd, mcp2221_error res, int64_t ns);
+void LIB_INTERNAL mcp2221_metricsI2cWait(struct mcp2221_metrics_t* m, mcp2221_error res, int nacked);
+mcp2221_error LIB_INTERNAL mcp2221_metricsInit(void);
+void LIB_INTERNAL mcp2221_metricsExit(void);
+#else
+static inline struct mcp2221_metrics_t* mcp2221_metricsAttach(const char* path) { (void)path; return NULL; }
+static inline void mcp2221_metricsSetSerial(struct mcp2221_metrics_t* m, const wchar_t* serial) { (void)m; (void)serial; }
+static inline void mcp2221_metricsDetach(struct mcp2221_metrics_t* m) { (void)m; }
+static inline void mcp2221_metricsTransaction(struct mcp2221_metrics_t* m, uint8_t cmd, mcp2221_error res, int64_t ns) { (void)m; (void)cmd; (void)res; (void)ns; }
+static inline void mcp2221_metricsI2cWait(struct mcp2221_metrics_t* m, mcp2221_error res, int nacked) { (void)m; (void)res; (void)nacked; }
+static inline mcp2221_error mcp2221_metricsInit(void) { return MCP2221_SUCCESS; }
+static inline void mcp2221_metricsExit(void) { }
+#endif
+
+// USDT probes for perf and bpftrace (provider "mcp2221"), built in with MCP2221_USDT.
+// A probe is a single NOP until a tracer attaches to it.
+#if defined(MCP2221_USDT) && !defined(_WIN32)
+#include <sys/sdt.h>
+#define MCP2221_PROBE1(name, a)				DTRACE_PROBE1(mcp2221, name, a)
+#define MCP2221_PROBE2(name, a, b)			DTRACE_PROBE2(mcp2221, name, a, b)
+#define MCP2221_PROBE3(name, a, b, c)		DTRACE_PROBE3(mcp2221, name, a, b, c)
+#define MCP2221_PROBE4(name, a, b, c, d)	DTRACE_PROBE4(mcp2221, name, a, b, c, d)
+#else
+#define MCP2221_PROBE1(name, a)				((void)0)
+#define MCP2221_PROBE2(name, a, b)			((void)0)
+#define MCP2221_PROBE3(name, a, b, c)		((void)0)
+#define MCP2221_PROBE4(name, a, b, c, d)	((void)0)
+#endif
+
+#define NS_PER_SEC	1000000000LL
+
+// Monotonic time in nanoseconds
+static inline int64_t mcp2221_nowNs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec * NS_PER_SEC) + ts.tv_nsec;
+}
+
+// Sleep until an absolute monotonic time, so that periodic loops do not accumulate drift
+static inline void mcp2221_sleepUntilNs(int64_t deadline)
+{
+	struct timespec ts;
+	ts.tv_sec = deadline / NS_PER_SEC;
+	ts.tv_nsec = deadline % NS_PER_SEC;
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+#endif /* LIBMCP2221_PRIVATE_H_ */
@@ -0,0 +1,459 @@
+/*
+ * Project: MCP2221 HID Library
+ * Author: Zak Kemble, contact@zakkemble.co.uk
+ * Copyright: (C) 2015 by Zak Kemble
+ * License: GNU GPL v3 (see License.txt)
+ * Web: http://blog.zakkemble.co.uk/mcp2221-hid-library/
+ */
+
+// Per-device counters and their export in Prometheus text format, to a Unix socket or a periodically rewritten file
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "libmcp2221.h"
+#include "libmcp2221_private.h"
+
+#define METRICS_BUCKETS		10
+#define METRICS_POLL_MS		250		// How quickly the exporter notices mcp2221_metricsStop()
+#define METRICS_LABEL_LEN	256
+
+// Upper bounds of the latency histogram buckets, the last one is +Inf
+static const int64_t bucketUs[METRICS_BUCKETS - 1] = {250, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000};
+
+// Counters of one device path, kept across close and reopen so they stay monotonic.
+// Only ever updated with relaxed atomics, the exporter reads them the same way.
+struct mcp2221_metrics_t{
+	struct mcp2221_metrics_t* next;
+	char path[METRICS_LABEL_LEN];
+	char serial[METRICS_LABEL_LEN];
+	int open; // Open devices pointing at this block
+	uint64_t opens;
+	uint64_t transactions;
+	uint64_t errors;
+	uint64_t timeouts;
+	uint64_t bytesSent;
+	uint64_t bytesReceived;
+	uint64_t latencyNsSum;
+	uint64_t buckets[METRICS_BUCKETS];
+	uint64_t i2cNacks;
+	uint64_t flashWrites;
+};
+
+// Exporter, and the list of counter blocks (append only, freed by mcp2221_metricsStop())
+static pthread_mutex_t metricsLock = PTHREAD_MUTEX_INITIALIZER;
+static struct mcp2221_metrics_t* metricsList;
+static int metricsRunning;
+static int metricsStopFlag;
+static pthread_t metricsThreadId;
+static int metricsFd = -1;				// Listening socket, -1 in file mode
+static char* metricsFile;				// File to rewrite, NULL in socket mode
+static char* metricsSocketPath;
+static int metricsIntervalMs;
+
+#define COUNT(field, n)	__atomic_fetch_add(&(field), (n), __ATOMIC_RELAXED)
+#define READ(field)		__atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+void LIB_INTERNAL mcp2221_metricsTransaction(struct mcp2221_metrics_t* m, uint8_t cmd, mcp2221_error res, int64_t ns)
+{
+	COUNT(m->transactions, 1);
+	COUNT(m->bytesSent, MCP2221_REPORT_SIZE);
+	if(res == MCP2221_SUCCESS && cmd != USB_CMD_RESET)
+		COUNT(m->bytesReceived, MCP2221_REPORT_SIZE);
+	if(res == MCP2221_TIMEOUT)
+		COUNT(m->timeouts, 1);
+	else if(res != MCP2221_SUCCESS)
+		COUNT(m->errors, 1);
+	if(cmd == USB_CMD_WRITEFLASH)
+		COUNT(m->flashWrites, 1);
+
+	int64_t us = ns / 1000;
+	int b;
+	for(b=0;b<METRICS_BUCKETS - 1 && us > bucketUs[b];b++);
+	COUNT(m->buckets[b], 1);
+	COUNT(m->latencyNsSum, (uint64_t)ns);
+}
+
+void LIB_INTERNAL mcp2221_metricsI2cWait(struct mcp2221_metrics_t* m, mcp2221_error res, int nacked)
+{
+	if(res == MCP2221_TIMEOUT)
+		COUNT(m->timeouts, 1);
+	if(nacked)
+		COUNT(m->i2cNacks, 1);
+}
+
+// Label values are ASCII, quotes, backslashes and line breaks escaped
+static void labelCopy(char* dst, const char* src, const wchar_t* wsrc)
+{
+	size_t o = 0;
+	for(size_t i=0;o < METRICS_LABEL_LEN - 3;i++)
+	{
+		int c = src ? (unsigned char)src[i] : (int)wsrc[i];
+		if(!c)
+			break;
+		if(c == '"' || c == '\\')
+			dst[o++] = '\\';
+		else if(c == '\n')
+		{
+			dst[o++] = '\\';
+			c = 'n';
+		}
+		dst[o++] = (c < 0x80) ? c : '?';
+	}
+	dst[o] = '\0';
+}
+
+LIB_INTERNAL struct mcp2221_metrics_t* mcp2221_metricsAttach(const char* path)
+{
+	pthread_mutex_lock(&metricsLock);
+	if(!metricsRunning)
+	{
+		pthread_mutex_unlock(&metricsLock);
+		return NULL;
+	}
+
+	char label[METRICS_LABEL_LEN];
+	labelCopy(label, path, NULL);
+
+	struct mcp2221_metrics_t** last = &metricsList;
+	struct mcp2221_metrics_t* m;
+	for(m = metricsList; m; m = m->next)
+	{
+		if(strcmp(m->path, label) == 0)
+			break;
+		last = &m->next;
+	}
+	if(!m && (m = calloc(1, sizeof(struct mcp2221_metrics_t))))
+	{
+		strcpy(m->path, label);
+		*last = m;
+	}
+	if(m)
+	{
+		COUNT(m->opens, 1);
+		COUNT(m->open, 1);
+	}
+
+	pthread_mutex_unlock(&metricsLock);
+	return m;
+}
+
+void LIB_INTERNAL mcp2221_metricsSetSerial(struct mcp2221_metrics_t* m, const wchar_t* serial)
+{
+	pthread_mutex_lock(&metricsLock);
+	labelCopy(m->serial, NULL, serial);
+	pthread_mutex_unlock(&metricsLock);
+}
+
+void LIB_INTERNAL mcp2221_metricsDetach(struct mcp2221_metrics_t* m)
+{
+	pthread_mutex_lock(&metricsLock);
+	__atomic_sub_fetch(&m->open, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&metricsLock);
+}
+
+static void printMetric(FILE* f, const char* name, const char* type, const char* help)
+{
+	fprintf(f, "# HELP mcp2221_%s %s\n# TYPE mcp2221_%s %s\n", name, help, name, type);
+}
+
+#define FOREACH_DEVICE(m)	for(struct mcp2221_metrics_t* m = metricsList; m; m = m->next)
+#define LABELS				"path=\"%s\",serial=\"%s\""
+
+// Whole exposition, caller must hold metricsLock
+static void writeExposition(FILE* f)
+{
+	static const struct{
+		const char* name;
+		const char* help;
+		size_t offset;
+	}counters[] = {
+		{"transactions_total",		"Reports sent to the device",							offsetof(struct mcp2221_metrics_t, transactions)},
+		{"transaction_errors_total","Transactions that failed, not counting timeouts",		offsetof(struct mcp2221_metrics_t, errors)},
+		{"timeouts_total",			"Transactions and I2C waits that timed out",			offsetof(struct mcp2221_metrics_t, timeouts)},
+		{"sent_bytes_total",		"Bytes of reports sent",								offsetof(struct mcp2221_metrics_t, bytesSent)},
+		{"received_bytes_total",	"Bytes of responses received",							offsetof(struct mcp2221_metrics_t, bytesReceived)},
+		{"i2c_nacks_total",			"I2C transfers the slave did not acknowledge",			offsetof(struct mcp2221_metrics_t, i2cNacks)},
+		{"flash_writes_total",		"Flash write commands",									offsetof(struct mcp2221_metrics_t, flashWrites)},
+	};
+
+	for(size_t i=0;i<sizeof(counters) / sizeof(counters[0]);i++)
+	{
+		printMetric(f, counters[i].name, "counter", counters[i].help);
+		FOREACH_DEVICE(m)
+		{
+			uint64_t* value = (uint64_t*)((char*)m + counters[i].offset);
+			fprintf(f, "mcp2221_%s{" LABELS "} %llu\n", counters[i].name, m->path, m->serial, (unsigned long long)READ(*value));
+		}
+	}
+
+	printMetric(f, "reconnects_total", "counter", "Times the device was opened again after the first time");
+	FOREACH_DEVICE(m)
+		fprintf(f, "mcp2221_reconnects_total{" LABELS "} %llu\n", m->path, m->serial, (unsigned long long)(READ(m->opens) - 1));
+
+	printMetric(f, "open", "gauge", "Whether the device is currently open");
+	FOREACH_DEVICE(m)
+		fprintf(f, "mcp2221_open{" LABELS "} %d\n", m->path, m->serial, READ(m->open) > 0);
+
+	printMetric(f, "transaction_duration_seconds", "histogram", "Time from sending a report to receiving its response");
+	FOREACH_DEVICE(m)
+	{
+		uint64_t total = 0;
+		for(int b=0;b<METRICS_BUCKETS;b++)
+		{
+			total += READ(m->buckets[b]);
+			if(b < METRICS_BUCKETS - 1)
+				fprintf(f, "mcp2221_transaction_duration_seconds_bucket{" LABELS ",le=\"%g\"} %llu\n", m->path, m->serial, bucketUs[b] / 1e6, (unsigned long long)total);
+			else
+				fprintf(f, "mcp2221_transaction_duration_seconds_bucket{" LABELS ",le=\"+Inf\"} %llu\n", m->path, m->serial, (unsigned long long)total);
+		}
+		fprintf(f, "mcp2221_transaction_duration_seconds_sum{" LABELS "} %.9f\n", m->path, m->serial, READ(m->latencyNsSum) / 1e9);
+		fprintf(f, "mcp2221_transaction_duration_seconds_count{" LABELS "} %llu\n", m->path, m->serial, (unsigned long long)total);
+	}
+}
+
+// Write to a temporary file and rename it over the target, so readers never see half a file
+static void exportFile(void)
+{
+	size_t len = strlen(metricsFile);
+	char* tmp = malloc(len + 5);
+	if(!tmp)
+		return;
+	memcpy(tmp, metricsFile, len);
+	strcpy(tmp + len, ".tmp");
+
+	FILE* f = fopen(tmp, "w");
+	if(f)
+	{
+		pthread_mutex_lock(&metricsLock);
+		writeExposition(f);
+		pthread_mutex_unlock(&metricsLock);
+		if(fclose(f) == 0)
+			rename(tmp, metricsFile);
+		else
+			unlink(tmp);
+	}
+	free(tmp);
+}
+
+// One exposition per connection, as an HTTP response if it looks like an HTTP request
+static void exportClient(int fd)
+{
+	char req[512];
+	struct pollfd pfd = {fd, POLLIN, 0};
+	ssize_t len = 0;
+	if(poll(&pfd, 1, 100) > 0)
+		len = recv(fd, req, sizeof(req) - 1, MSG_DONTWAIT);
+
+	char* body = NULL;
+	size_t size = 0;
+	FILE* f = open_memstream(&body, &size);
+	if(f)
+	{
+		pthread_mutex_lock(&metricsLock);
+		writeExposition(f);
+		pthread_mutex_unlock(&metricsLock);
+		fclose(f);
+
+		if(len >= 4 && memcmp(req, "GET ", 4) == 0)
+			dprintf(fd, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", size);
+		for(size_t off = 0; off < size;)
+		{
+			ssize_t n = send(fd, body + off, size - off, MSG_NOSIGNAL);
+			if(n <= 0)
+				break;
+			off += n;
+		}
+		free(body);
+	}
+	close(fd);
+}
+
+static void* metricsThread(void* arg)
+{
+	(void)arg;
+	int64_t next = mcp2221_nowNs();
+
+	while(1)
+	{
+		pthread_mutex_lock(&metricsLock);
+		int stop = metricsStopFlag;
+		pthread_mutex_unlock(&metricsLock);
+		if(stop)
+			break;
+
+		if(metricsFile)
+		{
+			if(mcp2221_nowNs() >= next)
+			{
+				exportFile();
+				next += (int64_t)metricsIntervalMs * 1000000;
+			}
+			usleep(METRICS_POLL_MS * 1000);
+			continue;
+		}
+
+		struct pollfd pfd = {metricsFd, POLLIN, 0};
+		if(poll(&pfd, 1, METRICS_POLL_MS) > 0)
+		{
+			int fd = accept(metricsFd, NULL, NULL);
+			if(fd >= 0)
+				exportClient(fd);
+		}
+	}
+
+	// Last state on the way out, so a file doesn't stay stale
+	if(metricsFile)
+		exportFile();
+	return NULL;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_metricsStart(const char* target, int intervalMs)
+{
+	if(!target || !target[0] || intervalMs < 0)
+		return MCP2221_INVALID_ARG;
+
+	pthread_mutex_lock(&metricsLock);
+	if(metricsRunning)
+	{
+		pthread_mutex_unlock(&metricsLock);
+		return MCP2221_ERROR;
+	}
+
+	metricsIntervalMs = intervalMs ? intervalMs : MCP2221_METRICS_INTERVAL;
+	metricsStopFlag = 0;
+	metricsFd = -1;
+	metricsFile = NULL;
+	metricsSocketPath = NULL;
+
+	if(strncmp(target, "unix:", 5) == 0)
+	{
+		struct sockaddr_un addr;
+		memset(&addr, 0x00, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if(strlen(target + 5) >= sizeof(addr.sun_path))
+		{
+			pthread_mutex_unlock(&metricsLock);
+			return MCP2221_INVALID_ARG;
+		}
+		strcpy(addr.sun_path, target + 5);
+
+		// A socket left behind by an earlier run would make bind() fail
+		unlink(addr.sun_path);
+		metricsFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(metricsFd < 0 || bind(metricsFd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(metricsFd, 8) != 0)
+		{
+			if(metricsFd >= 0)
+				close(metricsFd);
+			metricsFd = -1;
+			pthread_mutex_unlock(&metricsLock);
+			return MCP2221_ERROR;
+		}
+		metricsSocketPath = strdup(addr.sun_path);
+	}
+	else
+	{
+		metricsFile = strdup(strncmp(target, "file:", 5) == 0 ? target + 5 : target);
+		if(!metricsFile)
+		{
+			pthread_mutex_unlock(&metricsLock);
+			return MCP2221_ERROR;
+		}
+	}
+
+	if(pthread_create(&metricsThreadId, NULL, metricsThread, NULL) != 0)
+	{
+		if(metricsFd >= 0)
+		{
+			close(metricsFd);
+			unlink(metricsSocketPath);
+		}
+		free(metricsFile);
+		free(metricsSocketPath);
+		metricsFd = -1;
+		metricsFile = NULL;
+		metricsSocketPath = NULL;
+		pthread_mutex_unlock(&metricsLock);
+		return MCP2221_ERROR;
+	}
+
+	metricsRunning = 1;
+	pthread_mutex_unlock(&metricsLock);
+	return MCP2221_SUCCESS;
+}
+
+void LIB_EXPORT mcp2221_metricsStop(void)
+{
+	pthread_mutex_lock(&metricsLock);
+	if(!metricsRunning)
+	{
+		pthread_mutex_unlock(&metricsLock);
+		return;
+	}
+	metricsStopFlag = 1;
+	pthread_mutex_unlock(&metricsLock);
+
+	pthread_join(metricsThreadId, NULL);
+
+	pthread_mutex_lock(&metricsLock);
+	metricsRunning = 0;
+	if(metricsFd >= 0)
+	{
+		close(metricsFd);
+		unlink(metricsSocketPath);
+	}
+	free(metricsFile);
+	free(metricsSocketPath);
+	metricsFd = -1;
+	metricsFile = NULL;
+	metricsSocketPath = NULL;
+	pthread_mutex_unlock(&metricsLock);
+}
+
+// Counter blocks can only go once no open device points at them, the others stay
+// listed and are freed by a later mcp2221_exit() after their device is closed
+void LIB_INTERNAL mcp2221_metricsExit(void)
+{
+	mcp2221_metricsStop();
+
+	pthread_mutex_lock(&metricsLock);
+	struct mcp2221_metrics_t** last = &metricsList;
+	while(*last)
+	{
+		struct mcp2221_metrics_t* m = *last;
+		if(m->open > 0)
+		{
+			last = &m->next;
+			continue;
+		}
+		*last = m->next;
+		free(m);
+	}
+	pthread_mutex_unlock(&metricsLock);
+}
+
+mcp2221_error LIB_INTERNAL mcp2221_metricsInit(void)
+{
+	const char* target = getenv(MCP2221_METRICS_ENV);
+	if(!target || !target[0])
+		return MCP2221_SUCCESS;
+
+	// mcp2221_init() may be called again without mcp2221_exit()
+	pthread_mutex_lock(&metricsLock);
+	int running = metricsRunning;
+	pthread_mutex_unlock(&metricsLock);
+	if(running)
+		return MCP2221_SUCCESS;
+
+	const char* interval = getenv(MCP2221_METRICS_INTERVAL_ENV);
+	return mcp2221_metricsStart(target, interval ? atoi(interval) : 0);
+}
@@ -0,0 +1,341 @@
+/*
+ * Project: MCP2221 HID Library
+ * Author: Zak Kemble, contact@zakkemble.co.uk
+ * Copyright: (C) 2015 by Zak Kemble
+ * License: GNU GPL v3 (see License.txt)
+ * Web: http://blog.zakkemble.co.uk/mcp2221-hid-library/
+ */
+
+// Job pool over interchangeable devices, each device has a deque and idle devices steal from busy ones
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include "libmcp2221.h"
+#include "libmcp2221_private.h"
+
+typedef struct node_t{
+	struct node_t* prev;
+	struct node_t* next;
+	mcp2221_job_t* job;
+}node_t;
+
+typedef struct{
+	mcp2221_pool_t* pool;
+	int index;
+	pthread_t thread;
+
+	pthread_mutex_t lock;	// Protects the deque and stats
+	node_t* head;			// Owner takes from here (oldest first)
+	node_t* tail;			// Thieves take from here
+	int queued;
+	unsigned long jobs;
+	unsigned long stolen;
+	unsigned long failed;
+	int64_t busyNs;
+}worker_t;
+
+struct mcp2221_pool_t{
+	int count;
+	mcp2221_t** devices;
+	worker_t* workers;
+	int64_t createdNs;
+	int nextDevice;				// Round robin for jobs without affinity
+
+	pthread_mutex_t lock;		// Protects everything below
+	pthread_cond_t workCond;	// Signalled when a job is submitted
+	pthread_cond_t doneCond;	// Signalled when outstanding reaches 0
+	unsigned long generation;	// Incremented for every submit, so a sleeping worker doesn't miss one
+	int outstanding;			// Jobs submitted but not finished
+	int stop;
+};
+
+static void pushTail(worker_t* worker, node_t* node)
+{
+	node->next = NULL;
+	node->prev = worker->tail;
+	if(worker->tail)
+		worker->tail->next = node;
+	else
+		worker->head = node;
+	worker->tail = node;
+	worker->queued++;
+}
+
+static void removeNode(worker_t* worker, node_t* node)
+{
+	if(node->prev)
+		node->prev->next = node->next;
+	else
+		worker->head = node->next;
+	if(node->next)
+		node->next->prev = node->prev;
+	else
+		worker->tail = node->prev;
+	worker->queued--;
+}
+
+// Take the oldest job from our own deque
+static node_t* takeOwn(worker_t* worker)
+{
+	pthread_mutex_lock(&worker->lock);
+	node_t* node = worker->head;
+	if(node)
+		removeNode(worker, node);
+	pthread_mutex_unlock(&worker->lock);
+	return node;
+}
+
+// Take the newest job from another device's deque that isn't pinned to it
+static node_t* steal(worker_t* victim)
+{
+	pthread_mutex_lock(&victim->lock);
+	node_t* node = victim->tail;
+	while(node && node->job->pinned)
+		node = node->prev;
+	if(node)
+		removeNode(victim, node);
+	pthread_mutex_unlock(&victim->lock);
+	return node;
+}
+
+static void runJob(worker_t* worker, node_t* node, int stolen)
+{
+	mcp2221_pool_t* pool = worker->pool;
+	mcp2221_job_t* job = node->job;
+	free(node);
+
+	job->device = worker->index;
+	job->startNs = mcp2221_nowNs();
+	job->res = job->func(pool->devices[worker->index], worker->index, job->userData);
+	job->endNs = mcp2221_nowNs();
+
+	pthread_mutex_lock(&worker->lock);
+	worker->jobs++;
+	if(stolen)
+		worker->stolen++;
+	if(job->res != MCP2221_SUCCESS)
+		worker->failed++;
+	worker->busyNs += job->endNs - job->startNs;
+	pthread_mutex_unlock(&worker->lock);
+
+	pthread_mutex_lock(&pool->lock);
+	if(--pool->outstanding == 0)
+		pthread_cond_broadcast(&pool->doneCond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void* workerThread(void* arg)
+{
+	worker_t* worker = arg;
+	mcp2221_pool_t* pool = worker->pool;
+
+	while(1)
+	{
+		pthread_mutex_lock(&pool->lock);
+		unsigned long generation = pool->generation;
+		int stop = pool->stop;
+		pthread_mutex_unlock(&pool->lock);
+
+		node_t* node = takeOwn(worker);
+		if(node)
+		{
+			runJob(worker, node, 0);
+			continue;
+		}
+
+		// Own deque is empty, look around the others starting with our neighbour
+		for(int i=1;i<pool->count && !node;i++)
+			node = steal(&pool->workers[(worker->index + i) % pool->count]);
+		if(node)
+		{
+			runJob(worker, node, 1);
+			continue;
+		}
+
+		if(stop)
+			break;
+
+		// Nothing to do, sleep until something new is submitted
+		pthread_mutex_lock(&pool->lock);
+		while(!pool->stop && pool->generation == generation)
+			pthread_cond_wait(&pool->workCond, &pool->lock);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return NULL;
+}
+
+static void stopWorkers(mcp2221_pool_t* pool, int count)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->workCond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for(int i=0;i<count;i++)
+		pthread_join(pool->workers[i].thread, NULL);
+}
+
+mcp2221_error LIB_EXPORT mcp2221_poolCreate(mcp2221_t** devices, int count, mcp2221_pool_t** pool)
+{
+	if(!devices || count <= 0 || !pool)
+		return MCP2221_INVALID_ARG;
+	for(int i=0;i<count;i++)
+	{
+		if(!devices[i])
+			return MCP2221_INVALID_ARG;
+	}
+
+	mcp2221_pool_t* pl = calloc(1, sizeof(mcp2221_pool_t));
+	if(!pl)
+		return MCP2221_ERROR;
+
+	pl->devices = malloc(count * sizeof(mcp2221_t*));
+	pl->workers = calloc(count, sizeof(worker_t));
+	if(!pl->devices || !pl->workers)
+	{
+		free(pl->devices);
+		free(pl->workers);
+		free(pl);
+		return MCP2221_ERROR;
+	}
+	memcpy(pl->devices, devices, count * sizeof(mcp2221_t*));
+	pl->count = count;
+	pl->createdNs = mcp2221_nowNs();
+
+	pthread_mutex_init(&pl->lock, NULL);
+	pthread_cond_init(&pl->workCond, NULL);
+	pthread_cond_init(&pl->doneCond, NULL);
+
+	for(int i=0;i<count;i++)
+	{
+		pl->workers[i].pool = pl;
+		pl->workers[i].index = i;
+		pthread_mutex_init(&pl->workers[i].lock, NULL);
+	}
+
+	for(int i=0;i<count;i++)
+	{
+		if(pthread_create(&pl->workers[i].thread, NULL, workerThread, &pl->workers[i]) != 0)
+		{
+			stopWorkers(pl, i);
+			pl->count = 0;
+			for(int j=0;j<count;j++)
+				pthread_mutex_destroy(&pl->workers[j].lock);
+			pthread_cond_destroy(&pl->workCond);
+			pthread_cond_destroy(&pl->doneCond);
+			pthread_mutex_destroy(&pl->lock);
+			free(pl->devices);
+			free(pl->workers);
+			free(pl);
+			return MCP2221_ERROR;
+		}
+	}
+
+	*pool = pl;
+	return MCP2221_SUCCESS;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_poolSubmit(mcp2221_pool_t* pool, mcp2221_job_t* job)
+{
+	if(!pool || !job || !job->func || job->affinity >= pool->count)
+		return MCP2221_INVALID_ARG;
+	if(job->pinned && job->affinity < 0)
+		return MCP2221_INVALID_ARG;
+
+	node_t* node = malloc(sizeof(node_t));
+	if(!node)
+		return MCP2221_ERROR;
+	node->job = job;
+
+	job->res = MCP2221_SUCCESS;
+	job->device = -1;
+	job->queuedNs = mcp2221_nowNs();
+	job->startNs = 0;
+	job->endNs = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	if(pool->stop)
+	{
+		pthread_mutex_unlock(&pool->lock);
+		free(node);
+		return MCP2221_ERROR;
+	}
+	int target = job->affinity;
+	if(target < 0)
+	{
+		target = pool->nextDevice;
+		pool->nextDevice = (pool->nextDevice + 1) % pool->count;
+	}
+	pool->outstanding++;
+	pthread_mutex_unlock(&pool->lock);
+
+	worker_t* worker = &pool->workers[target];
+	pthread_mutex_lock(&worker->lock);
+	pushTail(worker, node);
+	pthread_mutex_unlock(&worker->lock);
+
+	// Only bump the generation once the job is visible, a worker that looked before this will then not sleep
+	pthread_mutex_lock(&pool->lock);
+	pool->generation++;
+	pthread_cond_broadcast(&pool->workCond);
+	pthread_mutex_unlock(&pool->lock);
+
+	return MCP2221_SUCCESS;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_poolWait(mcp2221_pool_t* pool)
+{
+	if(!pool)
+		return MCP2221_INVALID_ARG;
+
+	pthread_mutex_lock(&pool->lock);
+	while(pool->outstanding)
+		pthread_cond_wait(&pool->doneCond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	return MCP2221_SUCCESS;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_poolStats(mcp2221_pool_t* pool, int index, mcp2221_pool_stats_t* stats)
+{
+	if(!pool || !stats || index < 0 || index >= pool->count)
+		return MCP2221_INVALID_ARG;
+
+	worker_t* worker = &pool->workers[index];
+	int64_t elapsed = mcp2221_nowNs() - pool->createdNs;
+
+	pthread_mutex_lock(&worker->lock);
+	stats->jobs = worker->jobs;
+	stats->stolen = worker->stolen;
+	stats->failed = worker->failed;
+	stats->queued = worker->queued;
+	stats->busyNs = worker->busyNs;
+	pthread_mutex_unlock(&worker->lock);
+
+	stats->utilisation = (elapsed > 0) ? (double)stats->busyNs / elapsed : 0;
+
+	return MCP2221_SUCCESS;
+}
+
+void LIB_EXPORT mcp2221_poolFree(mcp2221_pool_t* pool)
+{
+	if(!pool)
+		return;
+
+	mcp2221_poolWait(pool);
+	stopWorkers(pool, pool->count);
+
+	for(int i=0;i<pool->count;i++)
+		pthread_mutex_destroy(&pool->workers[i].lock);
+	pthread_cond_destroy(&pool->workCond);
+	pthread_cond_destroy(&pool->doneCond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->devices);
+	free(pool->workers);
+	free(pool);
+}
@@ -0,0 +1,359 @@
+/*
+ * Project: MCP2221 HID Library
+ * Author: Zak Kemble, contact@zakkemble.co.uk
+ * Copyright: (C) 2015 by Zak Kemble
+ * License: GNU GPL v3 (see License.txt)
+ * Web: http://blog.zakkemble.co.uk/mcp2221-hid-library/
+ */
+
+// Software PWM on the GPIO pins, one scheduling thread drives all pins of a device
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include "libmcp2221.h"
+#include "libmcp2221_private.h"
+
+#define PWM_MERGE_NS	(MCP2221_PWM_MERGE_US * 1000LL)
+#define PWM_RETRY_NS	1000000LL	// Wait before resending edges after a transaction failed without the device going away
+
+typedef struct{
+	int enabled;			// Pin is toggling
+	int64_t period;
+	int64_t high;
+	int level;				// Current output level
+	int64_t cycleStart;		// Scheduled time of the current cycle's rising edge
+	int64_t next;			// Scheduled time of the next edge
+
+	int64_t lastRise;		// Measured time of the last rising edge, 0 = none yet
+	unsigned long cycles;
+	unsigned long skipped;
+	int64_t periodSum;
+	int64_t highSum;
+	int64_t periodErrSum;
+	int64_t periodErrMax;
+	int64_t highErrSum;
+	int64_t highErrMax;
+	unsigned long highCount;
+}channel_t;
+
+struct mcp2221_pwm_t{
+	mcp2221_t* device;
+	pthread_t thread;
+	pthread_mutex_t lock;	// Protects everything below
+	pthread_cond_t cond;	// Signalled when the configuration changes
+	int stop;
+	channel_t ch[MCP2221_GPIO_COUNT];
+	unsigned long reports;
+	unsigned long edges;
+};
+
+static int64_t absNs(int64_t val)
+{
+	return (val < 0) ? -val : val;
+}
+
+static void condWaitUntil(struct mcp2221_pwm_t* pwm, int64_t deadline)
+{
+	struct timespec ts;
+	ts.tv_sec = deadline / NS_PER_SEC;
+	ts.tv_nsec = deadline % NS_PER_SEC;
+	pthread_cond_timedwait(&pwm->cond, &pwm->lock, &ts);
+}
+
+// Every edge due within the merge window of earliest goes into the same report
+static int dueMask(struct mcp2221_pwm_t* pwm, int64_t earliest, int* values)
+{
+	int mask = 0;
+	*values = 0;
+	for(int i=0;i<MCP2221_GPIO_COUNT;i++)
+	{
+		channel_t* ch = &pwm->ch[i];
+		if(ch->enabled && ch->next <= earliest + PWM_MERGE_NS)
+		{
+			mask |= (1 << i);
+			if(!ch->level)
+				*values |= (1 << i);
+		}
+	}
+	return mask;
+}
+
+static void* pwmThread(void* arg)
+{
+	struct mcp2221_pwm_t* pwm = arg;
+	NEW_REPORT(report);
+	int64_t lead = 0; // How early to start a transaction, half of the smoothed round trip
+
+	pthread_mutex_lock(&pwm->lock);
+	while(!pwm->stop)
+	{
+		// Find the earliest edge due
+		int64_t earliest = -1;
+		for(int i=0;i<MCP2221_GPIO_COUNT;i++)
+		{
+			if(pwm->ch[i].enabled && (earliest < 0 || pwm->ch[i].next < earliest))
+				earliest = pwm->ch[i].next;
+		}
+
+		if(earliest < 0)
+		{
+			// Nothing is toggling, sleep until the configuration changes
+			pthread_cond_wait(&pwm->cond, &pwm->lock);
+			continue;
+		}
+
+		if(mcp2221_nowNs() < earliest - lead)
+		{
+			// Absolute deadline, but wake up early if the configuration changes so it is re-evaluated
+			condWaitUntil(pwm, earliest - lead);
+			continue;
+		}
+
+		// The device lock comes first (same order as mcp2221_pwmSet()), then the edges are picked again
+		// under both locks, so a pin that has just been set to a constant level doesn't get a stale toggle
+		pthread_mutex_unlock(&pwm->lock);
+		mcp2221_lock(pwm->device);
+		pthread_mutex_lock(&pwm->lock);
+		int values;
+		int mask = dueMask(pwm, earliest, &values);
+		pthread_mutex_unlock(&pwm->lock);
+
+		mcp2221_error res = MCP2221_SUCCESS;
+		int64_t t0 = 0;
+		int64_t t1 = 0;
+		if(mask)
+		{
+			mcp2221_encodeGPIOMask(report, mask, values);
+			mcp2221_cacheGPIOMask(pwm->device, mask, values);
+			t0 = mcp2221_nowNs();
+			res = mcp2221_doTransaction(pwm->device, report);
+			t1 = mcp2221_nowNs();
+		}
+		mcp2221_unlock(pwm->device);
+
+		pthread_mutex_lock(&pwm->lock);
+
+		if(!mask)
+			continue;
+
+		if(res == MCP2221_ERROR_HID)
+		{
+			// Device has gone, nothing sensible left to do
+			for(int i=0;i<MCP2221_GPIO_COUNT;i++)
+				pwm->ch[i].enabled = 0;
+			continue;
+		}
+		if(res != MCP2221_SUCCESS)
+		{
+			// Busy (e.g. an mcp2221_submit() is outstanding) or a one-off timeout, retry the same edges shortly
+			condWaitUntil(pwm, mcp2221_nowNs() + PWM_RETRY_NS);
+			continue;
+		}
+
+		int64_t applied = (t0 + t1) / 2;
+		lead = ((lead * 7) + ((t1 - t0) / 2)) / 8;
+		pwm->reports++;
+
+		for(int i=0;i<MCP2221_GPIO_COUNT;i++)
+		{
+			channel_t* ch = &pwm->ch[i];
+			if(!(mask & (1 << i)) || !ch->enabled)
+				continue;
+
+			pwm->edges++;
+			ch->level = !ch->level;
+
+			if(ch->level)
+			{
+				// Rising edge, start of a new cycle
+				if(ch->lastRise)
+				{
+					int64_t period = applied - ch->lastRise;
+					int64_t err = absNs(period - ch->period);
+					ch->cycles++;
+					ch->periodSum += period;
+					ch->periodErrSum += err;
+					if(err > ch->periodErrMax)
+						ch->periodErrMax = err;
+				}
+				ch->lastRise = applied;
+				ch->cycleStart = ch->next;
+				ch->next = ch->cycleStart + ch->high;
+			}
+			else
+			{
+				ch->next = ch->cycleStart + ch->period;
+
+				// Fell behind by more than a cycle, drop the missed cycles instead of bursting to catch up.
+				// They are counted as skipped, so neither this HIGH time nor the next period measurement spans them.
+				if(ch->next + ch->period < t1)
+				{
+					while(ch->next + ch->period < t1)
+					{
+						ch->next += ch->period;
+						ch->cycleStart += ch->period;
+						ch->skipped++;
+					}
+					ch->lastRise = 0;
+					continue;
+				}
+
+				int64_t high = applied - ch->lastRise;
+				int64_t err = absNs(high - ch->high);
+				ch->highCount++;
+				ch->highSum += high;
+				ch->highErrSum += err;
+				if(err > ch->highErrMax)
+					ch->highErrMax = err;
+			}
+		}
+	}
+	pthread_mutex_unlock(&pwm->lock);
+
+	return NULL;
+}
+
+static struct mcp2221_pwm_t* getPwm(mcp2221_t* device)
+{
+	if(device->priv->pwm)
+		return device->priv->pwm;
+
+	struct mcp2221_pwm_t* pwm = calloc(1, sizeof(struct mcp2221_pwm_t));
+	if(!pwm)
+		return NULL;
+	pwm->device = device;
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&pwm->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&pwm->lock, NULL);
+
+	if(pthread_create(&pwm->thread, NULL, pwmThread, pwm) != 0)
+	{
+		pthread_cond_destroy(&pwm->cond);
+		pthread_mutex_destroy(&pwm->lock);
+		free(pwm);
+		return NULL;
+	}
+
+	device->priv->pwm = pwm;
+	return pwm;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_pwmSet(mcp2221_t* device, int pin, double frequency, double duty)
+{
+	if(!device || !device->priv || pin < 0 || pin >= MCP2221_GPIO_COUNT)
+		return MCP2221_INVALID_ARG;
+	if(duty < 0 || duty > 1 || frequency < 0 || frequency > MCP2221_PWM_MAX_FREQ)
+		return MCP2221_INVALID_ARG;
+
+	int64_t period = (frequency > 0) ? (int64_t)(NS_PER_SEC / frequency) : 0;
+	int64_t high = (int64_t)(period * duty);
+
+	if(period == 0 || high <= 0 || high >= period)
+	{
+		// Constant level, no need for the scheduler. Holding the device lock across both steps means the
+		// scheduler's last toggle of this pin, if any, goes out before the constant level and not after it.
+		mcp2221_lock(device);
+		struct mcp2221_pwm_t* pwm = device->priv->pwm;
+		if(pwm)
+		{
+			pthread_mutex_lock(&pwm->lock);
+			pwm->ch[pin].enabled = 0;
+			pthread_cond_signal(&pwm->cond);
+			pthread_mutex_unlock(&pwm->lock);
+		}
+		int level = (period > 0 && high >= period);
+		mcp2221_error res = mcp2221_setGPIOMask(device, 1 << pin, level ? (1 << pin) : 0);
+		mcp2221_unlock(device);
+		return res;
+	}
+
+	struct mcp2221_pwm_t* pwm = getPwm(device);
+	if(!pwm)
+		return MCP2221_ERROR;
+
+	pthread_mutex_lock(&pwm->lock);
+	channel_t* ch = &pwm->ch[pin];
+	if(!ch->enabled)
+	{
+		// Start a fresh cycle from LOW, the first edge is the rising one
+		memset(ch, 0, sizeof(channel_t));
+		ch->next = mcp2221_nowNs();
+		ch->cycleStart = ch->next;
+	}
+	ch->period = period;
+	ch->high = high;
+	if(ch->enabled)
+		ch->next = ch->cycleStart + (ch->level ? high : period); // Takes effect from the current cycle on
+	ch->enabled = 1;
+	pthread_cond_signal(&pwm->cond);
+	pthread_mutex_unlock(&pwm->lock);
+
+	return MCP2221_SUCCESS;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_pwmStats(mcp2221_t* device, int pin, mcp2221_pwm_stats_t* stats)
+{
+	if(!device || !device->priv || !stats || pin < 0 || pin >= MCP2221_GPIO_COUNT)
+		return MCP2221_INVALID_ARG;
+
+	memset(stats, 0, sizeof(mcp2221_pwm_stats_t));
+
+	struct mcp2221_pwm_t* pwm = device->priv->pwm;
+	if(!pwm)
+		return MCP2221_SUCCESS;
+
+	pthread_mutex_lock(&pwm->lock);
+	channel_t* ch = &pwm->ch[pin];
+	stats->enabled = ch->enabled;
+	stats->cycles = ch->cycles;
+	stats->skipped = ch->skipped;
+	if(ch->cycles)
+	{
+		stats->frequency = (double)NS_PER_SEC * ch->cycles / ch->periodSum;
+		stats->periodErrAvgNs = ch->periodErrSum / ch->cycles;
+		stats->periodErrMaxNs = ch->periodErrMax;
+	}
+	if(ch->highCount)
+	{
+		stats->highErrAvgNs = ch->highErrSum / ch->highCount;
+		stats->highErrMaxNs = ch->highErrMax;
+		if(ch->cycles)
+			stats->duty = ((double)ch->highSum / ch->highCount) / ((double)ch->periodSum / ch->cycles);
+	}
+	stats->reports = pwm->reports;
+	stats->edges = pwm->edges;
+	pthread_mutex_unlock(&pwm->lock);
+
+	return MCP2221_SUCCESS;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_pwmStop(mcp2221_t* device)
+{
+	if(!device || !device->priv)
+		return MCP2221_INVALID_ARG;
+
+	struct mcp2221_pwm_t* pwm = device->priv->pwm;
+	if(!pwm)
+		return MCP2221_SUCCESS;
+
+	pthread_mutex_lock(&pwm->lock);
+	pwm->stop = 1;
+	pthread_cond_signal(&pwm->cond);
+	pthread_mutex_unlock(&pwm->lock);
+	pthread_join(pwm->thread, NULL);
+
+	pthread_cond_destroy(&pwm->cond);
+	pthread_mutex_destroy(&pwm->lock);
+	free(pwm);
+	device->priv->pwm = NULL;
+
+	return MCP2221_SUCCESS;
+}
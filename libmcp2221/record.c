@@ -0,0 +1,497 @@
+/*
+ * Project: MCP2221 HID Library
+ * Author: Zak Kemble, contact@zakkemble.co.uk
+ * Copyright: (C) 2015 by Zak Kemble
+ * License: GNU GPL v3 (see License.txt)
+ * Web: http://blog.zakkemble.co.uk/mcp2221-hid-library/
+ */
+
+// Recording of all reports exchanged with devices (MCP2221_RECORD) and a transport replaying them (MCP2221_REPLAY)
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "hidapi.h"
+#include "libmcp2221.h"
+#include "libmcp2221_private.h"
+
+#define REC_MAX_DEVICES		256		// mcp2221_recrecord_t.device is 8 bits
+#define REC_PATH_LEN		200		// Path and serial have to fit in the 255 byte payload
+#define REC_SERIAL_LEN		(255 - REC_PATH_LEN - 2)
+
+// Recorder, shared by all devices of the process
+static pthread_mutex_t recLock = PTHREAD_MUTEX_INITIALIZER;
+static FILE* recFile;
+static int64_t recStartNs;
+static uint64_t recLastUs;
+static int recDevices;
+
+// A record of a loaded recording
+typedef struct{
+	uint64_t timeUs;
+	uint8_t type;
+	uint8_t device;
+	uint8_t len;
+	int8_t status;
+	const uint8_t* payload;
+}rec_entry_t;
+
+// Loaded recording, kept until mcp2221_exit()
+static pthread_mutex_t replayLock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t* replayData;
+static rec_entry_t* replayEntries;
+static int replayCount;
+static uint8_t replayClaimed[REC_MAX_DEVICES];	// Device number has been opened for replay
+
+// Replay state of an opened device
+typedef struct{
+	const rec_entry_t** entries;	// SEND and GET records of the device
+	int count;
+	int pos;						// Next entry
+	int get;						// GET answering the last SEND, -1 if none
+	int64_t sendNs;					// When the last SEND was replayed
+	uint64_t sendUs;				// Its time in the recording
+}replay_t;
+
+static int reportLen(const uint8_t* report)
+{
+	int len = MCP2221_REPORT_SIZE;
+	while(len && !report[len - 1])
+		len--;
+	return len;
+}
+
+// Caller must hold recLock
+static void recWrite(int64_t timeNs, mcp2221_rectype_t type, int device, const void* payload, int len, mcp2221_error status)
+{
+	if(!recFile)
+		return;
+
+	// Records of different threads may be stamped slightly out of order
+	uint64_t us = (timeNs > recStartNs) ? (uint64_t)(timeNs - recStartNs) / 1000 : 0;
+	if(us < recLastUs)
+		us = recLastUs;
+	uint64_t delta = us - recLastUs;
+	recLastUs = us;
+
+	mcp2221_recrecord_t rec;
+	rec.deltaUs = (delta > UINT32_MAX) ? UINT32_MAX : delta;
+	rec.type = type;
+	rec.device = device;
+	rec.len = len;
+	rec.status = status;
+
+	if(fwrite(&rec, sizeof(rec), 1, recFile) != 1 || (len && fwrite(payload, len, 1, recFile) != 1))
+	{
+		// Disk full or similar, stop recording rather than writing a corrupt file
+		fclose(recFile);
+		recFile = NULL;
+	}
+}
+
+static mcp2221_error recordSend(mcp2221_t* device, const uint8_t* report)
+{
+	int64_t t = mcp2221_nowNs();
+	mcp2221_error res = device->priv->recordInner->send(device, report);
+
+	pthread_mutex_lock(&recLock);
+	recWrite(t, MCP2221_REC_SEND, device->priv->recordId, report, reportLen(report), res);
+	pthread_mutex_unlock(&recLock);
+	return res;
+}
+
+static mcp2221_error recordGet(mcp2221_t* device, uint8_t* report)
+{
+	mcp2221_error res = device->priv->recordInner->get(device, report);
+	int64_t t = mcp2221_nowNs();
+
+	pthread_mutex_lock(&recLock);
+	recWrite(t, MCP2221_REC_GET, device->priv->recordId, report, (res == MCP2221_SUCCESS) ? reportLen(report) : 0, res);
+	pthread_mutex_unlock(&recLock);
+	return res;
+}
+
+static void recordClose(mcp2221_t* device)
+{
+	device->priv->recordInner->close(device);
+
+	pthread_mutex_lock(&recLock);
+	recWrite(mcp2221_nowNs(), MCP2221_REC_CLOSE, device->priv->recordId, NULL, 0, MCP2221_SUCCESS);
+	if(recFile)
+		fflush(recFile);
+	pthread_mutex_unlock(&recLock);
+}
+
+static void recordDelay(mcp2221_t* device, int us)
+{
+	if(device->priv->recordInner->delay)
+		device->priv->recordInner->delay(device, us);
+	else
+		usleep(us);
+}
+
+static int recordAlive(mcp2221_t* device)
+{
+	return device->priv->recordInner->alive ? device->priv->recordInner->alive(device) : 1;
+}
+
+static int recordAsyncFd(mcp2221_t* device, int arm)
+{
+	return device->priv->recordInner->asyncFd ? device->priv->recordInner->asyncFd(device, arm) : -1;
+}
+
+static const mcp2221_transport_t recordTransport = {recordSend, recordGet, recordClose, recordDelay, recordAlive, recordAsyncFd};
+
+mcp2221_error LIB_INTERNAL mcp2221_recordWrap(mcp2221_t* device, const wchar_t* serial)
+{
+	const char* path = getenv(MCP2221_RECORD_ENV);
+	if(!path || !path[0])
+		return MCP2221_SUCCESS;
+
+	pthread_mutex_lock(&recLock);
+
+	if(!recFile && !recDevices)
+	{
+		recFile = fopen(path, "wb");
+		if(!recFile)
+		{
+			pthread_mutex_unlock(&recLock);
+			return MCP2221_ERROR;
+		}
+
+		mcp2221_recheader_t hdr;
+		memset(&hdr, 0x00, sizeof(hdr));
+		memcpy(hdr.magic, MCP2221_REC_MAGIC, sizeof(hdr.magic));
+		hdr.version = MCP2221_REC_VERSION;
+		hdr.headerSize = sizeof(hdr);
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		hdr.realtimeStartNs = ((int64_t)ts.tv_sec * NS_PER_SEC) + ts.tv_nsec;
+		hdr.monotonicStartNs = recStartNs = mcp2221_nowNs();
+		recLastUs = 0;
+		fwrite(&hdr, sizeof(hdr), 1, recFile);
+	}
+
+	// Out of device numbers or the file could not be written, carry on without recording
+	if(!recFile || recDevices >= REC_MAX_DEVICES)
+	{
+		pthread_mutex_unlock(&recLock);
+		return MCP2221_SUCCESS;
+	}
+
+	// Path and serial, both null terminated
+	char payload[255];
+	int len = snprintf(payload, REC_PATH_LEN, "%s", device->path);
+	if(len >= REC_PATH_LEN)
+		len = REC_PATH_LEN - 1;
+	len++;
+	int i;
+	for(i=0;serial && serial[i] && i<REC_SERIAL_LEN;i++)
+		payload[len + i] = (serial[i] < 0x80) ? serial[i] : '?';
+	payload[len + i] = '\0';
+	len += i + 1;
+
+	device->priv->recordId = recDevices++;
+	device->priv->recordInner = device->priv->transport;
+	device->priv->transport = &recordTransport;
+	recWrite(mcp2221_nowNs(), MCP2221_REC_OPEN, device->priv->recordId, payload, len, MCP2221_SUCCESS);
+
+	pthread_mutex_unlock(&recLock);
+	return MCP2221_SUCCESS;
+}
+
+LIB_INTERNAL const char* mcp2221_replayPath(void)
+{
+	const char* path = getenv(MCP2221_REPLAY_ENV);
+	return (path && path[0]) ? path : NULL;
+}
+
+// Read and index the whole recording, caller must hold replayLock
+static mcp2221_error replayLoad(void)
+{
+	if(replayData)
+		return MCP2221_SUCCESS;
+
+	FILE* f = fopen(mcp2221_replayPath(), "rb");
+	if(!f)
+		return MCP2221_ERROR;
+
+	long size = -1;
+	if(fseek(f, 0, SEEK_END) == 0)
+		size = ftell(f);
+	rewind(f);
+	if(size < (long)sizeof(mcp2221_recheader_t) || !(replayData = malloc(size)) || fread(replayData, size, 1, f) != 1)
+	{
+		free(replayData);
+		replayData = NULL;
+		fclose(f);
+		return MCP2221_ERROR;
+	}
+	fclose(f);
+
+	const mcp2221_recheader_t* hdr = (const mcp2221_recheader_t*)replayData;
+	if(memcmp(hdr->magic, MCP2221_REC_MAGIC, sizeof(hdr->magic)) != 0 || hdr->version != MCP2221_REC_VERSION ||
+		hdr->headerSize < sizeof(mcp2221_recheader_t) || hdr->headerSize > (uint32_t)size)
+	{
+		free(replayData);
+		replayData = NULL;
+		return MCP2221_ERROR;
+	}
+
+	// Records are at least 8 bytes, that's the most there can be
+	size_t maxEntries = ((size - hdr->headerSize) / sizeof(mcp2221_recrecord_t)) + 1;
+	replayEntries = malloc(maxEntries * sizeof(rec_entry_t));
+	if(!replayEntries)
+	{
+		free(replayData);
+		replayData = NULL;
+		return MCP2221_ERROR;
+	}
+
+	// A truncated last record (recording process killed) is dropped
+	uint64_t timeUs = 0;
+	size_t offset = hdr->headerSize;
+	replayCount = 0;
+	while(offset + sizeof(mcp2221_recrecord_t) <= (size_t)size)
+	{
+		mcp2221_recrecord_t rec;
+		memcpy(&rec, replayData + offset, sizeof(rec));
+		offset += sizeof(rec);
+		if(offset + rec.len > (size_t)size)
+			break;
+
+		timeUs += rec.deltaUs;
+		rec_entry_t* e = &replayEntries[replayCount++];
+		e->timeUs = timeUs;
+		e->type = rec.type;
+		e->device = rec.device;
+		e->len = rec.len;
+		e->status = rec.status;
+		e->payload = replayData + offset;
+		offset += rec.len;
+	}
+
+	memset(replayClaimed, 0x00, sizeof(replayClaimed));
+	return MCP2221_SUCCESS;
+}
+
+// OPEN payload is path then serial, make sure both are terminated
+static const char* openPath(const rec_entry_t* e)
+{
+	return (e->len && memchr(e->payload, '\0', e->len)) ? (const char*)e->payload : NULL;
+}
+
+static const char* openSerial(const rec_entry_t* e)
+{
+	const char* path = openPath(e);
+	if(!path)
+		return NULL;
+	size_t off = strlen(path) + 1;
+	return (off < e->len && memchr(e->payload + off, '\0', e->len - off)) ? path + off : NULL;
+}
+
+LIB_INTERNAL struct hid_device_info* mcp2221_replayEnumerate(unsigned short vid, unsigned short pid)
+{
+	if((vid && vid != MCP2221_DEFAULT_VID) || (pid && pid != MCP2221_DEFAULT_PID))
+		return NULL;
+
+	struct hid_device_info* first = NULL;
+	struct hid_device_info** next = &first;
+
+	pthread_mutex_lock(&replayLock);
+	if(replayLoad() != MCP2221_SUCCESS)
+	{
+		pthread_mutex_unlock(&replayLock);
+		return NULL;
+	}
+
+	for(int i=0;i<replayCount;i++)
+	{
+		const rec_entry_t* e = &replayEntries[i];
+		const char* path = openPath(e);
+		if(e->type != MCP2221_REC_OPEN || !path)
+			continue;
+
+		// A device opened more than once is listed once
+		int dup = 0;
+		for(struct hid_device_info* d = first; d && !dup; d = d->next)
+			dup = (strcmp(d->path, path) == 0);
+		if(dup)
+			continue;
+
+		struct hid_device_info* dev = calloc(1, sizeof(struct hid_device_info));
+		if(!dev)
+			break;
+		dev->path = strdup(path);
+		dev->vendor_id = MCP2221_DEFAULT_VID;
+		dev->product_id = MCP2221_DEFAULT_PID;
+		dev->interface_number = 2;
+		dev->manufacturer_string = wcsdup(MCP2221_DEFAULT_MANUFACTURER);
+		dev->product_string = wcsdup(MCP2221_DEFAULT_PRODUCT);
+
+		const char* serial = openSerial(e);
+		if(serial && serial[0])
+		{
+			size_t len = strlen(serial);
+			dev->serial_number = calloc(len + 1, sizeof(wchar_t));
+			for(size_t c=0;dev->serial_number && c<len;c++)
+				dev->serial_number[c] = (unsigned char)serial[c];
+		}
+
+		*next = dev;
+		next = &dev->next;
+	}
+
+	pthread_mutex_unlock(&replayLock);
+	return first;
+}
+
+void LIB_INTERNAL mcp2221_replayFreeEnumeration(struct hid_device_info* devs)
+{
+	while(devs)
+	{
+		struct hid_device_info* next = devs->next;
+		free(devs->path);
+		free(devs->manufacturer_string);
+		free(devs->product_string);
+		free(devs->serial_number);
+		free(devs);
+		devs = next;
+	}
+}
+
+static mcp2221_error replaySend(mcp2221_t* device, const uint8_t* report)
+{
+	replay_t* rp = device->handle;
+
+	// Next recorded request, or the next one with the same command if the application has taken another path
+	int idx = -1;
+	for(int i=rp->pos;i<rp->count;i++)
+	{
+		const rec_entry_t* e = rp->entries[i];
+		if(e->type != MCP2221_REC_SEND)
+			continue;
+		if(e->len && e->payload[0] == report[0])
+		{
+			idx = i;
+			break;
+		}
+	}
+	if(idx < 0)
+		return MCP2221_ERROR_HID;
+
+	rp->sendNs = mcp2221_nowNs();
+	rp->sendUs = rp->entries[idx]->timeUs;
+	rp->pos = idx + 1;
+	rp->get = (rp->pos < rp->count && rp->entries[rp->pos]->type == MCP2221_REC_GET) ? rp->pos : -1;
+	return rp->entries[idx]->status;
+}
+
+// The response arrives as long after the request as it did when recorded
+static mcp2221_error replayGet(mcp2221_t* device, uint8_t* report)
+{
+	replay_t* rp = device->handle;
+	if(rp->get < 0)
+		return MCP2221_ERROR_HID;
+
+	const rec_entry_t* e = rp->entries[rp->get];
+	mcp2221_sleepUntilNs(rp->sendNs + ((int64_t)(e->timeUs - rp->sendUs) * 1000));
+
+	memset(report, 0x00, MCP2221_REPORT_SIZE);
+	memcpy(report, e->payload, (e->len > MCP2221_REPORT_SIZE) ? MCP2221_REPORT_SIZE : e->len);
+	rp->pos = rp->get + 1;
+	rp->get = -1;
+	return e->status;
+}
+
+static void replayClose(mcp2221_t* device)
+{
+	replay_t* rp = device->handle;
+	if(rp)
+		free(rp->entries);
+	free(rp);
+}
+
+static const mcp2221_transport_t replayTransport = {replaySend, replayGet, replayClose, NULL, NULL, NULL};
+
+mcp2221_error LIB_INTERNAL mcp2221_replayOpen(mcp2221_t* device, const char* path)
+{
+	pthread_mutex_lock(&replayLock);
+	if(replayLoad() != MCP2221_SUCCESS)
+	{
+		pthread_mutex_unlock(&replayLock);
+		return MCP2221_ERROR_HID;
+	}
+
+	// Each open of the path takes the next recorded session of it
+	int start = -1;
+	for(int i=0;i<replayCount;i++)
+	{
+		const rec_entry_t* e = &replayEntries[i];
+		const char* recPath = openPath(e);
+		if(e->type == MCP2221_REC_OPEN && recPath && !replayClaimed[e->device] && strcmp(recPath, path) == 0)
+		{
+			start = i;
+			break;
+		}
+	}
+	if(start < 0)
+	{
+		pthread_mutex_unlock(&replayLock);
+		return MCP2221_ERROR_HID;
+	}
+
+	replay_t* rp = calloc(1, sizeof(replay_t));
+	if(rp)
+		rp->entries = malloc((replayCount - start) * sizeof(rec_entry_t*));
+	if(!rp || !rp->entries)
+	{
+		free(rp);
+		pthread_mutex_unlock(&replayLock);
+		return MCP2221_ERROR;
+	}
+
+	int id = replayEntries[start].device;
+	replayClaimed[id] = 1;
+	for(int i=start+1;i<replayCount;i++)
+	{
+		const rec_entry_t* e = &replayEntries[i];
+		if(e->device != id)
+			continue;
+		if(e->type == MCP2221_REC_CLOSE || e->type == MCP2221_REC_OPEN)
+			break;
+		if(e->type == MCP2221_REC_SEND || e->type == MCP2221_REC_GET)
+			rp->entries[rp->count++] = e;
+	}
+	rp->get = -1;
+
+	pthread_mutex_unlock(&replayLock);
+
+	device->handle = rp;
+	device->priv->transport = &replayTransport;
+	return MCP2221_SUCCESS;
+}
+
+void LIB_INTERNAL mcp2221_recordExit(void)
+{
+	pthread_mutex_lock(&recLock);
+	if(recFile)
+		fclose(recFile);
+	recFile = NULL;
+	recDevices = 0;
+	pthread_mutex_unlock(&recLock);
+
+	pthread_mutex_lock(&replayLock);
+	free(replayEntries);
+	free(replayData);
+	replayEntries = NULL;
+	replayData = NULL;
+	replayCount = 0;
+	pthread_mutex_unlock(&replayLock);
+}
@@ -0,0 +1,247 @@
+/*
+ * Project: MCP2221 HID Library
+ * Author: Zak Kemble, contact@zakkemble.co.uk
+ * Copyright: (C) 2015 by Zak Kemble
+ * License: GNU GPL v3 (see License.txt)
+ * Web: http://blog.zakkemble.co.uk/mcp2221-hid-library/
+ */
+
+// Real-time loop, a per-device I/O thread that runs a callback on absolute deadlines and measures its jitter
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "libmcp2221.h"
+#include "libmcp2221_private.h"
+
+#define RT_STACK_SIZE		(256 * 1024)
+#define RT_PREFAULT_SIZE	(64 * 1024)		// Part of the stack touched before the loop starts, so it never page faults
+
+struct mcp2221_rt_t{
+	mcp2221_t* device;
+	pthread_t thread;
+	mcp2221_rt_conf_t conf;
+	mcp2221_rt_callback_t callback;
+	void* userData;
+	int stop;				// Atomic, checked once per cycle
+	pthread_mutex_t statLock;	// Priority inheriting, the I/O thread never waits behind a reader for long
+	mcp2221_rt_stats_t stats;
+	int64_t wakeSum;
+	int64_t jitterSum;
+	unsigned long jitterCount;
+	int64_t runSum;
+};
+
+static __thread mcp2221_t* ioThreadDevice;	// Device whose I/O thread this is, NULL on any other thread
+
+mcp2221_rt_conf_t LIB_EXPORT mcp2221_rtConfInit(void)
+{
+	mcp2221_rt_conf_t conf;
+	conf.periodUs	= 1000;
+	conf.priority	= 80;
+	conf.cpu		= -1;
+	conf.lockMemory	= 1;
+	return conf;
+}
+
+static __attribute__((noinline)) void prefaultStack(void)
+{
+	volatile uint8_t buff[RT_PREFAULT_SIZE];
+	memset((uint8_t*)buff, 0x00, sizeof(buff));
+}
+
+static int64_t absNs(int64_t val)
+{
+	return (val < 0) ? -val : val;
+}
+
+static void* rtThread(void* arg)
+{
+	struct mcp2221_rt_t* rt = arg;
+	int64_t period = (int64_t)rt->conf.periodUs * 1000;
+
+	ioThreadDevice = rt->device;
+	prefaultStack();
+
+	int64_t next = mcp2221_nowNs() + period;
+	int64_t lastWake = 0;
+
+	while(!__atomic_load_n(&rt->stop, __ATOMIC_RELAXED))
+	{
+		mcp2221_sleepUntilNs(next);
+		int64_t wake = mcp2221_nowNs();
+		int result = rt->callback(rt->device, rt->userData);
+		int64_t end = mcp2221_nowNs();
+
+		pthread_mutex_lock(&rt->statLock);
+		mcp2221_rt_stats_t* stats = &rt->stats;
+		stats->cycles++;
+
+		int64_t late = wake - next;
+		rt->wakeSum += late;
+		if(late > stats->wakeMaxNs)
+			stats->wakeMaxNs = late;
+		int bucket = 0;
+		for(int64_t us = late / 1000; us > 0 && bucket < MCP2221_RT_HIST_BUCKETS - 1; us >>= 1)
+			bucket++;
+		stats->wakeHist[bucket]++;
+
+		if(lastWake)
+		{
+			int64_t jitter = absNs((wake - lastWake) - period);
+			rt->jitterSum += jitter;
+			rt->jitterCount++;
+			if(jitter > stats->jitterMaxNs)
+				stats->jitterMaxNs = jitter;
+		}
+		lastWake = wake;
+
+		int64_t run = end - wake;
+		rt->runSum += run;
+		if(run > stats->runMaxNs)
+			stats->runMaxNs = run;
+
+		// Ran past the next deadline, drop the missed ones instead of bursting to catch up
+		next += period;
+		if(end > next)
+		{
+			stats->overruns++;
+			while(next < end)
+			{
+				next += period;
+				stats->skipped++;
+			}
+			lastWake = 0;
+		}
+
+		if(result)
+		{
+			stats->result = result;
+			stats->running = 0;
+			pthread_mutex_unlock(&rt->statLock);
+			break;
+		}
+		pthread_mutex_unlock(&rt->statLock);
+	}
+
+	return NULL;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_rtStart(mcp2221_t* device, const mcp2221_rt_conf_t* conf, mcp2221_rt_callback_t callback, void* userData)
+{
+	if(!device || !device->priv || !callback)
+		return MCP2221_INVALID_ARG;
+
+	mcp2221_rt_conf_t c = conf ? *conf : mcp2221_rtConfInit();
+	if(c.periodUs <= 0 || c.priority < 0 || c.priority > sched_get_priority_max(SCHED_FIFO) || c.cpu >= CPU_SETSIZE)
+		return MCP2221_INVALID_ARG;
+	if(device->priv->rt)
+		return MCP2221_ERROR; // Already running
+
+	// Everything the loop touches is resident from here on, including what other threads allocate later
+	if(c.lockMemory && mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+		return MCP2221_ERROR;
+
+	struct mcp2221_rt_t* rt = calloc(1, sizeof(struct mcp2221_rt_t));
+	if(!rt)
+		return MCP2221_ERROR;
+
+	rt->device = device;
+	rt->conf = c;
+	rt->callback = callback;
+	rt->userData = userData;
+	rt->stats.running = 1;
+
+	pthread_mutexattr_t mattr;
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_setprotocol(&mattr, PTHREAD_PRIO_INHERIT);
+	pthread_mutex_init(&rt->statLock, &mattr);
+	pthread_mutexattr_destroy(&mattr);
+
+	// Scheduling and affinity are set before the thread runs, so it never runs at the wrong priority or CPU.
+	// Fails with EPERM without CAP_SYS_NICE or an RLIMIT_RTPRIO high enough.
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, RT_STACK_SIZE);
+	if(c.priority > 0)
+	{
+		struct sched_param param;
+		memset(&param, 0x00, sizeof(param));
+		param.sched_priority = c.priority;
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &param);
+	}
+	if(c.cpu >= 0)
+	{
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(c.cpu, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+	}
+
+	int res = pthread_create(&rt->thread, &attr, rtThread, rt);
+	pthread_attr_destroy(&attr);
+
+	if(res != 0)
+	{
+		pthread_mutex_destroy(&rt->statLock);
+		free(rt);
+		return MCP2221_ERROR;
+	}
+
+	device->priv->rt = rt;
+	return MCP2221_SUCCESS;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_rtStop(mcp2221_t* device)
+{
+	if(!device || !device->priv)
+		return MCP2221_INVALID_ARG;
+
+	struct mcp2221_rt_t* rt = device->priv->rt;
+	if(!rt)
+		return MCP2221_SUCCESS;
+
+	__atomic_store_n(&rt->stop, 1, __ATOMIC_RELAXED);
+	pthread_join(rt->thread, NULL);
+
+	pthread_mutex_destroy(&rt->statLock);
+	free(rt);
+	device->priv->rt = NULL;
+
+	return MCP2221_SUCCESS;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_rtStats(mcp2221_t* device, mcp2221_rt_stats_t* stats)
+{
+	if(!device || !device->priv || !stats)
+		return MCP2221_INVALID_ARG;
+
+	struct mcp2221_rt_t* rt = device->priv->rt;
+	if(!rt)
+		return MCP2221_ERROR;
+
+	pthread_mutex_lock(&rt->statLock);
+	*stats = rt->stats;
+	if(stats->cycles)
+	{
+		stats->wakeAvgNs = rt->wakeSum / stats->cycles;
+		stats->runAvgNs = rt->runSum / stats->cycles;
+	}
+	if(rt->jitterCount)
+		stats->jitterAvgNs = rt->jitterSum / rt->jitterCount;
+	pthread_mutex_unlock(&rt->statLock);
+
+	return MCP2221_SUCCESS;
+}
+
+int LIB_INTERNAL mcp2221_rtIsIoThread(mcp2221_t* device)
+{
+	return ioThreadDevice == device;
+}
@@ -0,0 +1,112 @@
+/*
+ * Project: MCP2221 HID Library
+ * Author: Zak Kemble, contact@zakkemble.co.uk
+ * Copyright: (C) 2015 by Zak Kemble
+ * License: GNU GPL v3 (see License.txt)
+ * Web: http://blog.zakkemble.co.uk/mcp2221-hid-library/
+ */
+
+// Wire protocol between the client transport (client.c) and the local server (utils/mcp2221d.c), not installed
+//
+// Every message is a srv_header_t followed by len bytes of payload, in host byte order (the socket is local).
+// A connection is used either for one LIST or for one device: OPEN, then any number of REPORTs.
+// REPORT requests may be pipelined, responses come back in the same order. RESET has no response.
+// After OPEN the client may hand over a shared memory region with SHM, from then on reports go through
+// its two single producer/single consumer rings and the socket is only used to notice the other side going away.
+// A client may have at most SRV_RING_SLOTS unread responses, the server hangs up on it if one more is due.
+
+#ifndef SERVER_PROTO_H_
+#define SERVER_PROTO_H_
+
+#include <stdint.h>
+#include <wchar.h>
+#include "libmcp2221.h"
+
+#define SRV_PATH_LEN	256
+#define SRV_RING_SLOTS	16
+#define SRV_SHM_MAGIC	0x4D435032
+
+typedef enum
+{
+	SRV_MSG_LIST	= 1,	// Request: srv_list_t, response: srv_devinfo_t for each device
+	SRV_MSG_OPEN	= 2,	// Request: device path (SRV_PATH_LEN bytes), response: no payload
+	SRV_MSG_REPORT	= 3,	// Request: report (MCP2221_REPORT_SIZE bytes), response: the device's response report
+	SRV_MSG_SHM		= 4		// Request: no payload, memfd + request eventfd + response eventfd as SCM_RIGHTS, response: no payload
+}srv_msg_t;
+
+typedef struct{
+	uint8_t type;		// srv_msg_t
+	uint8_t reserved[3];
+	int32_t status;		// mcp2221_error of the request, responses only
+	uint32_t len;		// Payload length
+}srv_header_t;
+
+typedef struct{
+	uint16_t vid;		// 0 matches all
+	uint16_t pid;		// 0 matches all
+}srv_list_t;
+
+typedef struct{
+	char path[SRV_PATH_LEN];
+	uint16_t vid;
+	uint16_t pid;
+	int32_t interface;
+	wchar_t manufacturer[MCP2221_STR_LEN];
+	wchar_t product[MCP2221_STR_LEN];
+	wchar_t serial[MCP2221_STR_LEN];
+}srv_devinfo_t;
+
+typedef struct{
+	int32_t status;		// mcp2221_error, responses only
+	uint8_t report[MCP2221_REPORT_SIZE];
+}srv_slot_t;
+
+// head and tail are free running, each on its own cache line so producer and consumer don't fight over it
+typedef struct{
+	uint32_t head;		// Next slot to write, only changed by the producer
+	uint8_t pad1[60];
+	uint32_t tail;		// Next slot to read, only changed by the consumer
+	uint8_t pad2[60];
+	srv_slot_t slots[SRV_RING_SLOTS];
+}srv_ring_t;
+
+// Layout of the memfd region
+typedef struct{
+	uint32_t magic;		// SRV_SHM_MAGIC
+	uint32_t slots;		// SRV_RING_SLOTS
+	uint8_t pad[56];
+	srv_ring_t req;		// Client to server, the client signals the request eventfd after pushing
+	srv_ring_t resp;	// Server to client, the server signals the response eventfd after pushing
+}srv_shm_t;
+
+// Slot to fill in, NULL if the ring is full
+static inline srv_slot_t* srv_ringWriteSlot(srv_ring_t* ring)
+{
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if(ring->head - tail >= SRV_RING_SLOTS)
+		return NULL;
+	return &ring->slots[ring->head % SRV_RING_SLOTS];
+}
+
+// Publish the slot from srv_ringWriteSlot()
+static inline void srv_ringPush(srv_ring_t* ring)
+{
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+// Oldest slot, NULL if the ring is empty
+static inline srv_slot_t* srv_ringReadSlot(srv_ring_t* ring)
+{
+	uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	if(head == ring->tail)
+		return NULL;
+	return &ring->slots[ring->tail % SRV_RING_SLOTS];
+}
+
+// Release the slot from srv_ringReadSlot()
+static inline void srv_ringPop(srv_ring_t* ring)
+{
+	__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* SERVER_PROTO_H_ */
@@ -0,0 +1,572 @@
+/*
+ * Project: MCP2221 HID Library
+ * Author: Zak Kemble, contact@zakkemble.co.uk
+ * Copyright: (C) 2015 by Zak Kemble
+ * License: GNU GPL v3 (see License.txt)
+ * Web: http://blog.zakkemble.co.uk/mcp2221-hid-library/
+ */
+
+// Simulated MCP2221 in the same process, for benchmarks and tests without hardware
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "hidapi.h"
+#include "libmcp2221.h"
+#include "libmcp2221_private.h"
+
+#define SIM_SERIAL_FMT	L"SIM%04d"
+
+// I2C engine states as reported in STATUS/SET byte 8
+#define SIM_I2C_IDLE		MCP2221_I2C_IDLE
+#define SIM_I2C_NOSTOP		MCP2221_I2C_UNKNOWN2
+#define SIM_I2C_DATAREADY	MCP2221_I2C_DATAREADY
+#define SIM_I2C_WRITING		0x41	// Any value other than idle, the library only waits for idle or data ready
+#define SIM_I2C_READING		MCP2221_I2C_UNKNOWN4
+
+#define SIM_I2C_CLOCK		12	// MHz, SCL = 12MHz / (divider + 3)
+#define SIM_I2C_DEFAULT_DIV	117	// 100kHz
+
+typedef enum{
+	SIM_TIMING_NONE,	// Every command completes instantly
+	SIM_TIMING_VIRTUAL,	// Modelled time only advances the device's virtual clock, nothing sleeps
+	SIM_TIMING_REAL		// Modelled time is also slept, for realistic wall clock latency
+}sim_timing_mode_t;
+
+// Timing model, from MCP2221_SIM_TIMING
+typedef struct{
+	sim_timing_mode_t mode;
+	int frameUs;		// Interrupt endpoint polling interval, 1000 at full speed
+	int procUs;			// Firmware time to handle a command
+	int adcUs;			// Converting the 3 ADC channels for STATUS/SET
+	int i2cBits;		// Bits per I2C transfer besides the 9 per byte (address and data): start, stop
+}sim_timing_t;
+
+typedef struct{
+	uint8_t response[REPORT_SIZE];
+	int pending;				// A response is waiting for get()
+	unsigned long reports;		// Requests handled since open
+	int eventFd;				// Signalled when a response is ready for mcp2221_complete(), -1 until first asked for
+	int armed;					// Signal eventFd on the next request
+
+	// Virtual clock, microseconds since open
+	sim_timing_t timing;
+	uint64_t now;
+	uint64_t respAt;			// When the pending response is polled by the host
+	int64_t realBase;			// mcp2221_nowNs() at open, SIM_TIMING_REAL only
+
+	// SRAM
+	uint8_t clock;				// Clock output duty | divider
+	uint8_t dacRef;
+	uint8_t dacValue;
+	uint8_t adcRef;
+	int intFlag;
+	uint8_t gpio[MCP2221_GPIO_COUNT];	// Same layout as gpioCache
+
+	// I2C, every address answers with the same 256 byte register file (24C02 style, first written byte is the pointer)
+	int i2cState;				// State once the transfer on the bus has finished
+	int i2cBusyState;			// State until then
+	uint64_t i2cDoneAt;
+	int i2cDiv;
+	uint8_t regs[256];
+	uint8_t regPtr;
+	uint8_t readBuff[60];
+	int readLen;
+}sim_t;
+
+// Power-up state: all pins GPIO inputs, DAC and ADC on VDD, I2C idle at 100kHz
+// The clock and timing model are kept
+static void simDefaults(sim_t* sim)
+{
+	sim_timing_t timing = sim->timing;
+	uint64_t now = sim->now;
+	int64_t realBase = sim->realBase;
+	unsigned long reports = sim->reports;
+	int eventFd = sim->eventFd;
+	int armed = sim->armed;
+
+	memset(sim, 0x00, sizeof(sim_t));
+	for(int i=0;i<MCP2221_GPIO_COUNT;i++)
+		sim->gpio[i] = 8;
+	sim->i2cDiv = SIM_I2C_DEFAULT_DIV;
+
+	sim->timing = timing;
+	sim->now = now;
+	sim->realBase = realBase;
+	sim->reports = reports;
+	sim->eventFd = eventFd;
+	sim->armed = armed;
+}
+
+// Parse "mode[,key=value...]", mode is none, virtual or real. Keys: frame, proc, adc (microseconds) and i2c (bits)
+static void simTimingParse(sim_timing_t* timing, const char* str)
+{
+	timing->mode = SIM_TIMING_NONE;
+	timing->frameUs = 1000;
+	timing->procUs = 50;
+	timing->adcUs = 90;
+	timing->i2cBits = 2;
+
+	if(!str || !str[0])
+		return;
+
+	char* copy = strdup(str);
+	if(!copy)
+		return;
+
+	char* save;
+	char* tok = strtok_r(copy, ",", &save);
+	if(tok && strcmp(tok, "virtual") == 0)
+		timing->mode = SIM_TIMING_VIRTUAL;
+	else if(tok && strcmp(tok, "real") == 0)
+		timing->mode = SIM_TIMING_REAL;
+
+	while((tok = strtok_r(NULL, ",", &save)))
+	{
+		char* value = strchr(tok, '=');
+		if(!value)
+			continue;
+		*value++ = 0;
+		int v = atoi(value);
+		if(v < 0)
+			continue;
+		if(strcmp(tok, "frame") == 0 && v > 0)
+			timing->frameUs = v;
+		else if(strcmp(tok, "proc") == 0)
+			timing->procUs = v;
+		else if(strcmp(tok, "adc") == 0)
+			timing->adcUs = v;
+		else if(strcmp(tok, "i2c") == 0)
+			timing->i2cBits = v;
+	}
+
+	free(copy);
+}
+
+// First frame boundary at or after t
+static uint64_t simFrameAt(const sim_t* sim, uint64_t t)
+{
+	uint64_t frame = sim->timing.frameUs;
+	return ((t + frame - 1) / frame) * frame;
+}
+
+static void simAdvance(sim_t* sim, uint64_t t)
+{
+	if(t <= sim->now)
+		return;
+	sim->now = t;
+	if(sim->timing.mode == SIM_TIMING_REAL)
+		mcp2221_sleepUntilNs(sim->realBase + ((int64_t)t * 1000));
+}
+
+// Time on the bus for len bytes plus the address byte
+static uint64_t simI2cBusUs(const sim_t* sim, int len)
+{
+	uint64_t bits = ((len + 1) * 9) + sim->timing.i2cBits;
+	return (bits * (sim->i2cDiv + 3)) / SIM_I2C_CLOCK;
+}
+
+static int simI2cStateAt(const sim_t* sim, uint64_t t)
+{
+	return (t < sim->i2cDoneAt) ? sim->i2cBusyState : sim->i2cState;
+}
+
+// t is when the command is handled, the transfer then takes the modelled bus time
+static void simI2cWrite(sim_t* sim, const uint8_t* report, uint64_t t)
+{
+	int len = report[1] | (report[2]<<8);
+	if(len > 60)
+		len = 60;
+	if(len > 0)
+	{
+		sim->regPtr = report[4];
+		for(int i=1;i<len;i++)
+			sim->regs[sim->regPtr++] = report[4 + i];
+	}
+	sim->i2cState = (report[0] == USB_CMD_I2CWRITE_NOSTOP) ? SIM_I2C_NOSTOP : SIM_I2C_IDLE;
+	sim->i2cBusyState = SIM_I2C_WRITING;
+	sim->i2cDoneAt = (sim->timing.mode != SIM_TIMING_NONE) ? t + simI2cBusUs(sim, len) : 0;
+}
+
+static void simI2cRead(sim_t* sim, const uint8_t* report, uint64_t t)
+{
+	int len = report[1] | (report[2]<<8);
+	if(len > 60)
+		len = 60;
+	for(int i=0;i<len;i++)
+		sim->readBuff[i] = sim->regs[sim->regPtr++];
+	sim->readLen = len;
+	sim->i2cState = SIM_I2C_DATAREADY;
+	sim->i2cBusyState = SIM_I2C_READING;
+	sim->i2cDoneAt = (sim->timing.mode != SIM_TIMING_NONE) ? t + simI2cBusUs(sim, len) : 0;
+}
+
+static void simStatus(sim_t* sim, const uint8_t* report, uint8_t* resp, uint64_t t)
+{
+	// Cancel
+	if(report[2] == 0x10)
+	{
+		sim->i2cState = SIM_I2C_IDLE;
+		sim->i2cDoneAt = 0;
+		resp[2] = 0x10;
+	}
+
+	// Set I2C speed, only accepted while the bus is idle
+	if(report[3] == 0x20 && simI2cStateAt(sim, t) == SIM_I2C_IDLE)
+	{
+		sim->i2cDiv = report[4];
+		resp[3] = 0x20;
+	}
+
+	resp[8] = simI2cStateAt(sim, t);
+	resp[14] = sim->i2cDiv;
+	resp[22] = 1; // SCL and SDA pulled up
+	resp[23] = 1;
+	resp[24] = sim->intFlag;
+	resp[46] = 'A';
+	resp[47] = '6';
+	resp[48] = '1';
+	resp[49] = '2';
+
+	// ADC inputs follow the DAC output so loopback tests see something sensible
+	for(int i=0;i<MCP2221_ADC_COUNT;i++)
+	{
+		int value = (sim->dacValue * 1023) / MCP2221_DAC_MAX;
+		resp[50 + (i * 2)] = value;
+		resp[51 + (i * 2)] = value>>8;
+	}
+}
+
+static void simSetSram(sim_t* sim, const uint8_t* report)
+{
+	if(report[2] & 0x80)
+		sim->clock = report[2] & 0x1F;
+	if(report[3] & 0x80)
+		sim->dacRef = report[3] & 0x07;
+	if(report[4] & 0x80)
+		sim->dacValue = report[4] & 0x1F;
+	if(report[5] & 0x80)
+		sim->adcRef = report[5] & 0x07;
+	if((report[6] & 0x81) == 0x81)
+		sim->intFlag = 0;
+	if(report[7] & 0x80)
+		memcpy(sim->gpio, &report[8], MCP2221_GPIO_COUNT);
+}
+
+static void simGetSram(sim_t* sim, uint8_t* resp)
+{
+	resp[5] = sim->clock;
+	resp[6] = (sim->dacRef<<5) | sim->dacValue;
+	resp[7] = sim->adcRef<<2;
+	resp[8] = MCP2221_DEFAULT_VID & 0xFF;
+	resp[9] = MCP2221_DEFAULT_VID>>8;
+	resp[10] = MCP2221_DEFAULT_PID & 0xFF;
+	resp[11] = MCP2221_DEFAULT_PID>>8;
+	resp[12] = MCP2221_PWRSRC_BUSPOWERED;
+	resp[13] = 100 / 2;
+	memcpy(&resp[22], sim->gpio, MCP2221_GPIO_COUNT);
+}
+
+static void simSetGpio(sim_t* sim, const uint8_t* report)
+{
+	for(int i=0;i<MCP2221_GPIO_COUNT;i++)
+	{
+		int idx = (i * 4) + 2;
+		if(report[idx])
+			sim->gpio[i] = (sim->gpio[i] & ~16) | (report[idx + 1] ? 16 : 0);
+		if(report[idx + 2])
+			sim->gpio[i] = (sim->gpio[i] & ~8) | (report[idx + 3] ? 8 : 0);
+	}
+}
+
+static void simGetGpio(sim_t* sim, uint8_t* resp)
+{
+	for(int i=0;i<MCP2221_GPIO_COUNT;i++)
+	{
+		if((sim->gpio[i] & 0x07) == MCP2221_GPIO_MODE_GPIO)
+		{
+			resp[(i * 2) + 2] = (sim->gpio[i] & 16) ? 1 : 0;
+			resp[(i * 2) + 3] = (sim->gpio[i] & 8) ? MCP2221_GPIO_DIR_INPUT : MCP2221_GPIO_DIR_OUTPUT;
+		}
+		else
+		{
+			resp[(i * 2) + 2] = MCP2221_GPIO_VALUE_INVALID;
+			resp[(i * 2) + 3] = MCP2221_GPIO_DIR_INVALID;
+		}
+	}
+}
+
+// Descriptors and settings in flash are not simulated, strings read back empty
+static void simReadFlash(const uint8_t* report, uint8_t* resp)
+{
+	switch(report[1])
+	{
+		case 0x02: // Manufacturer
+		case 0x03: // Product
+		case 0x04: // Serial
+			resp[2] = 2;
+			resp[3] = 0x03;
+			break;
+		default:
+			resp[2] = 0;
+			break;
+	}
+}
+
+static mcp2221_error simSend(mcp2221_t* device, const uint8_t* report)
+{
+	sim_t* sim = device->handle;
+	uint8_t* resp = sim->response;
+	uint64_t t = 0;
+
+	// The OUT report goes in the next frame and the firmware needs procUs to handle it
+	if(sim->timing.mode != SIM_TIMING_NONE)
+	{
+		if(sim->timing.mode == SIM_TIMING_REAL)
+			simAdvance(sim, (mcp2221_nowNs() - sim->realBase) / 1000);
+		simAdvance(sim, simFrameAt(sim, sim->now));
+		t = sim->now + sim->timing.procUs;
+		if(report[0] == USB_CMD_STATUSSET)
+			t += sim->timing.adcUs;
+	}
+
+	memset(resp, 0x00, REPORT_SIZE);
+	resp[0] = report[0];
+	sim->pending = 1;
+	sim->reports++;
+
+	switch(report[0])
+	{
+		case USB_CMD_STATUSSET:
+			simStatus(sim, report, resp, t);
+			break;
+		case USB_CMD_SETSRAM:
+			simSetSram(sim, report);
+			break;
+		case USB_CMD_GETSRAM:
+			simGetSram(sim, resp);
+			break;
+		case USB_CMD_SETGPIO:
+			simSetGpio(sim, report);
+			break;
+		case USB_CMD_GETGPIO:
+			simGetGpio(sim, resp);
+			break;
+		case USB_CMD_READFLASH:
+			simReadFlash(report, resp);
+			break;
+		case USB_CMD_WRITEFLASH:
+		case USB_CMD_FLASHPASS:
+			break;
+		case USB_CMD_I2CWRITE:
+		case USB_CMD_I2CWRITE_REPEATSTART:
+		case USB_CMD_I2CWRITE_NOSTOP:
+			if(t < sim->i2cDoneAt)
+			{
+				resp[1] = 0x01; // Engine busy
+				break;
+			}
+			simI2cWrite(sim, report, t);
+			break;
+		case USB_CMD_I2CREAD:
+		case USB_CMD_I2CREAD_REPEATSTART:
+			if(t < sim->i2cDoneAt)
+			{
+				resp[1] = 0x01;
+				break;
+			}
+			simI2cRead(sim, report, t);
+			break;
+		case USB_CMD_I2CREAD_GET:
+			if(simI2cStateAt(sim, t) != SIM_I2C_DATAREADY)
+			{
+				resp[1] = 0x41; // Error reading from the I2C engine
+				break;
+			}
+			resp[3] = sim->readLen;
+			memcpy(&resp[4], sim->readBuff, sim->readLen);
+			sim->i2cState = SIM_I2C_IDLE;
+			break;
+		case USB_CMD_RESET:
+			// No response, the chip re-enumerates with power-up settings
+			simDefaults(sim);
+			break;
+		default:
+			resp[1] = 0x01; // Unsupported command
+			break;
+	}
+
+	// The IN endpoint is polled once per frame, the response can go at the earliest in the frame after the request
+	if(sim->timing.mode != SIM_TIMING_NONE)
+	{
+		sim->respAt = simFrameAt(sim, t);
+		if(sim->respAt < sim->now + sim->timing.frameUs)
+			sim->respAt = sim->now + sim->timing.frameUs;
+	}
+
+	// Ready at once, get() still advances the clock to respAt
+	if(sim->armed)
+	{
+		uint64_t one = 1;
+		if(write(sim->eventFd, &one, sizeof(one)) != sizeof(one))
+			return MCP2221_ERROR_HID;
+		sim->armed = 0;
+	}
+
+	return MCP2221_SUCCESS;
+}
+
+static mcp2221_error simGet(mcp2221_t* device, uint8_t* report)
+{
+	sim_t* sim = device->handle;
+	if(!sim->pending)
+		return MCP2221_ERROR_HID;
+	if(sim->timing.mode != SIM_TIMING_NONE)
+		simAdvance(sim, sim->respAt);
+	memcpy(report, sim->response, REPORT_SIZE);
+	sim->pending = 0;
+	return MCP2221_SUCCESS;
+}
+
+static void simClose(mcp2221_t* device)
+{
+	sim_t* sim = device->handle;
+	if(sim->eventFd >= 0)
+		close(sim->eventFd);
+	free(sim);
+}
+
+static int simAsyncFd(mcp2221_t* device, int arm)
+{
+	sim_t* sim = device->handle;
+	if(sim->eventFd < 0)
+		sim->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(arm && sim->eventFd >= 0)
+	{
+		uint64_t count;
+		if(read(sim->eventFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			return -1;
+		sim->armed = 1;
+	}
+	return sim->eventFd;
+}
+
+static void simDelay(mcp2221_t* device, int us)
+{
+	sim_t* sim = device->handle;
+
+	if(sim->timing.mode != SIM_TIMING_VIRTUAL)
+	{
+		usleep(us);
+		return;
+	}
+
+	pthread_mutex_lock(&device->priv->lock);
+	simAdvance(sim, sim->now + us);
+	pthread_mutex_unlock(&device->priv->lock);
+}
+
+static const mcp2221_transport_t simTransport = {simSend, simGet, simClose, simDelay, NULL, simAsyncFd};
+
+int LIB_INTERNAL mcp2221_simCount(void)
+{
+	const char* count = getenv(MCP2221_SIM_ENV);
+	if(!count || !count[0])
+		return 0;
+	return atoi(count);
+}
+
+int LIB_INTERNAL mcp2221_simIsPath(const char* path)
+{
+	return strncmp(path, MCP2221_SIM_PREFIX, strlen(MCP2221_SIM_PREFIX)) == 0;
+}
+
+LIB_INTERNAL struct hid_device_info* mcp2221_simEnumerate(unsigned short vid, unsigned short pid)
+{
+	if((vid && vid != MCP2221_DEFAULT_VID) || (pid && pid != MCP2221_DEFAULT_PID))
+		return NULL;
+
+	struct hid_device_info* first = NULL;
+	struct hid_device_info** next = &first;
+	int count = mcp2221_simCount();
+
+	for(int i=0;i<count;i++)
+	{
+		char path[32];
+		wchar_t serial[MCP2221_STR_LEN];
+		snprintf(path, sizeof(path), MCP2221_SIM_PREFIX "%d", i);
+		swprintf(serial, MCP2221_STR_LEN, SIM_SERIAL_FMT, i);
+
+		struct hid_device_info* dev = calloc(1, sizeof(struct hid_device_info));
+		if(!dev)
+			break;
+		dev->path = strdup(path);
+		dev->vendor_id = MCP2221_DEFAULT_VID;
+		dev->product_id = MCP2221_DEFAULT_PID;
+		dev->interface_number = 2;
+		dev->manufacturer_string = wcsdup(MCP2221_DEFAULT_MANUFACTURER);
+		dev->product_string = wcsdup(MCP2221_DEFAULT_PRODUCT);
+		dev->serial_number = wcsdup(serial);
+
+		*next = dev;
+		next = &dev->next;
+	}
+
+	return first;
+}
+
+void LIB_INTERNAL mcp2221_simFreeEnumeration(struct hid_device_info* devs)
+{
+	while(devs)
+	{
+		struct hid_device_info* next = devs->next;
+		free(devs->path);
+		free(devs->manufacturer_string);
+		free(devs->product_string);
+		free(devs->serial_number);
+		free(devs);
+		devs = next;
+	}
+}
+
+mcp2221_error LIB_INTERNAL mcp2221_simOpen(mcp2221_t* device, const char* path)
+{
+	(void)path;
+
+	sim_t* sim = calloc(1, sizeof(sim_t));
+	if(!sim)
+		return MCP2221_ERROR;
+
+	simTimingParse(&sim->timing, getenv(MCP2221_SIM_TIMING_ENV));
+	if(sim->timing.mode == SIM_TIMING_REAL)
+		sim->realBase = mcp2221_nowNs();
+	simDefaults(sim);
+	sim->eventFd = -1;
+	device->handle = sim;
+	device->priv->transport = &simTransport;
+	return MCP2221_SUCCESS;
+}
+
+mcp2221_error LIB_EXPORT mcp2221_simClock(mcp2221_t* device, uint64_t* us, unsigned long* reports)
+{
+	if(!device || !device->priv || !us)
+		return MCP2221_INVALID_ARG;
+	// The recorder may sit on top of the simulated transport
+	const mcp2221_transport_t* transport = device->priv->recordInner ? device->priv->recordInner : device->priv->transport;
+	if(transport != &simTransport)
+		return MCP2221_INVALID_ARG;
+
+	pthread_mutex_lock(&device->priv->lock);
+	sim_t* sim = device->handle;
+	*us = sim->now;
+	if(reports)
+		*reports = sim->reports;
+	pthread_mutex_unlock(&device->priv->lock);
+	return MCP2221_SUCCESS;
+}
@@ -0,0 +1,168 @@
+/* -*-C-*- */
+/* SPDX-License-Identifier:    GPL-3.0 */
+/*
+ * Convert a GPIO capture file written by mcp2221_captureStart() to VCD
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "libmcp2221/libmcp2221.h"
+
+#define IDX_HELP 0
+
+static const char *const short_options = "h";
+
+static const struct option long_options[] = {
+        [IDX_HELP] = {"help",        no_argument, 0, 0},
+        // end of list
+        {0, 0, 0, 0}
+};
+
+static void print_help()
+{
+    puts("cap2vcd: convert MCP2221 GPIO capture to value change dump");
+    puts("usage: cap2vcd [options] <capture file> [<vcd file>]");
+    puts("    -h|--help                 print this help\n");
+    puts("    writes to stdout if no vcd file is given\n");
+}
+
+static int read_header(FILE *in, mcp2221_capheader_t *hdr)
+{
+    if (fread(hdr, sizeof(*hdr), 1, in) != 1)
+        return -1;
+
+    if (memcmp(hdr->magic, MCP2221_CAP_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != MCP2221_CAP_VERSION ||
+        hdr->recordSize != sizeof(mcp2221_caprecord_t) ||
+        hdr->headerSize < sizeof(*hdr))
+        return -1;
+
+    return fseek(in, hdr->headerSize, SEEK_SET);
+}
+
+static void write_vcd_header(FILE *out, const mcp2221_capheader_t *hdr)
+{
+    const time_t start = hdr->realtimeStartNs / 1000000000LL;
+    char date[64];
+
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&start));
+
+    fprintf(out, "$date %s $end\n", date);
+    fprintf(out, "$version libmcp2221 GPIO capture v%" PRIu32 " $end\n", hdr->version);
+    fprintf(out, "$timescale 1us $end\n");
+    fprintf(out, "$scope module mcp2221 $end\n");
+    for (int i = 0; i < MCP2221_GPIO_COUNT; i++) {
+        if (hdr->pins & (1 << i))
+            fprintf(out, "$var wire 1 %c GP%d $end\n", '!' + i, i);
+    }
+    fprintf(out, "$upscope $end\n");
+    fprintf(out, "$enddefinitions $end\n");
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    int option_index = 0;
+
+    while ((opt = getopt_long(argc, argv, short_options,
+            long_options, &option_index)) != -1) {
+
+        switch (opt) {
+        case 0:
+            if (option_index == IDX_HELP) {
+                print_help();
+                return 0;
+            }
+            break;
+        case 'h':
+        default:
+            print_help();
+            return 0;
+        }
+    }
+
+    if (optind >= argc) {
+        print_help();
+        return -1;
+    }
+
+    FILE *in = fopen(argv[optind], "rb");
+    if (!in) {
+        fprintf(stderr, "Error: cannot open %s: %s\n", argv[optind], strerror(errno));
+        return -1;
+    }
+
+    mcp2221_capheader_t hdr;
+    if (read_header(in, &hdr) != 0) {
+        fprintf(stderr, "Error: %s is not a MCP2221 capture file!\n", argv[optind]);
+        fclose(in);
+        return -1;
+    }
+
+    FILE *out = stdout;
+    if (optind + 1 < argc) {
+        out = fopen(argv[optind + 1], "w");
+        if (!out) {
+            fprintf(stderr, "Error: cannot open %s: %s\n", argv[optind + 1], strerror(errno));
+            fclose(in);
+            return -1;
+        }
+    }
+
+    write_vcd_header(out, &hdr);
+
+    uint64_t t = 0;
+    int last = -1;
+    mcp2221_caprecord_t rec;
+
+    for (uint64_t n = 0; n < hdr.records && fread(&rec, sizeof(rec), 1, in) == 1; n++) {
+
+        t += rec.deltaUs;
+
+        if ((int)rec.states == last)
+            continue; // keep-alive record
+
+        fprintf(out, "#%" PRIu64 "\n", last < 0 ? 0 : t);
+        if (last < 0)
+            fprintf(out, "$dumpvars\n");
+
+        for (int i = 0; i < MCP2221_GPIO_COUNT; i++) {
+            const int bit = 1 << i;
+            if ((hdr.pins & bit) && (last < 0 || ((rec.states ^ last) & bit)))
+                fprintf(out, "%d%c\n", !!(rec.states & bit), '!' + i);
+        }
+
+        if (last < 0)
+            fprintf(out, "$end\n");
+
+        last = rec.states;
+    }
+
+    if (hdr.flags & MCP2221_CAPFLAG_COMPLETE)
+        fprintf(out, "#%" PRIu64 "\n", (uint64_t)hdr.durationNs / 1000);
+
+    if (out != stdout)
+        fclose(out);
+    fclose(in);
+
+    return 0;
+}
+
+/* *INDENT-OFF* */
+/******************************************************************************
+ * Local Variables:
+ * mode: C
+ * c-indent-level: 4
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ * kate: space-indent on; indent-width 4; mixedindent off; indent-mode cstyle;
+ * vim: set expandtab filetype=c:
+ * vi: set et tabstop=4 shiftwidth=4: */
@@ -0,0 +1,475 @@
+/* -*-C-*- */
+/* SPDX-License-Identifier:    GPL-3.0 */
+/*
+ * Benchmarks for the MCP2221 library: enumeration and open time, round
+ * trip latency per command and I2C throughput by transfer size and speed
+ *
+ * Uses the first real device if there is one and a simulated device
+ * (MCP2221_SIM) otherwise. Results are printed as one JSON document so
+ * runs of different library versions can be compared.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+
+#include "libmcp2221/libmcp2221.h"
+
+#ifndef MCP2221_VERSION
+#define MCP2221_VERSION         "unknown"
+#endif
+
+#define DEFAULT_TRANSACTIONS    1000
+#define DEFAULT_I2C             100
+#define DEFAULT_ENUMERATION     20
+#define SIM_I2C_ADDRESS         0x50
+#define I2C_CLOCK               12000000
+
+#define IDX_HELP 0
+#define IDX_SUITE 1
+#define IDX_ITERATIONS 2
+#define IDX_OUTPUT 3
+#define IDX_SIM 4
+#define IDX_WRITES 5
+#define IDX_I2C_ADDR 6
+
+static const char *const short_options = "hs:n:o:";
+
+static const struct option long_options[] = {
+        [IDX_HELP]       = {"help",         no_argument,       0, 0},
+        [IDX_SUITE]      = {"suite",        required_argument, 0, 0},
+        [IDX_ITERATIONS] = {"iterations",   required_argument, 0, 0},
+        [IDX_OUTPUT]     = {"output",       required_argument, 0, 0},
+        [IDX_SIM]        = {"sim",          no_argument,       0, 0},
+        [IDX_WRITES]     = {"allow-writes", no_argument,       0, 0},
+        [IDX_I2C_ADDR]   = {"i2c-addr",     required_argument, 0, 0},
+        // end of list
+        {0, 0, 0, 0}
+};
+
+static const unsigned int i2c_sizes[] = {1, 8, 16, 32, 60};
+static const unsigned int i2c_speeds[] = {100000, 400000};
+
+static FILE *out;
+static int iterations;          // 0 = per suite default
+static int results;             // results printed so far, for the commas
+static int virtual_clock;       // simulated device with a timing model, measure its clock instead of ours
+static int allow_writes;
+static int i2c_addr = -1;
+
+typedef struct {
+    int64_t min;
+    int64_t max;
+    int64_t avg;
+    int64_t p50;
+    int64_t p99;
+    int64_t total;
+    int count;
+    int errors;
+} stats_t;
+
+static void print_help()
+{
+    puts("mcp2221bench: measure MCP2221 library performance");
+    puts("usage: mcp2221bench [options]");
+    puts("    -h|--help                 print this help");
+    puts("    -s|--suite <name>         enumeration, transactions, i2c or all (default all)");
+    puts("    -n|--iterations <n>       iterations per measurement (default depends on the suite)");
+    puts("    -o|--output <file>        write the JSON results to a file instead of stdout");
+    puts("    --sim                     use a simulated device even if hardware is present");
+    puts("    --allow-writes            also measure GPIO and DAC writes on real hardware");
+    puts("    --i2c-addr <addr>         I2C slave with a 24C02 style register file for the i2c suite");
+    puts("                              on real hardware (the suite is skipped otherwise)\n");
+}
+
+static int64_t now_ns(mcp2221_t *dev)
+{
+    struct timespec ts;
+    uint64_t us;
+
+    if (dev && virtual_clock && mcp2221_simClock(dev, &us, NULL) == MCP2221_SUCCESS)
+        return us * 1000;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t)ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+    const int64_t x = *(const int64_t *)a;
+    const int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Sorts the samples */
+static void summarise(int64_t *samples, int count, int errors, stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->count = count;
+    stats->errors = errors;
+    if (!count)
+        return;
+
+    qsort(samples, count, sizeof(int64_t), compare_ns);
+    for (int i = 0; i < count; i++)
+        stats->total += samples[i];
+    stats->min = samples[0];
+    stats->max = samples[count - 1];
+    stats->avg = stats->total / count;
+    stats->p50 = samples[count / 2];
+    stats->p99 = samples[((count * 99) / 100 < count) ? (count * 99) / 100 : count - 1];
+}
+
+static void begin_result(const char *suite, const char *name)
+{
+    fprintf(out, "%s\n    {\"suite\": \"%s\", \"name\": \"%s\"", results++ ? "," : "", suite, name);
+}
+
+static void print_stats(const stats_t *stats)
+{
+    fprintf(out, ", \"iterations\": %d, \"errors\": %d"
+            ", \"min_us\": %.3f, \"avg_us\": %.3f, \"p50_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f"
+            ", \"per_sec\": %.1f",
+            stats->count, stats->errors,
+            stats->min / 1e3, stats->avg / 1e3, stats->p50 / 1e3, stats->p99 / 1e3, stats->max / 1e3,
+            stats->total ? (stats->count * 1e9) / stats->total : 0.0);
+}
+
+typedef mcp2221_error (*op_t)(mcp2221_t *dev, int i, void *arg);
+
+/* Time count calls of op, returns -1 if the samples could not be allocated */
+static int measure(mcp2221_t *dev, int count, op_t op, void *arg, stats_t *stats)
+{
+    int64_t *samples = malloc(count * sizeof(int64_t));
+    int n = 0;
+    int errors = 0;
+
+    if (!samples)
+        return -1;
+
+    for (int i = 0; i < count; i++) {
+        const int64_t start = now_ns(dev);
+        const mcp2221_error res = op(dev, i, arg);
+        const int64_t end = now_ns(dev);
+        if (res != MCP2221_SUCCESS) {
+            errors++;
+            continue;
+        }
+        samples[n++] = end - start;
+    }
+
+    summarise(samples, n, errors, stats);
+    free(samples);
+    return 0;
+}
+
+static int count_for(int fallback)
+{
+    return iterations ? iterations : fallback;
+}
+
+/* enumeration: mcp2221_find() and open + close */
+
+static mcp2221_error op_find(mcp2221_t *dev, int i, void *arg)
+{
+    (void)dev;
+    (void)i;
+    (void)arg;
+    return mcp2221_find(MCP2221_DEFAULT_VID, MCP2221_DEFAULT_PID, NULL, NULL, NULL) > 0 ? MCP2221_SUCCESS : MCP2221_ERROR;
+}
+
+static mcp2221_error op_open_close(mcp2221_t *dev, int i, void *arg)
+{
+    (void)dev;
+    (void)i;
+    mcp2221_t *opened = mcp2221_open_byIndex(*(int *)arg);
+    if (!opened)
+        return MCP2221_ERROR_HID;
+    mcp2221_close(opened);
+    return MCP2221_SUCCESS;
+}
+
+static void suite_enumeration(int index)
+{
+    stats_t stats;
+    const int count = count_for(DEFAULT_ENUMERATION);
+
+    if (measure(NULL, count, op_find, NULL, &stats) == 0) {
+        begin_result("enumeration", "find");
+        print_stats(&stats);
+        fprintf(out, "}");
+    }
+
+    if (measure(NULL, count, op_open_close, &index, &stats) == 0) {
+        begin_result("enumeration", "open_close");
+        print_stats(&stats);
+        fprintf(out, "}");
+    }
+}
+
+/* transactions: one library call = one report round trip */
+
+static mcp2221_error op_status(mcp2221_t *dev, int i, void *arg)
+{
+    mcp2221_i2c_state_t state;
+    (void)i;
+    (void)arg;
+    return mcp2221_i2cState(dev, &state);
+}
+
+static mcp2221_error op_gpio_read(mcp2221_t *dev, int i, void *arg)
+{
+    mcp2221_gpio_value_t values[MCP2221_GPIO_COUNT];
+    (void)i;
+    (void)arg;
+    return mcp2221_readGPIO(dev, values);
+}
+
+static mcp2221_error op_sram_read(mcp2221_t *dev, int i, void *arg)
+{
+    mcp2221_dac_ref_t ref;
+    int value;
+    (void)i;
+    (void)arg;
+    return mcp2221_getDAC(dev, &ref, &value);
+}
+
+static mcp2221_error op_gpio_write(mcp2221_t *dev, int i, void *arg)
+{
+    (void)arg;
+    return mcp2221_setGPIO(dev, MCP2221_GPIO0, (i & 1) ? MCP2221_GPIO_VALUE_HIGH : MCP2221_GPIO_VALUE_LOW);
+}
+
+static mcp2221_error op_dac_write(mcp2221_t *dev, int i, void *arg)
+{
+    (void)arg;
+    return mcp2221_setDAC(dev, MCP2221_DAC_REF_VDD, i % (MCP2221_DAC_MAX + 1));
+}
+
+static void suite_transactions(mcp2221_t *dev, int writes)
+{
+    static const struct {
+        const char *name;
+        op_t op;
+        int write;
+    } ops[] = {
+        {"status",     op_status,     0},
+        {"gpio_read",  op_gpio_read,  0},
+        {"sram_read",  op_sram_read,  0},
+        {"gpio_write", op_gpio_write, 1},
+        {"dac_write",  op_dac_write,  1},
+    };
+    const int count = count_for(DEFAULT_TRANSACTIONS);
+    stats_t stats;
+
+    if (writes) {
+        // GPIO0 has to be an output for the write measurement
+        mcp2221_gpioconfset_t conf = mcp2221_GPIOConfInit();
+        conf.conf[0].gpios = MCP2221_GPIO0;
+        conf.conf[0].mode = MCP2221_GPIO_MODE_GPIO;
+        conf.conf[0].direction = MCP2221_GPIO_DIR_OUTPUT;
+        conf.conf[0].value = MCP2221_GPIO_VALUE_LOW;
+        if (mcp2221_setGPIOConf(dev, &conf) != MCP2221_SUCCESS)
+            writes = 0;
+    }
+
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (ops[i].write && !writes)
+            continue;
+        if (measure(dev, count, ops[i].op, NULL, &stats) != 0)
+            continue;
+        begin_result("transactions", ops[i].name);
+        print_stats(&stats);
+        fprintf(out, "}");
+    }
+}
+
+/* i2c: complete transfers through mcp2221_i2cWriteRead(), which includes its state polling */
+
+typedef struct {
+    int address;
+    unsigned int len;
+    uint8_t data[60];
+} i2c_arg_t;
+
+static mcp2221_error op_i2c_write(mcp2221_t *dev, int i, void *arg)
+{
+    i2c_arg_t *a = arg;
+    (void)i;
+    return mcp2221_i2cWriteRead(dev, a->address, a->data, a->len, NULL, 0);
+}
+
+static mcp2221_error op_i2c_read(mcp2221_t *dev, int i, void *arg)
+{
+    i2c_arg_t *a = arg;
+    (void)i;
+    return mcp2221_i2cWriteRead(dev, a->address, NULL, 0, a->data, a->len);
+}
+
+static void suite_i2c(mcp2221_t *dev, int address)
+{
+    const int count = count_for(DEFAULT_I2C);
+    i2c_arg_t arg;
+    stats_t stats;
+
+    arg.address = address;
+    for (size_t i = 0; i < sizeof(arg.data); i++)
+        arg.data[i] = i;
+    arg.data[0] = 0; // register pointer
+
+    for (size_t s = 0; s < sizeof(i2c_speeds) / sizeof(i2c_speeds[0]); s++) {
+        const int div = (I2C_CLOCK / i2c_speeds[s]) - 3;
+        // the speed can only be changed once the last transfer is done
+        mcp2221_i2c_state_t state = MCP2221_I2C_IDLE;
+        for (int tries = 0; tries < 100; tries++) {
+            if (mcp2221_i2cState(dev, &state) != MCP2221_SUCCESS || state == MCP2221_I2C_IDLE)
+                break;
+        }
+        if (mcp2221_i2cDivider(dev, div) != MCP2221_SUCCESS)
+            fprintf(stderr, "Warning: cannot set I2C divider %d\n", div);
+
+        for (size_t z = 0; z < sizeof(i2c_sizes) / sizeof(i2c_sizes[0]); z++) {
+            arg.len = i2c_sizes[z];
+
+            for (int read = 0; read < 2; read++) {
+                if (measure(dev, count, read ? op_i2c_read : op_i2c_write, &arg, &stats) != 0)
+                    continue;
+                begin_result("i2c", read ? "read" : "write");
+                fprintf(out, ", \"bytes\": %u, \"speed_hz\": %u, \"divider\": %d", arg.len, i2c_speeds[s], div);
+                print_stats(&stats);
+                fprintf(out, ", \"bytes_per_sec\": %.1f}", stats.total ? (stats.count * (double)arg.len * 1e9) / stats.total : 0.0);
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    int option_index = 0;
+    int sim = 0;
+    const char *suite = "all";
+    const char *output = NULL;
+
+    while ((opt = getopt_long(argc, argv, short_options,
+            long_options, &option_index)) != -1) {
+
+        switch (opt) {
+        case 0:
+            switch (option_index) {
+            case IDX_SUITE: suite = optarg; break;
+            case IDX_ITERATIONS: iterations = atoi(optarg); break;
+            case IDX_OUTPUT: output = optarg; break;
+            case IDX_SIM: sim = 1; break;
+            case IDX_WRITES: allow_writes = 1; break;
+            case IDX_I2C_ADDR: i2c_addr = strtol(optarg, NULL, 0); break;
+            case IDX_HELP:
+            default:
+                print_help();
+                return 0;
+            }
+            break;
+        case 's': suite = optarg; break;
+        case 'n': iterations = atoi(optarg); break;
+        case 'o': output = optarg; break;
+        case 'h':
+        default:
+            print_help();
+            return 0;
+        }
+    }
+
+    const int all = (strcmp(suite, "all") == 0);
+    if (!all && strcmp(suite, "enumeration") != 0 && strcmp(suite, "transactions") != 0 && strcmp(suite, "i2c") != 0) {
+        fprintf(stderr, "Error: unknown suite %s!\n", suite);
+        return 1;
+    }
+    if (iterations < 0) {
+        fprintf(stderr, "Error: invalid iteration count!\n");
+        return 1;
+    }
+
+    if (sim)
+        setenv(MCP2221_SIM_ENV, "1", 1);
+
+    if (mcp2221_init() != MCP2221_SUCCESS) {
+        fprintf(stderr, "Error: cannot initialize HIDAPI!\n");
+        return 1;
+    }
+
+    // no hardware, fall back to a simulated device
+    if (mcp2221_find(MCP2221_DEFAULT_VID, MCP2221_DEFAULT_PID, NULL, NULL, NULL) <= 0) {
+        setenv(MCP2221_SIM_ENV, "1", 1);
+        sim = 1;
+        mcp2221_find(MCP2221_DEFAULT_VID, MCP2221_DEFAULT_PID, NULL, NULL, NULL);
+    }
+
+    mcp2221_t *dev = mcp2221_open_byIndex(0);
+    if (!dev) {
+        fprintf(stderr, "Error: cannot open device!\n");
+        mcp2221_exit();
+        return 1;
+    }
+
+    // opening already ran some transactions, the clock only moves with MCP2221_SIM_TIMING
+    uint64_t clock_us;
+    virtual_clock = (sim && mcp2221_simClock(dev, &clock_us, NULL) == MCP2221_SUCCESS && clock_us > 0);
+
+    out = stdout;
+    if (output && !(out = fopen(output, "w"))) {
+        fprintf(stderr, "Error: cannot open %s: %s\n", output, strerror(errno));
+        mcp2221_close(dev);
+        mcp2221_exit();
+        return 1;
+    }
+
+    fprintf(out, "{\n  \"version\": \"%s\",\n  \"target\": \"%s\",\n  \"clock\": \"%s\",\n  \"path\": \"%s\",\n"
+            "  \"firmware\": \"%c.%c\",\n  \"hardware\": \"%c.%c\",\n  \"results\": [",
+            MCP2221_VERSION, sim ? "simulated" : "hardware", virtual_clock ? "virtual" : "wall", dev->path,
+            dev->usbInfo.firmware[0], dev->usbInfo.firmware[1],
+            dev->usbInfo.hardware[0], dev->usbInfo.hardware[1]);
+
+    if (all || strcmp(suite, "enumeration") == 0)
+        suite_enumeration(0);
+    if (all || strcmp(suite, "transactions") == 0)
+        suite_transactions(dev, sim || allow_writes);
+    if (all || strcmp(suite, "i2c") == 0) {
+        // on hardware only with a known slave, we don't want to write to whatever is on the bus
+        if (sim)
+            suite_i2c(dev, SIM_I2C_ADDRESS);
+        else if (i2c_addr >= 0)
+            suite_i2c(dev, i2c_addr);
+        else
+            fprintf(stderr, "Note: i2c suite skipped, use --i2c-addr\n");
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+
+    if (out != stdout)
+        fclose(out);
+    mcp2221_close(dev);
+    mcp2221_exit();
+
+    return 0;
+}
+
+/* *INDENT-OFF* */
+/******************************************************************************
+ * Local Variables:
+ * mode: C
+ * c-indent-level: 4
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ * kate: space-indent on; indent-width 4; mixedindent off; indent-mode cstyle;
+ * vim: set expandtab filetype=c:
+ * vi: set et tabstop=4 shiftwidth=4: */
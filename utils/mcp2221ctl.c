@@ -0,0 +1,813 @@
+/* -*-C-*- */
+/* SPDX-License-Identifier:    GPL-3.0 */
+/*
+ * Command line access to MCP2221 GPIO, ADC, DAC, I2C and flash settings
+ *
+ * Runs one command given on the command line, or with --batch a stream of
+ * commands from stdin while the devices stay open. Every command prints one
+ * result line per device, either as "<device> <command> <status> key=value..."
+ * or as one JSON object per line with --json.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <wchar.h>
+#include <locale.h>
+
+#include "libmcp2221/libmcp2221.h"
+
+#define MAX_DEVICES     16
+#define MAX_ARGS        (MCP2221_REPORT_SIZE + 4)
+#define MAX_I2C_LEN     60
+#define LINE_SIZE       4096
+
+#define IDX_HELP 0
+#define IDX_DEVICES 1
+#define IDX_BATCH 2
+#define IDX_JSON 3
+#define IDX_LIST 4
+#define IDX_VID 5
+#define IDX_PID 6
+
+static const char *const short_options = "hd:bjlv:p:";
+
+static const struct option long_options[] = {
+        [IDX_HELP]    = {"help",    no_argument,       0, 0},
+        [IDX_DEVICES] = {"devices", required_argument, 0, 0},
+        [IDX_BATCH]   = {"batch",   no_argument,       0, 0},
+        [IDX_JSON]    = {"json",    no_argument,       0, 0},
+        [IDX_LIST]    = {"list",    no_argument,       0, 0},
+        [IDX_VID]     = {"vid",     required_argument, 0, 0},
+        [IDX_PID]     = {"pid",     required_argument, 0, 0},
+        // end of list
+        {0, 0, 0, 0}
+};
+
+typedef mcp2221_error (*command_func_t)(mcp2221_t *dev, int argc, char **argv);
+
+typedef struct {
+    const char *name;
+    int min_args;
+    int max_args;
+    int no_device;                          // runs once, not per device
+    command_func_t func;
+    const char *usage;
+} command_t;
+
+static mcp2221_t *devices[MAX_DEVICES];
+static int ndevices;
+static int json;
+
+/* The result line is built here so the status can go in front of the values */
+static char line[LINE_SIZE];
+static size_t line_len;
+
+static void print_help()
+{
+    puts("mcp2221ctl: control MCP2221 GPIO, ADC, DAC, I2C and flash settings");
+    puts("usage: mcp2221ctl [options] <command> [args...]");
+    puts("       mcp2221ctl [options] --batch < commands");
+    puts("    -h|--help                 print this help");
+    puts("    -d|--devices <list>       comma separated device indexes or serials, or \"all\" (default 0)");
+    puts("    -b|--batch                read commands from stdin, one per line, devices stay open");
+    puts("    -j|--json                 print one JSON object per result");
+    puts("    -l|--list                 list devices and exit");
+    puts("    -v|--vid <vid>            USB vendor ID (default 0x04d8)");
+    puts("    -p|--pid <pid>            USB product ID (default 0x00dd)\n");
+    puts("commands (a batch line may start with @<n> to only address the n-th selected device,");
+    puts("          empty lines and lines starting with # are ignored):");
+}
+
+static void out_append(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void out_append(const char *fmt, ...)
+{
+    va_list ap;
+
+    if (line_len >= sizeof(line))
+        return;
+    va_start(ap, fmt);
+    const int res = vsnprintf(line + line_len, sizeof(line) - line_len, fmt, ap);
+    va_end(ap);
+    if (res > 0)
+        line_len += res;
+}
+
+static void out_int(const char *key, long value)
+{
+    if (json)
+        out_append(",\"%s\":%ld", key, value);
+    else
+        out_append(" %s=%ld", key, value);
+}
+
+static void out_hex(const char *key, const uint8_t *data, int len)
+{
+    out_append(json ? ",\"%s\":\"" : " %s=", key);
+    for (int i = 0; i < len; i++)
+        out_append("%02x", data[i]);
+    if (json)
+        out_append("\"");
+}
+
+/* Escape what JSON needs and keep text output on one line, truncates to fit dst */
+static void escape(char *dst, size_t size, const char *src)
+{
+    size_t len = 0;
+
+    for (const char *c = src; *c && len + 7 <= size; c++) {
+        if (*c == '"' || *c == '\\')
+            len += snprintf(dst + len, size - len, "\\%c", *c);
+        else if ((unsigned char)*c < 0x20)
+            len += snprintf(dst + len, size - len, "\\u%04x", *c);
+        else
+            dst[len++] = *c;
+    }
+    dst[len] = '\0';
+}
+
+/* Strings are descriptors and paths */
+static void out_str(const char *key, const char *value)
+{
+    char buf[sizeof(line)];
+
+    escape(buf, sizeof(buf), value);
+    out_append(json ? ",\"%s\":\"%s\"" : " %s=\"%s\"", key, buf);
+}
+
+static void out_wstr(const char *key, const wchar_t *value)
+{
+    char buf[MCP2221_STR_LEN * MB_LEN_MAX];
+
+    if (wcstombs(buf, value, sizeof(buf)) == (size_t)-1)
+        buf[0] = '\0';
+    buf[sizeof(buf) - 1] = '\0';
+    out_str(key, buf);
+}
+
+static const char *error_name(mcp2221_error res)
+{
+    switch (res) {
+    case MCP2221_SUCCESS: return "ok";
+    case MCP2221_ERROR: return "error";
+    case MCP2221_INVALID_ARG: return "invalid_arg";
+    case MCP2221_ERROR_HID: return "error_hid";
+    case MCP2221_TIMEOUT: return "timeout";
+    case MCP2221_PENDING: return "pending";
+    default: return "unknown";
+    }
+}
+
+static int parse_int(const char *str, long min, long max, long *value)
+{
+    char *end;
+
+    errno = 0;
+    *value = strtol(str, &end, 0);
+    return (errno || end == str || *end || *value < min || *value > max) ? -1 : 0;
+}
+
+static int parse_bytes(int argc, char **argv, uint8_t *buf)
+{
+    for (int i = 0; i < argc; i++) {
+        long value;
+        if (parse_int(argv[i], 0, 0xff, &value) != 0)
+            return -1;
+        buf[i] = value;
+    }
+    return 0;
+}
+
+static mcp2221_error cmd_status(mcp2221_t *dev, int argc, char **argv)
+{
+    mcp2221_i2c_state_t state;
+    mcp2221_i2cpins_t pins;
+    int interrupt;
+    mcp2221_error res;
+    (void)argc;
+    (void)argv;
+
+    if ((res = mcp2221_i2cState(dev, &state)) != MCP2221_SUCCESS ||
+        (res = mcp2221_i2cReadPins(dev, &pins)) != MCP2221_SUCCESS ||
+        (res = mcp2221_readInterrupt(dev, &interrupt)) != MCP2221_SUCCESS)
+        return res;
+
+    out_int("i2c_state", state);
+    out_int("scl", pins.SCL);
+    out_int("sda", pins.SDA);
+    out_int("interrupt", interrupt);
+    return MCP2221_SUCCESS;
+}
+
+static mcp2221_error cmd_info(mcp2221_t *dev, int argc, char **argv)
+{
+    char version[8];
+    (void)argc;
+    (void)argv;
+
+    out_str("path", dev->path);
+    out_int("vid", dev->usbInfo.vid);
+    out_int("pid", dev->usbInfo.pid);
+    out_wstr("manufacturer", dev->usbInfo.manufacturer);
+    out_wstr("product", dev->usbInfo.product);
+    out_wstr("serial", dev->usbInfo.serial);
+    snprintf(version, sizeof(version), "%c.%c", dev->usbInfo.firmware[0], dev->usbInfo.firmware[1]);
+    out_str("firmware", version);
+    snprintf(version, sizeof(version), "%c.%c", dev->usbInfo.hardware[0], dev->usbInfo.hardware[1]);
+    out_str("hardware", version);
+    out_int("milliamps", dev->usbInfo.milliamps);
+    return MCP2221_SUCCESS;
+}
+
+static mcp2221_error cmd_reset(mcp2221_t *dev, int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+    return mcp2221_reset(dev);
+}
+
+static mcp2221_error cmd_sleep(mcp2221_t *dev, int argc, char **argv)
+{
+    long ms;
+    (void)dev;
+    (void)argc;
+
+    if (parse_int(argv[0], 0, 3600000, &ms) != 0)
+        return MCP2221_INVALID_ARG;
+    usleep(ms * 1000);
+    return MCP2221_SUCCESS;
+}
+
+static mcp2221_error cmd_gpio_get(mcp2221_t *dev, int argc, char **argv)
+{
+    mcp2221_gpio_value_t values[MCP2221_GPIO_COUNT];
+    static const char *const keys[MCP2221_GPIO_COUNT] = {"gpio0", "gpio1", "gpio2", "gpio3"};
+    (void)argc;
+    (void)argv;
+
+    const mcp2221_error res = mcp2221_readGPIO(dev, values);
+    if (res != MCP2221_SUCCESS)
+        return res;
+
+    // pins that are not GPIOs read as -1
+    for (int i = 0; i < MCP2221_GPIO_COUNT; i++)
+        out_int(keys[i], values[i] == MCP2221_GPIO_VALUE_INVALID ? -1 : (long)values[i]);
+    return MCP2221_SUCCESS;
+}
+
+static mcp2221_error cmd_gpio_set(mcp2221_t *dev, int argc, char **argv)
+{
+    long pin;
+    long value;
+    (void)argc;
+
+    if (parse_int(argv[0], 0, MCP2221_GPIO_COUNT - 1, &pin) != 0 || parse_int(argv[1], 0, 1, &value) != 0)
+        return MCP2221_INVALID_ARG;
+    return mcp2221_setGPIO(dev, 1 << pin, value ? MCP2221_GPIO_VALUE_HIGH : MCP2221_GPIO_VALUE_LOW);
+}
+
+static mcp2221_error cmd_gpio_mask(mcp2221_t *dev, int argc, char **argv)
+{
+    long mask;
+    long values;
+    (void)argc;
+
+    if (parse_int(argv[0], 0, 0x0f, &mask) != 0 || parse_int(argv[1], 0, 0x0f, &values) != 0)
+        return MCP2221_INVALID_ARG;
+    return mcp2221_setGPIOMask(dev, mask, values);
+}
+
+static mcp2221_error cmd_gpio_mode(mcp2221_t *dev, int argc, char **argv)
+{
+    static const struct {
+        const char *name;
+        mcp2221_gpio_mode_t mode;
+        mcp2221_gpio_direction_t direction;
+    } modes[] = {
+        {"in",   MCP2221_GPIO_MODE_GPIO, MCP2221_GPIO_DIR_INPUT},
+        {"out",  MCP2221_GPIO_MODE_GPIO, MCP2221_GPIO_DIR_OUTPUT},
+        {"dedi", MCP2221_GPIO_MODE_DEDI, MCP2221_GPIO_DIR_INVALID},
+        {"alt1", MCP2221_GPIO_MODE_ALT1, MCP2221_GPIO_DIR_INVALID},
+        {"alt2", MCP2221_GPIO_MODE_ALT2, MCP2221_GPIO_DIR_INVALID},
+        {"alt3", MCP2221_GPIO_MODE_ALT3, MCP2221_GPIO_DIR_INVALID},
+        {"adc",  MCP2221_GPIO_MODE_ADC,  MCP2221_GPIO_DIR_INVALID},
+        {"dac",  MCP2221_GPIO_MODE_DAC,  MCP2221_GPIO_DIR_INVALID},
+        {"ioc",  MCP2221_GPIO_MODE_IOC,  MCP2221_GPIO_DIR_INVALID},
+    };
+    long pin;
+    long value = 0;
+
+    if (parse_int(argv[0], 0, MCP2221_GPIO_COUNT - 1, &pin) != 0 || (argc > 2 && parse_int(argv[2], 0, 1, &value) != 0))
+        return MCP2221_INVALID_ARG;
+
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        if (strcmp(argv[1], modes[i].name) != 0)
+            continue;
+
+        mcp2221_gpioconfset_t conf = mcp2221_GPIOConfInit();
+        conf.conf[0].gpios = 1 << pin;
+        conf.conf[0].mode = modes[i].mode;
+        conf.conf[0].direction = modes[i].direction;
+        conf.conf[0].value = value ? MCP2221_GPIO_VALUE_HIGH : MCP2221_GPIO_VALUE_LOW;
+        return mcp2221_setGPIOConf(dev, &conf);
+    }
+    return MCP2221_INVALID_ARG;
+}
+
+static int parse_ref(const char *str, int *ref)
+{
+    // DAC and ADC references share their values
+    if (strcmp(str, "vdd") == 0)
+        *ref = MCP2221_DAC_REF_VDD;
+    else if (strcmp(str, "off") == 0)
+        *ref = MCP2221_DAC_REF_OFF;
+    else if (strcmp(str, "1024") == 0)
+        *ref = MCP2221_DAC_REF_1024;
+    else if (strcmp(str, "2048") == 0)
+        *ref = MCP2221_DAC_REF_2048;
+    else if (strcmp(str, "4096") == 0)
+        *ref = MCP2221_DAC_REF_4096;
+    else
+        return -1;
+    return 0;
+}
+
+static mcp2221_error cmd_adc_read(mcp2221_t *dev, int argc, char **argv)
+{
+    int values[MCP2221_ADC_COUNT];
+    static const char *const keys[MCP2221_ADC_COUNT] = {"adc1", "adc2", "adc3"};
+    (void)argc;
+    (void)argv;
+
+    const mcp2221_error res = mcp2221_readADC(dev, values);
+    if (res != MCP2221_SUCCESS)
+        return res;
+
+    for (int i = 0; i < MCP2221_ADC_COUNT; i++)
+        out_int(keys[i], values[i]);
+    return MCP2221_SUCCESS;
+}
+
+static mcp2221_error cmd_adc_ref(mcp2221_t *dev, int argc, char **argv)
+{
+    int ref;
+    (void)argc;
+
+    if (parse_ref(argv[0], &ref) != 0)
+        return MCP2221_INVALID_ARG;
+    return mcp2221_setADC(dev, ref);
+}
+
+static mcp2221_error cmd_dac_set(mcp2221_t *dev, int argc, char **argv)
+{
+    long value;
+    int ref = MCP2221_DAC_REF_VDD;
+
+    if (parse_int(argv[0], 0, MCP2221_DAC_MAX, &value) != 0 || (argc > 1 && parse_ref(argv[1], &ref) != 0))
+        return MCP2221_INVALID_ARG;
+    return mcp2221_setDAC(dev, ref, value);
+}
+
+static mcp2221_error cmd_i2c_write(mcp2221_t *dev, int argc, char **argv)
+{
+    uint8_t buf[MAX_I2C_LEN];
+    long addr;
+
+    if (parse_int(argv[0], 0, 0x7f, &addr) != 0 || argc - 1 > MAX_I2C_LEN || parse_bytes(argc - 1, argv + 1, buf) != 0)
+        return MCP2221_INVALID_ARG;
+    return mcp2221_i2cWriteRead(dev, addr, buf, argc - 1, NULL, 0);
+}
+
+static mcp2221_error cmd_i2c_read(mcp2221_t *dev, int argc, char **argv)
+{
+    uint8_t buf[MAX_I2C_LEN];
+    long addr;
+    long len;
+    (void)argc;
+
+    if (parse_int(argv[0], 0, 0x7f, &addr) != 0 || parse_int(argv[1], 1, MAX_I2C_LEN, &len) != 0)
+        return MCP2221_INVALID_ARG;
+
+    const mcp2221_error res = mcp2221_i2cWriteRead(dev, addr, NULL, 0, buf, len);
+    if (res == MCP2221_SUCCESS)
+        out_hex("data", buf, len);
+    return res;
+}
+
+/* Write then read with a repeated start, e.g. register reads */
+static mcp2221_error cmd_i2c_xfer(mcp2221_t *dev, int argc, char **argv)
+{
+    uint8_t wbuf[MAX_I2C_LEN];
+    uint8_t rbuf[MAX_I2C_LEN];
+    long addr;
+    long len;
+
+    if (parse_int(argv[0], 0, 0x7f, &addr) != 0 || parse_int(argv[1], 1, MAX_I2C_LEN, &len) != 0 ||
+        argc - 2 > MAX_I2C_LEN || parse_bytes(argc - 2, argv + 2, wbuf) != 0)
+        return MCP2221_INVALID_ARG;
+
+    const mcp2221_error res = mcp2221_i2cWriteRead(dev, addr, wbuf, argc - 2, rbuf, len);
+    if (res == MCP2221_SUCCESS)
+        out_hex("data", rbuf, len);
+    return res;
+}
+
+static mcp2221_error cmd_i2c_div(mcp2221_t *dev, int argc, char **argv)
+{
+    long div;
+    (void)argc;
+
+    if (parse_int(argv[0], 0, 0xff, &div) != 0)
+        return MCP2221_INVALID_ARG;
+    return mcp2221_i2cDivider(dev, div);
+}
+
+static mcp2221_error cmd_i2c_cancel(mcp2221_t *dev, int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+    return mcp2221_i2cCancel(dev);
+}
+
+static mcp2221_error cmd_flash_read(mcp2221_t *dev, int argc, char **argv)
+{
+    wchar_t str[MCP2221_STR_LEN];
+    int vid;
+    int pid;
+    int milliamps;
+    mcp2221_error res;
+    (void)argc;
+    (void)argv;
+
+    if ((res = mcp2221_loadVIDPID(dev, &vid, &pid)) != MCP2221_SUCCESS ||
+        (res = mcp2221_loadMilliamps(dev, &milliamps)) != MCP2221_SUCCESS)
+        return res;
+    out_int("vid", vid);
+    out_int("pid", pid);
+    out_int("milliamps", milliamps);
+
+    if ((res = mcp2221_loadManufacturer(dev, str)) != MCP2221_SUCCESS)
+        return res;
+    out_wstr("manufacturer", str);
+    if ((res = mcp2221_loadProduct(dev, str)) != MCP2221_SUCCESS)
+        return res;
+    out_wstr("product", str);
+    if ((res = mcp2221_loadSerial(dev, str)) != MCP2221_SUCCESS)
+        return res;
+    out_wstr("serial", str);
+    return MCP2221_SUCCESS;
+}
+
+static int to_wide(const char *str, wchar_t *buf)
+{
+    const size_t len = mbstowcs(buf, str, MCP2221_STR_LEN);
+    return (len == (size_t)-1 || len >= MCP2221_STR_LEN) ? -1 : 0;
+}
+
+static mcp2221_error cmd_flash_manufacturer(mcp2221_t *dev, int argc, char **argv)
+{
+    wchar_t buf[MCP2221_STR_LEN];
+    (void)argc;
+
+    if (to_wide(argv[0], buf) != 0)
+        return MCP2221_INVALID_ARG;
+    return mcp2221_saveManufacturer(dev, buf);
+}
+
+static mcp2221_error cmd_flash_product(mcp2221_t *dev, int argc, char **argv)
+{
+    wchar_t buf[MCP2221_STR_LEN];
+    (void)argc;
+
+    if (to_wide(argv[0], buf) != 0)
+        return MCP2221_INVALID_ARG;
+    return mcp2221_saveProduct(dev, buf);
+}
+
+static mcp2221_error cmd_flash_serial(mcp2221_t *dev, int argc, char **argv)
+{
+    wchar_t buf[MCP2221_STR_LEN];
+    (void)argc;
+
+    if (to_wide(argv[0], buf) != 0)
+        return MCP2221_INVALID_ARG;
+    return mcp2221_saveSerial(dev, buf);
+}
+
+static mcp2221_error cmd_flash_vidpid(mcp2221_t *dev, int argc, char **argv)
+{
+    long vid;
+    long pid;
+    (void)argc;
+
+    if (parse_int(argv[0], 0, 0xffff, &vid) != 0 || parse_int(argv[1], 0, 0xffff, &pid) != 0)
+        return MCP2221_INVALID_ARG;
+    return mcp2221_saveVIDPID(dev, vid, pid);
+}
+
+static mcp2221_error cmd_flash_dac(mcp2221_t *dev, int argc, char **argv)
+{
+    long value;
+    int ref = MCP2221_DAC_REF_VDD;
+
+    if (parse_int(argv[0], 0, MCP2221_DAC_MAX, &value) != 0 || (argc > 1 && parse_ref(argv[1], &ref) != 0))
+        return MCP2221_INVALID_ARG;
+    return mcp2221_saveDAC(dev, ref, value);
+}
+
+static const command_t commands[] = {
+    {"status",             0, 0,            0, cmd_status,             "I2C state, I2C pin levels and interrupt flag"},
+    {"info",               0, 0,            0, cmd_info,               "enumerated USB information"},
+    {"reset",              0, 0,            0, cmd_reset,              "reset the device (it has to be reopened)"},
+    {"sleep",              1, 1,            1, cmd_sleep,              "<ms>  wait"},
+    {"gpio.get",           0, 0,            0, cmd_gpio_get,           "read GPIO values (-1 = not a GPIO)"},
+    {"gpio.set",           2, 2,            0, cmd_gpio_set,           "<pin> <0|1>  set an output"},
+    {"gpio.mask",          2, 2,            0, cmd_gpio_mask,          "<mask> <values>  set several outputs at once"},
+    {"gpio.mode",          2, 3,            0, cmd_gpio_mode,          "<pin> <in|out|dedi|alt1-3|adc|dac|ioc> [value]  configure a pin"},
+    {"adc.read",           0, 0,            0, cmd_adc_read,           "read the ADCs"},
+    {"adc.ref",            1, 1,            0, cmd_adc_ref,            "<vdd|off|1024|2048|4096>  set the ADC reference"},
+    {"dac.set",            1, 2,            0, cmd_dac_set,            "<0-31> [ref]  set the DAC output"},
+    {"i2c.write",          2, MAX_ARGS - 1, 0, cmd_i2c_write,          "<addr> <bytes...>  write"},
+    {"i2c.read",           2, 2,            0, cmd_i2c_read,           "<addr> <len>  read"},
+    {"i2c.xfer",           2, MAX_ARGS - 1, 0, cmd_i2c_xfer,           "<addr> <len> [bytes...]  write, repeated start, read"},
+    {"i2c.div",            1, 1,            0, cmd_i2c_div,            "<divider>  set the I2C clock divider"},
+    {"i2c.cancel",         0, 0,            0, cmd_i2c_cancel,         "cancel the current transfer"},
+    {"flash.read",         0, 0,            0, cmd_flash_read,         "read the settings stored in flash"},
+    {"flash.manufacturer", 1, 1,            0, cmd_flash_manufacturer, "<string>  store the manufacturer descriptor"},
+    {"flash.product",      1, 1,            0, cmd_flash_product,      "<string>  store the product descriptor"},
+    {"flash.serial",       1, 1,            0, cmd_flash_serial,       "<string>  store the serial descriptor"},
+    {"flash.vidpid",       2, 2,            0, cmd_flash_vidpid,       "<vid> <pid>  store VID and PID"},
+    {"flash.dac",          1, 2,            0, cmd_flash_dac,          "<0-31> [ref]  store the power-up DAC output"},
+};
+
+#define COMMAND_COUNT   (sizeof(commands) / sizeof(commands[0]))
+
+static void print_commands(void)
+{
+    for (size_t i = 0; i < COMMAND_COUNT; i++)
+        printf("    %-20s %s\n", commands[i].name, commands[i].usage);
+    puts("    (\"gpio get\" is the same as \"gpio.get\")");
+}
+
+static void print_result(int index, const char *cmd, mcp2221_error res)
+{
+    char buf[256];
+
+    // cmd is whatever was typed if it is not a known command
+    escape(buf, sizeof(buf), cmd);
+    if (json)
+        printf("{\"device\":%d,\"cmd\":\"%s\",\"status\":\"%s\",\"code\":%d%s}\n", index, buf, error_name(res), res, line);
+    else
+        printf("%d %s %s%s\n", index, cmd, error_name(res), line);
+    line[0] = '\0';
+    line_len = 0;
+}
+
+/* Run one tokenized command on the selected devices (all if only < 0), returns the number of failures */
+static int run(int argc, char **argv, int only)
+{
+    char name[64];
+    int first = 1;
+
+    // "gpio get" and "gpio.get" both work
+    snprintf(name, sizeof(name), "%s", argv[0]);
+    const command_t *cmd = NULL;
+    for (int pass = 0; pass < 2 && !cmd; pass++) {
+        if (pass == 1) {
+            if (argc < 2)
+                break;
+            snprintf(name, sizeof(name), "%s.%s", argv[0], argv[1]);
+            first = 2;
+        }
+        for (size_t i = 0; i < COMMAND_COUNT; i++) {
+            if (strcmp(commands[i].name, name) == 0) {
+                cmd = &commands[i];
+                break;
+            }
+        }
+    }
+
+    if (!cmd) {
+        print_result(-1, argv[0], MCP2221_INVALID_ARG);
+        return 1;
+    }
+
+    argc -= first;
+    argv += first;
+    if (argc < cmd->min_args || argc > cmd->max_args) {
+        print_result(-1, cmd->name, MCP2221_INVALID_ARG);
+        return 1;
+    }
+
+    if (cmd->no_device) {
+        const mcp2221_error res = cmd->func(NULL, argc, argv);
+        print_result(-1, cmd->name, res);
+        return res != MCP2221_SUCCESS;
+    }
+
+    int failed = 0;
+    for (int i = 0; i < ndevices; i++) {
+        if (only >= 0 && i != only)
+            continue;
+        const mcp2221_error res = cmd->func(devices[i], argc, argv);
+        if (res != MCP2221_SUCCESS) {
+            line[0] = '\0';
+            line_len = 0;
+            failed++;
+        }
+        print_result(i, cmd->name, res);
+    }
+    return failed;
+}
+
+/* One command per line, results are flushed per line so a script can read them as they come */
+static int run_batch(void)
+{
+    char *buf = NULL;
+    size_t size = 0;
+    int failed = 0;
+
+    while (getline(&buf, &size, stdin) >= 0) {
+        char *args[MAX_ARGS];
+        int argc = 0;
+        int only = -1;
+
+        for (char *tok = strtok(buf, " \t\r\n"); tok && argc < MAX_ARGS; tok = strtok(NULL, " \t\r\n"))
+            args[argc++] = tok;
+        if (!argc || args[0][0] == '#')
+            continue;
+
+        if (args[0][0] == '@') {
+            long index;
+            if (parse_int(args[0] + 1, 0, ndevices - 1, &index) != 0 || argc < 2) {
+                print_result(-1, args[0], MCP2221_INVALID_ARG);
+                fflush(stdout);
+                failed++;
+                continue;
+            }
+            only = index;
+            argc--;
+            memmove(args, args + 1, argc * sizeof(args[0]));
+        }
+
+        failed += run(argc, args, only);
+        fflush(stdout);
+    }
+
+    free(buf);
+    return failed;
+}
+
+static int list_devices(int count)
+{
+    for (int i = 0; i < count; i++) {
+        mcp2221_t *dev = mcp2221_open_byIndex(i);
+        if (!dev) {
+            print_result(i, "device", MCP2221_ERROR_HID);
+            continue;
+        }
+        cmd_info(dev, 0, NULL);
+        print_result(i, "device", MCP2221_SUCCESS);
+        mcp2221_close(dev);
+    }
+    return 0;
+}
+
+/* Open the devices in a comma separated list of indexes or serials */
+static int open_devices(char *list, int count)
+{
+    if (strcmp(list, "all") == 0) {
+        for (int i = 0; i < count && ndevices < MAX_DEVICES; i++) {
+            if (!(devices[ndevices] = mcp2221_open_byIndex(i))) {
+                fprintf(stderr, "Error: cannot open device %d!\n", i);
+                return -1;
+            }
+            ndevices++;
+        }
+        return 0;
+    }
+
+    for (char *item = strtok(list, ","); item; item = strtok(NULL, ",")) {
+        long index;
+        wchar_t serial[MCP2221_STR_LEN];
+        mcp2221_t *dev = NULL;
+
+        if (ndevices == MAX_DEVICES) {
+            fprintf(stderr, "Error: too many devices!\n");
+            return -1;
+        }
+        if (parse_int(item, 0, count - 1, &index) == 0)
+            dev = mcp2221_open_byIndex(index);
+        else if (to_wide(item, serial) == 0)
+            dev = mcp2221_open_bySerial(serial);
+        if (!dev) {
+            fprintf(stderr, "Error: cannot open device %s!\n", item);
+            return -1;
+        }
+        devices[ndevices++] = dev;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    int option_index = 0;
+    int batch = 0;
+    int list = 0;
+    int vid = MCP2221_DEFAULT_VID;
+    int pid = MCP2221_DEFAULT_PID;
+    char default_devices[] = "0";
+    char *device_list = default_devices;
+
+    setlocale(LC_CTYPE, "");
+
+    while ((opt = getopt_long(argc, argv, short_options,
+            long_options, &option_index)) != -1) {
+
+        switch (opt) {
+        case 0:
+            switch (option_index) {
+            case IDX_DEVICES: device_list = optarg; break;
+            case IDX_BATCH: batch = 1; break;
+            case IDX_JSON: json = 1; break;
+            case IDX_LIST: list = 1; break;
+            case IDX_VID: vid = strtoul(optarg, NULL, 0); break;
+            case IDX_PID: pid = strtoul(optarg, NULL, 0); break;
+            case IDX_HELP:
+            default:
+                print_help();
+                print_commands();
+                return 0;
+            }
+            break;
+        case 'd': device_list = optarg; break;
+        case 'b': batch = 1; break;
+        case 'j': json = 1; break;
+        case 'l': list = 1; break;
+        case 'v': vid = strtoul(optarg, NULL, 0); break;
+        case 'p': pid = strtoul(optarg, NULL, 0); break;
+        case 'h':
+        default:
+            print_help();
+            print_commands();
+            return 0;
+        }
+    }
+
+    if (!batch && !list && optind >= argc) {
+        print_help();
+        print_commands();
+        return 1;
+    }
+
+    if (mcp2221_init() != MCP2221_SUCCESS) {
+        fprintf(stderr, "Error: cannot initialize HIDAPI!\n");
+        return 1;
+    }
+
+    const int count = mcp2221_find(vid, pid, NULL, NULL, NULL);
+    if (list) {
+        list_devices(count);
+        mcp2221_exit();
+        return 0;
+    }
+
+    if (count <= 0) {
+        fprintf(stderr, "Error: no MCP2221 found!\n");
+        mcp2221_exit();
+        return 1;
+    }
+
+    int failed = 1;
+    if (open_devices(device_list, count) == 0)
+        failed = batch ? run_batch() : run(argc - optind, argv + optind, -1);
+
+    for (int i = 0; i < ndevices; i++)
+        mcp2221_close(devices[i]);
+    mcp2221_exit();
+
+    return failed ? 1 : 0;
+}
+
+/* *INDENT-OFF* */
+/******************************************************************************
+ * Local Variables:
+ * mode: C
+ * c-indent-level: 4
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ * kate: space-indent on; indent-width 4; mixedindent off; indent-mode cstyle;
+ * vim: set expandtab filetype=c:
+ * vi: set et tabstop=4 shiftwidth=4: */
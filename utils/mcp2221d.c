@@ -0,0 +1,922 @@
+/* -*-C-*- */
+/* SPDX-License-Identifier:    GPL-3.0 */
+/*
+ * Local multiplexing server: owns MCP2221 devices and shares them between
+ * processes over a Unix domain socket (see libmcp2221/server_proto.h)
+ *
+ * Clients need no code changes, setting MCP2221_SERVER=<socket> makes
+ * mcp2221_find() and mcp2221_open*() go through this server.
+ *
+ * Clients that hand over a shared memory region get their reports through
+ * its rings instead: one thread per such client waits on the request
+ * eventfd and queues what it finds, the device thread writes the response
+ * straight into the response ring.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <wchar.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "hidapi.h"
+#include "libmcp2221/libmcp2221.h"
+#include "libmcp2221/server_proto.h"
+
+#define DEFAULT_SOCKET          "/run/mcp2221d.sock"
+#define MAX_CLIENTS             64
+
+/* Multi-report I2C sequences of one client are not interleaved with other
+ * clients' I2C traffic, unless the client goes quiet for this long */
+#define I2C_OWNER_TIMEOUT_NS    100000000LL
+
+#define CMD_STATUSSET           0x10
+#define CMD_I2CREAD_GET         0x40
+#define CMD_SETGPIO             0x50
+#define CMD_SETSRAM             0x60
+#define CMD_GETSRAM             0x61
+#define CMD_RESET               0x70
+#define CMD_I2C_FIRST           0x90
+#define CMD_I2C_LAST            0x94
+
+#define IDX_HELP 0
+#define IDX_SOCKET 1
+#define IDX_VID 2
+#define IDX_PID 3
+
+static const char *const short_options = "hs:v:p:";
+
+static const struct option long_options[] = {
+        [IDX_HELP]   = {"help",   no_argument,       0, 0},
+        [IDX_SOCKET] = {"socket", required_argument, 0, 0},
+        [IDX_VID]    = {"vid",    required_argument, 0, 0},
+        [IDX_PID]    = {"pid",    required_argument, 0, 0},
+        // end of list
+        {0, 0, 0, 0}
+};
+
+typedef struct device device_t;
+typedef struct client client_t;
+typedef struct request request_t;
+
+struct client {
+    int fd;
+    int refs;                               // protected by refs_lock
+    int dead;                               // atomic, see client_dead()
+    device_t *dev;
+    int view_valid;
+    uint8_t view[MCP2221_GPIO_COUNT];       // SRAM GPIO config as this client last saw it
+    srv_shm_t *shm;                         // NULL until the client sent SHM
+    int req_event;
+    int resp_event;
+};
+
+struct request {
+    request_t *next;
+    client_t *client;
+    int shm;                                // response goes into the ring
+    uint8_t report[MCP2221_REPORT_SIZE];
+};
+
+struct device {
+    device_t *next;
+    char path[SRV_PATH_LEN];
+    mcp2221_t *handle;
+    pthread_t thread;
+    int broken;                             // atomic, HID errors, a new OPEN gets a fresh handle
+    int users;                              // protected by refs_lock, clients that opened this device and still exist
+
+    pthread_mutex_t lock;                   // protects everything below
+    pthread_cond_t cond;
+    request_t *head;
+    request_t *tail;
+    uint8_t shadow[MCP2221_GPIO_COUNT];     // SRAM GPIO config as it really is
+    client_t *i2c_owner;
+    int64_t i2c_since;
+    int stop;
+};
+
+static pthread_mutex_t refs_lock = PTHREAD_MUTEX_INITIALIZER;
+static device_t *devices;
+static volatile sig_atomic_t quit;
+static unsigned short match_vid = MCP2221_DEFAULT_VID;
+static unsigned short match_pid = MCP2221_DEFAULT_PID;
+
+static void print_help()
+{
+    puts("mcp2221d: share MCP2221 devices between processes");
+    puts("usage: mcp2221d [options]");
+    puts("    -h|--help                 print this help");
+    puts("    -s|--socket <path>        socket to listen on (default " DEFAULT_SOCKET ")");
+    puts("    -v|--vid <vid>            USB vendor ID to serve (default 0x04d8, 0 = any)");
+    puts("    -p|--pid <pid>            USB product ID to serve (default 0x00dd, 0 = any)\n");
+    puts("    clients use it by setting " MCP2221_SERVER_ENV "=<path>\n");
+}
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t)ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+}
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    quit = 1;
+}
+
+static int client_dead(client_t *c)
+{
+    return __atomic_load_n(&c->dead, __ATOMIC_ACQUIRE);
+}
+
+static int device_broken(device_t *d)
+{
+    return __atomic_load_n(&d->broken, __ATOMIC_ACQUIRE);
+}
+
+static void device_break(device_t *d)
+{
+    __atomic_store_n(&d->broken, 1, __ATOMIC_RELEASE);
+}
+
+/* Mark a client as gone and wake up everything that might wait on it */
+static void client_kill(client_t *c)
+{
+    __atomic_store_n(&c->dead, 1, __ATOMIC_RELEASE);
+    shutdown(c->fd, SHUT_RDWR);
+    if (c->shm) {
+        const uint64_t one = 1;
+        if (write(c->req_event, &one, sizeof(one)) != sizeof(one))
+            fprintf(stderr, "Error: cannot wake client thread: %s\n", strerror(errno));
+    }
+}
+
+static void client_get(client_t *c)
+{
+    pthread_mutex_lock(&refs_lock);
+    c->refs++;
+    pthread_mutex_unlock(&refs_lock);
+}
+
+static void client_put(client_t *c)
+{
+    pthread_mutex_lock(&refs_lock);
+    const int last = (--c->refs == 0);
+    if (last && c->dev)
+        c->dev->users--;
+    pthread_mutex_unlock(&refs_lock);
+
+    // the fd stays open until nobody can write to it anymore, so it cannot be reused under us
+    if (last) {
+        if (c->shm) {
+            munmap(c->shm, sizeof(srv_shm_t));
+            close(c->req_event);
+            close(c->resp_event);
+        }
+        close(c->fd);
+        free(c);
+    }
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+    uint8_t *ptr = buf;
+    while (len) {
+        const ssize_t res = recv(fd, ptr, len, 0);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return -1;
+        ptr += res;
+        len -= res;
+    }
+    return 0;
+}
+
+/* Like read_all() for a header, also picks up fds sent along with it */
+static int read_header(int fd, srv_header_t *hdr, int *fds, int *nfds)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    struct iovec iov = { hdr, sizeof(*hdr) };
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    *nfds = 0;
+
+    ssize_t res;
+    while ((res = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+    if (res <= 0)
+        return -1;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            *nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), *nfds * sizeof(int));
+        }
+    }
+
+    return read_all(fd, (uint8_t *)hdr + res, sizeof(*hdr) - res);
+}
+
+static int send_msg(int fd, uint8_t type, int32_t status, const void *payload, uint32_t len)
+{
+    uint8_t buf[sizeof(srv_header_t) + MCP2221_REPORT_SIZE];
+    srv_header_t hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = type;
+    hdr.status = status;
+    hdr.len = len;
+
+    if (len > MCP2221_REPORT_SIZE) {
+        if (send(fd, &hdr, sizeof(hdr), MSG_NOSIGNAL) != sizeof(hdr))
+            return -1;
+        return send(fd, payload, len, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+    }
+
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + sizeof(hdr), payload, len);
+    return send(fd, buf, sizeof(hdr) + len, MSG_NOSIGNAL) == (ssize_t)(sizeof(hdr) + len) ? 0 : -1;
+}
+
+static void release_owner(device_t *d)
+{
+    if (d->i2c_owner) {
+        client_put(d->i2c_owner);
+        d->i2c_owner = NULL;
+    }
+}
+
+/* First queued request that may run now, called with d->lock held */
+static request_t *pick(device_t *d, request_t **prev_out)
+{
+    if (d->i2c_owner && (client_dead(d->i2c_owner) || now_ns() - d->i2c_since > I2C_OWNER_TIMEOUT_NS))
+        release_owner(d);
+
+    request_t *prev = NULL;
+    for (request_t *r = d->head; r; prev = r, r = r->next) {
+        if (!d->i2c_owner || r->client == d->i2c_owner) {
+            *prev_out = prev;
+            return r;
+        }
+    }
+    return NULL;
+}
+
+/* Keep SRAM GPIO config consistent between clients. Every client builds
+ * SET SRAM from its own cached copy, so a pin the client did not mean to
+ * change (same as its last view) gets the real current config instead of
+ * whatever stale value the client had. Called with d->lock held. */
+static void merge_shadow(device_t *d, client_t *c, uint8_t *report)
+{
+    if (report[0] != CMD_SETSRAM || !(report[7] & 0x80) || !c->view_valid)
+        return;
+
+    for (int i = 0; i < MCP2221_GPIO_COUNT; i++) {
+        if (report[8 + i] == c->view[i])
+            report[8 + i] = d->shadow[i];
+    }
+}
+
+/* Update the shadow, the client's view and the I2C owner from a completed request,
+ * called with d->lock held */
+static void track(device_t *d, client_t *c, const uint8_t *sent, const uint8_t *resp, mcp2221_error res)
+{
+    if (res != MCP2221_SUCCESS)
+        return;
+
+    switch (sent[0]) {
+    case CMD_GETSRAM:
+        memcpy(d->shadow, resp + 22, MCP2221_GPIO_COUNT);
+        memcpy(c->view, d->shadow, MCP2221_GPIO_COUNT);
+        c->view_valid = 1;
+        break;
+    case CMD_SETSRAM:
+        if (sent[7] & 0x80) {
+            memcpy(d->shadow, sent + 8, MCP2221_GPIO_COUNT);
+            memcpy(c->view, d->shadow, MCP2221_GPIO_COUNT);
+            c->view_valid = 1;
+        }
+        break;
+    case CMD_SETGPIO:
+        for (int i = 0; i < MCP2221_GPIO_COUNT; i++) {
+            const int idx = (i * 4) + 2;
+            uint8_t bits = 0;
+            uint8_t mask = 0;
+            if (sent[idx]) {
+                mask |= 16;
+                bits |= sent[idx + 1] ? 16 : 0;
+            }
+            if (sent[idx + 2]) {
+                mask |= 8;
+                bits |= sent[idx + 3] ? 8 : 0;
+            }
+            d->shadow[i] = (d->shadow[i] & ~mask) | bits;
+            c->view[i] = (c->view[i] & ~mask) | bits;
+        }
+        break;
+    case CMD_STATUSSET:
+        // bus is idle again, other clients may use I2C
+        if (d->i2c_owner == c && resp[8] == MCP2221_I2C_IDLE)
+            release_owner(d);
+        break;
+    case CMD_I2CREAD_GET:
+        if (d->i2c_owner == c)
+            release_owner(d);
+        break;
+    default:
+        break;
+    }
+
+    if (sent[0] >= CMD_I2C_FIRST && sent[0] <= CMD_I2C_LAST) {
+        if (d->i2c_owner != c) {
+            client_get(c);
+            d->i2c_owner = c;
+        }
+        d->i2c_since = now_ns();
+    }
+}
+
+/* Only the device thread pushes responses, so the ring has a single producer.
+ * A client with more than SRV_RING_SLOTS requests outstanding would lose a response and wait for it
+ * forever, so it is dropped instead: it still reads the responses in the ring, then sees the hang up. */
+static void respond_shm(client_t *c, mcp2221_error res, const uint8_t *report)
+{
+    srv_slot_t *slot = srv_ringWriteSlot(&c->shm->resp);
+    if (!slot) {
+        fprintf(stderr, "Error: client response ring full, dropping client\n");
+        client_kill(c);
+        return;
+    }
+    slot->status = res;
+    memcpy(slot->report, report, MCP2221_REPORT_SIZE);
+    srv_ringPush(&c->shm->resp);
+
+    const uint64_t one = 1;
+    if (write(c->resp_event, &one, sizeof(one)) != sizeof(one))
+        fprintf(stderr, "Error: cannot signal client: %s\n", strerror(errno));
+}
+
+static void *device_thread(void *arg)
+{
+    device_t *d = arg;
+    uint8_t sent[MCP2221_REPORT_SIZE];
+
+    pthread_mutex_lock(&d->lock);
+    while (1) {
+        request_t *prev = NULL;
+        request_t *r = NULL;
+
+        while (!d->stop && !(r = pick(d, &prev))) {
+            if (d->head && d->i2c_owner) {
+                // someone else's I2C sequence is in progress, wait for it or its timeout
+                const int64_t deadline = d->i2c_since + I2C_OWNER_TIMEOUT_NS;
+                struct timespec ts = { deadline / 1000000000LL, deadline % 1000000000LL };
+                pthread_cond_timedwait(&d->cond, &d->lock, &ts);
+            } else {
+                pthread_cond_wait(&d->cond, &d->lock);
+            }
+        }
+        if (d->stop)
+            break;
+
+        if (prev)
+            prev->next = r->next;
+        else
+            d->head = r->next;
+        if (d->tail == r)
+            d->tail = prev;
+
+        client_t *c = r->client;
+        merge_shadow(d, c, r->report);
+        memcpy(sent, r->report, sizeof(sent));
+        pthread_mutex_unlock(&d->lock);
+
+        const mcp2221_error res = mcp2221_rawReport(d->handle, r->report);
+        if (res == MCP2221_ERROR_HID || sent[0] == CMD_RESET)
+            device_break(d);
+
+        pthread_mutex_lock(&d->lock);
+        track(d, c, sent, r->report, res);
+        // the owner's reference would keep the broken device from being reclaimed
+        if (device_broken(d))
+            release_owner(d);
+        pthread_mutex_unlock(&d->lock);
+
+        // RESET has no response
+        if (sent[0] != CMD_RESET && !client_dead(c) && r->shm)
+            respond_shm(c, res, r->report);
+        else if (sent[0] != CMD_RESET && !client_dead(c))
+            send_msg(c->fd, SRV_MSG_REPORT, res, r->report, MCP2221_REPORT_SIZE);
+
+        client_put(c);
+        free(r);
+
+        pthread_mutex_lock(&d->lock);
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return NULL;
+}
+
+static device_t *open_device(const char *path)
+{
+    for (device_t *d = devices; d; d = d->next) {
+        if (!device_broken(d) && strcmp(d->path, path) == 0) {
+            pthread_mutex_lock(&refs_lock);
+            d->users++;
+            pthread_mutex_unlock(&refs_lock);
+            return d;
+        }
+    }
+
+    device_t *d = calloc(1, sizeof(*d));
+    if (!d)
+        return NULL;
+
+    snprintf(d->path, sizeof(d->path), "%s", path);
+    d->handle = mcp2221_open_byPath(d->path);
+    if (!d->handle) {
+        free(d);
+        return NULL;
+    }
+    memcpy(d->shadow, d->handle->gpioCache, MCP2221_GPIO_COUNT);
+
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&d->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&d->thread, NULL, device_thread, d) != 0) {
+        mcp2221_close(d->handle);
+        free(d);
+        return NULL;
+    }
+
+    d->users = 1;
+    d->next = devices;
+    devices = d;
+    fprintf(stderr, "opened %s\n", path);
+    return d;
+}
+
+static void close_device(device_t *d)
+{
+    pthread_mutex_lock(&d->lock);
+    d->stop = 1;
+    pthread_cond_signal(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+    pthread_join(d->thread, NULL);
+
+    while (d->head) {
+        request_t *r = d->head;
+        d->head = r->next;
+        client_put(r->client);
+        free(r);
+    }
+    release_owner(d);
+
+    // detached shm threads of killed clients may still be dropping their references
+    pthread_mutex_lock(&refs_lock);
+    while (d->users) {
+        pthread_mutex_unlock(&refs_lock);
+        usleep(1000);
+        pthread_mutex_lock(&refs_lock);
+    }
+    pthread_mutex_unlock(&refs_lock);
+
+    mcp2221_close(d->handle);
+    pthread_cond_destroy(&d->cond);
+    pthread_mutex_destroy(&d->lock);
+    free(d);
+}
+
+static void close_devices(void)
+{
+    while (devices) {
+        device_t *d = devices;
+        devices = d->next;
+        close_device(d);
+    }
+}
+
+/* Close broken devices once the last client that opened them is gone,
+ * returns 1 if some are still waiting for that */
+static int reap_devices(void)
+{
+    int waiting = 0;
+
+    for (device_t **p = &devices; *p;) {
+        device_t *d = *p;
+        if (!device_broken(d)) {
+            p = &d->next;
+            continue;
+        }
+
+        pthread_mutex_lock(&refs_lock);
+        const int users = d->users;
+        pthread_mutex_unlock(&refs_lock);
+        if (users) {
+            waiting = 1;
+            p = &d->next;
+            continue;
+        }
+
+        // no client is left that could queue requests for it
+        *p = d->next;
+        fprintf(stderr, "closed %s\n", d->path);
+        close_device(d);
+    }
+
+    return waiting;
+}
+
+static void copy_string(wchar_t *dst, const wchar_t *src)
+{
+    dst[0] = L'\0';
+    if (src) {
+        wcsncpy(dst, src, MCP2221_STR_LEN - 1);
+        dst[MCP2221_STR_LEN - 1] = L'\0';
+    }
+}
+
+/* Queue a report for the client's device, behind everything else for it */
+static int enqueue(client_t *c, const uint8_t *report, int shm)
+{
+    request_t *r = malloc(sizeof(*r));
+    if (!r)
+        return -1;
+    r->next = NULL;
+    r->client = c;
+    r->shm = shm;
+    memcpy(r->report, report, MCP2221_REPORT_SIZE);
+    client_get(c);
+
+    device_t *d = c->dev;
+    pthread_mutex_lock(&d->lock);
+    // a stopped device thread won't take it, and close_device() has already drained the queue
+    if (d->stop) {
+        pthread_mutex_unlock(&d->lock);
+        client_put(c);
+        free(r);
+        return -1;
+    }
+    if (d->tail)
+        d->tail->next = r;
+    else
+        d->head = r;
+    d->tail = r;
+    pthread_cond_signal(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+    return 0;
+}
+
+/* Drains the client's request ring whenever it signals, until the client goes */
+static void *shm_thread(void *arg)
+{
+    client_t *c = arg;
+    srv_ring_t *ring = &c->shm->req;
+
+    while (!client_dead(c)) {
+        uint64_t count;
+        if (read(c->req_event, &count, sizeof(count)) < 0 && errno != EINTR)
+            break;
+
+        srv_slot_t *slot;
+        while (!client_dead(c) && (slot = srv_ringReadSlot(ring))) {
+            if (enqueue(c, slot->report, 1) != 0)
+                break;
+            srv_ringPop(ring);
+        }
+    }
+
+    client_put(c);
+    return NULL;
+}
+
+static int setup_shm(client_t *c, const int *fds)
+{
+    struct stat st;
+    const int seals = fcntl(fds[0], F_GET_SEALS);
+
+    // the client must not be able to shrink the region and SIGBUS us
+    if (seals < 0 || !(seals & F_SEAL_SHRINK) || fstat(fds[0], &st) != 0 || st.st_size < (off_t)sizeof(srv_shm_t))
+        return -1;
+
+    srv_shm_t *shm = mmap(NULL, sizeof(srv_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (shm == MAP_FAILED)
+        return -1;
+    if (shm->magic != SRV_SHM_MAGIC || shm->slots != SRV_RING_SLOTS) {
+        munmap(shm, sizeof(srv_shm_t));
+        return -1;
+    }
+
+    c->shm = shm;
+    c->req_event = fds[1];
+    c->resp_event = fds[2];
+
+    pthread_t thread;
+    client_get(c);
+    if (pthread_create(&thread, NULL, shm_thread, c) != 0) {
+        c->shm = NULL;
+        munmap(shm, sizeof(srv_shm_t));
+        client_put(c);
+        return -1;
+    }
+    pthread_detach(thread);
+
+    close(fds[0]);
+    return 0;
+}
+
+static int handle_list(client_t *c, const srv_list_t *list)
+{
+    struct hid_device_info *all = hid_enumerate(list->vid, list->pid);
+    int count = 0;
+
+    for (struct hid_device_info *i = all; i; i = i->next)
+        count++;
+
+    srv_devinfo_t *infos = calloc(count ? count : 1, sizeof(srv_devinfo_t));
+    if (!infos) {
+        hid_free_enumeration(all);
+        return send_msg(c->fd, SRV_MSG_LIST, MCP2221_ERROR, NULL, 0);
+    }
+
+    int n = 0;
+    for (struct hid_device_info *i = all; i; i = i->next, n++) {
+        strncpy(infos[n].path, i->path, SRV_PATH_LEN - 1);
+        infos[n].vid = i->vendor_id;
+        infos[n].pid = i->product_id;
+        infos[n].interface = i->interface_number;
+        copy_string(infos[n].manufacturer, i->manufacturer_string);
+        copy_string(infos[n].product, i->product_string);
+        copy_string(infos[n].serial, i->serial_number);
+    }
+    hid_free_enumeration(all);
+
+    const int res = send_msg(c->fd, SRV_MSG_LIST, MCP2221_SUCCESS, infos, count * sizeof(srv_devinfo_t));
+    free(infos);
+    return res;
+}
+
+/* Read and handle one message, returns -1 if the client has to go */
+static int handle_client(client_t *c)
+{
+    srv_header_t hdr;
+    union {
+        srv_list_t list;
+        char path[SRV_PATH_LEN];
+        uint8_t report[MCP2221_REPORT_SIZE];
+    } payload;
+    int fds[3];
+    int nfds;
+
+    if (read_header(c->fd, &hdr, fds, &nfds) != 0)
+        return -1;
+
+    // only SHM carries fds, and exactly memfd + 2 eventfds
+    if (nfds && (hdr.type != SRV_MSG_SHM || nfds != 3 || c->shm || !c->dev)) {
+        for (int i = 0; i < nfds; i++)
+            close(fds[i]);
+        return -1;
+    }
+
+    if (hdr.len > sizeof(payload) || read_all(c->fd, &payload, hdr.len) != 0) {
+        for (int i = 0; i < nfds; i++)
+            close(fds[i]);
+        return -1;
+    }
+
+    switch (hdr.type) {
+    case SRV_MSG_LIST:
+        if (hdr.len != sizeof(srv_list_t))
+            return -1;
+        if (match_vid && payload.list.vid != 0 && payload.list.vid != match_vid)
+            return send_msg(c->fd, SRV_MSG_LIST, MCP2221_SUCCESS, NULL, 0);
+        if (match_pid && payload.list.pid != 0 && payload.list.pid != match_pid)
+            return send_msg(c->fd, SRV_MSG_LIST, MCP2221_SUCCESS, NULL, 0);
+        if (match_vid)
+            payload.list.vid = match_vid;
+        if (match_pid)
+            payload.list.pid = match_pid;
+        return handle_list(c, &payload.list);
+
+    case SRV_MSG_OPEN:
+        if (hdr.len != SRV_PATH_LEN || c->dev)
+            return -1;
+        payload.path[SRV_PATH_LEN - 1] = '\0';
+        c->dev = open_device(payload.path);
+        return send_msg(c->fd, SRV_MSG_OPEN, c->dev ? MCP2221_SUCCESS : MCP2221_ERROR_HID, NULL, 0);
+
+    case SRV_MSG_REPORT:
+        if (hdr.len != MCP2221_REPORT_SIZE || !c->dev)
+            return -1;
+        // the client may already send its next request
+        return enqueue(c, payload.report, 0);
+
+    case SRV_MSG_SHM:
+        if (nfds != 3 || hdr.len != 0)
+            return -1;
+        if (setup_shm(c, fds) != 0) {
+            for (int i = 0; i < 3; i++)
+                close(fds[i]);
+            // the client carries on over the socket
+            return send_msg(c->fd, SRV_MSG_SHM, MCP2221_ERROR, NULL, 0);
+        }
+        return send_msg(c->fd, SRV_MSG_SHM, MCP2221_SUCCESS, NULL, 0);
+
+    default:
+        return -1;
+    }
+}
+
+static int listen_on(const char *path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: socket path too long!\n");
+        return -1;
+    }
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Error: socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+        fprintf(stderr, "Error: cannot listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    int option_index = 0;
+    const char *socket_path = DEFAULT_SOCKET;
+
+    while ((opt = getopt_long(argc, argv, short_options,
+            long_options, &option_index)) != -1) {
+
+        switch (opt) {
+        case 0:
+            switch (option_index) {
+            case IDX_SOCKET: socket_path = optarg; break;
+            case IDX_VID: match_vid = strtoul(optarg, NULL, 0); break;
+            case IDX_PID: match_pid = strtoul(optarg, NULL, 0); break;
+            case IDX_HELP:
+            default:
+                print_help();
+                return 0;
+            }
+            break;
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'v':
+            match_vid = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            match_pid = strtoul(optarg, NULL, 0);
+            break;
+        case 'h':
+        default:
+            print_help();
+            return 0;
+        }
+    }
+
+    // we are the server, never talk to ourselves
+    unsetenv(MCP2221_SERVER_ENV);
+
+    if (mcp2221_init() != MCP2221_SUCCESS) {
+        fprintf(stderr, "Error: cannot initialize HIDAPI!\n");
+        return -1;
+    }
+
+    const int lfd = listen_on(socket_path);
+    if (lfd < 0) {
+        mcp2221_exit();
+        return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    client_t *clients[MAX_CLIENTS];
+    int nclients = 0;
+    int reaping = 0;
+
+    while (!quit) {
+        struct pollfd fds[MAX_CLIENTS + 1];
+
+        fds[0].fd = lfd;
+        fds[0].events = (nclients < MAX_CLIENTS) ? POLLIN : 0;
+        for (int i = 0; i < nclients; i++) {
+            fds[i + 1].fd = clients[i]->fd;
+            fds[i + 1].events = POLLIN;
+        }
+
+        // the last client of a broken device can be freed on its device thread, so look again now and then
+        if (poll(fds, nclients + 1, reaping ? 100 : -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error: poll: %s\n", strerror(errno));
+            break;
+        }
+
+        // walk backwards so removing a client does not shift the ones still to check
+        for (int i = nclients - 1; i >= 0; i--) {
+            if (!fds[i + 1].revents)
+                continue;
+            if (!(fds[i + 1].revents & POLLIN) || handle_client(clients[i]) != 0) {
+                client_t *c = clients[i];
+                client_kill(c);
+                clients[i] = clients[--nclients];
+                client_put(c);
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            const int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                client_t *c = calloc(1, sizeof(*c));
+                if (c) {
+                    c->fd = fd;
+                    c->refs = 1;
+                    clients[nclients++] = c;
+                } else {
+                    close(fd);
+                }
+            }
+        }
+
+        reaping = reap_devices();
+    }
+
+    close(lfd);
+    unlink(socket_path);
+
+    for (int i = 0; i < nclients; i++) {
+        client_kill(clients[i]);
+        client_put(clients[i]);
+    }
+    close_devices();
+    mcp2221_exit();
+
+    return 0;
+}
+
+/* *INDENT-OFF* */
+/******************************************************************************
+ * Local Variables:
+ * mode: C
+ * c-indent-level: 4
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ * kate: space-indent on; indent-width 4; mixedindent off; indent-mode cstyle;
+ * vim: set expandtab filetype=c:
+ * vi: set et tabstop=4 shiftwidth=4: */
@@ -0,0 +1,644 @@
+/* -*-C-*- */
+/* SPDX-License-Identifier:    GPL-3.0 */
+/*
+ * Import Linux usbmon captures (pcap or pcapng, as written by Wireshark or
+ * tcpdump -i usbmonN) of MCP2221 sessions
+ *
+ * The HID interrupt reports of MCP2221 devices are paired into requests and
+ * responses, decoded into the command names used by the library and
+ * summarised as per-command latency statistics. Optionally a timeline is
+ * printed and a recording is written that the library can replay
+ * (MCP2221_REPLAY, see mcp2221_recheader_t).
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libmcp2221/libmcp2221.h"
+
+#define PCAP_MAGIC_US       0xA1B2C3D4
+#define PCAP_MAGIC_NS       0xA1B23C4D
+#define PCAPNG_SHB          0x0A0D0D0A
+#define PCAPNG_BOM          0x1A2B3C4D
+#define PCAPNG_IDB          0x00000001
+#define PCAPNG_EPB          0x00000006
+
+#define LINKTYPE_USB_LINUX          189     // 48 byte usbmon header
+#define LINKTYPE_USB_LINUX_MMAPPED  220     // 64 byte usbmon header
+
+#define USBMON_XFER_INTR    1
+#define MAX_INTERFACES      32
+#define MAX_DEVICES         64
+#define MAX_PENDING         16              // Requests waiting for their response, per device
+#define REPORT_SIZE         MCP2221_REPORT_SIZE
+
+#define IDX_HELP 0
+#define IDX_OUTPUT 1
+#define IDX_TIMELINE 2
+#define IDX_DEVICE 3
+
+static const char *const short_options = "ho:td:";
+
+static const struct option long_options[] = {
+        [IDX_HELP]     = {"help",     no_argument,       0, 0},
+        [IDX_OUTPUT]   = {"output",   required_argument, 0, 0},
+        [IDX_TIMELINE] = {"timeline", no_argument,       0, 0},
+        [IDX_DEVICE]   = {"device",   required_argument, 0, 0},
+        // end of list
+        {0, 0, 0, 0}
+};
+
+// usbmon packet header, the 64 byte variant adds 16 bytes we don't need
+typedef struct {
+    uint64_t id;
+    uint8_t type;           // 'S'ubmission, 'C'ompletion, 'E'rror
+    uint8_t xfer_type;
+    uint8_t epnum;          // Bit 7 set = IN
+    uint8_t devnum;
+    uint16_t busnum;
+    int8_t flag_setup;
+    int8_t flag_data;       // 0 = data present
+    int64_t ts_sec;
+    int32_t ts_usec;
+    int32_t status;
+    uint32_t length;
+    uint32_t len_cap;
+    uint8_t setup[8];
+} __attribute__((packed)) usbmon_t;
+
+static const struct {
+    uint8_t cmd;
+    const char *name;
+} commands[] = {
+    {0x10, "STATUSSET"},
+    {0x40, "I2CREAD_GET"},
+    {0x50, "SETGPIO"},
+    {0x51, "GETGPIO"},
+    {0x60, "SETSRAM"},
+    {0x61, "GETSRAM"},
+    {0x70, "RESET"},
+    {0x90, "I2CWRITE"},
+    {0x91, "I2CREAD"},
+    {0x92, "I2CWRITE_REPEATSTART"},
+    {0x93, "I2CREAD_REPEATSTART"},
+    {0x94, "I2CWRITE_NOSTOP"},
+    {0xB0, "READFLASH"},
+    {0xB1, "WRITEFLASH"},
+    {0xB2, "FLASHPASS"},
+};
+#define COMMAND_COUNT   (sizeof(commands) / sizeof(commands[0]))
+
+typedef struct {
+    uint8_t cmd;
+    int64_t us;
+    uint8_t report[REPORT_SIZE];
+} pending_t;
+
+typedef struct {
+    uint16_t bus;
+    uint8_t dev;
+    int excluded;           // Device descriptor says it is not an MCP2221
+    int id;                 // Number in the recording, -1 until the first request
+    unsigned long requests;
+    unsigned long responses;
+    unsigned long unanswered;
+    pending_t pending[MAX_PENDING];
+    int pendingCount;
+} device_t;
+
+// Latency samples of one command
+typedef struct {
+    int64_t *us;
+    size_t count;
+    size_t size;
+} samples_t;
+
+static device_t devices[MAX_DEVICES];
+static int device_count;
+static samples_t latency[COMMAND_COUNT];
+static int timeline;
+static int filter_bus = -1;
+static int filter_dev = -1;
+static int64_t first_us = -1;
+static int64_t last_us;
+static unsigned long packets;
+
+static FILE *rec;
+static int64_t rec_last_us;     // relative to first_us
+static int rec_devices;
+
+static void print_help()
+{
+    puts("mcp2221pcap: decode MCP2221 traffic in a usbmon capture");
+    puts("usage: mcp2221pcap [options] <capture.pcap|capture.pcapng>");
+    puts("    -h|--help                 print this help");
+    puts("    -t|--timeline             print every request and response");
+    puts("    -o|--output <file>        write a recording for MCP2221_REPLAY");
+    puts("    -d|--device <bus.dev>     only this device (default: every MCP2221 found)\n");
+}
+
+static int command_index(uint8_t cmd)
+{
+    for (size_t i = 0; i < COMMAND_COUNT; i++)
+        if (commands[i].cmd == cmd)
+            return i;
+    return -1;
+}
+
+static device_t *find_device(uint16_t bus, uint8_t dev)
+{
+    for (int i = 0; i < device_count; i++)
+        if (devices[i].bus == bus && devices[i].dev == dev)
+            return &devices[i];
+    if (device_count == MAX_DEVICES)
+        return NULL;
+    device_t *d = &devices[device_count++];
+    memset(d, 0, sizeof(*d));
+    d->bus = bus;
+    d->dev = dev;
+    d->id = -1;
+    return d;
+}
+
+static void add_sample(samples_t *s, int64_t us)
+{
+    if (s->count == s->size) {
+        size_t size = s->size ? s->size * 2 : 1024;
+        int64_t *p = realloc(s->us, size * sizeof(int64_t));
+        if (!p)
+            return;
+        s->us = p;
+        s->size = size;
+    }
+    s->us[s->count++] = us;
+}
+
+static int report_len(const uint8_t *report)
+{
+    int len = REPORT_SIZE;
+    while (len && !report[len - 1])
+        len--;
+    return len;
+}
+
+static void rec_write(int64_t us, mcp2221_rectype_t type, int device, const void *payload, int len)
+{
+    if (!rec)
+        return;
+
+    mcp2221_recrecord_t r;
+    int64_t delta = (us - first_us) - rec_last_us;
+    if (delta < 0)
+        delta = 0;
+    rec_last_us += delta;
+
+    r.deltaUs = (delta > UINT32_MAX) ? UINT32_MAX : delta;
+    r.type = type;
+    r.device = device;
+    r.len = len;
+    r.status = MCP2221_SUCCESS;
+    fwrite(&r, sizeof(r), 1, rec);
+    if (len)
+        fwrite(payload, len, 1, rec);
+}
+
+static void rec_open(device_t *d, int64_t us)
+{
+    char payload[64];
+    int len;
+
+    if (rec_devices == 256)
+        return;
+    d->id = rec_devices++;
+    // path, then an empty serial
+    len = snprintf(payload, sizeof(payload), "usbmon:%u.%u", d->bus, d->dev) + 1;
+    payload[len++] = '\0';
+    rec_write(us, MCP2221_REC_OPEN, d->id, payload, len);
+}
+
+static void decode(const uint8_t *req, const uint8_t *resp, char *buf, size_t size)
+{
+    const int len = req[1] | (req[2] << 8);
+
+    buf[0] = '\0';
+    switch (req[0]) {
+    case 0x10:
+        snprintf(buf, size, "%s%si2c=0x%02x", (req[2] == 0x10) ? "cancel " : "",
+                 (req[3] == 0x20) ? "speed " : "", resp ? resp[8] : 0);
+        if (req[3] == 0x20)
+            snprintf(buf + strlen(buf), size - strlen(buf), " div=%u%s", req[4],
+                     (resp && resp[3] == 0x20) ? "" : " rejected");
+        break;
+    case 0x90: case 0x92: case 0x94:
+    case 0x91: case 0x93:
+        snprintf(buf, size, "addr=0x%02x len=%d%s", req[3] >> 1, len, (resp && resp[1]) ? " busy" : "");
+        break;
+    case 0x40:
+        if (resp && resp[1])
+            snprintf(buf, size, "error=0x%02x", resp[1]);
+        else if (resp)
+            snprintf(buf, size, "len=%u", resp[3]);
+        break;
+    case 0x51:
+        if (resp)
+            snprintf(buf, size, "gpio=%u,%u,%u,%u", resp[2], resp[4], resp[6], resp[8]);
+        break;
+    case 0x60:
+        snprintf(buf, size, "%s%s%s", (req[3] & 0x80 || req[4] & 0x80) ? "dac " : "",
+                 (req[5] & 0x80) ? "adc " : "", (req[7] & 0x80) ? "gpio" : "");
+        break;
+    case 0xB0: case 0xB1:
+        snprintf(buf, size, "section=%u", req[1]);
+        break;
+    }
+}
+
+static void request(device_t *d, int64_t us, const uint8_t *report)
+{
+    d->requests++;
+    if (rec) {
+        if (d->id < 0)
+            rec_open(d, us);
+        if (d->id >= 0)
+            rec_write(us, MCP2221_REC_SEND, d->id, report, report_len(report));
+    }
+
+    // RESET has no response
+    if (report[0] == 0x70) {
+        if (timeline)
+            printf("%12.6f %3u.%-3u %-20s\n", (us - first_us) / 1e6, d->bus, d->dev, "RESET");
+        return;
+    }
+
+    if (d->pendingCount == MAX_PENDING) {
+        d->unanswered++;
+        memmove(&d->pending[0], &d->pending[1], (MAX_PENDING - 1) * sizeof(pending_t));
+        d->pendingCount--;
+    }
+    pending_t *p = &d->pending[d->pendingCount++];
+    p->cmd = report[0];
+    p->us = us;
+    memcpy(p->report, report, REPORT_SIZE);
+}
+
+// The response echoes the command, requests answered out of order or not at all are skipped
+static void response(device_t *d, int64_t us, const uint8_t *report)
+{
+    int i;
+    for (i = 0; i < d->pendingCount; i++)
+        if (d->pending[i].cmd == report[0])
+            break;
+    if (i == d->pendingCount)
+        return;
+
+    pending_t *p = &d->pending[i];
+    const int64_t lat = us - p->us;
+    const int idx = command_index(p->cmd);
+
+    d->responses++;
+    d->unanswered += i;
+    if (idx >= 0)
+        add_sample(&latency[idx], lat);
+    if (rec && d->id >= 0)
+        rec_write(us, MCP2221_REC_GET, d->id, report, report_len(report));
+
+    if (timeline) {
+        char details[64];
+        decode(p->report, report, details, sizeof(details));
+        printf("%12.6f %3u.%-3u %-20s %8.3f ms  %s\n", (p->us - first_us) / 1e6, d->bus, d->dev,
+               idx >= 0 ? commands[idx].name : "?", lat / 1e3, details);
+    }
+
+    d->pendingCount -= i + 1;
+    memmove(&d->pending[0], &d->pending[i + 1], d->pendingCount * sizeof(pending_t));
+}
+
+static uint16_t swap16(uint16_t v) { return __builtin_bswap16(v); }
+static uint32_t swap32(uint32_t v) { return __builtin_bswap32(v); }
+static uint64_t swap64(uint64_t v) { return __builtin_bswap64(v); }
+
+static void packet(const uint8_t *data, uint32_t caplen, int linktype, int swapped)
+{
+    const uint32_t hdrlen = (linktype == LINKTYPE_USB_LINUX_MMAPPED) ? 64 : 48;
+    usbmon_t h;
+
+    if ((linktype != LINKTYPE_USB_LINUX && linktype != LINKTYPE_USB_LINUX_MMAPPED) || caplen < hdrlen)
+        return;
+    memcpy(&h, data, sizeof(h));
+    if (swapped) {
+        h.busnum = swap16(h.busnum);
+        h.ts_sec = swap64(h.ts_sec);
+        h.ts_usec = swap32(h.ts_usec);
+        h.status = swap32(h.status);
+        h.len_cap = swap32(h.len_cap);
+    }
+    packets++;
+
+    const uint8_t *payload = data + hdrlen;
+    uint32_t len = h.len_cap;
+    if (len > caplen - hdrlen)
+        len = caplen - hdrlen;
+
+    if (filter_bus >= 0 && (h.busnum != filter_bus || h.devnum != filter_dev))
+        return;
+
+    const int64_t us = (h.ts_sec * 1000000LL) + h.ts_usec;
+    if (first_us < 0)
+        first_us = us;
+    last_us = us;
+
+    // Device descriptor (GET_DESCRIPTOR completion on endpoint 0) tells us whether it is an MCP2221
+    if (h.type == 'C' && (h.epnum & 0x7F) == 0 && len >= 12 && payload[0] == 18 && payload[1] == 1) {
+        const uint16_t vid = payload[8] | (payload[9] << 8);
+        const uint16_t pid = payload[10] | (payload[11] << 8);
+        device_t *d = find_device(h.busnum, h.devnum);
+        if (d)
+            d->excluded = (vid != MCP2221_DEFAULT_VID || pid != MCP2221_DEFAULT_PID);
+        return;
+    }
+
+    if (h.xfer_type != USBMON_XFER_INTR || h.flag_data != 0 || len != REPORT_SIZE)
+        return;
+
+    const int in = (h.epnum & 0x80) != 0;
+    // OUT data is in the submission, IN data in the successful completion
+    if ((!in && h.type != 'S') || (in && (h.type != 'C' || h.status != 0)))
+        return;
+
+    device_t *d = find_device(h.busnum, h.devnum);
+    if (!d || d->excluded)
+        return;
+
+    if (!in) {
+        // Only MCP2221 commands, so other 64 byte HID devices don't end up in the report
+        if (command_index(payload[0]) >= 0)
+            request(d, us, payload);
+    } else {
+        response(d, us, payload);
+    }
+}
+
+static int parse_pcap(const uint8_t *map, size_t size)
+{
+    uint32_t magic;
+    memcpy(&magic, map, 4);
+    const int swapped = (magic == swap32(PCAP_MAGIC_US) || magic == swap32(PCAP_MAGIC_NS));
+
+    uint32_t linktype;
+    memcpy(&linktype, map + 20, 4);
+    if (swapped)
+        linktype = swap32(linktype);
+
+    size_t off = 24;
+    while (off + 16 <= size) {
+        uint32_t caplen;
+        memcpy(&caplen, map + off + 8, 4);
+        if (swapped)
+            caplen = swap32(caplen);
+        off += 16;
+        if (caplen > size - off)
+            break;
+        packet(map + off, caplen, linktype & 0xFFFF, swapped);
+        off += caplen;
+    }
+    return 0;
+}
+
+static int parse_pcapng(const uint8_t *map, size_t size)
+{
+    int linktypes[MAX_INTERFACES];
+    int interfaces = 0;
+    int swapped = 0;
+    size_t off = 0;
+
+    while (off + 12 <= size) {
+        uint32_t type, len;
+        memcpy(&type, map + off, 4);
+        memcpy(&len, map + off + 4, 4);
+
+        // A new section can change the byte order and starts over with the interfaces
+        if (type == PCAPNG_SHB) {
+            uint32_t bom;
+            memcpy(&bom, map + off + 8, 4);
+            swapped = (bom != PCAPNG_BOM);
+            interfaces = 0;
+        }
+        if (swapped) {
+            type = swap32(type);
+            len = swap32(len);
+        }
+        if (len < 12 || len > size - off)
+            break;
+
+        const uint8_t *body = map + off + 8;
+        if (type == PCAPNG_IDB && interfaces < MAX_INTERFACES) {
+            uint16_t linktype;
+            memcpy(&linktype, body, 2);
+            linktypes[interfaces++] = swapped ? swap16(linktype) : linktype;
+        } else if (type == PCAPNG_EPB && len >= 32) {
+            uint32_t iface, caplen;
+            memcpy(&iface, body, 4);
+            memcpy(&caplen, body + 12, 4);
+            if (swapped) {
+                iface = swap32(iface);
+                caplen = swap32(caplen);
+            }
+            if ((int)iface < interfaces && caplen <= len - 32)
+                packet(body + 20, caplen, linktypes[iface], swapped);
+        }
+        off += len;
+    }
+    return 0;
+}
+
+static int compare_us(const void *a, const void *b)
+{
+    const int64_t x = *(const int64_t *)a;
+    const int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_stats(void)
+{
+    int found = 0;
+
+    printf("%s%lu usbmon packets, %.3f s\n", timeline ? "\n" : "", packets,
+           (first_us >= 0) ? (last_us - first_us) / 1e6 : 0.0);
+
+    for (int i = 0; i < device_count; i++) {
+        const device_t *d = &devices[i];
+        if (!d->requests)
+            continue;
+        found++;
+        printf("device %u.%u: %lu requests, %lu responses, %lu unanswered\n", d->bus, d->dev,
+               d->requests, d->responses, d->unanswered + d->pendingCount);
+    }
+    if (!found) {
+        puts("no MCP2221 traffic found");
+        return;
+    }
+
+    printf("\n%-20s %9s %9s %9s %9s %9s %9s\n", "command", "count", "min ms", "avg ms", "p50 ms", "p99 ms", "max ms");
+    for (size_t c = 0; c < COMMAND_COUNT; c++) {
+        samples_t *s = &latency[c];
+        if (!s->count)
+            continue;
+        qsort(s->us, s->count, sizeof(int64_t), compare_us);
+        int64_t total = 0;
+        for (size_t i = 0; i < s->count; i++)
+            total += s->us[i];
+        printf("%-20s %9zu %9.3f %9.3f %9.3f %9.3f %9.3f\n", commands[c].name, s->count,
+               s->us[0] / 1e3, (total / (double)s->count) / 1e3, s->us[s->count / 2] / 1e3,
+               s->us[(s->count * 99) / 100] / 1e3, s->us[s->count - 1] / 1e3);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    int option_index = 0;
+    const char *output = NULL;
+    unsigned int bus, dev;
+
+    while ((opt = getopt_long(argc, argv, short_options,
+            long_options, &option_index)) != -1) {
+
+        switch (opt) {
+        case 0:
+            switch (option_index) {
+            case IDX_OUTPUT: output = optarg; break;
+            case IDX_TIMELINE: timeline = 1; break;
+            case IDX_DEVICE:
+                if (sscanf(optarg, "%u.%u", &bus, &dev) != 2) {
+                    fprintf(stderr, "Error: device must be bus.dev!\n");
+                    return 1;
+                }
+                filter_bus = bus;
+                filter_dev = dev;
+                break;
+            case IDX_HELP:
+            default:
+                print_help();
+                return 0;
+            }
+            break;
+        case 'o': output = optarg; break;
+        case 't': timeline = 1; break;
+        case 'd':
+            if (sscanf(optarg, "%u.%u", &bus, &dev) != 2) {
+                fprintf(stderr, "Error: device must be bus.dev!\n");
+                return 1;
+            }
+            filter_bus = bus;
+            filter_dev = dev;
+            break;
+        case 'h':
+        default:
+            print_help();
+            return 0;
+        }
+    }
+
+    if (optind >= argc) {
+        print_help();
+        return 1;
+    }
+
+    const int fd = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Error: cannot open %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    if (st.st_size < 24) {
+        fprintf(stderr, "Error: %s is not a capture!\n", argv[optind]);
+        close(fd);
+        return 1;
+    }
+
+    const uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: cannot map %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+
+    if (output) {
+        rec = fopen(output, "wb");
+        if (!rec) {
+            fprintf(stderr, "Error: cannot open %s: %s\n", output, strerror(errno));
+            munmap((void *)map, st.st_size);
+            return 1;
+        }
+        // Placeholder, the header is written once the start of the capture is known
+        mcp2221_recheader_t hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        fwrite(&hdr, sizeof(hdr), 1, rec);
+    }
+
+    uint32_t magic;
+    memcpy(&magic, map, 4);
+    int res = 0;
+    if (magic == PCAP_MAGIC_US || magic == PCAP_MAGIC_NS ||
+        magic == swap32(PCAP_MAGIC_US) || magic == swap32(PCAP_MAGIC_NS)) {
+        res = parse_pcap(map, st.st_size);
+    } else if (magic == PCAPNG_SHB) {
+        res = parse_pcapng(map, st.st_size);
+    } else {
+        fprintf(stderr, "Error: %s is neither pcap nor pcapng!\n", argv[optind]);
+        res = 1;
+    }
+
+    if (!res) {
+        if (rec) {
+            // The recording starts at the first packet, every device is closed at its end
+            for (int i = 0; i < device_count; i++)
+                if (devices[i].id >= 0)
+                    rec_write(last_us, MCP2221_REC_CLOSE, devices[i].id, NULL, 0);
+
+            // usbmon times are wall clock, there is no monotonic time to give
+            mcp2221_recheader_t hdr;
+            memset(&hdr, 0, sizeof(hdr));
+            memcpy(hdr.magic, MCP2221_REC_MAGIC, sizeof(hdr.magic));
+            hdr.version = MCP2221_REC_VERSION;
+            hdr.headerSize = sizeof(hdr);
+            hdr.realtimeStartNs = (first_us > 0) ? first_us * 1000 : 0;
+            rewind(rec);
+            fwrite(&hdr, sizeof(hdr), 1, rec);
+        }
+        print_stats();
+    }
+
+    if (rec && fclose(rec) != 0) {
+        fprintf(stderr, "Error: cannot write %s: %s\n", output, strerror(errno));
+        res = 1;
+    }
+    munmap((void *)map, st.st_size);
+
+    return res;
+}
+
+/* *INDENT-OFF* */
+/******************************************************************************
+ * Local Variables:
+ * mode: C
+ * c-indent-level: 4
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ * kate: space-indent on; indent-width 4; mixedindent off; indent-mode cstyle;
+ * vim: set expandtab filetype=c:
+ * vi: set et tabstop=4 shiftwidth=4: */
@@ -0,0 +1,380 @@
+/* -*-C-*- */
+/* SPDX-License-Identifier:    GPL-3.0 */
+/*
+ * Capacity report: achievable sample rates for a job mix, per board and for
+ * several boards sharing one full-speed USB bus
+ *
+ * The job mix is run as a cycle on a simulated device with the virtual
+ * timing model (see mcp2221_simClock()), so the result includes the
+ * library's own polling and is the same on every run. No hardware is used.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <inttypes.h>
+
+#include "libmcp2221/libmcp2221.h"
+
+#define MAX_JOBS        32
+#define I2C_CLOCK       12000000
+#define I2C_ADDRESS     0x50
+
+#define IDX_HELP 0
+#define IDX_CYCLES 1
+#define IDX_FRAME 2
+#define IDX_PROC 3
+#define IDX_ADC 4
+#define IDX_SPEED 5
+#define IDX_BOARDS 6
+#define IDX_RATE 7
+#define IDX_SLOTS 8
+
+static const char *const short_options = "hc:f:s:b:r:";
+
+static const struct option long_options[] = {
+        [IDX_HELP]   = {"help",      no_argument,       0, 0},
+        [IDX_CYCLES] = {"cycles",    required_argument, 0, 0},
+        [IDX_FRAME]  = {"frame",     required_argument, 0, 0},
+        [IDX_PROC]   = {"proc",      required_argument, 0, 0},
+        [IDX_ADC]    = {"adc",       required_argument, 0, 0},
+        [IDX_SPEED]  = {"i2c-speed", required_argument, 0, 0},
+        [IDX_BOARDS] = {"boards",    required_argument, 0, 0},
+        [IDX_RATE]   = {"rate",      required_argument, 0, 0},
+        [IDX_SLOTS]  = {"bus-slots", required_argument, 0, 0},
+        // end of list
+        {0, 0, 0, 0}
+};
+
+typedef enum {
+    JOB_STATUS,
+    JOB_ADC,
+    JOB_GPIO_READ,
+    JOB_GPIO_WRITE,
+    JOB_DAC,
+    JOB_I2C_WRITE,
+    JOB_I2C_READ,
+    JOB_I2C_XFER
+} job_type_t;
+
+static const struct {
+    const char *name;
+    job_type_t type;
+    int bytes;          // takes /bytes
+} job_types[] = {
+    {"status",     JOB_STATUS,     0},
+    {"adc",        JOB_ADC,        0},
+    {"gpio.read",  JOB_GPIO_READ,  0},
+    {"gpio.write", JOB_GPIO_WRITE, 0},
+    {"dac",        JOB_DAC,        0},
+    {"i2c.write",  JOB_I2C_WRITE,  1},
+    {"i2c.read",   JOB_I2C_READ,   1},
+    {"i2c.xfer",   JOB_I2C_XFER,   1},
+};
+
+typedef struct {
+    const char *spec;
+    job_type_t type;
+    int bytes;
+    int count;          // runs per cycle
+    uint64_t total_us;
+    uint64_t max_us;
+    unsigned long reports;
+    unsigned long runs;
+    unsigned long errors;
+} job_t;
+
+static job_t jobs[MAX_JOBS];
+static int job_count;
+
+static void print_help()
+{
+    puts("mcp2221plan: capacity report for a job mix on simulated MCP2221 boards");
+    puts("usage: mcp2221plan [options] job[/bytes][:count] ...");
+    puts("    -h|--help                 print this help");
+    puts("    -c|--cycles <n>           job mix cycles to run (default 100)");
+    puts("    -f|--frame <us>           USB frame interval (default 1000)");
+    puts("    --proc <us>               firmware time per command (default 50)");
+    puts("    --adc <us>                ADC conversion time (default 90)");
+    puts("    -s|--i2c-speed <hz>       I2C clock (default 100000)");
+    puts("    -b|--boards <n>           boards sharing one full-speed bus (default 1)");
+    puts("    -r|--rate <hz>            required cycle rate, checked against the result");
+    puts("    --bus-slots <n>           64 byte interrupt transactions per frame on one bus (default 19)\n");
+    puts("jobs: status, adc, gpio.read, gpio.write, dac, i2c.write/N, i2c.read/N, i2c.xfer/N (N = 1..60 bytes)");
+    puts("example: mcp2221plan -s 400000 -b 4 adc:2 i2c.xfer/16 gpio.write\n");
+}
+
+/* "name[/bytes][:count]" */
+static int parse_job(const char *spec, job_t *job)
+{
+    char name[32];
+    const char *end = spec + strcspn(spec, "/:");
+
+    if ((size_t)(end - spec) >= sizeof(name))
+        return -1;
+    memcpy(name, spec, end - spec);
+    name[end - spec] = 0;
+
+    memset(job, 0, sizeof(*job));
+    job->spec = spec;
+    job->count = 1;
+
+    size_t i;
+    for (i = 0; i < sizeof(job_types) / sizeof(job_types[0]); i++)
+        if (strcmp(job_types[i].name, name) == 0)
+            break;
+    if (i == sizeof(job_types) / sizeof(job_types[0]))
+        return -1;
+    job->type = job_types[i].type;
+
+    if (*end == '/') {
+        job->bytes = strtol(end + 1, (char **)&end, 10);
+        if (!job_types[i].bytes || job->bytes < 1 || job->bytes > 60)
+            return -1;
+    } else if (job_types[i].bytes) {
+        return -1;
+    }
+
+    if (*end == ':') {
+        job->count = strtol(end + 1, (char **)&end, 10);
+        if (job->count < 1)
+            return -1;
+    }
+
+    return *end ? -1 : 0;
+}
+
+static mcp2221_error run_job(mcp2221_t *dev, const job_t *job, int n)
+{
+    uint8_t buf[60];
+    int adc[MCP2221_ADC_COUNT];
+    mcp2221_gpio_value_t gpio[MCP2221_GPIO_COUNT];
+    mcp2221_i2c_state_t state;
+
+    memset(buf, n, sizeof(buf));
+    buf[0] = 0; // register pointer
+
+    switch (job->type) {
+    case JOB_STATUS:
+        return mcp2221_i2cState(dev, &state);
+    case JOB_ADC:
+        return mcp2221_readADC(dev, adc);
+    case JOB_GPIO_READ:
+        return mcp2221_readGPIO(dev, gpio);
+    case JOB_GPIO_WRITE:
+        return mcp2221_setGPIO(dev, MCP2221_GPIO0, (n & 1) ? MCP2221_GPIO_VALUE_HIGH : MCP2221_GPIO_VALUE_LOW);
+    case JOB_DAC:
+        return mcp2221_setDAC(dev, MCP2221_DAC_REF_VDD, n % (MCP2221_DAC_MAX + 1));
+    case JOB_I2C_WRITE:
+        return mcp2221_i2cWriteRead(dev, I2C_ADDRESS, buf, job->bytes, NULL, 0);
+    case JOB_I2C_READ:
+        return mcp2221_i2cWriteRead(dev, I2C_ADDRESS, NULL, 0, buf, job->bytes);
+    case JOB_I2C_XFER:
+        return mcp2221_i2cWriteRead(dev, I2C_ADDRESS, buf, 1, buf, job->bytes);
+    }
+    return MCP2221_INVALID_ARG;
+}
+
+static mcp2221_t *open_sim(const char *timing, int speed)
+{
+    setenv(MCP2221_SIM_ENV, "1", 1);
+    setenv(MCP2221_SIM_TIMING_ENV, timing, 1);
+
+    if (mcp2221_init() != MCP2221_SUCCESS || mcp2221_find(0, 0, NULL, NULL, NULL) < 1)
+        return NULL;
+
+    mcp2221_t *dev = mcp2221_open_byIndex(0);
+    if (!dev)
+        return NULL;
+
+    // GPIO0 output for gpio.write
+    mcp2221_gpioconfset_t conf = mcp2221_GPIOConfInit();
+    conf.conf[0].gpios = MCP2221_GPIO0;
+    conf.conf[0].mode = MCP2221_GPIO_MODE_GPIO;
+    conf.conf[0].direction = MCP2221_GPIO_DIR_OUTPUT;
+    conf.conf[0].value = MCP2221_GPIO_VALUE_LOW;
+
+    if (mcp2221_setGPIOConf(dev, &conf) != MCP2221_SUCCESS ||
+        mcp2221_i2cDivider(dev, (I2C_CLOCK / speed) - 3) != MCP2221_SUCCESS) {
+        mcp2221_close(dev);
+        return NULL;
+    }
+    return dev;
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    int option_index = 0;
+    int cycles = 100;
+    int frame = 1000;
+    int proc = 50;
+    int adc = 90;
+    int speed = 100000;
+    int boards = 1;
+    int slots = 19;
+    double rate = 0;
+
+    while ((opt = getopt_long(argc, argv, short_options,
+            long_options, &option_index)) != -1) {
+
+        switch (opt) {
+        case 0:
+            switch (option_index) {
+            case IDX_CYCLES: cycles = atoi(optarg); break;
+            case IDX_FRAME: frame = atoi(optarg); break;
+            case IDX_PROC: proc = atoi(optarg); break;
+            case IDX_ADC: adc = atoi(optarg); break;
+            case IDX_SPEED: speed = atoi(optarg); break;
+            case IDX_BOARDS: boards = atoi(optarg); break;
+            case IDX_RATE: rate = atof(optarg); break;
+            case IDX_SLOTS: slots = atoi(optarg); break;
+            case IDX_HELP:
+            default:
+                print_help();
+                return 0;
+            }
+            break;
+        case 'c': cycles = atoi(optarg); break;
+        case 'f': frame = atoi(optarg); break;
+        case 's': speed = atoi(optarg); break;
+        case 'b': boards = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'h':
+        default:
+            print_help();
+            return 0;
+        }
+    }
+
+    if (cycles < 1 || frame < 1 || proc < 0 || adc < 0 || boards < 1 || slots < 1 ||
+        speed < (I2C_CLOCK / 258) || speed > (I2C_CLOCK / 4)) {
+        fprintf(stderr, "Error: invalid option value!\n");
+        return 1;
+    }
+
+    for (int i = optind; i < argc; i++) {
+        if (job_count == MAX_JOBS) {
+            fprintf(stderr, "Error: too many jobs!\n");
+            return 1;
+        }
+        if (parse_job(argv[i], &jobs[job_count]) != 0) {
+            fprintf(stderr, "Error: invalid job %s!\n", argv[i]);
+            return 1;
+        }
+        job_count++;
+    }
+    if (!job_count) {
+        print_help();
+        return 1;
+    }
+
+    char timing[128];
+    snprintf(timing, sizeof(timing), "virtual,frame=%d,proc=%d,adc=%d", frame, proc, adc);
+
+    mcp2221_t *dev = open_sim(timing, speed);
+    if (!dev) {
+        fprintf(stderr, "Error: cannot open simulated device!\n");
+        mcp2221_exit();
+        return 1;
+    }
+
+    uint64_t cycle_total = 0;
+    uint64_t cycle_max = 0;
+    unsigned long cycle_reports = 0;
+
+    // one extra cycle first so the I2C engine state is the same for every measured cycle
+    for (int c = -1; c < cycles; c++) {
+        uint64_t cycle_start;
+        unsigned long cycle_start_reports;
+        mcp2221_simClock(dev, &cycle_start, &cycle_start_reports);
+
+        for (int j = 0; j < job_count; j++) {
+            job_t *job = &jobs[j];
+            for (int n = 0; n < job->count; n++) {
+                uint64_t start, end;
+                unsigned long start_reports, end_reports;
+
+                mcp2221_simClock(dev, &start, &start_reports);
+                const mcp2221_error res = run_job(dev, job, n);
+                mcp2221_simClock(dev, &end, &end_reports);
+
+                if (c < 0)
+                    continue;
+                if (res != MCP2221_SUCCESS) {
+                    job->errors++;
+                    mcp2221_i2cCancel(dev);
+                }
+                job->runs++;
+                job->total_us += end - start;
+                job->reports += end_reports - start_reports;
+                if (end - start > job->max_us)
+                    job->max_us = end - start;
+            }
+        }
+
+        uint64_t cycle_end;
+        unsigned long cycle_end_reports;
+        mcp2221_simClock(dev, &cycle_end, &cycle_end_reports);
+        if (c < 0)
+            continue;
+        cycle_total += cycle_end - cycle_start;
+        cycle_reports += cycle_end_reports - cycle_start_reports;
+        if (cycle_end - cycle_start > cycle_max)
+            cycle_max = cycle_end - cycle_start;
+    }
+
+    mcp2221_close(dev);
+    mcp2221_exit();
+
+    const double cycle_avg = (double)cycle_total / cycles;
+    const double reports_per_cycle = (double)cycle_reports / cycles;
+    const double device_rate = 1e6 / cycle_avg;
+    // every report is one OUT and one IN interrupt transaction
+    const double bus_tx = (slots * 1e6) / frame;
+    const double board_tx = 2 * reports_per_cycle * device_rate;
+    const double bus_rate = bus_tx / (2 * reports_per_cycle * boards);
+    const double board_rate = (bus_rate < device_rate) ? bus_rate : device_rate;
+
+    printf("Timing model: frame %dus, command %dus, ADC %dus, I2C %dHz, %d cycles\n\n",
+           frame, proc, adc, speed, cycles);
+    printf("%-20s %5s %10s %8s %8s %6s\n", "job", "count", "avg us", "max us", "reports", "errors");
+    for (int j = 0; j < job_count; j++) {
+        const job_t *job = &jobs[j];
+        printf("%-20s %5d %10.1f %8" PRIu64 " %8.1f %6lu\n", job->spec, job->count,
+               (double)job->total_us / job->runs, job->max_us, (double)job->reports / job->runs, job->errors);
+    }
+
+    printf("\nCycle: avg %.1fus, max %" PRIu64 "us, %.1f reports\n", cycle_avg, cycle_max, reports_per_cycle);
+    printf("One board: %.2f cycles/s, %.0f interrupt transactions/s\n", device_rate, board_tx);
+    printf("Bus: %.0f transactions/s (%d per frame), up to %.0f boards at the full rate\n",
+           bus_tx, slots, (double)(long)(bus_tx / board_tx));
+    printf("%d board%s on one bus: %.2f cycles/s each (%s limited)\n", boards, boards == 1 ? "" : "s",
+           board_rate, (bus_rate < device_rate) ? "bus" : "device");
+    for (int j = 0; j < job_count; j++)
+        printf("    %-20s %10.2f samples/s\n", jobs[j].spec, board_rate * jobs[j].count);
+
+    if (rate > 0) {
+        printf("Required %.2f cycles/s: %s\n", rate, (board_rate >= rate) ? "ok" : "NOT achievable");
+        return (board_rate >= rate) ? 0 : 2;
+    }
+
+    return 0;
+}
+
+/* *INDENT-OFF* */
+/******************************************************************************
+ * Local Variables:
+ * mode: C
+ * c-indent-level: 4
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ * kate: space-indent on; indent-width 4; mixedindent off; indent-mode cstyle;
+ * vim: set expandtab filetype=c:
+ * vi: set et tabstop=4 shiftwidth=4: */